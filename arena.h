@@ -0,0 +1,95 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include<stddef.h>
+#include<stdint.h>
+#include<stdlib.h>
+
+
+// 按请求使用的线性分配器：分配只是往后移动指针，不单独释放，一个请求处理完整体reset
+// 第一块内存在第一次分配时申请，一块用完了再挂上新的块；reset只回到第一块的开头，所有的块都保留到连接对象析构，
+// 保持连接上的请求一个接一个地处理，稳定之后不再向malloc要内存。
+// 只能放平凡类型（不会调用析构函数），同一时间只有处理这个连接的线程用它。
+class request_arena {
+public:
+    static const size_t BLOCK_SIZE = 4096;      // 每块的默认大小，更大的分配单独成块
+
+    request_arena() : m_head(0), m_cur(0), m_ptr(0), m_end(0) {}
+    ~request_arena() {
+        while(m_head) {
+            block* next = m_head->next;
+            free(m_head);
+            m_head = next;
+        }
+    }
+
+    request_arena(const request_arena&) = delete;
+    request_arena& operator=(const request_arena&) = delete;
+
+    // 分配size字节，按align对齐，失败返回NULL
+    void* alloc(size_t size, size_t align = alignof(max_align_t)) {
+        char* p = (char*)(((uintptr_t)m_ptr + align - 1) & ~(uintptr_t)(align - 1));
+        if(m_ptr && p + size <= m_end) {
+            m_ptr = p + size;
+            return p;
+        }
+        return grow(size, align);
+    }
+
+    template<typename T>
+    T* alloc_array(size_t n) { return (T*)alloc(n * sizeof(T), alignof(T)); }
+
+    // 一个请求结束：之前分配的都作废，内存留着给下一个请求
+    void reset() {
+        m_cur = m_head;
+        if(m_cur) {
+            m_ptr = m_cur->data();
+            m_end = m_ptr + m_cur->size;
+        }
+    }
+
+private:
+    struct block {
+        block* next;
+        size_t size;
+        char* data() { return (char*)(this + 1); }
+    };
+
+    // 当前块放不下：先用reset之前挂上的后续块，都放不下再申请新块接在当前块后面
+    void* grow(size_t size, size_t align) {
+        size_t need = size + align;
+        while(m_cur && m_cur->next) {
+            m_cur = m_cur->next;
+            m_ptr = m_cur->data();
+            m_end = m_ptr + m_cur->size;
+            if(need <= m_cur->size) {
+                return alloc(size, align);
+            }
+        }
+        size_t n = need > BLOCK_SIZE ? need : BLOCK_SIZE;
+        block* b = (block*)malloc(sizeof(block) + n);
+        if(!b) {
+            return NULL;
+        }
+        b->next = NULL;
+        b->size = n;
+        if(m_cur) {
+            m_cur->next = b;
+        }else {
+            m_head = b;
+        }
+        m_cur = b;
+        m_ptr = b->data();
+        m_end = m_ptr + n;
+        return alloc(size, align);
+    }
+
+private:
+    block* m_head;      // 第一块
+    block* m_cur;       // 正在分配的块
+    char* m_ptr;        // 当前块里下一个空闲字节
+    char* m_end;        // 当前块的末尾
+};
+
+
+#endif
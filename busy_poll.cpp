@@ -0,0 +1,91 @@
+#include"busy_poll.h"
+#include<stdio.h>
+#include<string.h>
+#include<time.h>
+#include<errno.h>
+#include<sys/ioctl.h>
+#include<sys/socket.h>
+
+busy_poller http_poller;
+
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+// epoll的busy poll参数（Linux 6.9），旧的头文件里没有
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+
+busy_poller::busy_poller() : m_max_spin_ns(0), m_spin_ns(0), m_avg_gap_ns(0) {
+}
+
+void busy_poller::init(int max_spin_us, int epollfd) {
+    m_max_spin_ns = (int64_t)max_spin_us * 1000;
+    m_spin_ns     = m_max_spin_ns;
+    m_avg_gap_ns  = 0;
+    if(!enabled()) {
+        return;
+    }
+    struct epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs  = max_spin_us;
+    params.busy_poll_budget = BUSY_POLL_BUDGET;
+    params.prefer_busy_poll = 1;
+    if(ioctl(epollfd, EPIOCSPARAMS, &params) < 0) {
+        printf("epoll busy poll is not available (%s), spinning in user space only\n", strerror(errno));
+    }
+}
+
+// 设置失败（内核太旧、没有权限、回环这种没有NAPI的设备）不影响正常收发，忽略
+void busy_poller::setup_socket(int fd) {
+    int usecs = SOCKET_BUSY_POLL_US;
+    int on = 1;
+    int budget = BUSY_POLL_BUDGET;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget));
+}
+
+int64_t busy_poller::now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int busy_poller::wait(int epollfd, epoll_event* events, int max) {
+    int64_t start = now_ns();
+    int n = 0;
+    if(m_spin_ns > 0) {
+        do {
+            n = epoll_wait(epollfd, events, max, 0);
+        } while(n == 0 && now_ns() - start < m_spin_ns);
+    }
+    if(n == 0) {
+        n = epoll_wait(epollfd, events, max, -1);
+    }
+    if(n < 0) {
+        return n;
+    }
+
+    // 事件间隔的滑动平均（权重1/8）；平均间隔在上限的一半以内时，空转两倍平均间隔基本都能等到下一个事件
+    // 空闲很久之后的一次间隔按上限的4倍算，不然流量恢复之后要很多个事件才能把平均值拉回来
+    int64_t gap = now_ns() - start;
+    if(gap > 4 * m_max_spin_ns) {
+        gap = 4 * m_max_spin_ns;
+    }
+    m_avg_gap_ns += (gap - m_avg_gap_ns) / 8;
+    m_spin_ns = m_avg_gap_ns * 2 <= m_max_spin_ns ? m_avg_gap_ns * 2 : 0;
+    return n;
+}
@@ -0,0 +1,44 @@
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+
+#include<stdint.h>
+#include<sys/epoll.h>
+
+
+// 忙轮询的reactor：epoll_wait先用0超时空转一段时间，期间来了事件就省掉一次睡眠和唤醒，转完还没有事件再阻塞
+// 空转的时长按观察到的事件间隔自适应：间隔的滑动平均乘以2，超过上限就不空转，
+// 没有流量时事件间隔很长，自然退回到直接阻塞，不会白占一个核。
+// 同时给socket打开SO_BUSY_POLL/SO_PREFER_BUSY_POLL，epoll上打开busy poll参数（内核支持的话），
+// 让网卡队列在空转期间由我们的线程直接收包，不依赖中断。
+
+
+class busy_poller {
+public:
+    static const int SOCKET_BUSY_POLL_US = 50;      // SO_BUSY_POLL：socket上每次读最多忙等多久
+    static const int BUSY_POLL_BUDGET = 64;         // 每次忙轮询最多处理的包数
+
+    busy_poller();
+
+    // max_spin_us为0表示不开启
+    void init(int max_spin_us, int epollfd);
+    bool enabled() const { return m_max_spin_ns > 0; }
+
+    // 代替 epoll_wait(epollfd, events, max, -1)
+    int wait(int epollfd, epoll_event* events, int max);
+
+    // 新连接的socket
+    void setup_socket(int fd);
+
+private:
+    static int64_t now_ns();
+
+private:
+    int64_t m_max_spin_ns;      // 空转的上限
+    int64_t m_spin_ns;          // 当前的空转时长
+    int64_t m_avg_gap_ns;       // 事件间隔的滑动平均
+};
+
+extern busy_poller http_poller;
+
+
+#endif
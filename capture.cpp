@@ -0,0 +1,183 @@
+#include"capture.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<time.h>
+
+traffic_capture http_capture;
+
+// 后台线程最多隔这么久把攒着的记录写到文件
+static const int FLUSH_INTERVAL_SEC = 1;
+
+static uint64_t now_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+traffic_capture::traffic_capture()
+        : m_enabled(false), m_next_conn(1), m_fd(-1), m_max_bytes(0), m_written(0), m_start(0),
+          m_cur(NULL), m_cur_len(0), m_buffers(0), m_lost(0) {
+}
+
+bool traffic_capture::start(const char* path, size_t max_bytes) {
+    m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_fd < 0) {
+        return false;
+    }
+    capture_file_head head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    head.start_us = now_us(CLOCK_REALTIME);
+    if(write(m_fd, &head, sizeof(head)) != (ssize_t)sizeof(head)) {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    m_written = sizeof(head);
+    m_max_bytes = max_bytes;
+    m_start = now_us(CLOCK_MONOTONIC);
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, writer, this) != 0) {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    pthread_detach(tid);
+    m_enabled.store(true, std::memory_order_release);
+    return true;
+}
+
+uint32_t traffic_capture::open_conn() {
+    if(!enabled()) {
+        return 0;
+    }
+    uint32_t conn = m_next_conn.fetch_add(1, std::memory_order_relaxed);
+    if(conn == 0) {
+        conn = m_next_conn.fetch_add(1, std::memory_order_relaxed);     // 绕回来了，0表示不抓
+    }
+    append(conn, CAP_OPEN, NULL, 0);
+    return conn;
+}
+
+void traffic_capture::data(uint32_t conn, const char* buf, size_t len) {
+    // 一次recv最多读一个读缓冲区，长度字段放得下
+    append(conn, CAP_DATA, buf, len);
+}
+
+bool traffic_capture::reserve(size_t n) {
+    if(m_cur && m_cur_len + n <= BUFFER_SIZE) {
+        return true;
+    }
+    if(m_cur && m_cur_len > 0) {
+        m_full.push_back(std::make_pair(m_cur, m_cur_len));
+        m_cur = NULL;
+        m_ready.signal();
+    }
+    if(!m_cur) {
+        if(!m_free.empty()) {
+            m_cur = m_free.back();
+            m_free.pop_back();
+        }else if(m_buffers < MAX_BUFFERS) {
+            m_cur = (char*)malloc(BUFFER_SIZE);
+            if(m_cur) {
+                m_buffers++;
+            }
+        }
+        m_cur_len = 0;
+    }
+    return m_cur != NULL;
+}
+
+void traffic_capture::append(uint32_t conn, int type, const char* buf, size_t len) {
+    if(!enabled() || conn == 0) {
+        return;
+    }
+    size_t n = sizeof(capture_record) + len;
+    m_lock.lock();
+    // 之前丢过记录的话先补一条CAP_LOST，两条要放得下
+    if(!reserve(m_lost ? sizeof(capture_record) + n : n)) {
+        m_lost++;
+        m_lock.unlock();
+        return;
+    }
+    // 时间在锁里取，文件里的记录按时间排好序
+    uint64_t usec = now_us(CLOCK_MONOTONIC) - m_start;
+    capture_record* r = (capture_record*)(m_cur + m_cur_len);
+    if(m_lost) {
+        r->usec = usec;
+        r->conn = m_lost;
+        r->info = (uint32_t)CAP_LOST << 24;
+        m_lost = 0;
+        r++;
+    }
+    r->usec = usec;
+    r->conn = conn;
+    r->info = ((uint32_t)type << 24) | (uint32_t)len;
+    if(len > 0) {
+        memcpy(r + 1, buf, len);
+    }
+    m_cur_len = (char*)(r + 1) + len - m_cur;
+    m_lock.unlock();
+}
+
+void* traffic_capture::writer(void* arg) {
+    ((traffic_capture*)arg)->run();
+    return NULL;
+}
+
+// 等写满的缓冲区，等不到就每秒把正在记的那块拿过来，写完的缓冲区还回去复用
+void traffic_capture::run() {
+    std::vector<std::pair<char*, size_t> > batch;
+    while(true) {
+        m_lock.lock();
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_INTERVAL_SEC;
+        while(m_full.empty() && m_ready.timewait(m_lock.get(), deadline)) {
+            // 被唤醒了但是没有写满的缓冲区，接着等到原来的时间
+        }
+        if(m_full.empty() && m_cur && m_cur_len > 0) {
+            m_full.push_back(std::make_pair(m_cur, m_cur_len));
+            m_cur = NULL;
+            m_cur_len = 0;
+        }
+        batch.swap(m_full);
+        m_lock.unlock();
+
+        for(size_t i = 0; i < batch.size(); i++) {
+            const char* p = batch[i].first;
+            size_t left = batch[i].second;
+            while(left > 0 && m_fd >= 0) {
+                ssize_t n = write(m_fd, p, left);
+                if(n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(n <= 0) {
+                    printf("写抓包文件失败（%s），停止抓包\n", strerror(errno));
+                    m_enabled.store(false, std::memory_order_relaxed);
+                    close(m_fd);
+                    m_fd = -1;
+                    break;
+                }
+                p += n;
+                left -= n;
+                m_written += n;
+            }
+        }
+        if(m_written >= m_max_bytes && enabled()) {
+            printf("抓包文件到了%zuMB的上限，停止抓包\n", m_max_bytes >> 20);
+            m_enabled.store(false, std::memory_order_relaxed);
+        }
+
+        m_lock.lock();
+        for(size_t i = 0; i < batch.size(); i++) {
+            m_free.push_back(batch[i].first);
+        }
+        m_lock.unlock();
+        batch.clear();
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<pthread.h>
+#include<atomic>
+#include<vector>
+#include"locker.h"
+
+
+// 抓包文件的格式，replay/ 下的回放工具也用它：
+// 文件头之后一条接一条的记录，每条是一个定长的记录头，后面跟着len个字节的数据（只有CAP_DATA有数据）
+// 整数都是本机字节序，抓包和回放在同一类机器上
+#define CAPTURE_MAGIC "WSCAP01"
+
+struct capture_file_head {
+    char magic[8];          // CAPTURE_MAGIC
+    uint64_t start_us;      // 开始抓包时的墙上时间（微秒），只用来显示
+};
+
+enum CAPTURE_TYPE {
+    CAP_OPEN = 1,           // 接受了一个连接
+    CAP_DATA,               // 从连接上读到的原始字节，一次recv一条
+    CAP_CLOSE,              // 连接关闭（不管是哪一方关的）
+    CAP_GAP,                // 连接换成了抓不到的形式（HTTP/2、WebSocket、直接splice的请求体），之后不再记录
+    CAP_LOST                // 写不过来丢了记录，这时还开着的连接都不完整，conn是丢掉的条数
+};
+
+struct capture_record {
+    uint64_t usec;          // 距离开始抓包的微秒数
+    uint32_t conn;          // 连接编号，从1开始，每个进程一个序列
+    uint32_t info;          // 低24位是数据长度，高8位是CAPTURE_TYPE
+
+    uint32_t len() const { return info & 0xffffff; }
+    int type() const { return info >> 24; }
+};
+
+
+// 把连接上读到的请求原样记下来，给replay/下的回放工具重放
+// 主线程和工作线程只是在锁里把记录拷进内存缓冲区，后台线程攒满一块或者每秒把缓冲区写到文件，不在处理请求的线程里做磁盘IO。
+// 磁盘写不过来、缓冲区都满了时丢掉记录而不是等待，之后补一条CAP_LOST；文件写到上限就停止抓包。
+// 进程被信号杀掉时最后不到一秒的记录会丢失。
+class traffic_capture {
+public:
+    static const size_t BUFFER_SIZE = 1 << 20;      // 每块缓冲区1MB
+    static const int MAX_BUFFERS = 16;              // 最多攒这么多块还没写到文件
+
+    traffic_capture();
+
+    // 开始抓包：path是文件名，max_bytes是文件的上限，失败返回false
+    bool start(const char* path, size_t max_bytes);
+
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    // 新连接，返回它的编号；没在抓包时返回0
+    uint32_t open_conn();
+    void data(uint32_t conn, const char* buf, size_t len);
+    void close_conn(uint32_t conn) { append(conn, CAP_CLOSE, NULL, 0); }
+    void gap(uint32_t conn) { append(conn, CAP_GAP, NULL, 0); }
+
+private:
+    void append(uint32_t conn, int type, const char* buf, size_t len);
+    bool reserve(size_t n);         // 当前缓冲区放得下n个字节，需要时换一块，换不到返回false
+    static void* writer(void* arg);
+    void run();
+
+private:
+    std::atomic<bool> m_enabled;
+    std::atomic<uint32_t> m_next_conn;
+    int m_fd;
+    size_t m_max_bytes;
+    size_t m_written;               // 只有后台线程用
+    uint64_t m_start;               // 开始时的单调时钟（微秒）
+    locker m_lock;                  // 保护下面的缓冲区
+    cond m_ready;                   // 有写满的缓冲区了
+    char* m_cur;                    // 正在往里记的缓冲区
+    size_t m_cur_len;
+    std::vector<std::pair<char*, size_t> > m_full;      // 等着写到文件的缓冲区
+    std::vector<char*> m_free;                          // 写完了可以复用的缓冲区
+    int m_buffers;                  // 已经分配的缓冲区块数
+    uint32_t m_lost;                // 还没补CAP_LOST的丢掉的记录数
+};
+
+extern traffic_capture http_capture;
+
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include<stdint.h>
+
+
+// HTTP/1.1 chunked 传输编码的增量解码器
+// 只负责分帧：块大小行、块结尾的\r\n、最后的trailer。块里的数据本身不经过它，
+// 调用者看到 state == DATA 后自己搬运 data_left 个字节（可以直接splice），再调用 consume_data
+
+class chunked_decoder {
+public:
+    enum STATE {
+        SIZE = 0,       // 正在读块大小（十六进制）
+        SIZE_EXT,       // 块大小后面的 ;扩展，忽略到行尾
+        SIZE_LF,        // 块大小行读到了\r，等待\n
+        DATA,           // 块数据，剩余 data_left 字节
+        DATA_CR,        // 块数据后的\r
+        DATA_LF,        // 块数据后的\n
+        TRAILER,        // 最后一个块之后，trailer 行的开头
+        TRAILER_LINE,   // trailer 行中间，忽略到行尾
+        TRAILER_LF,     // 空行的\r之后，等待\n
+        DONE,           // 整个请求体结束
+        BAD             // 格式错误
+    };
+
+    chunked_decoder() { reset(); }
+
+    void reset() {
+        m_state     = SIZE;
+        m_data_left = 0;
+        m_digits    = 0;
+    }
+
+    STATE state() const { return m_state; }
+    int64_t data_left() const { return m_data_left; }
+    bool done() const { return m_state == DONE; }
+    bool bad() const { return m_state == BAD; }
+
+    // 处理分帧字节，遇到块数据、结束或出错时停下，返回消耗掉的字节数
+    int feed(const char* p, int n) {
+        int i = 0;
+        while(i < n && m_state != DATA && m_state != DONE && m_state != BAD) {
+            step(p[i++]);
+        }
+        return i;
+    }
+
+    // 调用者搬走了 n 个块数据字节
+    void consume_data(int64_t n) {
+        m_data_left -= n;
+        if(m_data_left <= 0) {
+            m_data_left = 0;
+            m_state = DATA_CR;
+        }
+    }
+
+private:
+    void step(char c) {
+        switch(m_state) {
+            case SIZE: {
+                int v = hex(c);
+                if(v >= 0) {
+                    // 块大小最多15个十六进制位，防止溢出
+                    if(++m_digits > 15) { m_state = BAD; return; }
+                    m_data_left = (m_data_left << 4) | v;
+                }else if(m_digits == 0) {
+                    m_state = BAD;
+                }else if(c == ';' || c == ' ' || c == '\t') {
+                    m_state = SIZE_EXT;
+                }else if(c == '\r') {
+                    m_state = SIZE_LF;
+                }else {
+                    m_state = BAD;
+                }
+                break;
+            }
+            case SIZE_EXT:
+                if(c == '\r') m_state = SIZE_LF;
+                break;
+            case SIZE_LF:
+                if(c != '\n') { m_state = BAD; return; }
+                m_digits = 0;
+                // 大小为0的块表示请求体结束，后面跟着trailer
+                m_state = m_data_left == 0 ? TRAILER : DATA;
+                break;
+            case DATA_CR:
+                m_state = c == '\r' ? DATA_LF : BAD;
+                break;
+            case DATA_LF:
+                m_state = c == '\n' ? SIZE : BAD;
+                break;
+            case TRAILER:
+                if(c == '\r') m_state = TRAILER_LF;
+                else m_state = TRAILER_LINE;
+                break;
+            case TRAILER_LINE:
+                if(c == '\n') m_state = TRAILER;
+                break;
+            case TRAILER_LF:
+                m_state = c == '\n' ? DONE : BAD;
+                break;
+            default:
+                break;
+        }
+    }
+
+    static int hex(char c) {
+        if(c >= '0' && c <= '9') return c - '0';
+        if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+private:
+    STATE m_state;
+    int64_t m_data_left;    // 当前块还剩余的数据字节数
+    int m_digits;           // 已读到的块大小位数
+};
+
+
+#endif
@@ -0,0 +1,937 @@
+#include"h2.h"
+#include"http_conn.h"
+#include"router.h"
+#include"rate_limit.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+
+
+// 错误页和HTTP/1.1共用
+extern const char* ok_200_title;
+extern const char* error_400_title;
+extern const char* error_400_form;
+extern const char* error_404_title;
+extern const char* error_404_form;
+extern const char* error_500_title;
+extern const char* error_500_form;
+extern const char* error_502_title;
+extern const char* error_502_form;
+
+// 帧类型
+enum { FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS,
+       FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION };
+
+// 帧标志
+static const uint8_t FLAG_END_STREAM  = 0x1;
+static const uint8_t FLAG_ACK         = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED      = 0x8;
+static const uint8_t FLAG_PRIORITY    = 0x20;
+
+// 错误码
+enum { H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+       H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR };
+
+// SETTINGS参数
+enum { SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS,
+       SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE };
+
+static const size_t MAX_HEADER_BLOCK = 64 * 1024;       // 一个头部块拼接后的上限
+
+
+static uint32_t get32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(std::string& out, uint32_t v) {
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+// HTTP2-Settings 头是不带填充的base64url
+static bool base64url_decode(const char* in, std::string& out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for(const char* p = in; *p && *p != ' ' && *p != '\t'; p++) {
+        int v;
+        char c = *p;
+        if(c >= 'A' && c <= 'Z') v = c - 'A';
+        else if(c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') v = c - '0' + 52;
+        else if(c == '-' || c == '+') v = 62;
+        else if(c == '_' || c == '/') v = 63;
+        else if(c == '=') break;
+        else return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if(bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+
+h2_session::h2_session(int sockfd, const sockaddr_in& peer, const struct ucred* cred) :
+        m_sockfd(sockfd), m_peer(peer), m_local(cred != NULL), m_in_len(0), m_preface_ok(false), m_out_pos(0),
+        m_last_sid(0), m_cont_sid(0), m_refused(false), m_send_window(H2_DEFAULT_WINDOW),
+        m_initial_window(H2_DEFAULT_WINDOW), m_peer_max_frame(H2_MAX_FRAME), m_vclock(0),
+        m_closing(false), m_peer_goaway(false) {
+    m_in = (char*)malloc(H2_INPUT_SIZE);
+    if(cred) {
+        m_cred = *cred;
+    }
+}
+
+h2_session::~h2_session() {
+    while(!m_streams.empty()) {
+        close_stream(m_streams.begin()->second);
+    }
+    free(m_in);
+}
+
+void h2_session::start() {
+    frame_header(18, FRAME_SETTINGS, 0, 0);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+    put32(m_out, H2_MAX_STREAMS);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_ENABLE_PUSH);
+    put32(m_out, 0);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_HEADER_LIST_SIZE);
+    put32(m_out, hpack_decoder::MAX_LIST_SIZE);
+}
+
+bool h2_session::feed(const char* data, size_t len) {
+    if(len > (size_t)(H2_INPUT_SIZE - m_in_len)) {
+        return false;
+    }
+    memcpy(m_in + m_in_len, data, len);
+    m_in_len += len;
+    return true;
+}
+
+bool h2_session::upgrade(const char* settings_b64, const char* method, const char* url, const char* authority,
+                         const header_list& headers) {
+    std::string settings;
+    if(!base64url_decode(settings_b64, settings) || settings.size() % 6 != 0) {
+        return false;
+    }
+    m_out.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    start();
+    // HTTP2-Settings 相当于客户端的第一个SETTINGS帧，不需要回ACK
+    on_settings(0, (const uint8_t*)settings.data(), settings.size(), false);
+
+    h2_stream* s = new_stream(1);
+    m_last_sid = 1;
+    s->req.push_back(std::make_pair(std::string(":method"), std::string(method)));
+    s->req.push_back(std::make_pair(std::string(":path"), std::string(url)));
+    s->req.push_back(std::make_pair(std::string(":scheme"), std::string("http")));
+    if(authority) {
+        s->req.push_back(std::make_pair(std::string(":authority"), std::string(authority)));
+    }
+    s->req.insert(s->req.end(), headers.begin(), headers.end());
+    s->remote_closed = true;
+    serve(s);
+    return true;
+}
+
+bool h2_session::read() {
+    while(m_in_len < H2_INPUT_SIZE) {
+        ssize_t n = recv(m_sockfd, m_in + m_in_len, H2_INPUT_SIZE - m_in_len, 0);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if(n == 0) {
+            return false;
+        }
+        m_in_len += n;
+    }
+    return true;
+}
+
+int h2_session::process() {
+    int pos = 0;
+    if(!m_preface_ok) {
+        int n = m_in_len < H2_PREFACE_LEN ? m_in_len : H2_PREFACE_LEN;
+        if(memcmp(m_in, H2_PREFACE, n) != 0) {
+            return -1;
+        }
+        if(m_in_len < H2_PREFACE_LEN) {
+            return flush();
+        }
+        pos = H2_PREFACE_LEN;
+        m_preface_ok = true;
+    }
+    while(!m_closing && m_in_len - pos >= 9) {
+        const uint8_t* h = (const uint8_t*)m_in + pos;
+        uint32_t len = ((uint32_t)h[0] << 16) | ((uint32_t)h[1] << 8) | h[2];
+        if(len > (uint32_t)H2_MAX_FRAME) {
+            goaway(H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if((uint32_t)(m_in_len - pos) < 9 + len) {
+            break;
+        }
+        if(!handle_frame(h[3], h[4], get32(h + 5) & 0x7fffffff, h + 9, len)) {
+            break;
+        }
+        pos += 9 + len;
+    }
+    memmove(m_in, m_in + pos, m_in_len - pos);
+    m_in_len -= pos;
+    return flush();
+}
+
+int h2_session::write() {
+    return flush();
+}
+
+// 连接错误：发GOAWAY，输出发完后关闭连接
+bool h2_session::goaway(uint32_t code) {
+    if(!m_closing) {
+        frame_header(8, FRAME_GOAWAY, 0, 0);
+        put32(m_out, m_last_sid);
+        put32(m_out, code);
+        m_closing = true;
+    }
+    return false;
+}
+
+bool h2_session::handle_frame(uint8_t type, uint8_t flags, uint32_t sid, const uint8_t* payload, uint32_t len) {
+    // 头部块没收完之前只能是同一个流的CONTINUATION
+    if(m_cont_sid && type != FRAME_CONTINUATION) {
+        return goaway(H2_PROTOCOL_ERROR);
+    }
+    switch(type) {
+        case FRAME_DATA:
+            return on_data(flags, sid, payload, len);
+        case FRAME_HEADERS:
+            return on_headers(flags, sid, payload, len);
+        case FRAME_PRIORITY: {
+            if(sid == 0) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            if(len != 5) {
+                send_rst(sid, H2_FRAME_SIZE_ERROR);
+                return true;
+            }
+            std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.find(sid);
+            if(it != m_streams.end()) {
+                on_priority(it->second, payload);
+            }
+            return true;
+        }
+        case FRAME_RST_STREAM: {
+            if(len != 4) {
+                return goaway(H2_FRAME_SIZE_ERROR);
+            }
+            if(sid == 0 || sid > m_last_sid) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.find(sid);
+            if(it != m_streams.end()) {
+                close_stream(it->second);
+            }
+            return true;
+        }
+        case FRAME_SETTINGS:
+            if(sid != 0) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            if(flags & FLAG_ACK) {
+                return len == 0 ? true : goaway(H2_FRAME_SIZE_ERROR);
+            }
+            return on_settings(flags, payload, len, true);
+        case FRAME_PUSH_PROMISE:
+            return goaway(H2_PROTOCOL_ERROR);     // 客户端不能推送
+        case FRAME_PING:
+            if(len != 8) {
+                return goaway(H2_FRAME_SIZE_ERROR);
+            }
+            if(sid != 0) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            if(!(flags & FLAG_ACK)) {
+                frame_header(8, FRAME_PING, FLAG_ACK, 0);
+                m_out.append((const char*)payload, 8);
+            }
+            return true;
+        case FRAME_GOAWAY:
+            if(sid != 0) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            m_peer_goaway = true;
+            return true;
+        case FRAME_WINDOW_UPDATE: {
+            if(len != 4) {
+                return goaway(H2_FRAME_SIZE_ERROR);
+            }
+            uint32_t inc = get32(payload) & 0x7fffffff;
+            if(sid == 0) {
+                if(inc == 0) {
+                    return goaway(H2_PROTOCOL_ERROR);
+                }
+                m_send_window += inc;
+                return m_send_window <= H2_MAX_WINDOW ? true : goaway(H2_FLOW_CONTROL_ERROR);
+            }
+            std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.find(sid);
+            if(it == m_streams.end()) {
+                return true;    // 已经关闭的流，忽略
+            }
+            h2_stream* s = it->second;
+            s->window += inc;
+            if(inc == 0 || s->window > H2_MAX_WINDOW) {
+                send_rst(sid, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                close_stream(s);
+            }
+            return true;
+        }
+        case FRAME_CONTINUATION:
+            if(sid == 0 || sid != m_cont_sid) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            m_block.append((const char*)payload, len);
+            if(m_block.size() > MAX_HEADER_BLOCK) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            if(flags & FLAG_END_HEADERS) {
+                m_cont_sid = 0;
+                return on_header_block(sid);
+            }
+            return true;
+        default:
+            return true;        // 不认识的帧类型必须忽略
+    }
+}
+
+bool h2_session::on_settings(uint8_t flags, const uint8_t* payload, uint32_t len, bool ack_needed) {
+    if(len % 6 != 0) {
+        return goaway(H2_FRAME_SIZE_ERROR);
+    }
+    for(uint32_t i = 0; i < len; i += 6) {
+        uint16_t id = ((uint16_t)payload[i] << 8) | payload[i + 1];
+        uint32_t value = get32(payload + i + 2);
+        switch(id) {
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1) {
+                    return goaway(H2_PROTOCOL_ERROR);
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if(value > H2_MAX_WINDOW) {
+                    return goaway(H2_FLOW_CONTROL_ERROR);
+                }
+                // 新的初始窗口对所有已经打开的流生效，按差值调整
+                int64_t delta = (int64_t)value - m_initial_window;
+                for(std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+                    it->second->window += delta;
+                    if(it->second->window > H2_MAX_WINDOW) {
+                        return goaway(H2_FLOW_CONTROL_ERROR);
+                    }
+                }
+                m_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if(value < 16384 || value > 16777215) {
+                    return goaway(H2_PROTOCOL_ERROR);
+                }
+                m_peer_max_frame = value;
+                break;
+            default:
+                break;      // 我们不用编码端的动态表，HEADER_TABLE_SIZE 不影响我们
+        }
+    }
+    if(ack_needed) {
+        frame_header(0, FRAME_SETTINGS, FLAG_ACK, 0);
+    }
+    return true;
+}
+
+void h2_session::on_priority(h2_stream* s, const uint8_t* p) {
+    uint32_t dep = get32(p) & 0x7fffffff;
+    s->parent = dep == s->id ? 0 : dep;     // 依赖自己的按根处理
+    s->weight = p[4] + 1;
+}
+
+bool h2_session::on_headers(uint8_t flags, uint32_t sid, const uint8_t* payload, uint32_t len) {
+    if(sid == 0 || !(sid & 1)) {
+        return goaway(H2_PROTOCOL_ERROR);
+    }
+    const uint8_t* p = payload;
+    uint32_t pad = 0;
+    const uint8_t* prio = NULL;
+    if(flags & FLAG_PADDED) {
+        if(len < 1) {
+            return goaway(H2_FRAME_SIZE_ERROR);
+        }
+        pad = *p++;
+        len--;
+    }
+    if(flags & FLAG_PRIORITY) {
+        if(len < 5) {
+            return goaway(H2_FRAME_SIZE_ERROR);
+        }
+        prio = p;
+        p += 5;
+        len -= 5;
+    }
+    if(pad > len) {
+        return goaway(H2_PROTOCOL_ERROR);
+    }
+    len -= pad;
+
+    m_refused = false;
+    std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.find(sid);
+    if(it != m_streams.end()) {
+        // 已经打开的流上再来HEADERS，只能是请求体之后的trailer
+        h2_stream* s = it->second;
+        if(s->remote_closed) {
+            return goaway(H2_STREAM_CLOSED);
+        }
+        if(!(flags & FLAG_END_STREAM)) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        s->end_pending = true;
+    }else {
+        if(sid <= m_last_sid) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        m_last_sid = sid;
+        if((int)m_streams.size() >= H2_MAX_STREAMS || m_peer_goaway) {
+            // 头部块还是要解码，不然两端的动态表就对不上了
+            m_refused = true;
+            send_rst(sid, H2_REFUSED_STREAM);
+        }else {
+            h2_stream* s = new_stream(sid);
+            s->end_pending = flags & FLAG_END_STREAM;
+            if(prio) {
+                on_priority(s, prio);
+            }
+        }
+    }
+    m_block.assign((const char*)p, len);
+    if(flags & FLAG_END_HEADERS) {
+        return on_header_block(sid);
+    }
+    m_cont_sid = sid;
+    return true;
+}
+
+bool h2_session::on_header_block(uint32_t sid) {
+    header_list list;
+    bool ok = m_decoder.decode((const uint8_t*)m_block.data(), m_block.size(), list);
+    m_block.clear();
+    if(!ok) {
+        return goaway(H2_COMPRESSION_ERROR);
+    }
+    if(m_refused) {
+        m_refused = false;
+        return true;
+    }
+    std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.find(sid);
+    if(it == m_streams.end()) {
+        return true;
+    }
+    h2_stream* s = it->second;
+    if(s->req.empty()) {
+        s->req.swap(list);      // trailer直接丢掉
+    }
+    if(s->end_pending) {
+        s->remote_closed = true;
+        serve(s);
+    }
+    return true;
+}
+
+// 请求体不支持，收到多少就马上还多少窗口，然后丢掉
+bool h2_session::on_data(uint8_t flags, uint32_t sid, const uint8_t* payload, uint32_t len) {
+    if(sid == 0) {
+        return goaway(H2_PROTOCOL_ERROR);
+    }
+    if((flags & FLAG_PADDED) && (len < 1 || payload[0] >= len)) {
+        return goaway(H2_PROTOCOL_ERROR);
+    }
+    if(len) {
+        send_window_update(0, len);
+    }
+    std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.find(sid);
+    if(it == m_streams.end() || it->second->remote_closed) {
+        if(sid > m_last_sid) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        send_rst(sid, H2_STREAM_CLOSED);
+        return true;
+    }
+    h2_stream* s = it->second;
+    if(flags & FLAG_END_STREAM) {
+        s->remote_closed = true;
+        serve(s);
+    }else if(len) {
+        send_window_update(sid, len);
+    }
+    return true;
+}
+
+const char* h2_session::header(const h2_stream* s, const char* name) {
+    for(size_t i = 0; i < s->req.size(); i++) {
+        if(strcasecmp(s->req[i].first.c_str(), name) == 0) {
+            return s->req[i].second.c_str();
+        }
+    }
+    return NULL;
+}
+
+const char* h2_session::header_getter(void* ctx, const char* name) {
+    return header((const h2_stream*)ctx, name);
+}
+
+// 和HTTP/1.1走同一套后端：限流、路由处理函数、响应缓存、静态文件
+void h2_session::serve(h2_stream* s) {
+    const char* method = header(s, ":method");
+    const char* path = header(s, ":path");
+    const char* authority = header(s, ":authority");
+    if(!authority) {
+        authority = header(s, "host");
+    }
+    if(!method || !path || path[0] != '/') {
+        respond_error(s, 400, error_400_title, error_400_form);
+        return;
+    }
+    if(http_limiter.enabled() && !m_local && !http_limiter.allow(m_peer)) {
+        const char* resp = rate_limiter::response();
+        const char* blank = strstr(resp, "\r\n\r\n");
+        s->body     = blank + 4;
+        s->body_len = rate_limiter::response_len() - (blank + 4 - resp);
+        respond_raw(s, resp, blank + 2 - resp, NULL);
+        return;
+    }
+    int m;
+    if(strcmp(method, "GET") == 0) {
+        m = http_conn::GET;
+    }else if(strcmp(method, "HEAD") == 0) {
+        m = http_conn::HEAD;
+    }else if(strcmp(method, "POST") == 0) {
+        m = http_conn::POST;
+    }else {
+        respond_error(s, 400, error_400_title, error_400_form);
+        return;
+    }
+    s->head_only = m == http_conn::HEAD;
+
+    size_t url_len = strlen(path);
+    size_t path_len = strcspn(path, "?");
+    size_t prefix_len = 0;
+    const router::route* r = http_router.empty() ? NULL : http_router.match(path, path_len, &prefix_len);
+    if(r && r->upstream) {
+        respond_error(s, 502, error_502_title, error_502_form);
+        return;
+    }
+
+    // :authority相当于Host，选站点；响应缓存，条件和HTTP/1.1一样
+    const vhost* site = http_vhosts.find(authority);
+    response_cache* cache = site->cache;
+    cache_entry* fill = NULL;
+    const char* cc = header(s, "cache-control");
+    const char* pragma = header(s, "pragma");
+    if(cache->enabled() && m == http_conn::GET && !header(s, "authorization") &&
+       !(cc && (strcasestr(cc, "no-cache") || strcasestr(cc, "no-store"))) && !(pragma && strcasestr(pragma, "no-cache"))) {
+        cache_entry* e = cache->lookup(method, authority ? authority : "", path, header_getter, s, &fill);
+        if(e && e->hot_key && http_replicas.count_cached(e->hot_key)) {
+            cache->invalidate(e);       // 和HTTP/1.1一样，够热的可复制文件下一个请求去安排复制
+        }
+        if(e) {
+            char age[24];
+            snprintf(age, sizeof(age), "%lld", (long long)((proxy_now_ms() - e->created_ms) / 1000));
+            s->entry    = e;
+            s->body     = e->body();
+            s->body_len = e->body_len;
+            respond_raw(s, e->head(), e->head_len, age);
+            return;
+        }
+    }
+
+    if(r) {
+        request_view req;
+        req.method = m;
+        req.path   = std::string_view(path, path_len);
+        req.query  = path_len < url_len ? std::string_view(path + path_len + 1, url_len - path_len - 1) : std::string_view();
+        req.rest   = std::string_view(path + prefix_len, path_len - prefix_len);
+        req.host   = authority ? std::string_view(authority) : std::string_view();
+        req.peer   = &m_peer;
+        req.cred   = m_local ? &m_cred : NULL;
+
+        // 请求头表的条目放在栈上，名字和值指向解码出来的头部列表，伪头部不放进去
+        header_map::entry slots[header_map::MAX_HEADERS];
+        header_map headers;
+        headers.reset(slots, header_map::MAX_HEADERS);
+        for(size_t i = 0; i < s->req.size(); i++) {
+            if(s->req[i].first[0] != ':' && !headers.add(s->req[i].first, s->req[i].second)) {
+                break;
+            }
+        }
+        req.headers = &headers;
+
+        char buf[http_conn::WRITE_BUFFER_SIZE];
+        response_builder resp(buf, sizeof(buf));
+        r->handler(req, resp, r->arg);
+        if(!resp.has_status()) {
+            resp.status(200, ok_200_title);
+        }
+        s->body     = resp.body_data();
+        s->body_len = resp.body_len();
+        s->owned    = resp.body_is_owned() ? (char*)resp.body_data() : NULL;
+        int len = resp.length();
+        if(!resp.has_content_type() && !resp.failed()) {
+            len += snprintf(buf + len, sizeof(buf) - len, "Content-Type:text/html\r\n");
+        }
+        if(!resp.failed() && len < (int)sizeof(buf)) {
+            len += snprintf(buf + len, sizeof(buf) - len, "Content-Length: %lld\r\n%s", (long long)s->body_len,
+                            site->headers.c_str());
+        }
+        if(resp.failed() || len >= (int)sizeof(buf)) {
+            cache->abandon(fill, true);
+            free(s->owned);
+            s->owned = NULL;
+            respond_error(s, 500, error_500_title, error_500_form);
+            return;
+        }
+        if(fill && resp.code() == 200 && !resp.set_cookie()) {
+            response_cache::release(cache->complete(fill, buf, len, s->body, s->body_len,
+                                    response_cache::max_age(resp.cache_control()), resp.vary(), header_getter, s));
+            fill = NULL;
+        }
+        cache->abandon(fill, true);
+        respond_raw(s, buf, len, NULL);
+        return;
+    }
+
+    // 静态文件
+    char real_file[http_conn::FILENAME_LEN];
+    struct stat st;
+    std::string url(path, path_len);
+    int fd = -1;
+    const char* data = NULL;        // 文件内容已经在内存里：热文件副本或者共享内存文件缓存
+    replica_entry* replica = NULL;
+    int shm_handle = -1;
+    http_conn::HTTP_CODE ret = http_conn::resolve_file(site->root.c_str(), url.c_str(), real_file, &st);
+    if(ret == http_conn::FILE_REQUEST) {
+        data = http_conn::acquire_shared_file(real_file, st, &replica, &shm_handle);
+    }
+    if(ret == http_conn::FILE_REQUEST && !data) {
+        fd = open(real_file, O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            ret = http_conn::NO_RESOURCE;
+        }else if((data = http_conn::insert_shared_file(real_file, st, fd, &shm_handle))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if(ret != http_conn::FILE_REQUEST) {
+        cache->abandon(fill, true);
+        if(ret == http_conn::NO_RESOURCE) {
+            respond_error(s, 404, error_404_title, error_404_form);
+        }else {
+            respond_error(s, 400, error_400_title, error_400_form);
+        }
+        return;
+    }
+    char head[128 + vhost::MAX_HEADER_BYTES];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 %s\r\nContent-Length: %lld\r\nContent-Type:text/html\r\n%s",
+                            ok_200_title, (long long)st.st_size, site->headers.c_str());
+    uint64_t hot_key;
+    if(fill && st.st_size > 0 && st.st_size <= http_conn::FILE_WINDOW_SIZE && http_replicas.cacheable(real_file, st, &hot_key)) {
+        // 和HTTP/1.1一样，一个窗口放得下的小文件放进缓存，之后的请求直接从缓存发；已经有副本或者正在复制的文件不放
+        void* addr = data ? (void*)data : mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(addr != MAP_FAILED) {
+            cache_entry* e = cache->complete(fill, head, head_len, (const char*)addr, st.st_size,
+                                                 http_conn::STATIC_CACHE_SECONDS, NULL, header_getter, s, hot_key);
+            fill = NULL;
+            if(!data) {
+                munmap(addr, st.st_size);
+            }
+            if(e) {
+                if(fd != -1) {
+                    close(fd);
+                }
+                if(replica) {
+                    numa_replicas::release(replica);
+                }
+                if(shm_handle != -1) {
+                    http_files.release(shm_handle);
+                }
+                s->entry    = e;
+                s->body     = e->body();
+                s->body_len = e->body_len;
+                respond_raw(s, e->head(), e->head_len, NULL);
+                return;
+            }
+        }
+    }
+    cache->abandon(fill, true);
+    s->replica    = replica;
+    s->shm_handle = shm_handle;
+    s->body       = data;
+    s->file_fd    = fd;
+    s->body_len   = st.st_size;
+    respond_raw(s, head, head_len, NULL);
+}
+
+void h2_session::respond_error(h2_stream* s, int status, const char* title, const char* form) {
+    char head[128];
+    s->body     = form;
+    s->body_len = strlen(form);
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Length: %lld\r\nContent-Type:text/html\r\n",
+                       status, title, (long long)s->body_len);
+    respond_raw(s, head, len, NULL);
+}
+
+// head是HTTP/1.1格式的状态行和响应头（缓存条目里存的就是这种格式），转成HPACK编码的HEADERS帧
+// 名字转成小写，只对一段连接有效的头部去掉
+void h2_session::respond_raw(h2_stream* s, const char* head, size_t head_len, const char* age) {
+    std::string block;
+    int status = 200;
+    if(head_len > 12 && strncmp(head, "HTTP/1.", 7) == 0) {
+        status = atoi(head + 9);
+    }
+    hpack_encode_status(block, status);
+    const char* p = (const char*)memchr(head, '\n', head_len);
+    const char* end = head + head_len;
+    p = p ? p + 1 : end;
+    char name[64];
+    while(p < end) {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if(!eol) {
+            eol = end;
+        }
+        const char* line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        const char* colon = (const char*)memchr(p, ':', line_end - p);
+        if(colon && colon - p < (int)sizeof(name)) {
+            size_t name_len = colon - p;
+            for(size_t i = 0; i < name_len; i++) {
+                name[i] = (p[i] >= 'A' && p[i] <= 'Z') ? p[i] - 'A' + 'a' : p[i];
+            }
+            name[name_len] = '\0';
+            const char* value = colon + 1;
+            while(value < line_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            if(strcmp(name, "connection") != 0 && strcmp(name, "keep-alive") != 0 &&
+               strcmp(name, "proxy-connection") != 0 && strcmp(name, "transfer-encoding") != 0 &&
+               strcmp(name, "upgrade") != 0) {
+                hpack_encode_header(block, name, name_len, value, line_end - value);
+            }
+        }
+        p = eol + 1;
+    }
+    if(age) {
+        hpack_encode_header(block, "age", 3, age, strlen(age));
+    }
+
+    bool end_stream = s->head_only || s->body_len == 0;
+    // 头部块超过对端的最大帧时切成HEADERS + CONTINUATION
+    size_t off = 0;
+    bool first = true;
+    do {
+        size_t n = block.size() - off;
+        if(n > m_peer_max_frame) {
+            n = m_peer_max_frame;
+        }
+        uint8_t flags = (off + n == block.size() ? FLAG_END_HEADERS : 0) | (first && end_stream ? FLAG_END_STREAM : 0);
+        frame_header(n, first ? FRAME_HEADERS : FRAME_CONTINUATION, flags, s->id);
+        m_out.append(block, off, n);
+        off += n;
+        first = false;
+    } while(off < block.size());
+
+    if(end_stream) {
+        close_stream(s);
+        return;
+    }
+    s->responding = true;
+    if(s->vtime < m_vclock) {
+        s->vtime = m_vclock;
+    }
+}
+
+void h2_session::frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t sid) {
+    char h[9];
+    h[0] = (char)(len >> 16);
+    h[1] = (char)(len >> 8);
+    h[2] = (char)len;
+    h[3] = (char)type;
+    h[4] = (char)flags;
+    h[5] = (char)(sid >> 24);
+    h[6] = (char)(sid >> 16);
+    h[7] = (char)(sid >> 8);
+    h[8] = (char)sid;
+    m_out.append(h, 9);
+}
+
+void h2_session::send_window_update(uint32_t sid, uint32_t inc) {
+    frame_header(4, FRAME_WINDOW_UPDATE, 0, sid);
+    put32(m_out, inc);
+}
+
+void h2_session::send_rst(uint32_t sid, uint32_t code) {
+    frame_header(4, FRAME_RST_STREAM, 0, sid);
+    put32(m_out, code);
+}
+
+// 依赖的流（往上最多找8层）还有响应体没发完时，先让它发
+bool h2_session::blocked_by_parent(const h2_stream* s) const {
+    uint32_t parent = s->parent;
+    for(int depth = 0; parent && depth < 8; depth++) {
+        std::unordered_map<uint32_t, h2_stream*>::const_iterator it = m_streams.find(parent);
+        if(it == m_streams.end()) {
+            return false;
+        }
+        if(it->second->responding) {
+            return true;
+        }
+        parent = it->second->parent;
+    }
+    return false;
+}
+
+// 加权公平调度：在有数据、有窗口、不被依赖的流挡住的流里挑虚拟完成时间最早的，
+// 发出n字节后它的虚拟时间前进 n*256/权重，权重大的流分到的带宽按比例多
+bool h2_session::schedule() {
+    if(m_send_window <= 0) {
+        return false;
+    }
+    h2_stream* best = NULL;
+    for(std::unordered_map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+        h2_stream* s = it->second;
+        if(!s->responding || s->window <= 0 || blocked_by_parent(s)) {
+            continue;
+        }
+        if(!best || s->vtime < best->vtime) {
+            best = s;
+        }
+    }
+    if(!best) {
+        return false;
+    }
+    int64_t n = best->body_len - best->sent;
+    if(n > best->window) {
+        n = best->window;
+    }
+    if(n > m_send_window) {
+        n = m_send_window;
+    }
+    if(n > m_peer_max_frame) {
+        n = m_peer_max_frame;
+    }
+    bool end = best->sent + n == best->body_len;
+    frame_header(n, FRAME_DATA, end ? FLAG_END_STREAM : 0, best->id);
+    if(best->file_fd != -1) {
+        size_t at = m_out.size();
+        m_out.resize(at + n);
+        ssize_t r = pread(best->file_fd, &m_out[at], n, best->sent);
+        if(r != n) {
+            // 文件在发送过程中被截短了，这个流没法正常结束
+            m_out.resize(at - 9);
+            send_rst(best->id, H2_INTERNAL_ERROR);
+            close_stream(best);
+            return true;
+        }
+    }else {
+        m_out.append(best->body + best->sent, n);
+    }
+    best->sent    += n;
+    best->window  -= n;
+    m_send_window -= n;
+    m_vclock       = best->vtime;
+    best->vtime   += (uint64_t)n * 256 / best->weight;
+    if(end) {
+        close_stream(best);
+    }
+    return true;
+}
+
+// 输出缓冲区发完了就让调度器再切一批DATA帧，直到socket写不进去或者没有可以发的
+int h2_session::flush() {
+    while(true) {
+        if(m_out_pos == m_out.size()) {
+            m_out.clear();
+            m_out_pos = 0;
+            if(!m_closing) {
+                while(m_out.size() < (size_t)H2_OUTPUT_HIGH && schedule()) {
+                }
+            }
+            if(m_out.empty()) {
+                return (m_closing || (m_peer_goaway && m_streams.empty())) ? -1 : 0;
+            }
+        }
+        ssize_t n = send(m_sockfd, m_out.data() + m_out_pos, m_out.size() - m_out_pos, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        m_out_pos += n;
+    }
+}
+
+h2_stream* h2_session::new_stream(uint32_t id) {
+    h2_stream* s = new h2_stream;
+    s->id            = id;
+    s->remote_closed = false;
+    s->end_pending   = false;
+    s->head_only     = false;
+    s->entry         = NULL;
+    s->replica       = NULL;
+    s->shm_handle    = -1;
+    s->owned         = NULL;
+    s->body          = NULL;
+    s->file_fd       = -1;
+    s->body_len      = 0;
+    s->sent          = 0;
+    s->responding    = false;
+    s->window        = m_initial_window;
+    s->weight        = 16;
+    s->parent        = 0;
+    s->vtime         = m_vclock;
+    m_streams[id] = s;
+    return s;
+}
+
+void h2_session::close_stream(h2_stream* s) {
+    m_streams.erase(s->id);
+    response_cache::release(s->entry);
+    if(s->replica) {
+        numa_replicas::release(s->replica);
+    }
+    if(s->shm_handle != -1) {
+        http_files.release(s->shm_handle);
+    }
+    free(s->owned);
+    if(s->file_fd != -1) {
+        close(s->file_fd);
+    }
+    delete s;
+}
@@ -0,0 +1,139 @@
+#ifndef H2_H
+#define H2_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<unordered_map>
+#include<netinet/in.h>
+#include<sys/socket.h>
+#include"hpack.h"
+#include"response_cache.h"
+#include"numa_replica.h"
+
+
+// HTTP/2（RFC 7540），一个连接上复用多个流
+// 连接以 h2c 先验知识（直接发连接前言）或者 HTTP/1.1 的 Upgrade: h2c 进入HTTP/2，之后由h2_session接管：
+//   主线程把socket上的数据读进输入缓冲区，工作线程解析帧、为每个请求生成响应，
+//   响应头编码后直接放进输出缓冲区，响应体由调度器按流控窗口和优先级切成DATA帧。
+// 请求的处理和HTTP/1.1共用：路由处理函数、虚拟主机（按:authority选站点）、响应缓存、站点根目录下的静态文件；代理路由和上传不支持。
+
+
+static const int H2_MAX_STREAMS = 256;                  // SETTINGS_MAX_CONCURRENT_STREAMS
+static const int H2_MAX_FRAME = 16384;                  // 我们接受的最大帧，也就是默认的SETTINGS_MAX_FRAME_SIZE
+static const int H2_INPUT_SIZE = 64 * 1024;             // 输入缓冲区，至少要放得下一个最大的帧
+static const int H2_OUTPUT_HIGH = 64 * 1024;            // 输出缓冲区超过这么多就先不再调度DATA帧
+static const int64_t H2_DEFAULT_WINDOW = 65535;         // 流控窗口的初始值
+static const int64_t H2_MAX_WINDOW = 0x7fffffff;
+static const char H2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";   // 客户端的连接前言
+static const int H2_PREFACE_LEN = 24;
+
+
+// 一个请求/响应
+struct h2_stream {
+    uint32_t id;
+    bool remote_closed;         // 对端已经发了END_STREAM，请求收完了
+    bool end_pending;           // HEADERS带了END_STREAM，但是头部块还没收完
+    bool head_only;             // HEAD请求，只发响应头
+    header_list req;            // 请求头，包括伪头部
+
+    // 响应体，三种来源之一：内存（缓存条目、热文件副本、共享内存文件缓存、处理函数的响应体、错误页）或者文件
+    cache_entry* entry;         // 缓存条目的引用
+    replica_entry* replica;     // 本节点上热文件副本的引用
+    int shm_handle;             // 共享内存文件缓存里条目的引用，-1表示没有
+    char* owned;                // 需要free的响应体
+    const char* body;           // 内存响应体
+    int file_fd;                // 文件响应体，-1表示没有
+    int64_t body_len;           // 响应体总长度
+    int64_t sent;               // 已经放进DATA帧的字节数
+    bool responding;            // 响应头已经发出，还有响应体要发
+
+    // 流控和优先级
+    int64_t window;             // 发送窗口
+    int weight;                 // 1~256
+    uint32_t parent;            // 依赖的流，0表示根
+    uint64_t vtime;             // 加权公平调度的虚拟完成时间
+};
+
+
+class h2_session {
+public:
+    h2_session(int sockfd, const sockaddr_in& peer, const struct ucred* cred = NULL);
+    ~h2_session();
+
+    // 发送服务端的连接前言（SETTINGS帧），先验知识的连接切换过来时调用
+    void start();
+
+    // 切换到HTTP/2时读缓冲区里已经读到的字节
+    bool feed(const char* data, size_t len);
+
+    // 从HTTP/1.1升级：先回101，stream 1 就是升级前的那个请求
+    bool upgrade(const char* settings_b64, const char* method, const char* url, const char* authority, const header_list& headers);
+
+    // 主线程：读socket到输入缓冲区，对方关闭或者出错返回false
+    bool read();
+    bool input_full() const { return m_in_len == H2_INPUT_SIZE; }     // 输入缓冲区满了，socket里可能还有数据
+
+    // 工作线程：处理收到的帧并尽量把输出发出去。返回-1表示要关闭连接，0表示没有待发的数据，1表示要等EPOLLOUT
+    int process();
+
+    // 主线程：EPOLLOUT之后继续发送，返回值同process
+    int write();
+
+private:
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t sid, const uint8_t* payload, uint32_t len);
+    bool on_headers(uint8_t flags, uint32_t sid, const uint8_t* payload, uint32_t len);
+    bool on_header_block(uint32_t sid);
+    bool on_data(uint8_t flags, uint32_t sid, const uint8_t* payload, uint32_t len);
+    bool on_settings(uint8_t flags, const uint8_t* payload, uint32_t len, bool ack_needed);
+    void on_priority(h2_stream* s, const uint8_t* p);
+
+    // 生成响应
+    void serve(h2_stream* s);
+    void respond_raw(h2_stream* s, const char* head, size_t head_len, const char* age);
+    void respond_error(h2_stream* s, int status, const char* title, const char* form);
+    static const char* header(const h2_stream* s, const char* name);
+    static const char* header_getter(void* ctx, const char* name);
+
+    // 输出
+    void frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t sid);
+    void send_window_update(uint32_t sid, uint32_t inc);
+    void send_rst(uint32_t sid, uint32_t code);
+    bool goaway(uint32_t code);
+    bool schedule();                    // 按优先级挑一个流，放一个DATA帧进输出缓冲区；没有可以发的返回false
+    bool blocked_by_parent(const h2_stream* s) const;
+    int flush();
+
+    h2_stream* new_stream(uint32_t id);
+    void close_stream(h2_stream* s);
+
+private:
+    int m_sockfd;
+    sockaddr_in m_peer;
+    struct ucred m_cred;        // Unix域socket连接对端进程的身份
+    bool m_local;               // 是Unix域socket上的连接，不限流
+    hpack_decoder m_decoder;
+    std::unordered_map<uint32_t, h2_stream*> m_streams;
+
+    char* m_in;                         // 输入缓冲区
+    int m_in_len;
+    bool m_preface_ok;                  // 客户端的连接前言已经收到
+
+    std::string m_out;                  // 输出缓冲区
+    size_t m_out_pos;                   // 已经发出去的位置
+
+    uint32_t m_last_sid;                // 客户端开过的最大的流
+    uint32_t m_cont_sid;                // 正在等CONTINUATION的流，0表示没有
+    std::string m_block;                // 正在拼接的头部块
+    bool m_refused;                     // 正在拼接的头部块属于被拒绝的流，解码完就丢掉
+
+    int64_t m_send_window;              // 连接级的发送窗口
+    int64_t m_initial_window;           // 对端的SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t m_peer_max_frame;          // 对端的SETTINGS_MAX_FRAME_SIZE
+    uint64_t m_vclock;                  // 调度器的虚拟时钟
+    bool m_closing;                     // 发完输出缓冲区就关闭连接
+    bool m_peer_goaway;                 // 对端发了GOAWAY，手上的流都发完就关闭
+};
+
+
+#endif
@@ -0,0 +1,108 @@
+#include"header_map.h"
+#include<strings.h>
+
+
+namespace {
+
+struct known_header {
+    const char* name;
+    size_t len;
+    uint32_t hash;
+};
+
+#define KNOWN(s) { s, sizeof(s) - 1, header_map::hash(s, sizeof(s) - 1) }
+
+// 下标就是HEADER_ID，哈希在编译期算好
+constexpr known_header known[HDR_COUNT] = {
+    { "", 0, 0 },
+    KNOWN("Host"),
+    KNOWN("Connection"),
+    KNOWN("Keep-Alive"),
+    KNOWN("Proxy-Connection"),
+    KNOWN("Content-Length"),
+    KNOWN("Transfer-Encoding"),
+    KNOWN("TE"),
+    KNOWN("Expect"),
+    KNOWN("Upgrade"),
+    KNOWN("HTTP2-Settings"),
+    KNOWN("Cache-Control"),
+    KNOWN("Pragma"),
+    KNOWN("Authorization"),
+    KNOWN("Cookie"),
+    KNOWN("User-Agent"),
+    KNOWN("Accept"),
+    KNOWN("Accept-Encoding"),
+    KNOWN("If-None-Match"),
+    KNOWN("If-Modified-Since"),
+    KNOWN("Range"),
+    KNOWN("Sec-WebSocket-Key"),
+    KNOWN("Sec-WebSocket-Version"),
+};
+
+#undef KNOWN
+
+// 按哈希的低位放进一张开放寻址的小表，也在编译期建好：认一个名字一般只看一个槽
+const int INDEX_SIZE = 128;
+
+struct known_index {
+    int8_t slot[INDEX_SIZE];
+
+    constexpr known_index() : slot() {
+        for(int i = 0; i < INDEX_SIZE; i++) {
+            slot[i] = -1;
+        }
+        for(int id = 1; id < HDR_COUNT; id++) {
+            uint32_t i = known[id].hash & (INDEX_SIZE - 1);
+            while(slot[i] >= 0) {
+                i = (i + 1) & (INDEX_SIZE - 1);
+            }
+            slot[i] = id;
+        }
+    }
+};
+
+constexpr known_index index_table;
+
+}
+
+
+int header_map::lookup(std::string_view name, uint32_t h) {
+    for(uint32_t i = h & (INDEX_SIZE - 1); index_table.slot[i] >= 0; i = (i + 1) & (INDEX_SIZE - 1)) {
+        const known_header& k = known[index_table.slot[i]];
+        if(k.hash == h && k.len == name.size() && strncasecmp(k.name, name.data(), k.len) == 0) {
+            return index_table.slot[i];
+        }
+    }
+    return HDR_OTHER;
+}
+
+bool header_map::add(std::string_view name, std::string_view value) {
+    if(m_count == m_capacity) {
+        return false;
+    }
+    entry& e = m_slots[m_count];
+    e.name  = name;
+    e.value = value;
+    e.hash  = hash(name.data(), name.size());
+    e.id    = lookup(name, e.hash);
+    if(e.id != HDR_OTHER && m_index[e.id] < 0) {
+        m_index[e.id] = m_count;
+    }
+    m_count++;
+    return true;
+}
+
+const header_map::entry* header_map::find(std::string_view name) const {
+    uint32_t h = hash(name.data(), name.size());
+    int id = lookup(name, h);
+    if(id != HDR_OTHER) {
+        return get((HEADER_ID)id);
+    }
+    for(int i = 0; i < m_count; i++) {
+        const entry& e = m_slots[i];
+        if(e.hash == h && e.name.size() == name.size() && strncasecmp(e.name.data(), name.data(), name.size()) == 0) {
+            return &e;
+        }
+    }
+    return NULL;
+}
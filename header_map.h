@@ -0,0 +1,103 @@
+#ifndef HEADER_MAP_H
+#define HEADER_MAP_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string_view>
+
+
+// 常用的请求头，解析时就认出来，按编号取不用比较名字
+enum HEADER_ID {
+    HDR_OTHER = 0,
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_PROXY_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_TRANSFER_ENCODING,
+    HDR_TE,
+    HDR_EXPECT,
+    HDR_UPGRADE,
+    HDR_HTTP2_SETTINGS,
+    HDR_CACHE_CONTROL,
+    HDR_PRAGMA,
+    HDR_AUTHORIZATION,
+    HDR_COOKIE,
+    HDR_USER_AGENT,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_RANGE,
+    HDR_SEC_WEBSOCKET_KEY,
+    HDR_SEC_WEBSOCKET_VERSION,
+    HDR_COUNT
+};
+
+
+// 请求头表：名字和值都是string_view，指向读缓冲区（HTTP/2是解码出来的头部列表），不拷贝
+// 每个名字在加入时算一次不区分大小写的哈希，常用的头按预先算好的哈希认出编号，记下第一次出现的位置，按编号取是O(1)；
+// 按名字取时先比哈希，哈希相同再比名字。条目的空间由调用者提供（连接的请求分配器，或者栈上的数组），表本身不分配内存。
+// 同名的头出现多次时按编号、按名字取到的都是第一个，需要全部的可以遍历。
+class header_map {
+public:
+    static const int MAX_HEADERS = 64;      // 一个请求最多的请求头数，超过的请求按错误处理
+
+    struct entry {
+        std::string_view name;
+        std::string_view value;     // 去掉了两边的空白；读缓冲区里的值后面紧跟着\0
+        uint32_t hash;              // 名字不区分大小写的哈希
+        int id;                     // HEADER_ID
+    };
+
+    header_map() : m_slots(0), m_capacity(0), m_count(0) { clear_index(); }
+
+    // 新请求开始：slots指向能放capacity个条目的空间，为NULL时只能当空表用
+    void reset(entry* slots, int capacity) {
+        m_slots = slots;
+        m_capacity = capacity;
+        m_count = 0;
+        clear_index();
+    }
+
+    // 加入一个请求头，放不下时返回false
+    bool add(std::string_view name, std::string_view value);
+
+    // 按编号取第一个这个名字的头，没有返回NULL
+    const entry* get(HEADER_ID id) const { return m_index[id] < 0 ? NULL : &m_slots[m_index[id]]; }
+
+    // 按名字取（不区分大小写），没有返回NULL
+    const entry* find(std::string_view name) const;
+
+    int size() const { return m_count; }
+    const entry& operator[](int i) const { return m_slots[i]; }
+
+    // 不区分大小写的FNV-1a，编译期也能算
+    static constexpr uint32_t hash(const char* s, size_t n) {
+        uint32_t h = 2166136261u;
+        for(size_t i = 0; i < n; i++) {
+            unsigned char c = s[i];
+            h = (h ^ (c >= 'A' && c <= 'Z' ? c + 32 : c)) * 16777619u;
+        }
+        return h;
+    }
+
+    // 名字对应的编号，不是常用的头返回HDR_OTHER
+    static int lookup(std::string_view name, uint32_t h);
+
+private:
+    void clear_index() {
+        for(int i = 0; i < HDR_COUNT; i++) {
+            m_index[i] = -1;
+        }
+    }
+
+private:
+    entry* m_slots;
+    int m_capacity;
+    int m_count;
+    int8_t m_index[HDR_COUNT];      // 每个常用的头第一次出现的下标，-1表示没有
+};
+
+
+#endif
@@ -0,0 +1,428 @@
+#include"hpack.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+
+// RFC 7541 附录A的静态表，下标从1开始
+static const char* static_table[][2] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+static const int STATIC_TABLE_LEN = 61;
+
+
+// RFC 7541 附录B的Huffman编码，最后一个是EOS
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff      // EOS
+};
+
+static const uint8_t huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+
+// 解码用的二叉树，启动后第一次用到时按上面的编码建好；叶子节点存 -(符号+1)
+struct huffman_tree {
+    int16_t child[512][2];
+    int nodes;
+
+    huffman_tree() : nodes(1) {
+        memset(child, 0, sizeof(child));
+        for(int sym = 0; sym < 257; sym++) {
+            int cur = 0;
+            for(int i = huffman_lens[sym] - 1; i >= 0; i--) {
+                int bit = (huffman_codes[sym] >> i) & 1;
+                if(i == 0) {
+                    child[cur][bit] = -(sym + 1);
+                }else {
+                    if(child[cur][bit] == 0) {
+                        child[cur][bit] = nodes++;
+                    }
+                    cur = child[cur][bit];
+                }
+            }
+        }
+    }
+};
+
+static const huffman_tree& tree() {
+    static huffman_tree t;
+    return t;
+}
+
+bool huffman_decode(const uint8_t* data, size_t len, std::string& out) {
+    const huffman_tree& t = tree();
+    int cur = 0;
+    int pad_bits = 0;       // 上一个符号之后读了几个比特
+    bool pad_ones = true;   // 这些比特是不是全是1
+    for(size_t i = 0; i < len; i++) {
+        for(int b = 7; b >= 0; b--) {
+            int bit = (data[i] >> b) & 1;
+            int next = t.child[cur][bit];
+            pad_bits++;
+            pad_ones = pad_ones && bit;
+            if(next < 0) {
+                if(next == -257) {
+                    return false;   // 不允许出现EOS
+                }
+                out.push_back((char)(-next - 1));
+                cur = 0;
+                pad_bits = 0;
+                pad_ones = true;
+            }else if(next == 0) {
+                return false;
+            }else {
+                cur = next;
+            }
+        }
+    }
+    // 结尾的填充必须是EOS的前缀（全1），且不超过7位
+    return pad_bits <= 7 && pad_ones;
+}
+
+static size_t huffman_length(const char* s, size_t len) {
+    uint64_t bits = 0;
+    for(size_t i = 0; i < len; i++) {
+        bits += huffman_lens[(uint8_t)s[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(std::string& out, const char* s, size_t len) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for(size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)s[i];
+        acc = (acc << huffman_lens[c]) | huffman_codes[c];
+        bits += huffman_lens[c];
+        while(bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    if(bits > 0) {
+        // 用EOS的高位（全1）填满最后一个字节
+        out.push_back((char)((acc << (8 - bits)) | (0xff >> bits)));
+    }
+}
+
+
+void hpack_encode_int(std::string& out, uint8_t first, int prefix_bits, uint64_t value) {
+    uint64_t max = (1u << prefix_bits) - 1;
+    if(value < max) {
+        out.push_back((char)(first | value));
+        return;
+    }
+    out.push_back((char)(first | max));
+    value -= max;
+    while(value >= 128) {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+void hpack_encode_string(std::string& out, const char* s, size_t len) {
+    size_t hlen = huffman_length(s, len);
+    if(hlen < len) {
+        hpack_encode_int(out, 0x80, 7, hlen);
+        huffman_encode(out, s, len);
+    }else {
+        hpack_encode_int(out, 0x00, 7, len);
+        out.append(s, len);
+    }
+}
+
+void hpack_encode_status(std::string& out, int status) {
+    // 常见的状态码在静态表里有完整的条目，一个字节就够了
+    for(int i = 8; i <= 14; i++) {
+        if(atoi(static_table[i][1]) == status) {
+            hpack_encode_int(out, 0x80, 7, i);
+            return;
+        }
+    }
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%03d", status % 1000);
+    hpack_encode_int(out, 0x00, 4, 8);
+    hpack_encode_string(out, buf, 3);
+}
+
+void hpack_encode_header(std::string& out, const char* name, size_t name_len, const char* value, size_t value_len) {
+    for(int i = 15; i <= STATIC_TABLE_LEN; i++) {
+        if(strlen(static_table[i][0]) == name_len && memcmp(static_table[i][0], name, name_len) == 0) {
+            hpack_encode_int(out, 0x00, 4, i);
+            hpack_encode_string(out, value, value_len);
+            return;
+        }
+    }
+    out.push_back(0x00);
+    hpack_encode_string(out, name, name_len);
+    hpack_encode_string(out, value, value_len);
+}
+
+
+hpack_decoder::hpack_decoder() : m_size(0), m_max_size(DEFAULT_TABLE_SIZE) {
+}
+
+static bool decode_int(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint64_t& value) {
+    uint64_t max = (1u << prefix_bits) - 1;
+    value = *p++ & max;
+    if(value < max) {
+        return true;
+    }
+    int shift = 0;
+    while(p < end) {
+        uint8_t b = *p++;
+        value += (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            return true;
+        }
+        shift += 7;
+        if(shift > 28) {
+            return false;   // 不接受超过32位的整数
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const uint8_t*& p, const uint8_t* end, std::string& out) {
+    if(p >= end) {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if(!decode_int(p, end, 7, len) || len > (uint64_t)(end - p)) {
+        return false;
+    }
+    out.clear();
+    bool ok = true;
+    if(huffman) {
+        ok = huffman_decode(p, len, out);
+    }else {
+        out.assign((const char*)p, len);
+    }
+    p += len;
+    return ok;
+}
+
+// 静态表转成std::string，查表时和动态表一样返回指针；多个工作线程同时解码，靠局部静态变量的线程安全初始化
+struct static_strings {
+    std::string names[STATIC_TABLE_LEN + 1];
+    std::string values[STATIC_TABLE_LEN + 1];
+
+    static_strings() {
+        for(int i = 1; i <= STATIC_TABLE_LEN; i++) {
+            names[i]  = static_table[i][0];
+            values[i] = static_table[i][1];
+        }
+    }
+};
+
+bool hpack_decoder::lookup(uint64_t index, const std::string** name, const std::string** value) const {
+    static static_strings st;
+    if(index == 0) {
+        return false;
+    }
+    if(index <= (uint64_t)STATIC_TABLE_LEN) {
+        *name  = &st.names[index];
+        *value = &st.values[index];
+        return true;
+    }
+    index -= STATIC_TABLE_LEN + 1;
+    if(index >= m_table.size()) {
+        return false;
+    }
+    *name  = &m_table[index].first;
+    *value = &m_table[index].second;
+    return true;
+}
+
+void hpack_decoder::evict(size_t max_size) {
+    while(m_size > max_size && !m_table.empty()) {
+        m_size -= m_table.back().first.size() + m_table.back().second.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const std::string& name, const std::string& value) {
+    size_t size = name.size() + value.size() + 32;
+    if(size > m_max_size) {
+        // 比整个表还大的条目：清空动态表，条目本身不放进去
+        evict(0);
+        return;
+    }
+    evict(m_max_size - size);
+    m_table.push_front(std::make_pair(name, value));
+    m_size += size;
+}
+
+bool hpack_decoder::decode(const uint8_t* data, size_t len, header_list& out) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    bool headers_started = false;
+    size_t list_size = 0;
+    while(p < end) {
+        uint8_t b = *p;
+        uint64_t index;
+        if(b & 0x80) {
+            // 索引表示
+            const std::string* name;
+            const std::string* value;
+            if(!decode_int(p, end, 7, index) || !lookup(index, &name, &value)) {
+                return false;
+            }
+            list_size += name->size() + value->size() + 32;
+            if(list_size > MAX_LIST_SIZE) {
+                return false;
+            }
+            out.push_back(std::make_pair(*name, *value));
+            headers_started = true;
+        }else if((b & 0xe0) == 0x20) {
+            // 动态表大小更新，只能出现在头部块的开头
+            if(headers_started || !decode_int(p, end, 5, index) || index > DEFAULT_TABLE_SIZE) {
+                return false;
+            }
+            m_max_size = index;
+            evict(m_max_size);
+        }else {
+            // 字面量：01 加索引，0000 不加索引，0001 永不索引
+            bool indexing = (b & 0xc0) == 0x40;
+            if(!decode_int(p, end, indexing ? 6 : 4, index)) {
+                return false;
+            }
+            std::pair<std::string, std::string> h;
+            if(index) {
+                const std::string* name;
+                const std::string* value;
+                if(!lookup(index, &name, &value)) {
+                    return false;
+                }
+                h.first = *name;
+            }else if(!decode_string(p, end, h.first)) {
+                return false;
+            }
+            if(!decode_string(p, end, h.second)) {
+                return false;
+            }
+            list_size += h.first.size() + h.second.size() + 32;
+            if(list_size > MAX_LIST_SIZE) {
+                return false;
+            }
+            if(indexing) {
+                insert(h.first, h.second);
+            }
+            out.push_back(h);
+            headers_started = true;
+        }
+    }
+    return true;
+}
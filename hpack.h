@@ -0,0 +1,60 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<deque>
+#include<vector>
+#include<utility>
+
+
+// HTTP/2 的头部压缩（RFC 7541）
+// 解码支持全部表示方式：静态表、动态表、Huffman编码的字符串。
+// 编码只用"不加索引的字面量"，名字能在静态表里找到就用下标，不维护编码端的动态表：
+// 响应头本来就很少，这样每个响应的编码结果和连接状态无关，出错也不会让两端的表不一致。
+
+
+typedef std::vector<std::pair<std::string, std::string> > header_list;
+
+
+class hpack_decoder {
+public:
+    static const size_t DEFAULT_TABLE_SIZE = 4096;      // SETTINGS_HEADER_TABLE_SIZE 的默认值，我们不修改
+    static const size_t MAX_LIST_SIZE = 64 * 1024;      // 解码后的头部列表的上限（每个头按 名字+值+32 计算），在SETTINGS_MAX_HEADER_LIST_SIZE里告诉对端
+
+    hpack_decoder();
+
+    // 解码一个完整的头部块（HEADERS加上所有CONTINUATION），结果追加到out；格式错误、解码后超过MAX_LIST_SIZE返回false，
+    // 连接要以COMPRESSION_ERROR关闭。一个字节的索引就能引用一个4KB的动态表条目，只限制压缩后的大小挡不住内存放大
+    bool decode(const uint8_t* data, size_t len, header_list& out);
+
+private:
+    bool lookup(uint64_t index, const std::string** name, const std::string** value) const;
+    void insert(const std::string& name, const std::string& value);
+    void evict(size_t max_size);
+
+private:
+    std::deque<std::pair<std::string, std::string> > m_table;  // 动态表，最新的在前面
+    size_t m_size;              // 动态表当前大小，每个条目按 名字+值+32 计算
+    size_t m_max_size;          // 对端通过"动态表大小更新"指定的上限，不超过DEFAULT_TABLE_SIZE
+};
+
+
+// 编码一个整数，first是第一个字节里前缀之外的高位
+void hpack_encode_int(std::string& out, uint8_t first, int prefix_bits, uint64_t value);
+
+// 编码一个字符串，Huffman编码更短时用Huffman
+void hpack_encode_string(std::string& out, const char* s, size_t len);
+
+// :status
+void hpack_encode_status(std::string& out, int status);
+
+// 不加索引的字面量，name必须是小写
+void hpack_encode_header(std::string& out, const char* name, size_t name_len, const char* value, size_t value_len);
+
+// Huffman解码，格式错误返回false
+bool huffman_decode(const uint8_t* data, size_t len, std::string& out);
+
+
+#endif
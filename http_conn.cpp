@@ -1,11 +1,32 @@
 #include"http_conn.h"
+#include"threadpool.h"
+#include<sys/socket.h>
+#include<poll.h>
+#include<netinet/tcp.h>
+#include<sys/eventfd.h>
+#include<atomic>
 
 int http_conn :: m_epollfd = 1;       // 所有socket上的事件都被注册到同一个eollfd上
-int http_conn :: m_user_count = 0;
+sharded_counter http_conn :: m_user_count;
+int http_conn :: m_write_policy = http_conn::WRITE_AUTO;
+int http_conn :: m_notsent_lowat = 256 * 1024;
+int http_conn :: m_handoff_fd = -1;
+locker http_conn :: m_handoff_lock;
+std::vector<std::pair<int, uint32_t> > http_conn :: m_handoff;
+
+// m_owner的布局：低17位是到了还没处理的事件（epoll的事件位和UPSTREAM_READY），高位是主人在等什么、有没有主人
+static const uint32_t OWNER_WANT_IN  = 1u << 24;
+static const uint32_t OWNER_WANT_OUT = 1u << 25;
+static const uint32_t OWNER_WANT_UP  = 1u << 26;
+static const uint32_t OWNER_WANTS    = OWNER_WANT_IN | OWNER_WANT_OUT | OWNER_WANT_UP;
+static const uint32_t OWNED          = 1u << 30;
+static const uint32_t CLOSE_EVENTS   = EPOLLRDHUP | EPOLLHUP | EPOLLERR;     // 不管在等什么都要处理
 
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* created_201_title = "Created";
+const char* created_201_form = "The file has been uploaded.\n";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossble to satisfy.\n";
 const char* error_403_title = "Forbidden";
@@ -14,11 +35,101 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server did not respond properly.\n";
+
+// 和METHOD枚举一一对应，转发请求行时用
+static const char* method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
 
 
 // 网站的根目录
 const char* doc_root = "/disk/sda/fx/linux/web_server/resources";
 
+// 上传文件保存的目录，为空表示不接受上传；PUT/POST /upload/<文件名> 会写到这里
+const char* upload_root = 0;
+const char* upload_prefix = "/upload/";
+
+// 按路径记下的优先级：高位是路径哈希的一部分，低2位是TASK_PRIORITY，0表示空槽
+// 主线程读、工作线程写，只是估计，槽被别的路径覆盖了也没关系
+static std::atomic<uint32_t> priority_hints[http_conn::PRIORITY_HINT_SLOTS];
+
+// FNV-1a，路径到?或者空白为止
+static uint64_t path_hash(const char* p, const char* end) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while(p < end && *p != '?' && *p != ' ' && *p != '\t' && *p != '\0') {
+        h ^= (unsigned char)*p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint32_t hint_tag(uint64_t h) {
+    return ((uint32_t)(h >> 32) & ~3u) | 4;
+}
+
+// 丢弃不需要的请求体时splice的目标
+static int devnull_fd() {
+    static int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    return fd;
+}
+
+// 把数据全部写到fd；fd是非阻塞的上游socket时，写不进去就在超时时间内等待
+static bool write_all(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t w = ::write(fd, data, len);
+        if(w < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN && proxy_wait(fd, POLLOUT, UPSTREAM_IO_TIMEOUT_MS)) {
+                continue;
+            }
+            return false;
+        }
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+// 逐行比较响应头/请求头的名字，忽略大小写
+static bool header_is(const char* line, const char* name) {
+    size_t n = strlen(name);
+    return strncasecmp(line, name, n) == 0 && line[n] == ':';
+}
+
+// 逐跳的头部只对一段连接有效，代理时不往下一段转发
+static bool hop_by_hop(const char* line) {
+    return header_is(line, "Connection") || header_is(line, "Keep-Alive") ||
+           header_is(line, "Proxy-Connection") || header_is(line, "Expect") ||
+           header_is(line, "Upgrade") || header_is(line, "TE");
+}
+
+static bool hop_by_hop(const header_map::entry& h) {
+    return h.id == HDR_CONNECTION || h.id == HDR_KEEP_ALIVE || h.id == HDR_PROXY_CONNECTION || h.id == HDR_EXPECT ||
+           h.id == HDR_UPGRADE || h.id == HDR_TE;
+}
+
+// Content-Length的值：只允许十进制数字，空的、带符号或者其它字符的、大到溢出的返回-1
+static int64_t parse_content_length(const char* value) {
+    if(*value == '\0') {
+        return -1;
+    }
+    int64_t n = 0;
+    for(const char* p = value; *p; p++) {
+        if(*p < '0' || *p > '9' || n > (INT64_MAX - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + (*p - '0');
+    }
+    return n;
+}
+
+// 响应缓存按Vary取请求头时的回调
+static const char* cache_header(void* ctx, const char* name) {
+    return ((const http_conn*)ctx)->get_header(name);
+}
+
 // 此处我使用的void 牛客是int 有返回值
 // 设置文件描述符非阻塞
 void setnonblocking(int fd) {
@@ -29,16 +140,13 @@ void setnonblocking(int fd) {
 }
 
 // 将文件描述符添加到epoll对象中
-void addfd(int epollfd, int fd, bool one_shot) {
+// 监听socket、eventfd用水平触发只关注读；客户端连接用边沿触发同时关注读写，整个连接只注册这一次，
+// 同一时间由谁处理靠http_conn::claim/release在用户态交接，不用EPOLLONESHOT每次重新注册
+void addfd(int epollfd, int fd, bool edge) {
     epoll_event event;
+    event.data.u64  = 0;    // 高32位留给上游socket的标记，这里必须清零
     event.data.fd   = fd;
-    event.events    = EPOLLIN | EPOLLRDHUP;     // 要检测的任务是读和挂起
-    // event.events    = EPOLLIN | EPOLLRDHUP | EPOLLET;
-
-    // one_shot机制，使文件描述符同一时间只能触发一个事件，但同时监听的文件描述符不能用oneshot
-    if(one_shot) {
-        event.events | EPOLLONESHOT;
-    }
+    event.events    = edge ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : (EPOLLIN | EPOLLRDHUP);
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
     // 设置文件描述符非阻塞
     setnonblocking(fd);
@@ -50,29 +158,147 @@ void removefd(int epollfd, int fd) {
     close(fd);
 }
 
-// 修改文件描述符, 重置socket上的EPOLLONESHOT事件，确保下一次可读时EPOLLIN事件能触发     
-void modfd(int epollfd, int fd, int ev) {
-    epoll_event event;
-    event.data.fd   = fd;
-    event.events    = ev | EPOLLONESHOT | EPOLLRDHUP | EPOLLET;
-    // 此处多添加一个一个EPOLLET；
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+// 主人在等的事件，关闭类的事件总是要处理
+static uint32_t owner_wanted(uint32_t state) {
+    return CLOSE_EVENTS | (state & OWNER_WANT_IN ? EPOLLIN : 0) | (state & OWNER_WANT_OUT ? EPOLLOUT : 0) |
+           (state & OWNER_WANT_UP ? http_conn::UPSTREAM_READY : 0);
+}
+
+// 没有主人时记下的事件里，不在等的可写不用留着：没有要发的数据，可写没有意义，以后要发了先直接写；
+// 不在等的可读要留着，边沿已经过去了，数据还在socket里
+static uint32_t owner_take(uint32_t* state) {
+    if(!(*state & OWNER_WANT_OUT)) {
+        *state &= ~EPOLLOUT;
+    }
+    uint32_t run = *state & owner_wanted(*state);
+    if(run) {
+        *state = (*state & ~run) | OWNED;
+    }
+    return run;
+}
+
+uint32_t http_conn::claim(uint32_t events) {
+    uint32_t old = m_owner.load(std::memory_order_relaxed);
+    uint32_t next, run;
+    do {
+        next = old | events;
+        run  = (old & OWNED) ? 0 : owner_take(&next);
+    } while(!m_owner.compare_exchange_weak(old, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+    return run;
+}
+
+uint32_t http_conn::release() {
+    uint32_t want = (m_want & EPOLLIN ? OWNER_WANT_IN : 0) | (m_want & EPOLLOUT ? OWNER_WANT_OUT : 0) |
+                    (m_want & UPSTREAM_READY ? OWNER_WANT_UP : 0);
+    uint32_t old = m_owner.load(std::memory_order_relaxed);
+    uint32_t next, run;
+    do {
+        next = (old & ~(OWNER_WANTS | OWNED)) | want | m_kick;
+        run  = owner_take(&next);
+    } while(!m_owner.compare_exchange_weak(old, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+    m_kick = 0;
+    return run;
+}
+
+// 放手之后连接可能马上被主线程拿走，之后不能再碰任何成员
+void http_conn::hand_back() {
+    int fd = m_socketfd;
+    uint32_t run = release();
+    if(run) {
+        // 处理期间又来了事件，少见：交给主线程按事件处理
+        m_handoff_lock.lock();
+        m_handoff.push_back(std::make_pair(fd, run));
+        m_handoff_lock.unlock();
+        uint64_t one = 1;
+        ::write(m_handoff_fd, &one, sizeof(one));
+    }
+}
+
+bool http_conn::init_handoff() {
+    m_handoff_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_handoff_fd < 0) {
+        return false;
+    }
+    addfd(m_epollfd, m_handoff_fd, false);
+    return true;
+}
+
+void http_conn::take_handoff(std::vector<std::pair<int, uint32_t> >& out) {
+    uint64_t count;
+    ::read(m_handoff_fd, &count, sizeof(count));
+    m_handoff_lock.lock();
+    out.swap(m_handoff);
+    m_handoff_lock.unlock();
+}
+
+// 客户端可以不等响应就接着发下一个请求（流水线），和这个请求一起读进来的字节挪到缓冲区开头；
+// 读的边沿已经过去了，放手时当作可读，由主线程照常交给工作线程解析
+void http_conn::next_request() {
+    int from = m_checked_idx;
+    int left = m_read_idx - from;
+    init();
+    if(left > 0) {
+        memmove(m_read_buf, m_read_buf + from, left);
+        m_read_idx = left;
+        m_read_buf[m_read_idx] = '\0';
+        m_kick |= EPOLLIN;
+    }
 }
 
 // 外部调用，初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in &addr) {
+void http_conn::init(int sockfd, const sockaddr_in &addr, const struct ucred* cred) {
+    // 读写缓冲区和文件名放在一块内存里，第一次用到这个下标时分配，之后连接复用时保留
+    if(!m_read_buf) {
+        m_read_buf = (char*)malloc(READ_BUFFER_SIZE + 1 + WRITE_BUFFER_SIZE + FILENAME_LEN);
+        if(!m_read_buf) {
+            close(sockfd);
+            return;
+        }
+        m_write_buf = m_read_buf + READ_BUFFER_SIZE + 1;
+        m_real_file = m_write_buf + WRITE_BUFFER_SIZE;
+    }
     m_socketfd    = sockfd;
     m_address     = addr;
+    m_local       = cred != NULL;
+    if(m_local) {
+        m_peer_cred = *cred;
+    }
+    m_capture     = http_capture.open_conn();
 
     // 设置端口复用
     int reuse = 1;
     setsockopt(m_socketfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-    // 添加到epoll中`
+    // 写策略：小响应不被Nagle算法拖住；未发出的数据超过低水位时不再往内核里塞，EPOLLOUT也要降到低水位以下才触发，
+    // 大文件不会在内核里堆几兆字节，同一个连接上后面的响应和别的连接的首字节都不用排在它后面
+    // Unix域socket没有这些TCP选项
+    if(m_write_policy != WRITE_PLAIN && !m_local) {
+        int on = 1;
+        setsockopt(m_socketfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if(m_notsent_lowat > 0 && !m_local) {
+        setsockopt(m_socketfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &m_notsent_lowat, sizeof(m_notsent_lowat));
+    }
+    m_corked = false;
+    m_held   = false;
+    m_want   = EPOLLIN;
+    m_kick   = 0;
+    m_owner.store(OWNER_WANT_IN, std::memory_order_relaxed);
+
+    // 添加到epoll中，注册时已经可读的话马上就会报告
     addfd(m_epollfd, m_socketfd, true);
-    m_user_count++; // 用户数+1
+    m_user_count.add(1); // 用户数+1
 
     init(); // 分开init是因为可能会单独初始化此部分，不初始化上上面的初始化
+
+    // TLS监听：先握手，握手由工作线程推进，完成前主线程不读socket；同一台机器上的Unix域socket不加密
+    m_secure = http_tls.enabled() && !m_local;
+    if(m_secure) {
+        m_tls = http_tls.create(m_socketfd);
+        if(!m_tls) {
+            close_conn();
+        }
+    }
 }
 
 // 对http部分的初始化
@@ -86,26 +312,172 @@ void http_conn::init(){
     m_method = GET;                                 // 请求方法             GET/POST
     m_linger = false;                               // 默认不保持链接，     状态有二：keep-alive; close
     m_write_idx = 0;                                // 写缓冲区中待发送的字节数
-    m_content_length = 0;                           // 响应体的总大小
+    m_content_length = 0;                           // 请求体的总大小
+    m_chunked = false;                              // 请求体是否是chunked编码
+    m_expect_continue = false;                      // 是否需要先回复100 Continue
+    m_body_streaming = false;                       // 是否正在流式接收请求体
+    m_body_left = 0;                                // 剩余未接收的请求体字节数
+    m_body_raw = false;                             // 请求体是否原样转发
+    m_pipe_bytes = 0;                               // 管道中的字节数
+    m_route = NULL;                                 // 匹配到的路由
+    m_route_prefix = 0;                             // 路由匹配的前缀长度
+    m_proxy_body = PROXY_NONE;                      // 上游响应体的长度确定方式
+    m_proxy_left = 0;                               // 上游响应体剩余字节数
+    m_proxy_keepalive = false;                      // 上游连接能否复用
+    m_proxy_eof = false;                            // 上游是否已经关闭
+    m_proxy_head_wait = false;                      // 是否在等上游的响应头
+    m_proxy_head_len = 0;                           // 已经收到的上游响应头字节数
     m_host = 0;                                     // 客户端主机
-
-
-
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, WRITE_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);               // 文件
+    m_site = http_vhosts.fallback();                // 没有Host头时用默认站点
+    m_iv_count = 0;                                 // 待写的内存块数量
+    m_bytes_to_send = 0;                            // 本次响应剩余待发送的字节数
+    m_bytes_have_sent = 0;                          // 本次响应已经发送的字节数
+    m_file_offset = 0;                              // 下一个映射窗口的文件偏移
+    m_readahead_end = 0;                            // 已提示预读到的位置
+    m_send_rate = 0;                                // 发送速率估计
+    m_upgrade_h2c = false;                          // 是否请求升级到h2c
+    m_upgrade_ws = false;                           // 是否请求升级到WebSocket
+    m_h2_settings = 0;                              // HTTP2-Settings 头
+
+    // 上一个请求分配的内存整体作废，请求头表的条目从头分配；申请不到内存时表是空的，有请求头的请求都回400
+    m_arena.reset();
+    header_map::entry* slots = m_arena.alloc_array<header_map::entry>(header_map::MAX_HEADERS);
+    m_headers.reset(slots, slots ? header_map::MAX_HEADERS : 0);
+
+    // 缓冲区不按请求清零：读缓冲区每次读完在数据末尾补\0，写缓冲区和文件名都按长度使用
+    m_read_buf[0] = '\0';
 }
 
 void http_conn::close_conn() {
     if(m_socketfd != -1) {
-        removefd(m_epollfd, m_socketfd);
+        int fd = m_socketfd;
         m_socketfd = -1;
-        m_user_count --;
+        m_user_count.add(-1);
+        if(m_capture) {
+            http_capture.close_conn(m_capture);
+            m_capture = 0;
+        }
+        delete m_h2;    // HTTP/2的连接：手上所有流的缓存引用、文件描述符一起释放
+        m_h2 = NULL;
+        delete m_ws;    // WebSocket的连接：退出频道，释放输出队列里的帧
+        m_ws = NULL;
+        http_tls.destroy(m_tls);    // 握手没完成就断开了
+        m_tls = NULL;
+        unmap();    // 大文件发送到一半断开时，释放映射窗口和文件描述符
+        delete m_zc;    // 还没等到完成通知的缓存条目过一会儿再释放
+        m_zc = NULL;
+        abort_body();   // 上传到一半断开时，删掉不完整的文件
+        release_upstream(false);    // 代理转发到一半断开时，上游连接不能再复用
+        m_site->cache->abandon(m_cache_fill, false);   // 占位条目还没填就断开了，让等待的请求自己去生成
+        m_cache_fill = NULL;
+        m_body_streaming = false;
+        if(m_body_pipe[0] != -1) {
+            close(m_body_pipe[0]);
+            close(m_body_pipe[1]);
+            m_body_pipe[0] = m_body_pipe[1] = -1;
+        }
+        m_pipe_bytes = 0;
+        // 最后才关socket：工作线程里关闭时，socket号一释放就可能被主线程接受的新连接用上，这个对象随即被重新初始化
+        removefd(m_epollfd, fd);
+    }
+}
+
+// 不经过线程池，尽力发一次，发不完也不等，反正马上就关闭
+void http_conn::reply_and_close(const char* data, size_t len) {
+    send(m_socketfd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close_conn();
+}
+
+// 读缓冲区里正好是一个完整的、没有请求体的GET时才看：请求行、Host、Connection，
+// 有请求体、要升级、命中路由的照常交给工作线程。回完404读缓冲区就空了，保持连接时直接开始下一个请求
+int http_conn::reply_missing() {
+    if(m_read_idx < 18 || m_read_idx >= READ_BUFFER_SIZE || memcmp(m_read_buf, "GET /", 5) != 0 ||
+       memcmp(m_read_buf + m_read_idx - 4, "\r\n\r\n", 4) != 0) {
+        return 0;
+    }
+    const char* end = m_read_buf + m_read_idx;
+    const char* url = m_read_buf + 4;
+    const char* eol = (const char*)memchr(url, '\r', end - url);
+    const char* sp = (const char*)memchr(url, ' ', eol - url);
+    if(!sp || memchr(url, '\t', eol - url) || eol - sp != 9 || strncasecmp(sp + 1, "HTTP/1.1", 8) != 0 || eol[1] != '\n') {
+        return 0;
+    }
+    size_t url_len = sp - url;
+    bool linger = true;
+    char host[vhost_table::MAX_HOST_LEN + 1];
+    host[0] = '\0';
+    for(const char* p = eol + 2; p < end - 2; p = eol + 2) {
+        eol = (const char*)memchr(p, '\r', end - p);
+        const char* colon = (const char*)memchr(p, ':', eol - p);
+        if(eol[1] != '\n' || !colon || colon == p) {
+            return 0;
+        }
+        std::string_view name(p, colon - p);
+        const char* v = colon + 1 + strspn(colon + 1, " \t");
+        size_t v_len = eol - v;
+        while(v_len > 0 && (v[v_len - 1] == ' ' || v[v_len - 1] == '\t')) {
+            v_len--;
+        }
+        switch(header_map::lookup(name, header_map::hash(name.data(), name.size()))) {
+            case HDR_HOST:
+                if(v_len > (size_t)vhost_table::MAX_HOST_LEN) {
+                    return 0;
+                }
+                memcpy(host, v, v_len);
+                host[v_len] = '\0';
+                break;
+            case HDR_CONNECTION:
+                if(v_len == 5 && strncasecmp(v, "close", 5) == 0) {
+                    linger = false;
+                }else if(v_len == 10 && strncasecmp(v, "keep-alive", 10) == 0) {
+                    linger = true;
+                }
+                break;
+            case HDR_CONTENT_LENGTH:
+            case HDR_TRANSFER_ENCODING:
+            case HDR_UPGRADE:
+            case HDR_EXPECT:
+                return 0;
+            default:
+                break;
+        }
     }
+    const vhost* site = http_vhosts.find(host[0] ? host : NULL);
+    const char* q = (const char*)memchr(url, '?', url_len);
+    size_t prefix_len;
+    if(!site->missing || (!http_router.empty() && http_router.match(url, q ? q - url : url_len, &prefix_len)) ||
+       !site->missing->missing(url, url_len)) {
+        return 0;
+    }
+    const std::string& resp = site->missing->response(linger);
+    if(send(m_socketfd, resp.data(), resp.size(), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)resp.size() || !linger) {
+        return -1;
+    }
+    init();
+    want(EPOLLIN);
+    return 1;
 }
 
 // 循环读取客户数据，直到无数据可读，或者对方关闭连接 
 bool http_conn::read() {
+    profile_stage stage(STAGE_READ);
+    // 握手期间的数据由OpenSSL在工作线程里读
+    if(m_tls) {
+        return true;
+    }
+    if(m_h2) {
+        if(!m_h2->read()) {
+            return false;
+        }
+        if(m_h2->input_full()) {
+            m_kick = EPOLLIN;   // 没读到EAGAIN，边沿不会再来，处理完接着读
+        }
+        return true;
+    }
+    // 请求体由工作线程直接从socket上splice，不经过读缓冲区
+    if(m_body_streaming) {
+        return true;
+    }
     // 非阻塞读
     if(m_read_idx >= READ_BUFFER_SIZE) {
         return false;       // 判断如果已读的数据超过读缓冲区大小，返回
@@ -113,7 +485,8 @@ bool http_conn::read() {
 
     // 已经读取到的字节
     int bytes_read = 0;
-    while(true) {
+    while(m_read_idx < READ_BUFFER_SIZE) {
+        // 缓冲区满了就先停下，剩下的数据（通常是请求体）留在socket里
         // 为了数据的连续性，数据保存在数组+序号的位置，得到的就是连续的数据；
         // recv 参数：1.连接的套接字；2.指向缓冲区的指针；3.缓冲区的长度；4.行为标识符    返回值：读出来的数据大小
         // 数组的大小就是缓冲区的大小减去已经读到的大小
@@ -129,15 +502,23 @@ bool http_conn::read() {
             // 对方关闭连接
             return false;
         }
+        if(m_capture) {
+            http_capture.data(m_capture, m_read_buf + m_read_idx, bytes_read);
+        }
         // 索引向后移动
         m_read_idx += bytes_read;
     }
+    if(m_read_idx >= READ_BUFFER_SIZE) {
+        m_kick = EPOLLIN;   // 缓冲区满了，socket里可能还有数据，边沿不会再来，这个请求处理完接着读
+    }
+    m_read_buf[m_read_idx] = '\0';
     printf("读取到的数据：%s\n", m_read_buf);
     return true;
 }   
 
 // 主状态机，解析请求
 http_conn::HTTP_CODE http_conn::process_read(){
+    profile_stage stage(STAGE_PARSE);
     // 初始化一些状态
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
@@ -166,16 +547,20 @@ http_conn::HTTP_CODE http_conn::process_read(){
             case CHECK_STATE_HEADER:
             {
                 ret = parse_headers(text);
-                if(ret == BAD_REQUEST) return BAD_REQUEST;
-                else if(ret == GET_REQUEST) return do_request();
+                if(ret == GET_REQUEST) return do_request();
+                else if(ret != NO_REQUEST) {
+                    // 请求有误，或者代理直接失败：请求头没解析完、请求体还没收，剩下的字节里找不到下一个请求的开头，回完就关
+                    if((ret != CACHE_HIT && ret != UPGRADE_WS && ret != UPGRADE_H2) || m_content_length != 0 || m_chunked) {
+                        m_linger = false;
+                    }
+                    return ret;
+                }
                 break;
             }
             case CHECK_STATE_CONTENT:
             {
-                ret = parse_content(text);
-                if(ret == GET_REQUEST) return do_request();
-                line_status = LINE_OPEN;
-                break;
+                // 请求体不再按行解析，也不要求整个放进读缓冲区
+                return begin_body();
             }  
             default:
                 return INTERNAL_ERROR;
@@ -230,6 +615,9 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     //  char *strpbrk(const char *str1, const char *str2) 检索字符串 str1 中第一个匹配字符串 str2 中字符的字符,返回位置
     // 检测空格 和 \t， 此时m_url位置在GET后空格的位置
     m_url = strpbrk(text, " \t"); 
+    if(!m_url) {
+        return BAD_REQUEST;
+    }
     // 将空格变为'\0',并向后移动一位 :  GET\0/index.html HTTP/1.1,      此时m_url并指向-> /
     *m_url++ = '\0';
 
@@ -238,6 +626,10 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     if(strcasecmp(method, "GET") == 0) {
         m_method = GET;
         printf("The request method is GET\n");
+    }else if(strcasecmp(method, "POST") == 0) {
+        m_method = POST;
+    }else if(strcasecmp(method, "PUT") == 0) {
+        m_method = PUT;
     }else {
         return BAD_REQUEST;
     }
@@ -251,6 +643,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     if(strcasecmp(m_version, "HTTP/1.1") != 0) {
         return BAD_REQUEST;
     }
+    // HTTP/1.1默认保持连接，除非请求头里有Connection: close
+    m_linger = true;
     // http://10.15.1.252:10000/index.html
     if(strncasecmp(m_url, "http://", 7) == 0) {
         // 10.15.1.252:10000/index.html
@@ -276,136 +670,1215 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
 http_conn::HTTP_CODE http_conn::parse_headers(char* text){
     // 遇到空行 说明头部已经解析完毕了，因为请求头和请求内容之间有一个空行
     if(text[0] == '\0') {
+        // 请求头完整了，先查路由，再查响应缓存；命中缓存的请求不用找文件，也不用转发给上游
+        // 代理路由要在请求体之前把请求头转发给上游
+        match_route();
+        // WebSocket只接受/ws/下面没有请求体的GET
+        const char* channel;
+        size_t channel_len;
+        if(m_upgrade_ws && m_method == GET && m_content_length == 0 && !m_chunked &&
+           ws_hub::accepts(m_url, &channel, &channel_len)) {
+            return UPGRADE_WS;
+        }
+        // 升级到h2c只对没有请求体的请求做，代理路由在HTTP/2上不支持，就继续按HTTP/1.1处理；TLS连接上的HTTP/2走ALPN
+        if(m_upgrade_h2c && m_h2_settings && !m_secure && m_content_length == 0 && !m_chunked && !(m_route && m_route->upstream)) {
+            return UPGRADE_H2;
+        }
+        if(cache_lookup() == CACHE_HIT) {
+            return CACHE_HIT;
+        }
+        if(m_route && m_route->upstream) {
+            HTTP_CODE ret = start_proxy();
+            if(ret != NO_REQUEST) {
+                return ret;
+            }
+        }
         // 不等于0则有请求体， 主状态机转为CHECK_STATE_CONTENT状态,请求还没读完
-        if(m_content_length != 0) {
+        if(m_content_length != 0 || m_chunked) {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
         // 否则说明我们已经得到一个完整的HTTP请求了
         return GET_REQUEST;
-    // 还没有解析完 继续解析
-    }else if(strncasecmp(text, "Host:", 5) == 0) {
-        text += 5;      // 此时text指向空格
-        // strspn   检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标
-        text += strspn(text, " \t");       // 此时得到m_host指向IP地址和端口号
-        m_host = text;
-        printf("The request Host is : %s\n", m_host);
-    }else if(strncasecmp(text, "connection:", 11) == 0) {
-        text += 11;
-        text += strspn(text, " \t");
-        if(strcasecmp(text, "keep-alive") == 0) {
-            m_linger = true;
-        }
-    }else if(strncasecmp(text, "Content-Length:", 15) == 0) {
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
-    }else {
+    }
+    // 还没有解析完 继续解析：名字和值记进请求头表，常用的头顺便在这里处理
+    char* colon = strchr(text, ':');
+    if(!colon || colon == text) {
         printf("Cannot parse header%s\n", text);
+        return NO_REQUEST;
+    }
+    char* value = colon + 1;
+    value += strspn(value, " \t");
+    char* value_end = value + strlen(value);
+    while(value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        *--value_end = '\0';
+    }
+    if(!m_headers.add(std::string_view(text, colon - text), std::string_view(value, value_end - value))) {
+        return BAD_REQUEST;     // 请求头太多
+    }
+    switch(m_headers[m_headers.size() - 1].id) {
+        case HDR_HOST:
+            m_host = value;
+            m_site = http_vhosts.find(m_host);
+            printf("The request Host is : %s\n", m_host);
+            break;
+        case HDR_CONNECTION:
+            if(strcasecmp(value, "keep-alive") == 0) {
+                m_linger = true;
+            }else if(strcasecmp(value, "close") == 0) {
+                m_linger = false;
+            }
+            break;
+        case HDR_CONTENT_LENGTH: {
+            // 请求体的边界以后要靠它找下一个请求，含糊的都按错误处理并且回完就关（RFC 9112 6.3）：
+            // 不是纯数字、和前面的Content-Length不一样、和Transfer-Encoding同时出现
+            const header_map::entry* first = m_headers.get(HDR_CONTENT_LENGTH);
+            int64_t length = parse_content_length(value);
+            if(length < 0 || m_headers.get(HDR_TRANSFER_ENCODING) ||
+               (first != &m_headers[m_headers.size() - 1] && length != m_content_length)) {
+                m_linger = false;
+                return BAD_REQUEST;
+            }
+            m_content_length = length;
+            break;
+        }
+        case HDR_TRANSFER_ENCODING:
+            if(m_headers.get(HDR_CONTENT_LENGTH)) {
+                m_linger = false;
+                return BAD_REQUEST;
+            }
+            if(strcasecmp(value, "chunked") == 0) {
+                m_chunked = true;
+            }else if(strcasecmp(value, "identity") != 0) {
+                return BAD_REQUEST;
+            }
+            break;
+        case HDR_EXPECT:
+            m_expect_continue = strcasecmp(value, "100-continue") == 0;
+            break;
+        case HDR_UPGRADE:
+            m_upgrade_h2c = strcasestr(value, "h2c") != NULL;
+            m_upgrade_ws = strcasestr(value, "websocket") != NULL;
+            break;
+        case HDR_HTTP2_SETTINGS:
+            m_h2_settings = value;
+            break;
+        default:
+            break;
     }
     return NO_REQUEST;
 } 
 
-http_conn::HTTP_CODE http_conn::parse_content(char* text){
-    if(m_read_idx >= (m_content_length + m_checked_idx)) {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+// 请求头解析完毕且带有请求体：确定请求体的去向，先处理已经读进缓冲区的部分，
+// 剩下的交给pump_body直接从socket搬运
+http_conn::HTTP_CODE http_conn::begin_body() {
+    m_body_left = m_chunked ? 0 : m_content_length;
+    m_chunk.reset();
+    if(m_upstream.fd != -1) {
+        // 代理：请求体连同chunked分帧原样转给上游
+        m_body_fd  = m_upstream.fd;
+        m_body_raw = true;
+    }else if(m_method == POST || m_method == PUT) {
+        // 请求体只收一部分就回错误，连接上剩下的字节没法再解析，回完就关掉
+        HTTP_CODE ret = open_upload();
+        if(ret != NO_REQUEST) {
+            m_linger = false;
+            return ret;
+        }
+    }
+    if(m_body_fd == -1) {
+        // 不是上传的请求体，读完丢弃
+        m_body_fd = devnull_fd();
+    }
+
+    if(m_expect_continue) {
+        const char* cont = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(m_socketfd, cont, strlen(cont), MSG_NOSIGNAL);
+    }
+
+    // 请求体之后的字节是客户端接着发的下一个请求（流水线），留在缓冲区里等这个请求回完再解析
+    int used = consume_body(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+    if(used < 0) {
+        abort_body();
+        m_linger = false;
+        return m_chunk.bad() ? BAD_REQUEST : INTERNAL_ERROR;
+    }
+    m_checked_idx += used;
+    if(body_complete()) {
+        return finish_body();
+    }
+    capture_gap();      // 剩下的请求体直接从socket搬走，不经过读缓冲区
+    m_body_streaming = true;
+    return pump_body();
+}
+
+// 上传目标只能是upload_root下的一个普通文件名，不允许子目录和..
+// 返回NO_REQUEST表示继续接收请求体，其它值是要直接回复的错误
+http_conn::HTTP_CODE http_conn::open_upload() {
+    int prefix_len = strlen(upload_prefix);
+    if(!upload_root || strncmp(m_url, upload_prefix, prefix_len) != 0) {
+        // 只有上传目录接受PUT；POST到普通文件时丢弃请求体后按GET处理
+        return m_method == PUT ? FORBIDDEN_REQUEST : NO_REQUEST;
+    }
+    const char* name = m_url + prefix_len;
+    if(name[0] == '\0' || name[0] == '.' || strchr(name, '/')) {
+        return FORBIDDEN_REQUEST;
+    }
+    int len = snprintf(m_real_file, FILENAME_LEN, "%s/%s", upload_root, name);
+    if(len >= FILENAME_LEN) {
+        return BAD_REQUEST;
+    }
+    m_body_fd = open(m_real_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_body_fd < 0) {
+        return INTERNAL_ERROR;
+    }
+    m_body_upload = true;
+    return NO_REQUEST;
+}
+
+// 写出缓冲区里已经读到的请求体字节，chunked编码时顺便去掉分帧；请求体完整了就停下
+int http_conn::consume_body(const char* data, int len) {
+    int total = len;
+    while(len > 0 && !body_complete()) {
+        int64_t n;
+        if(m_chunked) {
+            if(m_chunk.state() != chunked_decoder::DATA) {
+                int k = m_chunk.feed(data, len);
+                if(m_body_raw && !write_all(m_body_fd, data, k)) {
+                    return -1;
+                }
+                data += k;
+                len -= k;
+                if(m_chunk.bad()) {
+                    return -1;
+                }
+                continue;
+            }
+            n = m_chunk.data_left();
+        }else {
+            n = m_body_left;
+        }
+        if(n > len) {
+            n = len;
+        }
+        if(!write_all(m_body_fd, data, n)) {
+            return -1;
+        }
+        if(m_chunked) {
+            m_chunk.consume_data(n);
+        }else {
+            m_body_left -= n;
+        }
+        data += n;
+        len -= n;
+    }
+    return total - len;
+}
+
+// 在工作线程里把socket上的请求体经管道splice到目标文件，数据不经过用户态缓冲区
+// 返回NO_REQUEST表示还没收完，等下一次EPOLLIN
+bool http_conn::ensure_body_pipe() {
+    if(m_body_pipe[0] == -1) {
+        if(pipe2(m_body_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            m_body_pipe[0] = m_body_pipe[1] = -1;
+            return false;
+        }
+        fcntl(m_body_pipe[1], F_SETPIPE_SZ, BODY_PIPE_SIZE);
+    }
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::pump_body() {
+    if(!ensure_body_pipe()) {
+        abort_body();
+        m_linger = false;
+        return INTERNAL_ERROR;
+    }
+
+    int64_t budget = BODY_PUMP_BUDGET;
+    while(!body_complete() && budget > 0) {
+        if(m_chunked && m_chunk.state() != chunked_decoder::DATA) {
+            // 分帧字节很少，先偷看一小段，解析完只取走分帧部分，块数据仍然留在socket里走splice
+            char frame[64];
+            int n = recv(m_socketfd, frame, sizeof(frame), MSG_PEEK);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return NO_REQUEST;
+            }
+            if(n <= 0) {
+                abort_body();
+                m_linger = false;
+                return BAD_REQUEST;
+            }
+            int k = m_chunk.feed(frame, n);
+            recv(m_socketfd, frame, k, 0);
+            if(m_body_raw && !m_chunk.bad() && !write_all(m_body_fd, frame, k)) {
+                abort_body();
+                m_linger = false;
+                return BAD_GATEWAY;
+            }
+            if(m_chunk.bad()) {
+                abort_body();
+                m_linger = false;
+                return BAD_REQUEST;
+            }
+            continue;
+        }
+
+        int64_t want = m_chunked ? m_chunk.data_left() : m_body_left;
+        if(want > budget) {
+            want = budget;
+        }
+        if(want > BODY_PIPE_SIZE) {
+            want = BODY_PIPE_SIZE;
+        }
+        ssize_t n = splice(m_socketfd, NULL, m_body_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return NO_REQUEST;
+        }
+        if(n <= 0) {
+            // 请求体没收完对方就关闭了
+            abort_body();
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+        // 把管道里的数据落盘。磁盘慢的时候这里会阻塞，socket上的数据就留在内核里，
+        // 接收窗口被填满后客户端自然会慢下来，这就是上传的反压；代理时上游慢也是一样
+        for(ssize_t left = n; left > 0; ) {
+            ssize_t w = splice(m_body_pipe[0], NULL, m_body_fd, NULL, left, SPLICE_F_MOVE);
+            if(w < 0 && (errno == EINTR || (errno == EAGAIN && proxy_wait(m_body_fd, POLLOUT, UPSTREAM_IO_TIMEOUT_MS)))) {
+                continue;
+            }
+            if(w <= 0) {
+                abort_body();
+                m_linger = false;
+                return m_body_raw ? BAD_GATEWAY : INTERNAL_ERROR;
+            }
+            left -= w;
+        }
+        if(m_chunked) {
+            m_chunk.consume_data(n);
+        }else {
+            m_body_left -= n;
+        }
+        budget -= n;
+    }
+    if(body_complete()) {
+        return finish_body();
     }
+    // 本次预算用完，让出工作线程；socket上还有数据，放手时当作可读，交回主线程再排一次队
+    m_kick = EPOLLIN;
     return NO_REQUEST;
 }
 
+// 请求体接收完毕，上传请求回复201，其它请求按原来的方式找文件
+http_conn::HTTP_CODE http_conn::finish_body() {
+    m_body_streaming = false;
+    if(m_body_upload) {
+        close(m_body_fd);
+        m_body_fd = -1;
+        m_body_upload = false;
+        return CREATED_REQUEST;
+    }
+    m_body_fd = -1;
+    return do_request();
+}
+
+void http_conn::abort_body() {
+    if(m_body_upload) {
+        close(m_body_fd);
+        unlink(m_real_file);
+        m_body_upload = false;
+    }
+    m_body_fd = -1;
+}
+
 // 当一个完整的、正确的HTTP请求时，我们分析目标文件的属性
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其映射到内存上，并告诉调用者获取文件成功
+// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其第一个窗口映射到内存上，并告诉调用者获取文件成功
+// 大文件不会一次性整个映射，而是保持文件描述符打开，在write()里按FILE_WINDOW_SIZE大小的窗口依次映射发送
 http_conn::HTTP_CODE http_conn::do_request() {
-    // 服务器的资源目录为： /disk/sda/fx/linux/web_server/resources
-    strcpy(m_real_file, doc_root);
+    profile_stage stage(STAGE_REQUEST);
+    // 代理请求：请求已经转发完，等上游的响应
+    if(m_upstream.fd != -1) {
+        return proxy_read_response();
+    }
+    // 命中进程内注册的路由，交给处理函数生成响应，不再去找文件
+    if(m_route) {
+        return dispatch_route();
+    }
+
+    printf("此时请求的m_url是： %s\n", m_url);
+    uint32_t missing_gen = m_site->missing ? m_site->missing->generation() : 0;
+    HTTP_CODE ret = resolve_file(m_site->root.c_str(), m_url, m_real_file, &m_file_stat);
+    if(ret != FILE_REQUEST) {
+        if(ret == NO_RESOURCE && m_site->missing) {
+            // 记下来，同一个路径下次在主线程里就回404
+            m_site->missing->note_miss(m_url, missing_gen);
+        }
+        return ret;
+    }
+
+    // 热文件的本节点副本、共享内存里的小文件，命中就不用open、mmap
+    if(use_shared_file(acquire_shared_file(m_real_file, m_file_stat, &m_replica, &m_shm_handle))) {
+        return FILE_REQUEST;
+    }
+
+    // 以只读方式打开文件
+    m_file_fd = open(m_real_file, O_RDONLY);
+    if(m_file_fd < 0) {
+        return NO_RESOURCE;
+    }
+    if(use_shared_file(insert_shared_file(m_real_file, m_file_stat, m_file_fd, &m_shm_handle))) {
+        close(m_file_fd);
+        m_file_fd = -1;
+        return FILE_REQUEST;
+    }
+    m_file_offset   = 0;
+    m_readahead_end = 0;
+    m_send_rate     = 0;
+    if(m_file_stat.st_size > FILE_WINDOW_SIZE) {
+        // 大文件顺序读，让内核加大默认预读
+        posix_fadvise(m_file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    // 创建第一个窗口的内存映射, 映射到了m_file_address
+    if(!map_window()) {
+        unmap();
+        return INTERNAL_ERROR;
+    }
+    if(m_file_offset >= m_file_stat.st_size) {
+        // 整个文件一个窗口就放下了，不需要继续保留文件描述符
+        close(m_file_fd);
+        m_file_fd = -1;
+    }
+    return FILE_REQUEST;
+}
+
+// 文件内容在共享内存里，整个文件就是一个窗口，和一次映射完的小文件一样发送
+bool http_conn::use_shared_file(const char* data) {
+    if(!data) {
+        return false;
+    }
+    m_file_address  = (char*)data;
+    m_file_map_len  = m_file_stat.st_size;
+    m_file_offset   = m_file_stat.st_size;
+    m_readahead_end = 0;
+    m_send_rate     = 0;
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::resolve_file(const char* root, const char* url, char* real_file, struct stat* st) {
+    // 站点的根目录，没有配置虚拟主机时为： /disk/sda/fx/linux/web_server/resources
     // len 是根目录的长度
-    int len = strlen(doc_root);
+    int len = strlen(root);
+    if(len >= FILENAME_LEN) {
+        return NO_RESOURCE;
+    }
+    memcpy(real_file, root, len);
     // 拼接，将url与资源目录拼接，得到具体的路径
     // 如 ：   /disk/sda/fx/linux/web_server/resources + /index.html
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    printf("此时请求的m_url是： %s\n", m_url);
-    printf("此处是m_real_file的地址：%s\n", m_real_file);
+    strncpy(real_file + len, url, FILENAME_LEN - len - 1);
+    real_file[FILENAME_LEN - 1] = '\0';
+    printf("此处是m_real_file的地址：%s\n", real_file);
     // stat函数： 获取文件信息，参数：1.文件路径；2.stat类的结构体
-    // 获取m_real_flie文件相关的状态信息， -1 失败； 0成功
-    if(stat(m_real_file, &m_file_stat) < 0) {
+    // 获取real_file文件相关的状态信息， -1 失败； 0成功
+    if(stat(real_file, st) < 0) {
         return NO_RESOURCE;
     }
 
     // 判断访问权限
-    if(! (m_file_stat.st_mode & S_IROTH)) {
+    if(! (st->st_mode & S_IROTH)) {
         return BAD_REQUEST;
     }
 
     // 判断是否是目录
-    if(S_ISDIR(m_file_stat.st_mode)){
+    if(S_ISDIR(st->st_mode)){
         return BAD_REQUEST;
     }
-
-    // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
-    // 创建内存映射, 请求体内容映射到了m_file_address
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    printf("此时开辟的内存映射区地址为：%s\n", m_file_address);
-    close(fd);
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行unmap操作
+const char* http_conn::acquire_shared_file(const char* path, const struct stat& st, replica_entry** replica, int* shm_handle) {
+    // 多个NUMA节点的机器上，热文件从当前CPU所在节点上的副本发送
+    if(http_replicas.enabled()) {
+        const char* data = http_replicas.acquire(path, st, replica);
+        if(data) {
+            return data;
+        }
+    }
+    if(http_files.enabled() && st.st_size > 0 && st.st_size <= FILE_WINDOW_SIZE) {
+        return http_files.acquire(path, st, shm_handle);
+    }
+    return NULL;
+}
+
+const char* http_conn::insert_shared_file(const char* path, const struct stat& st, int fd, int* shm_handle) {
+    if(http_files.enabled() && st.st_size > 0 && st.st_size <= FILE_WINDOW_SIZE) {
+        return http_files.insert(path, st, fd, shm_handle);
+    }
+    return NULL;
+}
+
+// 路由查找只沿着路径走一遍基数树，不分配内存
+void http_conn::match_route() {
+    m_route = NULL;
+    if(http_router.empty()) {
+        return;
+    }
+    const char* q = strchr(m_url, '?');
+    size_t path_len = q ? q - m_url : strlen(m_url);
+    m_route = http_router.match(m_url, path_len, &m_route_prefix);
+}
+
+// 值在读缓冲区里，后面紧跟着\0，可以直接当C字符串用
+const char* http_conn::get_header(const char* name) const {
+    const header_map::entry* e = m_headers.find(name);
+    return e ? e->value.data() : NULL;
+}
+
+// 只缓存没有请求体的GET；带Authorization的请求和要求不用缓存的请求直接去生成响应
+// 未命中时lookup会放一个占位条目，同一个键的并发请求等第一个请求生成完
+http_conn::HTTP_CODE http_conn::cache_lookup() {
+    if(!m_site->cache->enabled() || m_method != GET || m_content_length != 0 || m_chunked) {
+        return NO_REQUEST;
+    }
+    const char* cc = get_header(HDR_CACHE_CONTROL);
+    const char* pragma = get_header(HDR_PRAGMA);
+    if(get_header(HDR_AUTHORIZATION) || (cc && (strcasestr(cc, "no-cache") || strcasestr(cc, "no-store"))) ||
+       (pragma && strcasestr(pragma, "no-cache"))) {
+        return NO_REQUEST;
+    }
+    m_cache_entry = m_site->cache->lookup(method_names[m_method], m_host ? m_host : "", m_url,
+                                      cache_header, this, &m_cache_fill);
+    if(m_cache_entry && m_cache_entry->hot_key && http_replicas.count_cached(m_cache_entry->hot_key)) {
+        // 能在各个节点上复制的文件够热了：这次照常发，缓存里的那一份去掉，下一个请求去安排复制
+        m_site->cache->invalidate(m_cache_entry);
+    }
+    return m_cache_entry ? CACHE_HIT : NO_REQUEST;
+}
+
+// 用写缓冲区里前head_len字节的响应头（不含Connection和空行）填充占位条目
+// 返回新条目（调用者持有一个引用），不可缓存或者放不下时返回NULL
+cache_entry* http_conn::cache_fill(int head_len, const char* body, size_t body_len, int max_age, const char* vary, uint64_t hot_key) {
+    cache_entry* e = m_site->cache->complete(m_cache_fill, m_write_buf, head_len, body, body_len,
+                                         max_age, vary, cache_header, this, hot_key);
+    m_cache_fill = NULL;
+    return e;
+}
+
+// 请求视图直接指向读缓冲区，不做拷贝
+http_conn::HTTP_CODE http_conn::dispatch_route() {
+    const router::route* r = m_route;
+    size_t url_len = strlen(m_url);
+    const char* q = (const char*)memchr(m_url, '?', url_len);
+    size_t path_len = q ? q - m_url : url_len;
+    size_t prefix_len = m_route_prefix;
+
+    request_view req;
+    req.method = m_method;
+    req.path   = std::string_view(m_url, path_len);
+    req.query  = q ? std::string_view(q + 1, url_len - path_len - 1) : std::string_view();
+    req.rest   = std::string_view(m_url + prefix_len, path_len - prefix_len);
+    req.host   = m_host ? std::string_view(m_host) : std::string_view();
+    req.peer   = &m_address;
+    req.cred   = peer_cred();
+    req.headers = &m_headers;
+
+    response_builder resp(m_write_buf, WRITE_BUFFER_SIZE);
+    r->handler(req, resp, r->arg);
+    m_resp_body       = resp.body_data();
+    m_resp_body_len   = resp.body_len();
+    m_resp_body_owned = resp.body_is_owned();
+    if(!resp.has_status()) {
+        resp.status(200, ok_200_title);
+    }
+    if(resp.failed()) {
+        unmap();
+        return INTERNAL_ERROR;
+    }
+    // 状态行和处理函数自己的响应头已经在写缓冲区里了，接着补上通用的响应头
+    m_write_idx = resp.length();
+    if(!resp.has_content_type()) {
+        add_content_type();
+    }
+    if(!add_content_length(m_resp_body_len) || !add_site_headers()) {
+        unmap();
+        return INTERNAL_ERROR;
+    }
+    // 处理函数用Cache-Control声明了可以缓存的200响应放进缓存，Connection头每个连接不一样，不缓存
+    if(m_cache_fill && resp.code() == 200 && !resp.set_cookie()) {
+        response_cache::release(cache_fill(m_write_idx, m_resp_body, m_resp_body_len,
+                                           response_cache::max_age(resp.cache_control()), resp.vary()));
+    }
+    if(!(add_linger() && add_blank_line())) {
+        unmap();
+        return INTERNAL_ERROR;
+    }
+    return HANDLER_REQUEST;
+}
+
+// 代理：从连接池取一条上游连接，把请求行和请求头转发过去
+// 逐跳的头部去掉，加上X-Forwarded-For；请求体之后由begin_body/pump_body原样转发
+http_conn::HTTP_CODE http_conn::start_proxy() {
+    if(!m_proxy_buf) {
+        m_proxy_buf = (char*)malloc(PROXY_BUFFER_SIZE);
+        if(!m_proxy_buf) {
+            return INTERNAL_ERROR;
+        }
+    }
+    int len = snprintf(m_proxy_buf, PROXY_BUFFER_SIZE, "%s %s HTTP/1.1\r\n", method_names[m_method], m_url);
+    for(int i = 0; i < m_headers.size() && len < PROXY_BUFFER_SIZE; i++) {
+        const header_map::entry& h = m_headers[i];
+        if(!hop_by_hop(h)) {
+            len += snprintf(m_proxy_buf + len, PROXY_BUFFER_SIZE - len, "%.*s: %s\r\n",
+                            (int)h.name.size(), h.name.data(), h.value.data());
+        }
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip));
+    if(len < PROXY_BUFFER_SIZE) {
+        len += snprintf(m_proxy_buf + len, PROXY_BUFFER_SIZE - len,
+                        "X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n", ip);
+    }
+    if(len >= PROXY_BUFFER_SIZE) {
+        return BAD_REQUEST;
+    }
+
+    m_upstream_group = m_route->upstream;
+    if(!m_upstream_group->acquire(m_upstream)) {
+        m_upstream.fd = -1;
+        m_linger = false;
+        return BAD_GATEWAY;
+    }
+    if(!write_all(m_upstream.fd, m_proxy_buf, len)) {
+        // 复用的连接可能刚好被上游关掉了，换一条新连接再试一次
+        if(!m_upstream.reused || !m_upstream_group->reconnect(m_upstream) ||
+           !write_all(m_upstream.fd, m_proxy_buf, len)) {
+            release_upstream(false);
+            m_linger = false;
+            return BAD_GATEWAY;
+        }
+    }
+    return NO_REQUEST;
+}
+
+// 请求转发完毕，读上游的响应头，组装好给客户端的响应头；响应体留给write()在主线程里splice
+// 响应头还没到齐时不在工作线程里等：收到的部分留在m_proxy_buf里，返回NO_REQUEST，
+// 由serve()把上游socket注册到epoll，上游可读了主线程再把连接交给线程池从这里接着读
+http_conn::HTTP_CODE http_conn::proxy_read_response() {
+    int len = m_proxy_head_len;
+    int head_end = -1;
+    int status = 0;
+    m_proxy_head_wait = false;
+    while(head_end < 0) {
+        if(len == PROXY_BUFFER_SIZE) {
+            break;      // 响应头太大
+        }
+        ssize_t n = recv(m_upstream.fd, m_proxy_buf + len, PROXY_BUFFER_SIZE - len, 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN) {
+            m_proxy_head_len  = len;
+            m_proxy_head_wait = true;
+            return NO_REQUEST;
+        }
+        if(n <= 0) {
+            break;
+        }
+        int from = len > 3 ? len - 3 : 0;
+        len += n;
+        for(int i = from; i + 3 < len; i++) {
+            if(memcmp(m_proxy_buf + i, "\r\n\r\n", 4) == 0) {
+                head_end = i + 4;
+                break;
+            }
+        }
+        if(head_end > 0) {
+            // 1xx 是中间响应，跳过它继续等最终响应
+            if(len < 12 || sscanf(m_proxy_buf, "HTTP/%*d.%*d %d", &status) != 1) {
+                head_end = -1;
+                break;
+            }
+            if(status >= 100 && status < 200) {
+                memmove(m_proxy_buf, m_proxy_buf + head_end, len - head_end);
+                len -= head_end;
+                head_end = -1;
+                // 剩下的字节里可能已经有完整的最终响应头，从头再找一遍
+                for(int i = 0; i + 3 < len; i++) {
+                    if(memcmp(m_proxy_buf + i, "\r\n\r\n", 4) == 0) {
+                        head_end = i + 4;
+                        break;
+                    }
+                }
+                if(head_end > 0 && sscanf(m_proxy_buf, "HTTP/%*d.%*d %d", &status) != 1) {
+                    head_end = -1;
+                    break;
+                }
+                if(head_end > 0 && status < 200) {
+                    head_end = -1;
+                }
+            }
+        }
+    }
+    if(head_end < 0) {
+        release_upstream(false);
+        m_linger = false;
+        return BAD_GATEWAY;
+    }
+
+    // 逐行处理响应头：记录长度信息，去掉逐跳的头部，其余原样复制到写缓冲区
+    m_proxy_keepalive = strncmp(m_proxy_buf, "HTTP/1.1", 8) == 0;
+    bool has_length = false;
+    bool chunked = false;
+    char cache_control[128] = "";       // 响应缓存要用的几个响应头
+    char vary[128] = "";
+    bool set_cookie = false;
+    m_write_idx = 0;
+    char* line = m_proxy_buf;
+    char* head_stop = m_proxy_buf + head_end - 2;
+    bool ok = true;
+    bool first = true;
+    while(line < head_stop && ok) {
+        char* eol = (char*)memchr(line, '\n', head_stop - line);
+        if(!eol) {
+            break;
+        }
+        int line_len = eol - line;
+        if(line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        if(first) {
+            first = false;
+        }else if(header_is(line, "Content-Length")) {
+            has_length = true;
+            m_proxy_left = atoll(line + 15);
+        }else if(header_is(line, "Transfer-Encoding")) {
+            chunked = strncasecmp(line + line_len - 7, "chunked", 7) == 0;
+        }else if(header_is(line, "Cache-Control") && line_len - 14 < (int)sizeof(cache_control)) {
+            snprintf(cache_control, sizeof(cache_control), "%.*s", line_len - 14, line + 14);
+        }else if(header_is(line, "Vary")) {
+            // 太长的Vary当成*，不缓存
+            if(line_len - 5 < (int)sizeof(vary)) {
+                snprintf(vary, sizeof(vary), "%.*s", line_len - 5, line + 5);
+            }else {
+                strcpy(vary, "*");
+            }
+        }else if(header_is(line, "Set-Cookie")) {
+            set_cookie = true;
+        }else if(header_is(line, "Connection")) {
+            if(strncasecmp(line + 11 + strspn(line + 11, " \t"), "close", 5) == 0) {
+                m_proxy_keepalive = false;
+            }else if(strncasecmp(line + 11 + strspn(line + 11, " \t"), "keep-alive", 10) == 0) {
+                m_proxy_keepalive = true;
+            }
+            line = eol + 1;
+            continue;
+        }
+        if(!hop_by_hop(line)) {
+            ok = add_response("%.*s\r\n", line_len, line);
+        }
+        line = eol + 1;
+    }
+
+    if(status == 204 || status == 304) {
+        m_proxy_body = PROXY_NONE;
+    }else if(chunked) {
+        m_proxy_body = PROXY_CHUNKED;
+        m_chunk.reset();
+    }else if(has_length) {
+        m_proxy_body = PROXY_LENGTH;
+    }else {
+        // 既没有长度也不是chunked，上游关闭连接才算结束，客户端这边也只能关闭连接
+        m_proxy_body = PROXY_EOF;
+        m_proxy_keepalive = false;
+        m_linger = false;
+    }
+    int head_len = m_write_idx;         // 缓存的响应头不含Connection
+    if(!ok || !add_linger() || !add_blank_line() || !ensure_body_pipe()) {
+        release_upstream(false);
+        m_linger = false;
+        m_write_idx = 0;
+        return BAD_GATEWAY;
+    }
+
+    // 和响应头一起读上来的响应体先放进管道，后面的直接从上游splice进管道
+    int extra = len - head_end;
+    int used = track_proxy_body(m_proxy_buf + head_end, extra);
+    if(used < 0) {
+        release_upstream(false);
+        m_linger = false;
+        m_write_idx = 0;
+        return BAD_GATEWAY;
+    }
+    if(used < extra) {
+        m_proxy_keepalive = false;      // 上游多发了数据，这条连接不能再用
+    }
+
+    // 可以缓存的定长200响应不走管道，在这里把响应体读完放进缓存
+    int max_age = response_cache::max_age(cache_control);
+    if(m_cache_fill && status == 200 && m_proxy_body == PROXY_LENGTH && max_age > 0 && !set_cookie &&
+       head_len + used + m_proxy_left <= (int64_t)m_site->cache->max_object()) {
+        return proxy_cache_body(head_len, m_proxy_buf + head_end, used, max_age, vary[0] ? vary : NULL);
+    }
+    if(used > 0) {
+        if(::write(m_body_pipe[1], m_proxy_buf + head_end, used) != used) {
+            release_upstream(false);
+            return BAD_GATEWAY;
+        }
+        m_pipe_bytes = used;
+    }
+    return PROXY_REQUEST;
+}
+
+// 在工作线程里读完上游的响应体（最多等UPSTREAM_IO_TIMEOUT_MS），填充缓存后按命中缓存发送；
+// 缓存没放进去就把读到的响应体当作处理函数的响应体发送
+http_conn::HTTP_CODE http_conn::proxy_cache_body(int head_len, const char* data, int used, int max_age, const char* vary) {
+    size_t total = used + m_proxy_left;
+    char* body = (char*)malloc(total ? total : 1);
+    if(!body) {
+        release_upstream(false);
+        m_linger = false;
+        m_write_idx = 0;
+        return INTERNAL_ERROR;
+    }
+    memcpy(body, data, used);
+    size_t got = used;
+    while(got < total) {
+        ssize_t n = recv(m_upstream.fd, body + got, total - got, 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN && proxy_wait(m_upstream.fd, POLLIN, UPSTREAM_IO_TIMEOUT_MS)) {
+            continue;
+        }
+        if(n <= 0) {
+            free(body);
+            release_upstream(false);
+            m_linger = false;
+            m_write_idx = 0;
+            return BAD_GATEWAY;
+        }
+        got += n;
+    }
+    m_proxy_left = 0;
+    release_upstream(m_proxy_keepalive);
+
+    cache_entry* e = cache_fill(head_len, body, total, max_age, vary);
+    if(e) {
+        free(body);
+        m_cache_entry = e;
+        return CACHE_HIT;
+    }
+    m_resp_body       = body;
+    m_resp_body_len   = total;
+    m_resp_body_owned = true;
+    return HANDLER_REQUEST;
+}
+
+int http_conn::track_proxy_body(const char* data, int len) {
+    switch(m_proxy_body) {
+        case PROXY_LENGTH: {
+            int n = len < m_proxy_left ? len : (int)m_proxy_left;
+            m_proxy_left -= n;
+            return n;
+        }
+        case PROXY_CHUNKED: {
+            int i = 0;
+            while(i < len && !m_chunk.done()) {
+                if(m_chunk.state() == chunked_decoder::DATA) {
+                    int64_t n = m_chunk.data_left();
+                    if(n > len - i) {
+                        n = len - i;
+                    }
+                    m_chunk.consume_data(n);
+                    i += n;
+                }else {
+                    i += m_chunk.feed(data + i, len - i);
+                    if(m_chunk.bad()) {
+                        return -1;
+                    }
+                }
+            }
+            return i;
+        }
+        case PROXY_EOF:
+            return len;
+        default:
+            return 0;
+    }
+}
+
+bool http_conn::proxy_body_done() const {
+    switch(m_proxy_body) {
+        case PROXY_LENGTH:  return m_proxy_left == 0;
+        case PROXY_CHUNKED: return m_chunk.done();
+        case PROXY_EOF:     return false;
+        default:            return true;
+    }
+}
+
+// 上游 -> 管道。chunked的分帧字节需要看到内容，先偷看再取走，写进管道；
+// 块数据和定长响应体直接splice，不经过用户态
+int http_conn::fill_proxy_pipe() {
+    if(m_proxy_body == PROXY_CHUNKED && m_chunk.state() != chunked_decoder::DATA) {
+        char frame[64];
+        ssize_t n = recv(m_upstream.fd, frame, sizeof(frame), MSG_PEEK);
+        if(n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if(n == 0) {
+            m_proxy_eof = true;
+            return -1;
+        }
+        int k = m_chunk.feed(frame, n);
+        recv(m_upstream.fd, frame, k, 0);
+        if(m_chunk.bad() || ::write(m_body_pipe[1], frame, k) != k) {
+            return -1;
+        }
+        m_pipe_bytes += k;
+        return 1;
+    }
+
+    int64_t want = BODY_PIPE_SIZE;
+    if(m_proxy_body == PROXY_LENGTH && m_proxy_left < want) {
+        want = m_proxy_left;
+    }else if(m_proxy_body == PROXY_CHUNKED && m_chunk.data_left() < want) {
+        want = m_chunk.data_left();
+    }
+    ssize_t n = splice(m_upstream.fd, NULL, m_body_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if(n == 0) {
+        m_proxy_eof = true;
+        return -1;
+    }
+    if(m_proxy_body == PROXY_LENGTH) {
+        m_proxy_left -= n;
+    }else if(m_proxy_body == PROXY_CHUNKED) {
+        m_chunk.consume_data(n);
+    }
+    m_pipe_bytes += n;
+    return 1;
+}
+
+// 响应头发完后在主线程里转发响应体：上游 -> 管道 -> 客户端。
+// 客户端写不动就等EPOLLOUT，上游没数据就把上游socket挂到epoll上等它可读
+bool http_conn::relay_proxy() {
+    while(true) {
+        if(m_pipe_bytes > 0) {
+            bool more = m_write_policy == WRITE_AUTO && !proxy_body_done();
+            ssize_t n = splice(m_body_pipe[0], NULL, m_socketfd, NULL, m_pipe_bytes,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (more ? SPLICE_F_MORE : 0));
+            if(n < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    want(EPOLLOUT);
+                    return true;
+                }
+                release_upstream(false);
+                return false;
+            }
+            m_pipe_bytes -= n;
+            continue;
+        }
+        if(proxy_body_done()) {
+            release_upstream(m_proxy_keepalive);
+            return finish_write();
+        }
+        int ret = fill_proxy_pipe();
+        if(ret == 0) {
+            // 上游暂时没有数据，已经发出去的部分不能压在内核里等
+            push_pending(false);
+            arm_upstream();
+            return true;
+        }
+        if(ret < 0) {
+            // 以关闭连接为结束标志的响应，上游关闭就是发送完了
+            bool complete = m_proxy_body == PROXY_EOF && m_proxy_eof;
+            release_upstream(false);
+            return complete ? finish_write() : false;
+        }
+    }
+}
+
+// 上游socket也是边沿触发，这次代理请求里第一次等它时注册，之后只改m_want
+void http_conn::arm_upstream() {
+    want(UPSTREAM_READY);
+    if(m_upstream_in_epoll) {
+        return;
+    }
+    epoll_event event;
+    event.data.u64 = ((uint64_t)UPSTREAM_EVENT_TAG << 32) | (uint32_t)m_socketfd;
+    event.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_upstream.fd, &event);
+    m_upstream_in_epoll = true;
+}
+
+void http_conn::release_upstream(bool keepalive) {
+    if(m_upstream.fd == -1) {
+        return;
+    }
+    if(m_upstream_in_epoll) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_upstream.fd, 0);
+        m_upstream_in_epoll = false;
+    }
+    m_upstream_group->release(m_upstream, keepalive);
+    m_upstream.fd = -1;
+}
+
+// 响应发送完毕，根据HTTP请求中的Connection字段决定是否立即关闭连接
+bool http_conn::finish_write() {
+    push_pending(true);
+    unmap();
+    if(m_ws) {
+        // 101发完了，之后的帧在主线程里由ws_session收发
+        want(EPOLLIN | EPOLLOUT);
+        return m_ws->start();
+    }
+    want(EPOLLIN);
+    if(m_linger) {
+        next_request();
+        return true;
+    }
+    return false;
+}
+
+void http_conn::begin_response() {
+    if(m_write_policy == WRITE_CORK && !m_corked) {
+        int on = 1;
+        setsockopt(m_socketfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        m_corked = true;
+    }
+}
+
+// TCP_CORK拔掉再塞上就会把攒着的数据发出去；TCP_NODELAY重新设置一次也会立即推送
+void http_conn::push_pending(bool end) {
+    if(m_corked) {
+        int off = 0;
+        setsockopt(m_socketfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        m_corked = false;
+        if(!end) {
+            begin_response();
+        }
+    }else if(m_held) {
+        int on = 1;
+        setsockopt(m_socketfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    m_held = false;
+}
+
+// 当前m_iv之后还有文件窗口没有映射，或者代理的响应头后面还有响应体
+bool http_conn::more_follows() const {
+    if(m_file_fd != -1 && m_file_offset < m_file_stat.st_size) {
+        return true;
+    }
+    return m_upstream.fd != -1 && (m_pipe_bytes > 0 || !proxy_body_done());
+}
+
+// 对内存映射区执行unmap操作，并关闭流式发送时保留的文件描述符
 void http_conn::unmap() {
+    if(m_resp_body_owned) {
+        free((void*)m_resp_body);
+        m_resp_body_owned = false;
+    }
+    m_resp_body = 0;
+    if(m_zc_body) {
+        m_zc->end();    // 内核还没用完的话零拷贝那边留着自己的引用
+        m_zc_body = false;
+    }
+    if(m_cache_entry) {
+        response_cache::release(m_cache_entry);
+        m_cache_entry = NULL;
+    }
+    if(m_shm_handle != -1) {
+        http_files.release(m_shm_handle);
+        m_shm_handle = -1;
+        m_file_address = 0;
+        m_file_map_len = 0;
+    }
+    if(m_replica) {
+        numa_replicas::release(m_replica);
+        m_replica = NULL;
+        m_file_address = 0;
+        m_file_map_len = 0;
+    }
     if(m_file_address) {
-        munmap(m_file_address, m_file_stat.st_size);
+        munmap(m_file_address, m_file_map_len);
         m_file_address = 0;
+        m_file_map_len = 0;
+    }
+    if(m_file_fd != -1) {
+        close(m_file_fd);
+        m_file_fd = -1;
     }
 }
 
-bool http_conn::write(){
-    int temp = 0;
-    int bytes_have_sent = 0;            // 已经发送的字节数
-    int bytes_to_send = m_write_idx;    // 将要发送的字节数  m_write_idx是写缓冲区中待发送的字节数
-
-    if(bytes_to_send == 0) {
-        // 将要发送的字节数为0， 即已经发送完了,将epoll监测事件换为EPOLLIN
-        modfd(m_epollfd, m_socketfd, EPOLLIN);
-        init();
+// 释放当前窗口，映射文件从m_file_offset开始的下一个窗口，并让m_iv[1]指向它
+// 每个连接同一时间最多只映射FILE_WINDOW_SIZE字节，与文件大小无关
+bool http_conn::map_window() {
+    if(m_file_address) {
+        munmap(m_file_address, m_file_map_len);
+        m_file_address = 0;
+        m_file_map_len = 0;
+    }
+    off_t remain = m_file_stat.st_size - m_file_offset;
+    if(remain <= 0) {
+        // 空文件或者已经发送完毕
+        m_iv[1].iov_base = 0;
+        m_iv[1].iov_len  = 0;
         return true;
     }
+    size_t len = remain > FILE_WINDOW_SIZE ? FILE_WINDOW_SIZE : (size_t)remain;
+    // m_file_offset总是FILE_WINDOW_SIZE的整数倍，满足mmap偏移按页对齐的要求
+    void* addr = mmap(0, len, PROT_READ, MAP_PRIVATE, m_file_fd, m_file_offset);
+    if(addr == MAP_FAILED) {
+        return false;
+    }
+    m_file_address  = (char*)addr;
+    m_file_map_len  = len;
+    m_file_offset  += len;
+    m_iv[1].iov_base = m_file_address;
+    m_iv[1].iov_len  = m_file_map_len;
+    advise_readahead();
+    return true;
+}
 
-    while(1) {
-        // writev  参数：1.文件描述符；2.iovec结构的结构体，里面有要写的数据的地址和长度；3.指定iovec的个数  返回值：失败-1，成功返回写的字节数
-        // 分散写， 将写缓冲区和内存映射地址一块写出去
+// 根据最近窗口的发送速率估计预读深度：大约覆盖接下来200ms要发送的数据，
+// 最少一个窗口，最多READAHEAD_MAX_WINDOWS个窗口。慢客户端不会让内核预读一大片用不上的页
+void http_conn::advise_readahead() {
+    if(m_file_fd == -1 || m_file_offset >= m_file_stat.st_size) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(m_file_offset > FILE_WINDOW_SIZE) {
+        // 不是第一个窗口，用上一个窗口的发送耗时更新速率（指数加权平均）
+        int64_t us = (now.tv_sec - m_window_ts.tv_sec) * 1000000LL + (now.tv_nsec - m_window_ts.tv_nsec) / 1000;
+        if(us <= 0) {
+            us = 1;
+        }
+        int64_t rate = (int64_t)FILE_WINDOW_SIZE * 1000000LL / us;
+        m_send_rate = m_send_rate ? (m_send_rate * 3 + rate) / 4 : rate;
+    }
+    m_window_ts = now;
 
+    int64_t depth = m_send_rate / 5;
+    if(depth < FILE_WINDOW_SIZE) {
+        depth = FILE_WINDOW_SIZE;
+    }else if(depth > (int64_t)FILE_WINDOW_SIZE * READAHEAD_MAX_WINDOWS) {
+        depth = (int64_t)FILE_WINDOW_SIZE * READAHEAD_MAX_WINDOWS;
+    }
+    off_t want = m_file_offset + depth;
+    if(want > m_file_stat.st_size) {
+        want = m_file_stat.st_size;
+    }
+    if(want > m_readahead_end) {
+        off_t start = m_readahead_end > m_file_offset ? m_readahead_end : m_file_offset;
+        posix_fadvise(m_file_fd, start, want - start, POSIX_FADV_WILLNEED);
+        m_readahead_end = want;
+    }
+}
+
+// writev可能只写出一部分，把已经写出的n个字节从m_iv中去掉，下次从断点继续写
+void http_conn::consume_iov(int64_t n) {
+    for(int i = 0; i < m_iv_count && n > 0; i++) {
+        size_t k = (size_t)n < m_iv[i].iov_len ? (size_t)n : m_iv[i].iov_len;
+        m_iv[i].iov_base = (char*)m_iv[i].iov_base + k;
+        m_iv[i].iov_len -= k;
+        n -= k;
+    }
+}
+
+bool http_conn::write(){
+    profile_stage stage(STAGE_WRITE);
+    ssize_t temp = 0;
 
+    if(m_tls) {
+        // 握手消息没写完，等到了EPOLLOUT
+        return tls_handshake() >= 0;
+    }
 
-        //  没有进行writev的判断，直接让temp = 0， bytes_to_send和bytes_have_sent永远不会变，所以出了问题
+    if(m_h2) {
+        int ret = m_h2->write();
+        if(ret < 0) {
+            return false;
+        }
+        want(EPOLLIN | (ret > 0 ? EPOLLOUT : 0));
+        return true;
+    }
 
+    if(m_upstream.fd != -1 && m_bytes_to_send == 0) {
+        // 代理响应头已经发完，继续转发上游的响应体
+        return relay_proxy();
+    }
 
+    if(m_bytes_to_send == 0) {
+        // 将要发送的字节数为0， 即已经发送完了，接下来等EPOLLIN
+        want(EPOLLIN);
+        next_request();
+        return true;
+    }
 
-        temp = writev(m_socketfd, m_iv, m_iv_count);
+    while(1) {
+        // sendmsg和writev一样是分散写，将写缓冲区和当前映射窗口一块写出去；
+        // 多了flags，后面还有窗口或者代理的响应体要发时带上MSG_MORE，内核攒满报文段再发
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = m_iv;
+        msg.msg_iovlen = m_iv_count;
+        bool more = m_write_policy == WRITE_AUTO && more_follows();
+        int zerocopy = 0;
+        if(m_zc_body) {
+            // 只有缓存的响应体零拷贝：写缓冲区每个请求都会改写，不能让内核引用，
+            // 前面的响应头照常拷贝，带上MORE和后面的响应体凑成整的报文段
+            if(m_iv[0].iov_len + m_iv[1].iov_len > 0) {
+                msg.msg_iovlen = 2;
+                more = true;
+            }else {
+                msg.msg_iov    = m_iv + 2;
+                msg.msg_iovlen = 1;
+                zerocopy = MSG_ZEROCOPY;
+            }
+        }
+        temp = sendmsg(m_socketfd, &msg, MSG_NOSIGNAL | zerocopy | (more ? MSG_MORE : 0));
+        m_held = more;
         if(temp <= -1) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if(errno == EAGAIN || errno == EWOULDBLOCK) {
-                modfd(m_epollfd, m_socketfd, EPOLLOUT);
+                want(EPOLLOUT);
                 return true;
             }
+            if(zerocopy && errno == ENOBUFS) {
+                // 锁住的页超过了optmem的限制，这个响应剩下的部分改成拷贝
+                m_zc_body = false;
+                m_zc->end();
+                continue;
+            }
             // 写失败
             printf("写失败\n");
             unmap();
+            release_upstream(false);
             return false;
         }
 
-        bytes_to_send -= temp;
-        bytes_have_sent += temp;
-        if(bytes_to_send <= bytes_have_sent) {
+        if(zerocopy) {
+            m_zc->sent();
+        }
+        m_bytes_to_send -= temp;
+        m_bytes_have_sent += temp;
+        if(m_bytes_to_send <= 0) {
+            if(m_upstream.fd != -1) {
+                return relay_proxy();
+            }
             // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            if(m_linger) {
-                init();
-                modfd(m_epollfd, m_socketfd, EPOLLIN);
-                return true;
-            }else {
-                modfd(m_epollfd, m_socketfd, EPOLLIN);
+            return finish_write();
+        }
+
+        // 部分写，推进m_iv；当前窗口发完了就映射文件的下一个窗口
+        consume_iov(temp);
+        if(m_file_fd != -1 && m_iv[0].iov_len == 0 && m_iv[1].iov_len == 0) {
+            if(!map_window()) {
+                unmap();
                 return false;
             }
         }
@@ -443,15 +1916,18 @@ bool http_conn::add_status_line(int status, const char* title) {
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool http_conn::add_headers(int content_length) {
-    add_content_length(content_length);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+bool http_conn::add_headers(int64_t content_length) {
+    return add_content_length(content_length) && add_content_type() && add_site_headers() &&
+           add_linger() && add_blank_line();
+}
+
+// 虚拟主机配置里给这个站点附加的响应头
+bool http_conn::add_site_headers() {
+    return m_site->headers.empty() || add_response("%s", m_site->headers.c_str());
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response("Content-Length: %d\r\n", content_len);
+bool http_conn::add_content_length(int64_t content_len) {
+    return add_response("Content-Length: %lld\r\n", (long long)content_len);
 }
 
 bool http_conn::add_content_type() {
@@ -459,7 +1935,7 @@ bool http_conn::add_content_type() {
 }
 
 bool http_conn::add_linger() {
-    return add_response("Connection: %s\r\n", (m_linger = true) ? "keep-alive" : "close");
+    return add_response("Connection: %s\r\n", m_linger ? "keep-alive" : "close");
 }
 
 bool http_conn::add_blank_line() {
@@ -473,6 +1949,7 @@ bool http_conn::add_content(const char *content) {
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret) {
+    profile_stage stage(STAGE_WRITE);
     switch (ret)
     {
         case INTERNAL_ERROR:
@@ -485,32 +1962,105 @@ bool http_conn::process_write(HTTP_CODE ret) {
         case BAD_REQUEST:
             add_status_line(400, error_400_title);
             add_headers(strlen(error_400_form));
-            if(add_content(error_400_form)){
+            if(!add_content(error_400_form)){
                 return false;
             }
             break;
         case NO_RESOURCE:
             add_status_line(404, error_404_title);
             add_headers(strlen(error_404_form));
-            if(add_content(error_404_form)) {
+            if(!add_content(error_404_form)) {
                 return false;
             }
             break;
         case FORBIDDEN_REQUEST:
             add_status_line(403, error_403_title);
             add_headers(strlen(error_403_form));
-            if(add_content(error_403_form)) {
+            if(!add_content(error_403_form)) {
+                return false;
+            }
+            break;
+        case CREATED_REQUEST:
+            add_status_line(201, created_201_title);
+            add_headers(strlen(created_201_form));
+            if(!add_content(created_201_form)) {
                 return false;
             }
             break;
-        case FILE_REQUEST:
+        case FILE_REQUEST: {
             add_status_line(200, ok_200_title);
-            add_headers(m_file_stat.st_size);
+            uint64_t hot_key;
+            if(m_cache_fill && m_file_fd == -1 && http_replicas.cacheable(m_real_file, m_file_stat, &hot_key)) {
+                // 一个窗口就能放下的小文件放进缓存，之后的请求不用再stat、open、mmap；
+                // 已经在各个节点上有副本、或者正在复制的文件不放：缓存里只有一份
+                add_content_length(m_file_stat.st_size);
+                add_content_type();
+                add_site_headers();
+                response_cache::release(cache_fill(m_write_idx, m_file_address, m_file_map_len,
+                                                   STATIC_CACHE_SECONDS, NULL, hot_key));
+                add_linger();
+                add_blank_line();
+            }else {
+                add_headers(m_file_stat.st_size);
+            }
             m_iv[0].iov_base    = m_write_buf;
             m_iv[0].iov_len     = m_write_idx;
             m_iv[1].iov_base    = m_file_address;
-            m_iv[1].iov_len     = m_file_stat.st_size;
+            m_iv[1].iov_len     = m_file_map_len;
             m_iv_count = 2;
+            m_bytes_to_send     = m_write_idx + (int64_t)m_file_stat.st_size;
+            m_bytes_have_sent   = 0;
+            return true;
+        }
+        case BAD_GATEWAY:
+            add_status_line(502, error_502_title);
+            add_headers(strlen(error_502_form));
+            if(!add_content(error_502_form)) {
+                return false;
+            }
+            break;
+        case PROXY_REQUEST:
+            // 只有响应头在写缓冲区里，响应体在write()里从上游转发
+            m_iv[0].iov_base    = m_write_buf;
+            m_iv[0].iov_len     = m_write_idx;
+            m_iv_count = 1;
+            m_bytes_to_send     = m_write_idx;
+            m_bytes_have_sent   = 0;
+            return true;
+        case CACHE_HIT: {
+            // 缓存的响应头和响应体直接发送，写缓冲区里只有每个连接自己的Age和Connection
+            m_write_idx = 0;
+            int64_t age = (proxy_now_ms() - m_cache_entry->created_ms) / 1000;
+            if(!(add_response("Age: %lld\r\n", (long long)age) && add_linger() && add_blank_line())) {
+                return false;
+            }
+            m_iv[0].iov_base    = (void*)m_cache_entry->head();
+            m_iv[0].iov_len     = m_cache_entry->head_len;
+            m_iv[1].iov_base    = m_write_buf;
+            m_iv[1].iov_len     = m_write_idx;
+            m_iv[2].iov_base    = (void*)m_cache_entry->body();
+            m_iv[2].iov_len     = m_cache_entry->body_len;
+            m_iv_count = 3;
+            // 大的响应体用零拷贝发送；kTLS的socket要在内核里加密，不支持
+            if(!m_secure && m_cache_entry->body_len >= zerocopy_tracker::MIN_BYTES) {
+                if(!m_zc) {
+                    m_zc = new zerocopy_tracker;
+                }
+                m_zc_body = m_zc->begin(m_socketfd, m_cache_entry, m_cache_entry->body_len);
+            }
+            m_bytes_to_send     = m_cache_entry->head_len + m_write_idx + (int64_t)m_cache_entry->body_len;
+            m_bytes_have_sent   = 0;
+            return true;
+        }
+        case HANDLER_REQUEST:
+            // 响应头在写缓冲区里，响应体由处理函数提供
+            m_iv[0].iov_base    = m_write_buf;
+            m_iv[0].iov_len     = m_write_idx;
+            m_iv[1].iov_base    = (void*)m_resp_body;
+            m_iv[1].iov_len     = m_resp_body_len;
+            m_iv_count = m_resp_body_len ? 2 : 1;
+            m_bytes_to_send     = m_write_idx + (int64_t)m_resp_body_len;
+            m_bytes_have_sent   = 0;
             return true;
         default:
             return false;
@@ -519,24 +2069,262 @@ bool http_conn::process_write(HTTP_CODE ret) {
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_idx;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_idx;
+    m_bytes_have_sent = 0;
     return true;
 }
 
+// 只看读缓冲区开头的请求行，不解析请求头：请求行可能已经被process_read把空格换成了\0
+// 有请求体的请求和代理路由排在后面；这个路径以前处理过就按上次的实际代价；路由处理函数在前面；其余的放中间
+int http_conn::priority() const {
+    if(m_tls || m_h2) {
+        return PRIO_NORMAL;
+    }
+    if(m_body_streaming) {
+        return PRIO_BULK;
+    }
+    const char* end = m_read_buf + m_read_idx;
+    const char* url = m_read_buf;
+    while(url < end && *url != ' ' && *url != '\t' && *url != '\0') {
+        url++;
+    }
+    size_t method_len = url - m_read_buf;
+    if(method_len != 3 || strncasecmp(m_read_buf, "GET", 3) != 0) {
+        bool upload = (method_len == 4 && strncasecmp(m_read_buf, "POST", 4) == 0) ||
+                      (method_len == 3 && strncasecmp(m_read_buf, "PUT", 3) == 0);
+        return upload ? PRIO_BULK : PRIO_NORMAL;
+    }
+    url++;
+    if(end - url > 7 && strncasecmp(url, "http://", 7) == 0) {
+        const char* slash = (const char*)memchr(url + 7, '/', end - url - 7);
+        if(!slash) {
+            return PRIO_NORMAL;
+        }
+        url = slash;
+    }
+    uint64_t h = path_hash(url, end);
+    uint32_t hint = priority_hints[h & (PRIORITY_HINT_SLOTS - 1)].load(std::memory_order_relaxed);
+    if((hint & ~3u) == hint_tag(h)) {
+        return hint & 3;
+    }
+    if(!http_router.empty()) {
+        const char* p = url;
+        while(p < end && *p != '?' && *p != ' ' && *p != '\t' && *p != '\0') {
+            p++;
+        }
+        size_t prefix_len;
+        const router::route* r = http_router.match(url, p - url, &prefix_len);
+        if(r) {
+            return r->upstream ? PRIO_BULK : PRIO_HIGH;
+        }
+    }
+    return PRIO_NORMAL;
+}
+
+// 工作线程在process_write之后调用，这时m_bytes_to_send就是整个响应的大小（代理的只有响应头）
+// 缓存命中和错误页生成起来都很便宜，大文件和代理、上传要占着连接很久
+void http_conn::learn_priority(HTTP_CODE ret) {
+    if(!m_url || m_method != GET) {
+        return;
+    }
+    int prio;
+    if(ret == PROXY_REQUEST) {
+        prio = PRIO_BULK;
+    }else if(m_bytes_to_send <= SMALL_RESPONSE) {
+        prio = PRIO_HIGH;
+    }else if(ret == CACHE_HIT || m_bytes_to_send <= FILE_WINDOW_SIZE) {
+        prio = PRIO_NORMAL;
+    }else {
+        prio = PRIO_BULK;
+    }
+    uint64_t h = path_hash(m_url, m_url + strlen(m_url));
+    priority_hints[h & (PRIORITY_HINT_SLOTS - 1)].store(hint_tag(h) | prio, std::memory_order_relaxed);
+}
+
 // 由线程池的工作函数调用
-void http_conn::process () {
-    // 解析http请求
-    HTTP_CODE read_ret = process_read();
+// 工作线程里处理完，放手之前不能再碰连接以外的东西也不能再等事件
+void http_conn::process() {
+    if(serve()) {
+        hand_back();
+    }
+}
+
+// 返回false表示连接已经关了：socket号可能马上被主线程接受的新连接用上，这个对象不能再碰
+bool http_conn::serve() {
+    if(m_tls) {
+        if(tls_handshake() < 0) {
+            close_conn();
+            return false;
+        }
+        return true;
+    }
+    if(m_h2) {
+        return process_h2();
+    }
+    // 新请求以连接前言开头：客户端用先验知识直接说HTTP/2
+    if(!m_body_streaming && m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0 && m_read_buf[0] == 'P') {
+        int n = m_read_idx < H2_PREFACE_LEN ? m_read_idx : H2_PREFACE_LEN;
+        if(memcmp(m_read_buf, H2_PREFACE, n) == 0) {
+            if(n < H2_PREFACE_LEN) {
+                want(EPOLLIN);
+                return true;
+            }
+            return start_h2();
+        }
+    }
+
+    // 解析http请求；请求体还没收完时继续搬运请求体，代理请求在等上游时接着读上游的响应头
+    HTTP_CODE read_ret = m_proxy_head_wait ? proxy_read_response() : m_body_streaming ? pump_body() : process_read();
+    if(read_ret == UPGRADE_H2) {
+        if(upgrade_h2()) {
+            return process_h2();
+        }
+        read_ret = BAD_REQUEST;
+    }
+    if(read_ret == UPGRADE_WS) {
+        if(upgrade_ws()) {
+            return true;
+        }
+        m_linger = false;
+        read_ret = BAD_REQUEST;
+    }
     if (read_ret == NO_REQUEST) {
-        modfd(m_epollfd, m_socketfd, EPOLLIN);
-        return;
+        if(m_proxy_head_wait) {
+            // 上游还没回响应头，工作线程不等，上游可读了再接着处理
+            arm_upstream();
+            return true;
+        }
+        if(m_body_streaming || m_read_idx < READ_BUFFER_SIZE) {
+            want(EPOLLIN);
+            return true;
+        }
+        // 读缓冲区已满，请求头仍然不完整
+        m_linger = false;
+        read_ret = BAD_REQUEST;
     }
 
     // 生成相应
     bool write_ret = process_write(read_ret);
+    if(write_ret) {
+        learn_priority(read_ret);
+        begin_response();
+    }
+    if(m_cache_fill) {
+        // 生成的响应不能缓存，短时间内同一个键的请求不再排队等待
+        m_site->cache->abandon(m_cache_fill, true);
+        m_cache_fill = NULL;
+    }
     if(!write_ret) {
         close_conn();
+        return false;
     }
-    modfd(m_epollfd, m_socketfd, EPOLLOUT);
+    // 响应直接在工作线程里发出去，发不完才等EPOLLOUT；保持连接的请求一来一回不用再经过主线程和epoll_ctl
+    if(!write()) {
+        close_conn();
+        return false;
+    }
+    return true;
+}
+
+// 抓包只记HTTP/1.1的字节流：HTTP/2、WebSocket、直接splice的请求体记下一条CAP_GAP就不再记了，回放时跳过这样的连接
+void http_conn::capture_gap() {
+    if(m_capture) {
+        http_capture.gap(m_capture);
+        m_capture = 0;
+    }
+}
+
+bool http_conn::start_h2() {
+    capture_gap();
+    m_h2 = new h2_session(m_socketfd, m_address, peer_cred());
+    m_h2->start();
+    m_h2->feed(m_read_buf, m_read_idx);
+    return process_h2();
 }
 
+// 升级前的请求变成stream 1，请求头转成HTTP/2的小写名字，逐跳的头部和升级用的头部去掉
+bool http_conn::upgrade_h2() {
+    header_list headers;
+    for(int i = 0; i < m_headers.size(); i++) {
+        const header_map::entry& h = m_headers[i];
+        if(h.id != HDR_HOST && h.id != HDR_HTTP2_SETTINGS && h.id != HDR_TRANSFER_ENCODING && !hop_by_hop(h)) {
+            std::string name(h.name);
+            for(size_t k = 0; k < name.size(); k++) {
+                name[k] = tolower((unsigned char)name[k]);
+            }
+            headers.push_back(std::make_pair(name, std::string(h.value)));
+        }
+    }
+    h2_session* h2 = new h2_session(m_socketfd, m_address, peer_cred());
+    if(!h2->upgrade(m_h2_settings, method_names[m_method], m_url, m_host, headers)) {
+        delete h2;
+        return false;
+    }
+    // 101之后客户端可能已经跟着发了连接前言
+    h2->feed(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+    capture_gap();
+    m_h2 = h2;
+    return true;
+}
 
+// 101响应和普通响应一样由write()发出去，发完后finish_write里再切换，
+// 在那之前主线程还把这条连接当HTTP/1.1处理
+bool http_conn::upgrade_ws() {
+    const char* key = get_header(HDR_SEC_WEBSOCKET_KEY);
+    const char* version = get_header(HDR_SEC_WEBSOCKET_VERSION);
+    if(!key || strlen(key) != 24 || !version || atoi(version) != 13) {
+        return false;
+    }
+    char accept[32];
+    ws_accept_key(key, accept);
+    m_write_idx = 0;
+    if(!add_status_line(101, "Switching Protocols") ||
+       !add_response("Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept)) {
+        return false;
+    }
+    const char* channel;
+    size_t channel_len;
+    ws_hub::accepts(m_url, &channel, &channel_len);
+    m_ws = new ws_session(m_socketfd, channel, channel_len);
+    capture_gap();
+    m_iv[0].iov_base  = m_write_buf;
+    m_iv[0].iov_len   = m_write_idx;
+    m_iv_count        = 1;
+    m_bytes_to_send   = m_write_idx;
+    m_bytes_have_sent = 0;
+    // 101发完之后ws_session要加入主线程里的频道表，所以交给主线程去发
+    want(EPOLLOUT);
+    m_kick = EPOLLOUT;
+    return true;
+}
+
+bool http_conn::process_h2() {
+    int ret = m_h2->process();
+    if(ret < 0) {
+        close_conn();
+        return false;
+    }
+    // 输出没发完的时候同时等EPOLLOUT，客户端这期间发来的帧（WINDOW_UPDATE之类）也要能收到
+    want(EPOLLIN | (ret > 0 ? EPOLLOUT : 0));
+    return true;
+}
+
+// 握手完成后内核已经接手了加解密，之后和明文连接一样处理；客户端可能已经发了请求，它的边沿已经过去了，当作可读再处理一次
+int http_conn::tls_handshake() {
+    switch(http_tls.handshake(m_tls)) {
+        case tls_context::TLS_DONE:
+            http_tls.destroy(m_tls);
+            m_tls = NULL;
+            want(EPOLLIN);
+            m_kick = EPOLLIN;
+            return 1;
+        case tls_context::TLS_WANT_READ:
+            want(EPOLLIN);
+            return 0;
+        case tls_context::TLS_WANT_WRITE:
+            want(EPOLLOUT);
+            return 0;
+        default:
+            return -1;
+    }
+}
@@ -12,21 +12,56 @@
 #include<sys/stat.h>
 #include<errno.h>
 #include"locker.h"
+#include"chunked.h"
+#include"router.h"
+#include"proxy.h"
+#include"response_cache.h"
+#include"h2.h"
+#include"tls.h"
+#include"sharded_counter.h"
+#include"vhost.h"
+#include"shm_cache.h"
+#include"ws.h"
+#include"zerocopy.h"
+#include"profiler.h"
+#include"arena.h"
+#include"header_map.h"
+#include"negative_cache.h"
+#include"capture.h"
+#include"numa_replica.h"
 #include<sys/uio.h>
 #include<string.h>
 #include<sys/mman.h>
 #include<stdarg.h>
-
-class http_conn{
+#include<stdint.h>
+#include<time.h>
+#include<atomic>
+#include<vector>
+#include<utility>
+
+// 缓冲区不放在对象里：users数组只有连接的状态，缓冲区在连接第一次用到时分配
+class alignas(64) http_conn{
 public:
 
     static int m_epollfd;       // 所有socket上的事件都被注册到同一个eollfd上
-    static int m_user_count;    // 统计用户的数量
+    static sharded_counter m_user_count;    // 统计用户的数量，主线程加、工作线程减，按线程分片
+    static int m_write_policy;  // 写策略，WRITE_POLICY
+    static int m_notsent_lowat; // TCP_NOTSENT_LOWAT，内核里未发出的数据最多这么多字节，0表示不设置
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
     static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
     static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int FILE_WINDOW_SIZE = 256 * 1024;     // 大文件流式发送时每次映射的窗口大小，必须是页大小的整数倍
+    static const int READAHEAD_MAX_WINDOWS = 16;        // 预读提示最多领先发送位置的窗口数
+    static const int BODY_PIPE_SIZE = 256 * 1024;       // 请求体splice中转管道的容量
+    static const int BODY_PUMP_BUDGET = 4 * 1024 * 1024;// 每次唤醒最多搬运的请求体字节数，防止一个上传占住工作线程
+    static const int PROXY_BUFFER_SIZE = 8192;          // 代理时组装请求头、读取上游响应头的缓冲区大小
+    static const uint32_t UPSTREAM_EVENT_TAG = 1;       // 上游socket注册到epoll时，data.u64高32位是这个标记，低32位是客户端的socket
+    static const uint32_t UPSTREAM_READY = 1u << 16;    // 上游socket上有事件，和epoll的事件位一起记在连接上
+    static const int STATIC_CACHE_SECONDS = 5;          // 静态文件在响应缓存里的有效期，文件改了最多这么久之后生效
+    static const int SMALL_RESPONSE = 16 * 1024;        // 不超过这么大的响应算小请求，线程池里优先处理
+    static const int PRIORITY_HINT_SLOTS = 4096;        // 按路径记录上一次处理代价的表的大小，2的幂
     
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，这里支持GET，以及带请求体的POST、PUT
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
 
     /*
@@ -51,15 +86,41 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        CREATED_REQUEST     :   上传请求，请求体已经完整写入目标文件
+        HANDLER_REQUEST     :   请求命中了注册的路由，处理函数已经生成了响应
+        PROXY_REQUEST       :   代理请求，上游的响应头已经准备好，响应体在write()里从上游转发
+        BAD_GATEWAY         :   上游连接失败或者响应有误
+        CACHE_HIT           :   命中响应缓存，直接发送缓存里的响应
+        UPGRADE_H2          :   请求带了 Upgrade: h2c，连接切换到HTTP/2，这个请求作为stream 1处理
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, CREATED_REQUEST, HANDLER_REQUEST, PROXY_REQUEST, BAD_GATEWAY, CACHE_HIT, UPGRADE_H2, UPGRADE_WS };
+
+    /*
+        socket的写策略
+        WRITE_PLAIN     :   什么都不设置，Nagle算法打开
+        WRITE_NODELAY   :   TCP_NODELAY，每次写都立即发出
+        WRITE_CORK      :   每个响应发送期间打开TCP_CORK，只发满的报文段，发完再拔掉
+        WRITE_AUTO      :   TCP_NODELAY，同一个响应后面还有数据要发的时候带MSG_MORE/SPLICE_F_MORE，
+                            小响应一次发完不等待，大响应和代理响应不产生零碎的报文段
+    */
+    enum WRITE_POLICY { WRITE_PLAIN = 0, WRITE_NODELAY, WRITE_CORK, WRITE_AUTO };
+
+    // 上游响应体的长度确定方式
+    enum PROXY_BODY { PROXY_NONE = 0, PROXY_LENGTH, PROXY_CHUNKED, PROXY_EOF };
     
-    http_conn() {};
+    http_conn() : m_socketfd(-1), m_read_idx(0), m_write_idx(0), m_file_fd(-1), m_shm_handle(-1), m_corked(false), m_held(false), m_secure(false),
+            m_read_buf(0), m_write_buf(0), m_h2(0), m_ws(0), m_tls(0), m_file_address(0), m_replica(0), m_local(false), m_capture(0),
+            m_body_fd(-1), m_body_upload(false), m_upstream_in_epoll(false), m_proxy_buf(0), m_real_file(0),
+            m_file_map_len(0), m_resp_body(0), m_resp_body_owned(false), m_cache_entry(0), m_cache_fill(0), m_zc(0), m_zc_body(false) {
+        m_body_pipe[0] = m_body_pipe[1] = -1;
+        m_upstream.fd = -1;
+        m_upstream.up = NULL;
+    };
     
-    ~http_conn() {};
+    ~http_conn() { free(m_proxy_buf); free(m_read_buf); };
 
-    // 初始化新接收的连接到users数组
-    void init(int sockfd, const sockaddr_in &addr);
+    // 初始化新接收的连接到users数组；cred不为NULL表示是Unix域socket上的连接，不设置TCP选项、不走TLS
+    void init(int sockfd, const sockaddr_in &addr, const struct ucred* cred = NULL);
 
     // 处理客户端请求，先解析后做出响应
     void process();
@@ -68,53 +129,203 @@ public:
     void close_conn();
 
     bool read();    // 非阻塞读
-    bool write();   // 非阻塞写
+    bool write();   // 非阻塞写，代理请求时也负责把上游的响应体转发给客户端
+
+    const char* get_header(const char* name) const;    // 请求头解析完后按名字取请求头的值，没有返回NULL
+    const char* get_header(HEADER_ID id) const { const header_map::entry* e = m_headers.get(id); return e ? e->value.data() : NULL; }
+
+    const sockaddr_in& address() const { return m_address; }
+    const struct ucred* peer_cred() const { return m_local ? &m_peer_cred : NULL; }    // Unix域socket对端进程的身份，TCP连接为NULL
+    // 读缓冲区里的是一个还没开始解析的新请求：新读进来的，或者流水线上回完上一个请求后挪过来的；HTTP/2的连接按流限流
+    bool at_request_start() const { return !m_tls && !m_h2 && !m_body_streaming && m_check_state == CHECK_STATE_REQUESTLINE && m_checked_idx == 0; }
+    bool handshaking() const { return m_tls != NULL; }     // TLS握手还没完成，socket上的数据还是密文
+    int priority() const;       // 主线程read()之后调用，估计这次要处理的请求的代价，返回线程池的TASK_PRIORITY
+    bool websocket() const { return m_ws && m_ws->started(); }     // 已经切换到WebSocket，读写都在主线程里由ws_session处理
+    bool awaiting_upstream() const { return m_proxy_head_wait; }   // 代理请求在等上游的响应头，上游可读了交给线程池接着读
+    bool ws_event(uint32_t events) { return m_ws->on_event(events); }
+    void reply_and_close(const char* data, size_t len);    // 主线程直接回一个预先生成好的响应，然后关闭连接
+    int reply_missing();        // 主线程read()之后调用：请求的文件确定不存在时直接回404。0不是，1回完了接着等请求，-1回完了要关闭
+    bool zerocopy_pending() const { return m_zc && m_zc->pending(); }     // 有零拷贝发送在等内核的完成通知
+    bool reap_zerocopy() { return m_zc->reap(m_socketfd); }               // EPOLLERR时收取完成通知，socket真的出错返回false
+
+    // 连接的归属：socket以边沿触发同时关注读写，建立连接时注册一次，之后不再epoll_ctl。
+    // 同一时间只有一个线程（主线程，或者处理它的工作线程）碰一个连接，这个线程是它的主人；
+    // 主线程收到事件时连接已经有主人，就只把事件记下来，主人放手时发现有它在等的事件，接着处理（工作线程交回主线程）
+    uint32_t claim(uint32_t events);    // 主线程收到事件：返回现在要处理的事件，不为0时主线程成了主人
+    uint32_t release();                 // 主人处理完放手，接下来等m_want；返回放手前已经到了的、在等的事件，不为0时仍然是主人
+    void hand_back();                   // 工作线程处理完：放手，有没处理的事件就交给主线程
+
+    // 工作线程交回主线程的连接和事件，主线程在eventfd可读时取走
+    static bool init_handoff();
+    static int handoff_fd() { return m_handoff_fd; }
+    static void take_handoff(std::vector<std::pair<int, uint32_t> >& out);
+
+    // url对应站点根目录root下的文件，检查存在、可读、不是目录，HTTP/2也用
+    static HTTP_CODE resolve_file(const char* root, const char* url, char* real_file, struct stat* st);
+
+    // resolve_file之后，文件内容已经在内存里时直接用：先找本节点上的热文件副本，再找共享内存文件缓存。
+    // 命中返回文件内容，replica或者shm_handle记下要释放的引用（numa_replicas::release、http_files.release），HTTP/2也用
+    static const char* acquire_shared_file(const char* path, const struct stat& st, replica_entry** replica, int* shm_handle);
+    // 没命中、打开文件之后：一个窗口放得下的小文件读进共享内存文件缓存，成功返回内容，之后就不需要fd了
+    static const char* insert_shared_file(const char* path, const struct stat& st, int fd, int* shm_handle);
 
     
 private:
+    static int m_handoff_fd;            // 工作线程交回连接时通知主线程的eventfd
+    static locker m_handoff_lock;       // 保护m_handoff
+    static std::vector<std::pair<int, uint32_t> > m_handoff;   // 交回的连接和它们没处理的事件
 
+    // 热数据：每次读写事件、每个请求都要碰的字段放在对象开头，连续的几条缓存行
+    // 对象按缓存行对齐，相邻的两个连接由不同线程处理时不会抢同一条缓存行
     int m_socketfd;                     // 该http连接的socket
-    sockaddr_in m_address;              // 通信的socket地址
-    char m_read_buf[READ_BUFFER_SIZE];  // 读缓冲区
+    CHECK_STATE m_check_state;          // 主状态机当前所处的状态
     int m_read_idx;                     // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下标
     int m_checked_idx;                  // 当前正在分析的字符在读缓冲区的位置
     int m_start_line;                   // 当前正在解析的行的起始位置
-
+    int m_write_idx;                    // 写缓冲区中待发送的字节数
+    int m_iv_count;                     // 被写的内存块的数量
+    METHOD m_method;                    // 请求方法
+    int m_file_fd;                      // 大文件流式发送时保持打开的文件描述符，-1表示不需要
+    int m_shm_handle;                   // m_file_address指向共享内存文件缓存里的条目时是它的编号，否则-1
+    bool m_linger;                      // 是否保持连接
+    bool m_chunked;                     // 请求体使用 Transfer-Encoding: chunked
+    bool m_body_streaming;              // 请求体还没收完，后续数据由工作线程直接从socket搬运
+    bool m_corked;                      // WRITE_CORK：当前响应是否已经塞住了socket
+    bool m_held;                        // WRITE_AUTO：最近一次发送带了MORE标志，内核里可能压着不满一个报文段的数据
+    bool m_secure;                      // 是TLS连接
+    std::atomic<uint32_t> m_owner;      // 还没处理的事件、主人在等的事件、有没有主人，见claim/release
+    uint32_t m_want;                    // 主人放手之后要等的事件：EPOLLIN/EPOLLOUT/UPSTREAM_READY
+    uint32_t m_kick;                    // 放手时当作已经到了的事件：数据还留在socket里、边沿不会再来的时候
+    char* m_read_buf;                   // 读缓冲区，READ_BUFFER_SIZE+1字节，最后一个字节留给结尾的\0
+    char* m_write_buf;                  // 写缓冲区
     char *m_url;                        // 请求目标文件的文件名
     char *m_version;                    // 协议版本， 只支持http1.1
-    METHOD m_method;                    // 请求方法
     char *m_host;                       // 主机名
-    bool m_linger;                      // 是否保持连接
-    int m_content_length;               // 请求体的长度（单位字节）
-
-    char m_real_file[FILENAME_LEN];     // 客户请求的目标文件的完整路径 doc_root + m_url
+    h2_session* m_h2;                   // 切换到HTTP/2之后由它接管连接的读写，NULL表示HTTP/1.1
+    ws_session* m_ws;                   // WebSocket升级：101发完之后由它接管连接
+    tls_conn* m_tls;                    // TLS握手状态，握手完成、内核接手加解密之后释放
+    const router::route* m_route;       // 请求头解析完后匹配到的路由
+    const vhost* m_site;                // 按Host选中的站点：根目录、响应缓存、附加的响应头
+    char *m_file_address;               // 当前映射窗口的内存起始位置
+    replica_entry* m_replica;           // m_file_address指向本节点上的热文件副本时是那个副本，否则NULL
+    int64_t m_content_length;           // 请求体的长度（单位字节）
+    int64_t m_bytes_to_send;            // 本次响应还剩余的字节数
+    int64_t m_bytes_have_sent;          // 本次响应已经发送的字节数
+    struct iovec m_iv[3];               // 用writev来执行的写，1对应写缓冲区，2对应内存映射区；命中缓存时是缓存的响应头、写缓冲区、缓存的响应体
+    upstream_conn m_upstream;           // 代理请求正在使用的上游连接，fd为-1表示没有
+    request_arena m_arena;              // 这个请求用的内存，每个请求开始时reset
+    header_map m_headers;               // 解析出来的请求头，条目放在m_arena里，名字和值指向读缓冲区
+
+    // 冷数据：只有上传、代理、缓存、大文件、HTTP/2升级这些路径才用，从新的缓存行开始
+    alignas(64) sockaddr_in m_address;  // 通信的socket地址
+    struct ucred m_peer_cred;           // Unix域socket连接时对端进程的pid/uid/gid（SO_PEERCRED）
+    bool m_local;                       // 是Unix域socket上的连接
+    uint32_t m_capture;                 // 抓包时这个连接的编号，0表示不记录
+    bool m_expect_continue;             // 客户端在等待 100 Continue 再发请求体
+
+    int m_body_fd;                      // 请求体的去向：上传的目标文件，或者丢弃用的/dev/null
+    bool m_body_upload;                 // m_body_fd 是否是上传的目标文件
+    int m_body_pipe[2];                 // socket到目标文件之间splice用的管道，按需创建
+    int64_t m_body_left;                // Content-Length 模式下剩余未收的请求体字节数
+    chunked_decoder m_chunk;            // chunked 模式下的分帧解码器，代理时请求体收完后再用来跟踪上游响应体
+    bool m_body_raw;                    // 请求体原样转发（代理），chunked的分帧也写给目标
+    int m_pipe_bytes;                   // m_body_pipe里还没有取走的字节数
+
+    size_t m_route_prefix;              // 路由匹配上的前缀长度
+    upstream_group* m_upstream_group;   // 上游连接所属的组，归还连接时用
+    bool m_upstream_in_epoll;           // 上游socket是否已经注册到epoll
+    char* m_proxy_buf;                  // 代理用的缓冲区，按需分配，连接复用时保留
+    PROXY_BODY m_proxy_body;            // 上游响应体的长度确定方式
+    int64_t m_proxy_left;               // PROXY_LENGTH 模式下剩余的响应体字节数
+    bool m_proxy_keepalive;             // 上游连接转发完后能否放回连接池
+    bool m_proxy_eof;                   // 上游已经关闭连接
+    bool m_proxy_head_wait;             // 上游的响应头还没收全，等上游socket可读
+    int m_proxy_head_len;               // m_proxy_buf里已经收到的响应头字节数
+
+    char* m_real_file;                  // 客户请求的目标文件的完整路径 站点根目录 + m_url，FILENAME_LEN字节
     struct stat m_file_stat;            // 目标文件的状态
-    char *m_file_address;               // 内存映射的内存起始位置
-    int m_write_idx;                    // 写缓冲区中待发送的字节数
-    char m_write_buf[WRITE_BUFFER_SIZE];// 写缓冲区
-    struct iovec m_iv[2];               // 用writev来执行的写，1对应写缓冲区，2对应内存映射区
-    int m_iv_count;                     // 被写的内存块的数量
+    size_t m_file_map_len;              // 当前映射窗口的长度
+    off_t m_file_offset;                // 下一个窗口在文件中的起始偏移（64位）
+    const char* m_resp_body;            // 路由处理函数生成的响应体
+    size_t m_resp_body_len;             // 路由处理函数生成的响应体长度
+    bool m_resp_body_owned;             // 响应体是否需要在发送完后free
+    cache_entry* m_cache_entry;         // 正在发送的缓存条目，发送完释放引用
+    cache_entry* m_cache_fill;          // 缓存未命中时的占位条目，生成响应后填充或者放弃
+    zerocopy_tracker* m_zc;             // 零拷贝发送的完成通知，第一次用到时分配
+    bool m_zc_body;                     // 当前响应的缓存响应体（m_iv[2]）用MSG_ZEROCOPY发送
+
+    bool m_upgrade_h2c;                 // 请求带了 Upgrade: h2c
+    bool m_upgrade_ws;                  // 请求带了 Upgrade: websocket
+    const char* m_h2_settings;          // HTTP2-Settings 头的值
+
+    off_t m_readahead_end;              // 已经提示内核预读到的文件位置
+    int64_t m_send_rate;                // 估计的发送速率（字节/秒），用来决定预读的深度
+    struct timespec m_window_ts;        // 上一个窗口开始发送的时间
 
 
     void init();                        // 初始化连接其余的信息
-    void unmap();                       // 释放内存映射
+    void next_request();                // 保持连接的响应发完了：同一次读进来的下一个请求挪到缓冲区开头
+    bool serve();                       // process的主体，连接还开着时由process放手
+    void want(uint32_t ev) { m_want = ev; }     // 处理完之后等什么事件
+    void unmap();                       // 释放内存映射、处理函数分配的响应体以及缓存条目的引用
+    bool map_window();                  // 映射文件的下一个窗口
+    bool use_shared_file(const char* data);     // 用共享内存文件缓存里的内容作为整个文件，data为NULL时返回false
+    void advise_readahead();            // 根据发送速率给内核预读提示
+    void consume_iov(int64_t n);        // writev部分写之后推进m_iv
 
     // 这部分都是响应相关
     bool add_response(const char* format, ...);
     bool add_status_line(int status, const char* title);// 添加状态行
-    bool add_headers(int content_length);               // 添加响应头
+    bool add_headers(int64_t content_length);           // 添加响应头
     bool add_content(const char *content);              // 添加响应内容
-    bool add_content_length(int content_length);        // 添加响应内容长度
+    bool add_content_length(int64_t content_length);    // 添加响应内容长度
     bool add_content_type();
+    bool add_site_headers();
     bool add_linger();
     bool add_blank_line();
 
-    CHECK_STATE m_check_state;                      //主状态机当前所处的状态
-
     HTTP_CODE process_read();                       // 解析http请求
     HTTP_CODE parse_headers(char* text);            // 解析请求头
     HTTP_CODE parse_request_line(char* text);       // 解析请求首行 
-    HTTP_CODE parse_content(char* text);            // 解析请求体 
+    HTTP_CODE begin_body();                         // 请求头解析完，开始接收请求体
+    HTTP_CODE pump_body();                          // 把socket上的请求体splice到目标文件
+    HTTP_CODE finish_body();                        // 请求体接收完毕
+    HTTP_CODE open_upload();                        // 打开上传的目标文件
+    int consume_body(const char* data, int len);    // 处理已经读进读缓冲区的请求体，返回用掉的字节数，出错返回-1
+    bool body_complete() const { return m_chunked ? m_chunk.done() : m_body_left == 0; }
+    void abort_body();                              // 请求体出错，丢弃已经写了一半的上传文件
+    bool ensure_body_pipe();                        // 按需创建splice用的管道
+
+    // 反向代理相关
+    void match_route();                             // 请求头解析完后查找路由
+    HTTP_CODE start_proxy();                        // 取上游连接，转发请求头
+    HTTP_CODE proxy_read_response();                // 读取上游的响应头，组装给客户端的响应头
+    int track_proxy_body(const char* data, int len);// 统计属于响应体的字节，返回其中属于本次响应的字节数，格式错误返回-1
+    bool proxy_body_done() const;
+    int fill_proxy_pipe();                          // 从上游往管道里搬一段响应体，1有进展，0需要等待，-1出错或上游关闭
+    bool relay_proxy();                             // 在主线程里把上游的响应体splice给客户端
+    void arm_upstream();                            // 等待上游socket可读
+    void release_upstream(bool keepalive);          // 归还或者关闭上游连接
+    bool finish_write();                            // 响应发送完毕，根据是否保持连接决定后续
+
+    // 写策略相关
+    void begin_response();                          // 响应准备好、开始发送之前调用
+    void push_pending(bool end);                    // 把内核里压着的数据推出去，end表示整个响应发完了
+    bool more_follows() const;                      // 当前这次发送之后，同一个响应是否马上还有数据要发
+
+    int tls_handshake();                            // 推进TLS握手并记下接着要等的事件，-1失败，0等待，1完成
+
+    // HTTP/2相关
+    bool start_h2();                                // 收到了先验知识的连接前言，切换到HTTP/2
+    void capture_gap();                             // 连接换成了抓不到的形式，之后不再记录
+    bool upgrade_h2();                              // 处理 Upgrade: h2c 的请求，回101并切换到HTTP/2
+    bool upgrade_ws();                              // 处理 Upgrade: websocket 的请求，回101，发完后切换到WebSocket
+    bool process_h2();                              // 工作线程处理HTTP/2的帧，记下接着要等的事件；出错关闭连接并返回false
+
+    // 响应缓存相关
+    HTTP_CODE cache_lookup();                       // 请求头解析完后查缓存，命中返回CACHE_HIT
+    cache_entry* cache_fill(int head_len, const char* body, size_t body_len, int max_age, const char* vary, uint64_t hot_key = 0);
+    HTTP_CODE proxy_cache_body(int head_len, const char* data, int used, int max_age, const char* vary);
 
     LINE_STATUS parse_line();                       // 解析请求头 
 
@@ -122,9 +333,15 @@ private:
     
     char* get_line() { return m_read_buf + m_start_line;}  // 获取一行文本
     HTTP_CODE do_request();   // do_request
+    HTTP_CODE dispatch_route();     // 查找并执行注册的路由处理函数，没有命中返回NO_REQUEST
+    void learn_priority(HTTP_CODE ret);     // 响应生成之后按实际的代价记下这个路径的优先级，下次请求同一路径时用
 
 };
 
+// 本进程的线程池，run_reactor里创建；别的模块可以用submit往里面提交后台任务
+template<typename T> class threadpool;
+extern threadpool<http_conn>* http_workers;
+
 
 
 
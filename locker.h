@@ -4,6 +4,8 @@
 #include<pthread.h>
 #include<exception>
 #include<semaphore.h>
+#include<time.h>
+#include<errno.h>
 
 
 // 线程同步机制所需要使用的一些封装类
@@ -108,13 +110,32 @@ public:
 
     // 
     bool wait() {
-        return sem_wait(&m_sem) == 0;
+        // 被信号打断（比如采样剖析的SIGPROF）就接着等
+        while(sem_wait(&m_sem) != 0) {
+            if(errno != EINTR) {
+                return false;
+            }
+        }
+        return true;
     }
 
     bool post() {
         return sem_post(&m_sem) == 0;
     }
 
+    // 最多等ms毫秒，超时或者被信号打断返回false
+    bool timewait(int ms) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += ms / 1000;
+        t.tv_nsec += (long)(ms % 1000) * 1000000;
+        if(t.tv_nsec >= 1000000000) {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000;
+        }
+        return sem_timedwait(&m_sem, &t) == 0;
+    }
+
 private:
     sem_t m_sem;
 };
@@ -6,10 +6,27 @@
 #include<errno.h>
 #include<fcntl.h>
 #include<sys/epoll.h>
+#include<sys/wait.h>
+#include<sys/prctl.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/stat.h>
+#include<stddef.h>
+#include<time.h>
 #include"locker.h"
 #include"threadpool.h"
 #include<signal.h>
 #include"http_conn.h"
+#include"router.h"
+#include"rate_limit.h"
+#include"tls.h"
+#include"busy_poll.h"
+#include"vhost.h"
+#include"shm_cache.h"
+#include"profiler.h"
+#include"capture.h"
+#include"numa_replica.h"
+#include<vector>
 
 // 定义最大文件描述符个数
 #define MAX_FD 65535
@@ -29,35 +46,166 @@ void addsig(int sig, void(handler)(int)) {
 }
 
 // 将文件描述符添加到epoll对象中
-extern void addfd(int epollfd, int fd, bool one_shot);
+extern void addfd(int epollfd, int fd, bool edge);
 
 // 从epoll中删除文件描述符
 extern void remvefd(int epollfd, int fd);
 
-// 修改文件描述符
-extern void modfd(int epollfd, int fd, int ev);
+// 上传文件保存的目录
+extern const char* upload_root;
 
-// 传入参数用
-int main(int argc, char* argv[]) {
+// 反向代理路由
+extern bool proxy_add_route(const char* arg);
 
-    if(argc <= 1) {
-        printf("按照如下格式运行：%s port_number\n", basename(argv[0]));
-        exit(-1);
+// 响应缓存默认的大小
+static const int DEFAULT_CACHE_MB = 64;
+
+// 限流表的容量，按IP和/24网段各占一个桶
+static const size_t RATE_LIMIT_SLOTS = 1 << 22;
+
+// 多进程模式下共享内存文件缓存默认的大小
+static const int DEFAULT_SHM_MB = 64;
+
+// 多个NUMA节点的机器上，每个节点默认拿出这么多内存放热文件的副本
+static const int DEFAULT_REPLICA_MB = 64;
+
+threadpool<http_conn>* http_workers = NULL;
+
+// 主进程收到SIGTERM/SIGINT后置位，通知工作进程退出
+static volatile sig_atomic_t stopping = 0;
+
+// 线程池是否按请求的代价分优先级调度，-q fifo 关掉
+static bool prioritized = true;
+
+// 线程池线程数的上下限，-t 最少[:最多]，相等时线程数固定
+static int pool_min_threads = 4;
+static int pool_max_threads = 64;
+
+// -C 抓包文件和它的上限，在各自的reactor里打开
+static const char* capture_path = NULL;
+static size_t capture_max_mb = 1024;
+static bool capture_per_process = false;
+
+// -U 打开的Unix域socket监听，在fork之前创建，多进程模式下所有工作进程共用
+static std::vector<int> unix_listeners;
+
+// 创建Unix域socket监听：@开头是抽象命名空间，否则是文件系统路径，路径上残留的旧socket文件先删掉
+static int open_unix_listener(const char* spec) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    bool abstract = spec[0] == '@';
+    size_t len = strlen(spec);
+    if(len == 0 || len >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(addr.sun_path, spec, len);
+    if(abstract) {
+        addr.sun_path[0] = '\0';
+    }else {
+        struct stat st;
+        if(lstat(spec, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(spec);
+        }
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        return -1;
     }
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + len + (abstract ? 0 : 1);
+    if(bind(fd, (struct sockaddr*)&addr, addr_len) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    // 获取端口号
-    int port = atoi(argv[1]);
+static bool is_unix_listener(int fd) {
+    for(size_t i = 0; i < unix_listeners.size(); i++) {
+        if(unix_listeners[i] == fd) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    // 对sigpie信号进行处理
-    addsig(SIGPIPE, SIG_IGN);
+static void stop_handler(int sig) {
+    stopping = 1;
+}
+
+// 主线程处理一个它拿到手的连接，events是要处理的事件：交给线程池之后归工作线程，否则处理完放手，
+// 处理期间又到了在等的事件就接着处理
+static void serve_conn(http_conn* users, int sockfd, uint32_t events, threadpool<http_conn>* pool) {
+    http_conn& conn = users[sockfd];
+    while(events) {
+        if((events & EPOLLERR) && conn.zerocopy_pending()) {
+            // 零拷贝发送的完成通知也以EPOLLERR报告：收完通知后按其余的事件照常处理，socket真的出错才关闭
+            if(!conn.reap_zerocopy()) {
+                conn.close_conn();
+                return;
+            }
+            events &= ~EPOLLERR;
+        }
+        if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            // 对方异常断开或者错误
+            conn.close_conn();
+            return;
+        }
+        if(conn.websocket()) {
+            // WebSocket的帧在主线程里收发，不进线程池
+            if(!conn.ws_event(events)) {
+                conn.close_conn();
+                return;
+            }
+        }else if((events & http_conn::UPSTREAM_READY) && conn.awaiting_upstream()) {
+            // 代理请求的上游回响应头了，交给线程池接着读、组装响应
+            pool->append(users + sockfd, conn.priority());
+            return;
+        }else if(events & EPOLLIN) {
+            // 一次性把所有数据都读出来，交给线程池
+            bool fresh = conn.at_request_start();
+            if(!conn.read()) {
+                conn.close_conn();
+                return;
+            }
+            if(fresh && http_limiter.enabled() && !conn.peer_cred() && !http_limiter.allow(conn.address())) {
+                // 每个新请求扣一个令牌，扣不到就在主线程里回429，不进线程池
+                conn.reply_and_close(rate_limiter::response(), rate_limiter::response_len());
+                return;
+            }
+            int missing = fresh ? conn.reply_missing() : 0;
+            if(missing < 0) {
+                conn.close_conn();
+                return;
+            }
+            if(missing == 0) {
+                pool->append(users + sockfd, conn.priority());
+                return;
+            }
+            // 确定不存在的路径，404已经在主线程里回了，接着等下一个请求
+        }else if(events & (EPOLLOUT | http_conn::UPSTREAM_READY)) {
+            // 上次没写完的响应，或者代理的上游又有数据了
+            if(!conn.write()) {
+                conn.close_conn();
+                return;
+            }
+        }
+        events = conn.release();
+    }
+}
 
+// 一个进程的reactor：监听socket、epoll、线程池都在这里创建，多进程模式下在fork出来的工作进程里调用
+static void run_reactor(int port, int spin_us) {
     // 创建线程池，并初始化
     threadpool<http_conn>* pool = NULL;
     try{
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(pool_min_threads, 10000, prioritized, pool_max_threads);
     }catch(...) {
         exit(-1);
     }
+    http_workers = pool;
+    http_profiler.attach_thread();
 
     // 创建一个数组用于保存所有的客户端信息
     http_conn* users = new http_conn[MAX_FD];
@@ -69,9 +217,10 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
-    // 设置端口复用
+    // 设置端口复用；多进程模式下每个工作进程都绑定同一个端口，由内核在它们之间分配新连接
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
 
     struct sockaddr_in saddr;
     saddr.sin_family    = AF_INET;
@@ -96,9 +245,41 @@ int main(int argc, char* argv[]) {
     // 将监听的文件描述符添加到epoll中
     addfd(epollfd, listenfd, false);
     http_conn::m_epollfd    = epollfd;
+    http_poller.init(spin_us, epollfd);
+    if(!http_ws.init(epollfd) || !http_conn::init_handoff()) {
+        perror("eventfd");
+        exit(-1);
+    }
+    std::vector<std::pair<int, uint32_t> > handoff;
+    if(capture_path) {
+        // 多进程模式下每个工作进程写自己的文件，后面加上pid，重新拉起的进程不会覆盖崩溃的进程抓到的记录
+        std::string path = capture_path;
+        if(capture_per_process) {
+            path += "." + std::to_string(getpid());
+        }
+        if(!http_capture.start(path.c_str(), capture_max_mb * 1024 * 1024)) {
+            printf("打开抓包文件失败：%s（%s）\n", path.c_str(), strerror(errno));
+            exit(-1);
+        }
+    }
+    if(!http_missing.init(epollfd)) {
+        perror("inotify_init1");    // 不影响正常服务，只是不缓存不存在的路径
+    }
+    if(http_poller.enabled()) {
+        http_poller.setup_socket(listenfd);
+    }
+    // Unix域socket监听是几个工作进程共用的，EPOLLEXCLUSIVE让一个新连接只唤醒其中一个
+    for(size_t i = 0; i < unix_listeners.size(); i++) {
+        epoll_event event;
+        event.data.u64 = 0;
+        event.data.fd  = unix_listeners[i];
+        event.events   = EPOLLIN | EPOLLEXCLUSIVE;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, unix_listeners[i], &event);
+    }
     
     while(true) {
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        int num = http_poller.enabled() ? http_poller.wait(epollfd, events, MAX_EVENT_NUMBER)
+                                        : epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
         if((num < 0) && (errno != EINTR)) {
             printf("epoll failure!\n");
             break;
@@ -107,39 +288,80 @@ int main(int argc, char* argv[]) {
         // 循环遍历事件数组
         for(int i = 0; i < num; i++) {
             int sockfd = events[i].data.fd;
-            if(sockfd == listenfd) {
+            if((events[i].data.u64 >> 32) == http_conn::UPSTREAM_EVENT_TAG) {
+                // 代理请求的上游socket可读了，继续把响应体转发给对应的客户端
+                sockfd = (int)(uint32_t)events[i].data.u64;
+                uint32_t ready = users[sockfd].claim(http_conn::UPSTREAM_READY);
+                if(ready) {
+                    serve_conn(users, sockfd, ready, pool);
+                }
+            }else if(sockfd == listenfd) {
                 // 有客户端连接进来
                 struct sockaddr_in clientaddr;
                 socklen_t clientaddr_len = sizeof(clientaddr);
                 
                 int connfd = accept(listenfd, (struct sockaddr*)&clientaddr, &clientaddr_len);
 
-                if(http_conn::m_user_count >= MAX_FD) {
+                if(http_conn::m_user_count.load() >= MAX_FD) {
                     // 当前连接数大于等于最大FD连接数，服务器满了
                     // 给客户端信息，服务器正忙
                     close(connfd);
                     continue;
                 }
+                if(http_limiter.enabled() && http_limiter.limited(clientaddr)) {
+                    // 已经被限流的客户端，新连接也直接回429；TLS连接还没握手，只能直接关闭
+                    if(!http_tls.enabled()) {
+                        send(connfd, rate_limiter::response(), rate_limiter::response_len(), MSG_DONTWAIT | MSG_NOSIGNAL);
+                    }
+                    close(connfd);
+                    continue;
+                }
+                if(http_poller.enabled()) {
+                    http_poller.setup_socket(connfd);
+                }
                 // 将新的客户数据初始化，放入数组中
                 users[connfd].init(connfd, clientaddr);
 
-            }else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                // printf("这里是epoll检测到客户挂起或者错误，断开连接的地方，接下来继续循环检测epoll\n");
-                // 对方异常断开或者错误
-                users[sockfd].close_conn();
-            }else if (events[i].events & EPOLLIN) {
-                // printf("这里是epoll检测到客户数据到了下面会一次性读入数据，并添加任务到线程池\n");
-                if(users[sockfd].read()) {
-                    // 一次性把所有数据都读出来
-                    pool->append(users + sockfd);
-                }else {
-                    users[sockfd].close_conn();
+            }else if(is_unix_listener(sockfd)) {
+                // 同一台机器上的边车从Unix域socket连进来：没有TCP协议栈的开销，不限流，对端进程的身份交给路由处理函数做访问控制
+                int connfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+                if(connfd < 0) {
+                    continue;   // 被别的工作进程抢先接走了
+                }
+                if(http_conn::m_user_count.load() >= MAX_FD) {
+                    close(connfd);
+                    continue;
+                }
+                struct ucred cred;
+                socklen_t cred_len = sizeof(cred);
+                if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+                    close(connfd);
+                    continue;
+                }
+                struct sockaddr_in clientaddr;
+                memset(&clientaddr, 0, sizeof(clientaddr));
+                clientaddr.sin_family      = AF_INET;
+                clientaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                users[connfd].init(connfd, clientaddr, &cred);
+
+            }else if(sockfd == http_ws.notify_fd()) {
+                // 别的线程推送的WebSocket消息
+                http_ws.drain();
+            }else if(sockfd == http_missing.notify_fd()) {
+                // 站点根目录下有了变化
+                http_missing.drain();
+            }else if(sockfd == http_conn::handoff_fd()) {
+                // 工作线程处理期间连接上又来了事件，放手时交回来的
+                http_conn::take_handoff(handoff);
+                for(size_t k = 0; k < handoff.size(); k++) {
+                    serve_conn(users, handoff[k].first, handoff[k].second, pool);
                 }
-            }else if(events[i].events & EPOLLOUT) {
-                // printf("这里是检测到写操作，一次性写入所有数据\n");
-                if(!users[sockfd].write()) {
-                    // 一次性写完所有的数据,如果没写
-                    users[sockfd].close_conn();
+                handoff.clear();
+            }else {
+                // 连接空闲时主线程拿过来处理；正在被工作线程处理的，事件先记在连接上
+                uint32_t ready = users[sockfd].claim(events[i].events);
+                if(ready) {
+                    serve_conn(users, sockfd, ready, pool);
                 }
             }
 
@@ -151,6 +373,263 @@ int main(int argc, char* argv[]) {
     close(listenfd);
     delete[] users;
     delete pool;
+}
+
+// fork一个工作进程，id是它的编号，共享内存文件缓存按编号记引用
+static pid_t spawn_worker(int id, int port, int spin_us) {
+    fflush(stdout);     // 不然缓冲区里还没输出的内容父子进程各输出一遍
+    pid_t pid = fork();
+    if(pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);   // 主进程没了，工作进程也跟着退出
+        addsig(SIGTERM, SIG_DFL);
+        addsig(SIGINT, SIG_DFL);
+        http_files.attach(id);
+        run_reactor(port, spin_us);
+        exit(0);
+    }
+    if(pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+// 多进程模式的主进程：只负责fork工作进程，某个工作进程崩溃了就重新拉起一个，其余的进程和它们的连接不受影响
+// 工作进程自己退出（比如绑定端口失败）说明配置有问题，重启也没用，整体退出
+static void run_master(int workers, int port, int spin_us) {
+    pid_t* pids = new pid_t[workers];
+    time_t* started = new time_t[workers];
+    addsig(SIGTERM, stop_handler);
+    addsig(SIGINT, stop_handler);
+    for(int i = 0; i < workers; i++) {
+        pids[i] = spawn_worker(i, port, spin_us);
+        started[i] = time(NULL);
+    }
+
+    while(!stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if(pid < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        int id = -1;
+        for(int i = 0; i < workers; i++) {
+            if(pids[i] == pid) {
+                id = i;
+            }
+        }
+        if(id < 0) {
+            continue;
+        }
+        pids[id] = -1;
+        http_files.reap(id);    // 它手上的共享缓存条目不会再有人释放了
+        if(WIFEXITED(status)) {
+            printf("工作进程%d退出（%d），停止服务\n", id, WEXITSTATUS(status));
+            break;
+        }
+        printf("工作进程%d（pid %d）被信号%d终止，重新启动\n", id, pid, WTERMSIG(status));
+        if(time(NULL) - started[id] < 1) {
+            sleep(1);   // 一启动就崩溃的，不要连续不断地fork
+        }
+        pids[id] = spawn_worker(id, port, spin_us);
+        started[id] = time(NULL);
+    }
+
+    for(int i = 0; i < workers; i++) {
+        if(pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while(waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+    }
+    delete[] pids;
+    delete[] started;
+}
+
+// 传入参数用
+int main(int argc, char* argv[]) {
+
+    // 可选参数： -u 上传目录；-p /前缀=上游地址[,上游地址...]，可以有多个；-c 响应缓存大小（MB），0表示关闭
+    // -r 每个IP每秒的请求数[:突发量]，不设置不限流
+    // -w 写策略 auto/nodelay/cork/plain；-l TCP_NOTSENT_LOWAT（KB），0表示不设置
+    // -s 证书链,私钥：监听端口改为TLS；-b 忙轮询空转的上限（微秒），不设置不忙轮询
+    // -v 虚拟主机配置文件，不设置时所有请求都用doc_root
+    // -f 工作进程数，不设置时单进程运行；-m 共享内存文件缓存的大小（MB），多进程模式下默认64，0表示关闭
+    // -q 线程池调度方式 priority/fifo，默认priority；-t 线程池最少[:最多]线程数，默认4:64
+    // -U 额外监听的Unix域socket，路径或者@抽象名字，可以有多个
+    // -C 抓包文件[:上限MB]，把收到的请求原样记下来给replay/下的工具回放，上限默认1024MB
+    // -n 每个NUMA节点上热文件副本的总大小（MB），多进程模式下由各个工作进程平分，默认64，0表示关闭；只有一个节点时不启用
+    int opt;
+    int workers = 0;
+    int shm_mb = -1;
+    int replica_mb = DEFAULT_REPLICA_MB;
+    const char* vhost_conf = NULL;
+    int spin_us = 0;
+    int cache_mb = DEFAULT_CACHE_MB;
+    unsigned rate = 0, burst = 0;
+    while((opt = getopt(argc, argv, "u:p:c:r:w:l:s:b:v:f:m:q:t:U:C:n:")) != -1) {
+        switch(opt) {
+            case 'u':
+                upload_root = optarg;
+                break;
+            case 'p':
+                if(!proxy_add_route(optarg)) {
+                    printf("代理配置有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'c':
+                cache_mb = atoi(optarg);
+                break;
+            case 'r':
+                if(sscanf(optarg, "%u:%u", &rate, &burst) < 1) {
+                    printf("限流配置有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'w':
+                if(strcmp(optarg, "auto") == 0) {
+                    http_conn::m_write_policy = http_conn::WRITE_AUTO;
+                }else if(strcmp(optarg, "nodelay") == 0) {
+                    http_conn::m_write_policy = http_conn::WRITE_NODELAY;
+                }else if(strcmp(optarg, "cork") == 0) {
+                    http_conn::m_write_policy = http_conn::WRITE_CORK;
+                }else if(strcmp(optarg, "plain") == 0) {
+                    http_conn::m_write_policy = http_conn::WRITE_PLAIN;
+                }else {
+                    printf("写策略有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'l':
+                http_conn::m_notsent_lowat = atoi(optarg) * 1024;
+                break;
+            case 'b':
+                spin_us = atoi(optarg);
+                break;
+            case 'v':
+                vhost_conf = optarg;
+                break;
+            case 'f':
+                workers = atoi(optarg);
+                if(workers < 0 || workers > shm_file_cache::MAX_WORKERS) {
+                    printf("工作进程数有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'm':
+                shm_mb = atoi(optarg);
+                break;
+            case 'n':
+                replica_mb = atoi(optarg);
+                if(replica_mb < 0) {
+                    printf("副本内存配置有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 't': {
+                int n = sscanf(optarg, "%d:%d", &pool_min_threads, &pool_max_threads);
+                if(n == 1) {
+                    pool_max_threads = pool_min_threads;
+                }
+                if(n < 1 || pool_min_threads <= 0 || pool_max_threads < pool_min_threads) {
+                    printf("线程数有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'U': {
+                int fd = open_unix_listener(optarg);
+                if(fd == -1) {
+                    printf("Unix域socket监听失败：%s（%s）\n", optarg, strerror(errno));
+                    exit(-1);
+                }
+                unix_listeners.push_back(fd);
+                break;
+            }
+            case 'C': {
+                capture_path = optarg;
+                char* max = strrchr(optarg, ':');
+                if(max && max[1] && strspn(max + 1, "0123456789") == strlen(max + 1)) {
+                    *max++ = '\0';
+                    capture_max_mb = atoi(max);
+                }
+                if(!capture_path[0] || capture_max_mb == 0) {
+                    printf("抓包配置有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'q':
+                if(strcmp(optarg, "priority") == 0) {
+                    prioritized = true;
+                }else if(strcmp(optarg, "fifo") == 0) {
+                    prioritized = false;
+                }else {
+                    printf("调度方式有误：%s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 's': {
+                char* key = strchr(optarg, ',');
+                if(!key) {
+                    printf("TLS配置有误：%s\n", optarg);
+                    exit(-1);
+                }
+                *key++ = '\0';
+                if(!http_tls.init(optarg, key)) {
+                    printf("加载证书失败：%s %s\n", optarg, key);
+                    exit(-1);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    if(argc <= optind) {
+        printf("按照如下格式运行：%s [-u upload_dir] [-p /prefix=host:port,unix:/path] [-c cache_mb] [-r rate[:burst]] [-w auto|nodelay|cork|plain] [-l lowat_kb] [-s cert.pem,key.pem] [-b spin_us] [-v vhosts.conf] [-f workers] [-m shm_mb] [-q priority|fifo] [-t min[:max]] [-U /path|@name] [-C capture_file[:max_mb]] [-n replica_mb] port_number\n", basename(argv[0]));
+        exit(-1);
+    }
+
+    // 获取端口号
+    int port = atoi(argv[optind]);
+
+    http_cache.init(cache_mb > 0 ? (size_t)cache_mb * 1024 * 1024 : 0);
+    if(vhost_conf && !http_vhosts.load(vhost_conf)) {
+        exit(-1);
+    }
+    if(!http_limiter.init(rate, burst, RATE_LIMIT_SLOTS)) {
+        printf("限流配置有误：%u:%u\n", rate, burst);
+        exit(-1);
+    }
+    if(shm_mb < 0) {
+        shm_mb = workers > 0 ? DEFAULT_SHM_MB : 0;
+    }
+    if(!http_files.init((size_t)shm_mb * 1024 * 1024)) {
+        printf("创建共享内存文件缓存失败：%dMB\n", shm_mb);
+        exit(-1);
+    }
+    // 每个进程各有一份副本，预算按进程平分
+    http_replicas.init((size_t)replica_mb * 1024 * 1024 / (workers > 0 ? workers : 1));
+
+    // 对sigpie信号进行处理
+    addsig(SIGPIPE, SIG_IGN);
+
+    // 注册进程内的路由，其余的请求按文件处理
+    http_router.add("/healthz", router::EXACT, health_handler);
+    http_router.add("/", router::EXACT, redirect_handler, (void*)"/love.html");
+    http_router.add("/debug/profile", router::EXACT, profile_handler);
+
+    capture_per_process = workers > 0;
+    if(workers > 0) {
+        run_master(workers, port, spin_us);
+    }else {
+        run_reactor(port, spin_us);
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,312 @@
+#include"negative_cache.h"
+#include"vhost.h"
+#include"http_conn.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<dirent.h>
+#include<sys/stat.h>
+#include<sys/inotify.h>
+
+negative_watch http_missing;
+
+extern void addfd(int epollfd, int fd, bool edge);
+extern const char* error_404_title;
+extern const char* error_404_form;
+
+// 每个路径在过滤器里置的位数，每个路径留10位：设计容量下误判率不到1%
+static const int BLOOM_PROBES = 7;
+static const int BLOOM_BITS_PER_ENTRY = 10;
+static const size_t BLOOM_MIN_CAPACITY = 1024;
+
+// 新文件、移入、权限变化（目录的权限决定了下面的文件stat不stat得到），目录自己被删除或者移走
+static const uint32_t WATCH_MASK = IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+
+negative_cache::negative_cache(const std::string& root, size_t max_url, const std::string& site_headers)
+        : m_root(root), m_max_url(max_url), m_enabled(false), m_bit_mask(0), m_count(0), m_capacity(0), m_gen(1) {
+    m_slots = (miss_slot*)calloc(MISS_SLOTS, sizeof(miss_slot));
+    // 和process_write里NO_RESOURCE的响应一样：状态行、Content-Length、Content-Type、站点的响应头、Connection
+    char head[256];
+    for(int keepalive = 0; keepalive < 2; keepalive++) {
+        snprintf(head, sizeof(head), "%s %d %s\r\nContent-Length: %lld\r\nContent-Type:%s\r\n", "HTTP/1.1", 404,
+                 error_404_title, (long long)strlen(error_404_form), "text/html");
+        std::string& r = keepalive ? m_resp_keepalive : m_resp_close;
+        r.append(head).append(site_headers);
+        r.append("Connection: ").append(keepalive ? "keep-alive" : "close").append("\r\n\r\n");
+        r.append(error_404_form);
+    }
+}
+
+negative_cache::~negative_cache() {
+    free(m_slots);
+}
+
+// FNV-1a，最后再混合一遍，高低32位分别当两个独立的哈希用
+uint64_t negative_cache::hash(const char* s, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// stat会把//、/./、/../解析掉，这样的url和过滤器里的路径对不上，不下结论
+bool negative_cache::canonical(const char* url, size_t len) {
+    if(len < 2 || url[0] != '/') {
+        return false;
+    }
+    for(size_t i = 0; i + 1 < len; i++) {
+        if(url[i] != '/') {
+            continue;
+        }
+        char c = url[i + 1];
+        if(c == '/') {
+            return false;
+        }
+        if(c == '.') {
+            char d = i + 2 < len ? url[i + 2] : '/';
+            if(d == '/' || (d == '.' && (i + 3 >= len || url[i + 3] == '/'))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool negative_cache::missing(const char* url, size_t len) {
+    if(!m_enabled || len > m_max_url || !canonical(url, len)) {
+        return false;
+    }
+    // 末尾的/：目录stat得到（回400），文件和不存在的都stat不到（回404），按去掉/之后的路径查
+    size_t key_len = url[len - 1] == '/' ? len - 1 : len;
+    uint64_t h = hash(url, key_len);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for(int i = 0; i < BLOOM_PROBES; i++) {
+        uint64_t bit = (h1 + (uint64_t)i * h2) & m_bit_mask;
+        if(!(m_bits[bit >> 6] & (1ULL << (bit & 63)))) {
+            return true;
+        }
+    }
+    // 过滤器说可能存在：再看最近stat过的
+    if(len > (size_t)MISS_URL_LEN || !m_slots) {
+        return false;
+    }
+    const miss_slot& s = m_slots[hash(url, len) & (MISS_SLOTS - 1)];
+    m_lock.lock();
+    bool hit = s.gen == generation() && s.len == len && memcmp(s.url, url, len) == 0;
+    m_lock.unlock();
+    return hit;
+}
+
+void negative_cache::note_miss(const char* url, uint32_t gen) {
+    size_t len = strlen(url);
+    if(len > (size_t)MISS_URL_LEN || len > m_max_url || !m_slots || !canonical(url, len)) {
+        return;
+    }
+    miss_slot& s = m_slots[hash(url, len) & (MISS_SLOTS - 1)];
+    m_lock.lock();
+    if(gen == generation()) {
+        s.gen = gen;
+        s.len = len;
+        memcpy(s.url, url, len);
+    }
+    m_lock.unlock();
+}
+
+void negative_cache::start_build() {
+    m_enabled = false;
+    m_building.clear();
+    m_count = 0;
+    invalidate();
+}
+
+void negative_cache::finish_build(bool ok) {
+    std::vector<uint64_t> hashes;
+    hashes.swap(m_building);
+    if(!ok) {
+        m_bits.clear();
+        return;
+    }
+    // 容量留一倍给之后新建的文件
+    m_capacity = hashes.size() * 2 > BLOOM_MIN_CAPACITY ? hashes.size() * 2 : BLOOM_MIN_CAPACITY;
+    size_t bits = 64;
+    while(bits < m_capacity * BLOOM_BITS_PER_ENTRY) {
+        bits <<= 1;
+    }
+    m_bits.assign(bits / 64, 0);
+    m_bit_mask = bits - 1;
+    for(size_t i = 0; i < hashes.size(); i++) {
+        insert(hashes[i]);
+    }
+    m_enabled = true;
+}
+
+void negative_cache::insert(uint64_t h) {
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for(int k = 0; k < BLOOM_PROBES; k++) {
+        uint64_t bit = (h1 + (uint64_t)k * h2) & m_bit_mask;
+        m_bits[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+// 扫描期间只记哈希；建好之后直接置位
+void negative_cache::add(const char* path, size_t len) {
+    uint64_t h = hash(path, len);
+    if(m_enabled) {
+        insert(h);
+    }else {
+        m_building.push_back(h);
+    }
+    m_count++;
+}
+
+
+negative_watch::negative_watch() : m_fd(-1) {
+}
+
+bool negative_watch::init(int epollfd) {
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_fd < 0) {
+        return false;
+    }
+    std::vector<vhost*> sites = http_vhosts.all();
+    for(size_t i = 0; i < sites.size(); i++) {
+        size_t root_len = sites[i]->root.size();
+        size_t max_url = root_len + 1 < (size_t)http_conn::FILENAME_LEN ? http_conn::FILENAME_LEN - 1 - root_len : 0;
+        negative_cache* c = new negative_cache(sites[i]->root, max_url, sites[i]->headers);
+        build(c);
+        m_caches.push_back(c);
+        sites[i]->missing = c;
+    }
+    addfd(epollfd, m_fd, false);
+    return true;
+}
+
+// 先监视再列目录：列的时候新建的文件要么列得到，要么之后有事件
+bool negative_watch::walk(negative_cache* c, const std::string& dir, int depth) {
+    if(depth > negative_cache::MAX_DEPTH || m_watches.size() >= (size_t)MAX_WATCHES) {
+        return false;
+    }
+    std::string full = c->root() + dir;
+    int wd = inotify_add_watch(m_fd, full.c_str(), WATCH_MASK);
+    if(wd < 0) {
+        return false;
+    }
+    watch w = { c, dir };
+    m_watches[wd].push_back(w);
+    DIR* d = opendir(full.c_str());
+    if(!d) {
+        return false;
+    }
+    bool ok = true;
+    std::string path;
+    while(struct dirent* e = readdir(d)) {
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        path = dir + "/" + e->d_name;
+        c->add(path.data(), path.size());
+        if(c->m_count > (size_t)negative_cache::MAX_ENTRIES) {
+            ok = false;
+            break;
+        }
+        bool is_dir = e->d_type == DT_DIR;
+        if(e->d_type == DT_LNK || e->d_type == DT_UNKNOWN) {
+            // 指向目录的符号链接：下面的文件url能访问到，但是监视不到变化，整个站点不下结论
+            struct stat st;
+            if(stat((c->root() + path).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                if(e->d_type == DT_LNK) {
+                    ok = false;
+                    break;
+                }
+                struct stat lst;
+                if(lstat((c->root() + path).c_str(), &lst) != 0 || !S_ISDIR(lst.st_mode)) {
+                    ok = false;
+                    break;
+                }
+                is_dir = true;
+            }
+        }
+        if(is_dir && !walk(c, path, depth + 1)) {
+            ok = false;
+            break;
+        }
+    }
+    closedir(d);
+    return ok;
+}
+
+void negative_watch::build(negative_cache* c) {
+    c->start_build();
+    bool ok = walk(c, "", 0);
+    c->finish_build(ok);
+    if(!ok) {
+        printf("站点 %s 的文件太多或者没法完整监视，不缓存不存在的路径\n", c->root().c_str());
+    }
+}
+
+// 说不清的变化：所有监视都去掉，所有站点从头扫描
+void negative_watch::rebuild_all() {
+    for(std::unordered_map<int, std::vector<watch> >::iterator it = m_watches.begin(); it != m_watches.end(); ++it) {
+        inotify_rm_watch(m_fd, it->first);
+    }
+    m_watches.clear();
+    for(size_t i = 0; i < m_caches.size(); i++) {
+        build(m_caches[i]);
+    }
+}
+
+void negative_watch::drain() {
+    alignas(struct inotify_event) char buf[16384];
+    bool rebuild = false;
+    while(true) {
+        ssize_t n = read(m_fd, buf, sizeof(buf));
+        if(n <= 0) {
+            break;
+        }
+        for(char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if(ev->mask & (IN_Q_OVERFLOW | IN_MOVE_SELF)) {
+                // 丢了事件，或者监视着的目录换了地方，记着的相对路径都不对了
+                rebuild = true;
+                continue;
+            }
+            std::unordered_map<int, std::vector<watch> >::iterator it = m_watches.find(ev->wd);
+            if(it == m_watches.end()) {
+                continue;
+            }
+            if(ev->mask & IN_IGNORED) {
+                m_watches.erase(it);
+                continue;
+            }
+            // 拷一份：扫描新目录时会往m_watches里插入
+            std::vector<watch> owners = it->second;
+            for(size_t i = 0; i < owners.size(); i++) {
+                negative_cache* c = owners[i].cache;
+                if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    std::string path = owners[i].dir + "/" + ev->name;
+                    c->add(path.data(), path.size());
+                    if((ev->mask & IN_ISDIR) && !walk(c, path, 0)) {
+                        c->disable();
+                    }
+                }
+                if(ev->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)) {
+                    c->invalidate();
+                }
+                rebuild = rebuild || c->overfull();
+            }
+        }
+    }
+    if(rebuild) {
+        rebuild_all();
+    }
+}
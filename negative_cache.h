@@ -0,0 +1,118 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<vector>
+#include<atomic>
+#include<unordered_map>
+#include"locker.h"
+
+
+// 站点根目录下确定不存在的路径
+// 扫描器的请求（/wp-admin、/.env之类）每个都要在工作线程里拼路径、stat一次，最后回404。
+// 启动时把根目录下所有文件和目录的url放进一个布隆过滤器，不在过滤器里的url一定不存在；
+// 过滤器误判的url，再用一个有界的集合记下最近stat过、确实不存在的。
+// 主线程read()之后先看一眼请求，确定不存在的GET直接回预先生成好的404，不进线程池，也不碰文件系统。
+// 只对规范的url下结论：带//、/./、/../的照常交给工作线程。根目录里有指向目录的符号链接、
+// 打不开的目录、文件太多或者inotify监视不过来的站点不建，全部照常处理。
+class negative_cache {
+public:
+    static const int MAX_ENTRIES = 1 << 20;     // 根目录下的文件和目录超过这么多就不建
+    static const int MAX_DEPTH = 32;            // 目录最多的层数
+    static const int MISS_SLOTS = 1024;         // 未命中集合的槽数，按url的哈希直接映射，新的覆盖旧的
+    static const int MISS_URL_LEN = 116;        // 更长的url不进未命中集合
+
+    // max_url：根目录拼上url之后不会被截断的最长url；site_headers：站点附加的响应头，404里也要带上
+    negative_cache(const std::string& root, size_t max_url, const std::string& site_headers);
+    ~negative_cache();
+
+    const std::string& root() const { return m_root; }
+
+    // 主线程：url（到请求行里的空格为止，可以带查询串）确定不存在时返回true
+    bool missing(const char* url, size_t len);
+
+    // 工作线程：stat之前取一次generation，stat确认不存在之后把url记进未命中集合；
+    // 这期间根目录下有了新文件，generation变了，就不记
+    uint32_t generation() const { return m_gen.load(std::memory_order_acquire); }
+    void note_miss(const char* url, uint32_t gen);
+
+    // 预先生成好的404，和工作线程生成的一字不差
+    const std::string& response(bool keepalive) const { return keepalive ? m_resp_keepalive : m_resp_close; }
+
+private:
+    friend class negative_watch;
+
+    struct miss_slot {
+        uint32_t gen;               // 0表示空槽，和m_gen不同的是作废了的
+        uint16_t len;
+        char url[MISS_URL_LEN];
+    };
+
+    static uint64_t hash(const char* s, size_t n);
+    static bool canonical(const char* url, size_t len);
+
+    // 下面由negative_watch在主线程里调用
+    void start_build();                 // 清空，开始扫描根目录
+    void finish_build(bool ok);         // 扫描完：按个数建过滤器
+    void add(const char* path, size_t len);     // 根目录下有了这个路径（相对根目录，/开头）
+    void insert(uint64_t h);                    // 在过滤器里置位
+    void invalidate() { m_gen.fetch_add(1, std::memory_order_acq_rel); }    // 有了新文件，未命中集合作废
+    void disable() { m_enabled = false; }
+    bool overfull() const { return m_enabled && m_count > m_capacity; }     // 新文件太多，误判率上去了，要重建
+
+private:
+    std::string m_root;
+    size_t m_max_url;
+    bool m_enabled;                     // 过滤器建好了，可以下结论
+    std::vector<uint64_t> m_building;   // 扫描期间先记下哈希，扫完知道个数再建过滤器
+    std::vector<uint64_t> m_bits;       // 布隆过滤器
+    uint64_t m_bit_mask;
+    size_t m_count;                     // 根目录下扫描到、新建的路径数
+    size_t m_capacity;                  // 过滤器按这么多路径设计，超过了重建
+    std::atomic<uint32_t> m_gen;        // 未命中集合的版本
+    locker m_lock;                      // 保护m_slots：工作线程写，主线程读
+    miss_slot* m_slots;
+    std::string m_resp_keepalive;
+    std::string m_resp_close;
+};
+
+
+// 用inotify监视所有站点根目录下的每个目录：有文件新建、移入时把它加进过滤器并让未命中集合作废，
+// 新建的目录接着扫描、监视；目录被移动、事件队列溢出这类说不清的变化就全部重建。
+// 每个进程一份，在reactor里初始化，inotify的fd注册在主循环的epoll里，事件由主线程处理。
+class negative_watch {
+public:
+    static const int MAX_WATCHES = 65536;       // 所有站点加起来最多监视的目录数
+
+    negative_watch();
+
+    // 给每个站点建负缓存并开始监视，inotify不可用时返回false（站点都不建）
+    bool init(int epollfd);
+
+    int notify_fd() const { return m_fd; }
+
+    // 主线程：inotify的fd可读了
+    void drain();
+
+private:
+    struct watch {
+        negative_cache* cache;
+        std::string dir;                // 相对根目录，根目录本身是空串
+    };
+
+    bool walk(negative_cache* c, const std::string& dir, int depth);
+    void build(negative_cache* c);
+    void rebuild_all();
+
+private:
+    int m_fd;
+    std::vector<negative_cache*> m_caches;
+    std::unordered_map<int, std::vector<watch> > m_watches;    // 同一个目录可能属于根目录重叠的几个站点
+};
+
+extern negative_watch http_missing;
+
+
+#endif
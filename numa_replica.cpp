@@ -0,0 +1,389 @@
+#include"numa_replica.h"
+#include"http_conn.h"
+#include"threadpool.h"
+#include<stdio.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sched.h>
+#include<time.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<linux/mempolicy.h>
+#include<memory>
+
+numa_replicas http_replicas;
+
+static const char* NODE_DIR = "/sys/devices/system/node";
+
+// "0-3,8-11"这样的列表
+static bool read_list(const char* path, std::vector<int>& out) {
+    FILE* fp = fopen(path, "r");
+    if(!fp) {
+        return false;
+    }
+    char buf[4096];
+    bool ok = fgets(buf, sizeof(buf), fp) != NULL;
+    fclose(fp);
+    if(!ok) {
+        return false;
+    }
+    char* p = buf;
+    while(*p >= '0' && *p <= '9') {
+        long lo = strtol(p, &p, 10);
+        long hi = lo;
+        if(*p == '-') {
+            hi = strtol(p + 1, &p, 10);
+        }
+        for(long i = lo; i <= hi && i < 4096; i++) {
+            out.push_back((int)i);
+        }
+        if(*p == ',') {
+            p++;
+        }
+    }
+    return !out.empty();
+}
+
+static uint32_t now_second() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+numa_replicas::numa_replicas() : m_budget(0), m_max_file(0), m_used(0), m_hot(NULL) {
+}
+
+bool numa_replicas::init(size_t node_budget) {
+    if(node_budget == 0) {
+        return false;
+    }
+    std::vector<int> nodes;
+    char path[128];
+    snprintf(path, sizeof(path), "%s/online", NODE_DIR);
+    if(!read_list(path, nodes) || nodes.size() < 2 || nodes.back() >= MAX_NODES) {
+        return false;
+    }
+    m_nodes = nodes;
+    for(size_t i = 0; i < m_nodes.size(); i++) {
+        std::vector<int> cpus;
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", NODE_DIR, m_nodes[i]);
+        read_list(path, cpus);      // 没有CPU的节点（只有内存）列表是空的
+        for(size_t j = 0; j < cpus.size(); j++) {
+            if(cpus[j] >= (int)m_cpu_node.size()) {
+                m_cpu_node.resize(cpus[j] + 1, 0);
+            }
+            m_cpu_node[cpus[j]] = (int)i;
+        }
+    }
+    // 先在每个节点上试一页，容器里常常没有权限
+    long page = sysconf(_SC_PAGESIZE);
+    for(size_t i = 0; i < m_nodes.size(); i++) {
+        char* p = alloc_on((int)i, page);
+        if(!p) {
+            printf("mbind不可用（%s），不在各个NUMA节点上复制热文件\n", strerror(errno));
+            m_nodes.clear();
+            m_cpu_node.clear();
+            return false;
+        }
+        munmap(p, page);
+    }
+    m_hot = new hot_slot[HOT_SLOTS]();
+    m_max_file = node_budget / 4 < MAX_FILE ? node_budget / 4 : MAX_FILE;
+    m_budget = node_budget;
+    return true;
+}
+
+// 匿名映射，页还没分配时设好策略，之后第一次写到哪一页就在那个节点上分配
+char* numa_replicas::alloc_on(int node, size_t len) {
+    void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        return NULL;
+    }
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    int id = m_nodes[node];
+    mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+    if(syscall(SYS_mbind, p, len, MPOL_BIND, mask, (unsigned long)MAX_NODES + 1, 0) != 0) {
+        int err = errno;
+        munmap(p, len);
+        errno = err;
+        return NULL;
+    }
+    return (char*)p;
+}
+
+uint64_t numa_replicas::hash(const char* s, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool numa_replicas::same_file(const replica_entry* e, const struct stat& st) {
+    return e->ino == (uint64_t)st.st_ino && e->size == (uint64_t)st.st_size &&
+           e->mtime_ns == st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+int numa_replicas::local_node() const {
+    int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < (int)m_cpu_node.size() ? m_cpu_node[cpu] : 0;
+}
+
+const char* numa_replicas::acquire(const char* path, const struct stat& st, replica_entry** handle) {
+    size_t len = strlen(path);
+    uint64_t h = hash(path, len);
+    shard& s = shard_of(h);
+    s.lock.lock();
+    std::unordered_map<uint64_t, replica_entry*>::iterator it = s.entries.find(h);
+    if(it != s.entries.end()) {
+        replica_entry* e = it->second;
+        if(e->path.size() == len && memcmp(e->path.data(), path, len) == 0) {
+            if(same_file(e, st)) {
+                e->refs.fetch_add(1, std::memory_order_relaxed);
+                s.lock.unlock();
+                e->hits.fetch_add(1, std::memory_order_relaxed);
+                *handle = e;
+                return e->copies[local_node()];
+            }
+            remove(s, e);       // 文件改过了，等它再热起来重新复制
+        }
+    }
+    s.lock.unlock();
+    if(eligible(st)) {
+        note_access(path, len, h, st);
+    }
+    return NULL;
+}
+
+void numa_replicas::release(replica_entry* e) {
+    if(e->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        destroy(e);
+    }
+}
+
+void numa_replicas::destroy(replica_entry* e) {
+    for(size_t i = 0; i < e->copies.size(); i++) {
+        munmap(e->copies[i], e->map_len);
+    }
+    delete e;
+}
+
+void numa_replicas::remove(shard& s, replica_entry* e) {
+    s.entries.erase(hash(e->path.data(), e->path.size()));
+    m_used.fetch_sub(e->map_len, std::memory_order_relaxed);
+    release(e);     // 表的那个引用，正在发送的连接发完才真正释放
+}
+
+uint32_t numa_replicas::count(uint64_t h) {
+    hot_slot& slot = m_hot[(h >> 32) & (HOT_SLOTS - 1)];
+    uint32_t sec = now_second();
+    if(slot.second.load(std::memory_order_relaxed) != sec) {
+        // 新的一秒，并发的线程可能各清一次，少算几次无所谓
+        slot.second.store(sec, std::memory_order_relaxed);
+        slot.hits.store(0, std::memory_order_relaxed);
+    }
+    return slot.hits.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+bool numa_replicas::cacheable(const char* path, const struct stat& st, uint64_t* key) {
+    *key = 0;
+    if(!eligible(st)) {
+        return true;
+    }
+    size_t len = strlen(path);
+    uint64_t h = hash(path, len);
+    shard& s = shard_of(h);
+    s.lock.lock();
+    bool present = s.entries.count(h) > 0;
+    s.lock.unlock();
+    // 复制是线程池里的后台任务，刚安排的这一两秒里也不放，免得又把它挡在缓存后面
+    uint32_t scheduled = m_hot[(h >> 32) & (HOT_SLOTS - 1)].scheduled.load(std::memory_order_relaxed);
+    if(present || now_second() - scheduled <= 1) {
+        return false;
+    }
+    *key = h | 1;       // 0留给不能复制的文件，最低位不影响槽的选择
+    return true;
+}
+
+bool numa_replicas::count_cached(uint64_t key) {
+    return count(key) == HOT_HITS;
+}
+
+// 一秒里访问够HOT_HITS次就安排复制，一秒里一个槽最多安排一次；
+// 命中缓存的访问也计过数，缓存里的那一份去掉之后走到这里的第一个请求就安排
+void numa_replicas::note_access(const char* path, size_t len, uint64_t h, const struct stat& st) {
+    if(count(h) < HOT_HITS || !http_workers) {
+        return;
+    }
+    hot_slot& slot = m_hot[(h >> 32) & (HOT_SLOTS - 1)];
+    uint32_t sec = now_second();
+    uint32_t last = slot.scheduled.load(std::memory_order_relaxed);
+    if(last == sec || !slot.scheduled.compare_exchange_strong(last, sec, std::memory_order_relaxed)) {
+        return;
+    }
+    // 路径放在堆上，任务的捕获放得进task里；队列满了任务被丢掉时跟着释放
+    std::unique_ptr<std::string> p(new std::string(path, len));
+    uint64_t ino = st.st_ino;
+    uint64_t size = st.st_size;
+    int64_t mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    http_workers->submit([this, p = std::move(p), ino, size, mtime_ns]() {
+        promote(*p, ino, size, mtime_ns, HOT_HITS);
+    }, PRIO_BULK);
+}
+
+// 后台任务：读文件，在每个节点上各复制一份，放进表里
+void numa_replicas::promote(const std::string& path, uint64_t ino, uint64_t size, int64_t mtime_ns, uint32_t rate) {
+    uint64_t h = hash(path.data(), path.size());
+    shard& s = shard_of(h);
+    s.lock.lock();
+    bool present = s.entries.count(h) > 0;
+    s.lock.unlock();
+    if(present) {
+        return;
+    }
+
+    m_promote_lock.lock();
+    long page = sysconf(_SC_PAGESIZE);
+    size_t map_len = (size + page - 1) / page * page;
+    if(!make_room(map_len, rate)) {
+        m_promote_lock.unlock();
+        return;     // 放着的都比它热
+    }
+    m_used.fetch_add(map_len, std::memory_order_relaxed);   // 先占上，失败了还回去
+
+    replica_entry* e = new replica_entry;
+    e->path = path;
+    e->ino = ino;
+    e->size = size;
+    e->mtime_ns = mtime_ns;
+    e->map_len = map_len;
+    e->refs.store(1, std::memory_order_relaxed);
+    e->hits.store(0, std::memory_order_relaxed);
+    e->since = e->born = now_second();
+    bool ok = true;
+    for(size_t i = 0; i < m_nodes.size() && ok; i++) {
+        char* p = alloc_on((int)i, map_len);
+        if(!p) {
+            ok = false;
+            break;
+        }
+        e->copies.push_back(p);
+        if(i == 0) {
+            // 第一份从文件读，读的过程中页分配在第一个节点上；读完核对文件没被换掉
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            size_t got = 0;
+            if(fd >= 0) {
+                while(got < size) {
+                    ssize_t n = pread(fd, p + got, size - got, got);
+                    if(n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if(n <= 0) {
+                        break;
+                    }
+                    got += n;
+                }
+                ok = got == size && fstat(fd, &st) == 0 && (uint64_t)st.st_ino == ino &&
+                     (uint64_t)st.st_size == size && st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == mtime_ns;
+                close(fd);
+            }else {
+                ok = false;
+            }
+        }else {
+            memcpy(p, e->copies[0], size);
+        }
+    }
+    if(!ok) {
+        m_used.fetch_sub(map_len, std::memory_order_relaxed);
+        m_promote_lock.unlock();
+        destroy(e);
+        return;
+    }
+    for(size_t i = 0; i < e->copies.size(); i++) {
+        mprotect(e->copies[i], map_len, PROT_READ);
+    }
+
+    s.lock.lock();
+    std::unordered_map<uint64_t, replica_entry*>::iterator it = s.entries.find(h);
+    if(it != s.entries.end()) {
+        remove(s, it->second);      // 哈希撞上了别的路径，或者这期间又复制了一份
+    }
+    s.entries[h] = e;
+    s.lock.unlock();
+    m_promote_lock.unlock();
+}
+
+// 预算不够时，一个一个淘汰每秒命中最少的副本，直到放得下；最冷的也不比新来的冷就放弃。
+// 命中数和挑选的间隔无关，按计数开始以来经过的秒数折算成每秒的命中率；刚复制好的副本还没攒下命中，MIN_AGE秒内不参与。
+// 挑选过之后命中数和经过的时间各减半，命中率不变，以后的命中占的分量更大，很久以前热过的副本慢慢让位
+bool numa_replicas::make_room(size_t len, uint32_t rate) {
+    if(len > m_budget) {
+        return false;
+    }
+    bool ok = true;
+    bool scanned = false;
+    while(m_used.load(std::memory_order_relaxed) + len > m_budget) {
+        // 只记下哈希，解锁之后别的线程可能因为文件改过已经把它拿掉、释放了
+        int victim_shard = -1;
+        uint64_t victim_key = 0;
+        const replica_entry* victim = NULL;
+        uint32_t victim_rate = 0;
+        uint32_t now = now_second();
+        for(int i = 0; i < SHARDS; i++) {
+            m_shards[i].lock.lock();
+            std::unordered_map<uint64_t, replica_entry*>::iterator it;
+            for(it = m_shards[i].entries.begin(); it != m_shards[i].entries.end(); ++it) {
+                const replica_entry* e = it->second;
+                if(now - e->born < MIN_AGE) {
+                    continue;
+                }
+                uint32_t elapsed = now - e->since;
+                uint32_t n = e->hits.load(std::memory_order_relaxed) / (elapsed ? elapsed : 1);
+                if(!victim || n < victim_rate) {
+                    victim = e;
+                    victim_key = it->first;
+                    victim_rate = n;
+                    victim_shard = i;
+                }
+            }
+            m_shards[i].lock.unlock();
+        }
+        scanned = true;
+        if(!victim || victim_rate >= rate) {
+            ok = false;
+            break;
+        }
+        shard& s = m_shards[victim_shard];
+        s.lock.lock();
+        std::unordered_map<uint64_t, replica_entry*>::iterator it = s.entries.find(victim_key);
+        if(it != s.entries.end() && it->second == victim) {
+            remove(s, it->second);
+        }
+        s.lock.unlock();
+    }
+    if(scanned) {
+        uint32_t now = now_second();
+        for(int i = 0; i < SHARDS; i++) {
+            m_shards[i].lock.lock();
+            std::unordered_map<uint64_t, replica_entry*>::iterator it;
+            for(it = m_shards[i].entries.begin(); it != m_shards[i].entries.end(); ++it) {
+                replica_entry* e = it->second;
+                uint32_t elapsed = now - e->since;
+                if(elapsed >= 2) {
+                    // 并发的命中在读和写之间可能丢几次，无所谓
+                    e->hits.store(e->hits.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+                    e->since = now - elapsed / 2;
+                }
+            }
+            m_shards[i].lock.unlock();
+        }
+    }
+    return ok;
+}
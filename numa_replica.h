@@ -0,0 +1,108 @@
+#ifndef NUMA_REPLICA_H
+#define NUMA_REPLICA_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<atomic>
+#include<string>
+#include<vector>
+#include<unordered_map>
+#include<sys/stat.h>
+#include"locker.h"
+
+
+// 一个热文件在每个NUMA节点上的副本
+struct replica_entry {
+    std::string path;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    size_t map_len;                 // 每份副本映射的长度，按页对齐
+    std::vector<char*> copies;      // 下标是节点的序号，内存用mbind绑在那个节点上
+    std::atomic<int> refs;          // 表本身持有一个，每个正在发送它的连接各持有一个
+    std::atomic<uint32_t> hits;     // 从since开始的命中次数，除以经过的秒数就是命中率
+    uint32_t since;                 // 计数从哪一秒开始，持m_promote_lock修改
+    uint32_t born;                  // 复制好的那一秒
+};
+
+
+// 多路服务器上热文件的节点本地副本
+// 文件页缓存、响应缓存里的数据都只有一份，落在第一次读它的线程所在的节点上，另一个插槽上的工作线程发送时
+// 每个字节都要跨节点去读。这里按访问频率挑出热文件，在每个节点上各复制一份，内存用mbind绑定在那个节点上，
+// 工作线程按自己当前所在的CPU取本节点的副本发送。每个节点有自己的内存预算，所有节点上放的是同一组文件。
+// 访问计数按路径的哈希放在一张定长的表里，每秒清零；一秒内被访问HOT_HITS次的文件交给线程池的后台任务复制，
+// 预算不够时淘汰每秒命中最少、并且比它冷的副本，刚复制好MIN_AGE秒以内的不淘汰。新鲜度和共享内存文件缓存一样靠每个请求的stat。
+// 已经有副本、或者已经安排了复制的文件不再放进响应缓存（缓存里只有一份），由共享内存文件缓存、mmap和这里的副本发送；
+// 其余的照常放进缓存，命中缓存时也计数，够热了就把缓存里的那一份去掉，下一个请求走到这里安排复制。
+// 只有一个节点、或者mbind不可用（比如容器里没有权限）时不启用，请求照常走原来的路径。
+class numa_replicas {
+public:
+    static const int MAX_NODES = 64;
+    static const int SHARDS = 16;
+    static const int HOT_SLOTS = 4096;              // 访问计数表的槽数，2的幂
+    static const uint32_t HOT_HITS = 32;            // 一秒内访问这么多次的文件复制到各个节点
+    static const uint32_t MIN_AGE = 5;              // 新副本至少保留这么多秒，命中率攒起来之前不拿它和别人比
+    static const size_t MAX_FILE = 8 << 20;         // 超过这么大的文件不复制，也不超过预算的1/4
+
+    numa_replicas();
+
+    // node_budget是每个节点上副本的总大小，机器只有一个节点、预算为0或者mbind不可用时返回false
+    bool init(size_t node_budget);
+    bool enabled() const { return m_budget > 0; }
+    int nodes() const { return (int)m_nodes.size(); }
+
+    // 这个大小的文件会按访问频率复制到各个节点
+    bool eligible(const struct stat& st) const { return m_budget > 0 && st.st_size > 0 && (size_t)st.st_size <= m_max_file; }
+
+    // 工作线程：path在本节点上的副本，元数据要和st一致。命中返回文件内容，handle用来release；
+    // 没有副本时记一次访问，够热了就安排复制，返回NULL
+    const char* acquire(const char* path, const struct stat& st, replica_entry** handle);
+
+    static void release(replica_entry* e);
+
+    // 响应缓存能不能放这个文件：已经有副本或者刚安排了复制的不放。能放时key是命中缓存时计数用的键，不能复制的文件为0
+    bool cacheable(const char* path, const struct stat& st, uint64_t* key);
+
+    // 命中缓存的可复制文件记一次访问，够热了返回true，调用者把缓存里的那一份去掉
+    bool count_cached(uint64_t key);
+
+private:
+    struct hot_slot {
+        std::atomic<uint32_t> second;       // 计数属于哪一秒
+        std::atomic<uint32_t> hits;
+        std::atomic<uint32_t> scheduled;    // 上一次安排复制是哪一秒
+    };
+
+    struct shard {
+        locker lock;
+        std::unordered_map<uint64_t, replica_entry*> entries;     // 按路径的哈希，撞上了算没命中
+    };
+
+    static uint64_t hash(const char* s, size_t n);
+    static bool same_file(const replica_entry* e, const struct stat& st);
+    static void destroy(replica_entry* e);
+
+    int local_node() const;
+    shard& shard_of(uint64_t h) { return m_shards[h & (SHARDS - 1)]; }
+    uint32_t count(uint64_t h);         // 访问计数加一，返回这一秒里的次数
+    void note_access(const char* path, size_t len, uint64_t h, const struct stat& st);
+    void promote(const std::string& path, uint64_t ino, uint64_t size, int64_t mtime_ns, uint32_t rate);
+    char* alloc_on(int node, size_t len);       // 按节点绑定的匿名内存
+    bool make_room(size_t len, uint32_t rate);  // 持m_promote_lock调用：淘汰每秒命中比rate少的副本直到放得下
+    void remove(shard& s, replica_entry* e);    // 持分片锁调用：从表里拿掉，预算还回去
+
+private:
+    size_t m_budget;                    // 每个节点的预算，0表示不启用
+    size_t m_max_file;
+    std::vector<int> m_nodes;           // 在线的节点号，下标就是副本的序号
+    std::vector<int> m_cpu_node;        // CPU号到节点序号
+    std::atomic<size_t> m_used;         // 每个节点上已经用掉的（所有节点都一样）
+    shard m_shards[SHARDS];
+    hot_slot* m_hot;
+    locker m_promote_lock;              // 复制、淘汰串行进行
+};
+
+extern numa_replicas http_replicas;
+
+
+#endif
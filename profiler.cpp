@@ -0,0 +1,448 @@
+#include"profiler.h"
+#include"router.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<signal.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<time.h>
+#include<sched.h>
+#include<sys/time.h>
+#include<ucontext.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/socket.h>
+#include<arpa/inet.h>
+#include<execinfo.h>
+#include<dlfcn.h>
+#include<link.h>
+#include<elf.h>
+#include<cxxabi.h>
+#include<algorithm>
+#include<map>
+#include<unordered_map>
+#include<vector>
+
+sampling_profiler http_profiler;
+
+// 这个线程登记的槽，-1表示没有登记
+static thread_local int profile_slot = -1;
+
+static const char* stage_names[STAGE_COUNT] = { "other", "read", "parse", "do_request", "write" };
+
+
+sampling_profiler::sampling_profiler() : m_interval(0), m_bufs(0), m_running(false), m_active(false), m_inside(0), m_dropped(0) {
+    memset(m_slots, 0, sizeof(m_slots));
+}
+
+void sampling_profiler::attach_thread() {
+    m_lock.lock();
+    for(int i = 0; i < MAX_THREADS; i++) {
+        if(!m_slots[i].used) {
+            thread_slot& t = m_slots[i];
+            t.used   = true;
+            t.tid    = gettid();
+            t.thread = pthread_self();
+            t.armed  = false;
+            profile_slot = i;
+            if(m_interval) {
+                // 采样期间新起的线程（线程池扩容）也加进来
+                arm(t);
+            }
+            break;
+        }
+    }
+    m_lock.unlock();
+}
+
+void sampling_profiler::detach_thread() {
+    if(profile_slot < 0) {
+        return;
+    }
+    m_lock.lock();
+    disarm(m_slots[profile_slot]);
+    m_slots[profile_slot].used = false;
+    m_lock.unlock();
+    profile_slot = -1;
+}
+
+// 定时器按这个线程消耗的CPU时间走，到点把SIGPROF送给这个线程本身，不会落到别的线程上
+bool sampling_profiler::arm(thread_slot& t) {
+    clockid_t clock;
+    if(pthread_getcpuclockid(t.thread, &clock) != 0) {
+        return false;
+    }
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo  = SIGPROF;
+    ev._sigev_un._tid = t.tid;
+    if(timer_create(clock, &ev, &t.timer) != 0) {
+        printf("创建采样定时器失败：%s\n", strerror(errno));
+        return false;
+    }
+    // hz=1时间隔正好是一秒，tv_nsec必须小于10亿
+    struct itimerspec spec;
+    spec.it_interval.tv_sec  = m_interval / 1000000000L;
+    spec.it_interval.tv_nsec = m_interval % 1000000000L;
+    spec.it_value = spec.it_interval;
+    if(timer_settime(t.timer, 0, &spec, NULL) != 0) {
+        printf("启动采样定时器失败：%s\n", strerror(errno));
+        timer_delete(t.timer);
+        return false;
+    }
+    t.armed = true;
+    return true;
+}
+
+void sampling_profiler::disarm(thread_slot& t) {
+    if(t.armed) {
+        timer_delete(t.timer);
+        t.armed = false;
+    }
+}
+
+// 信号打断的那条指令的地址
+static void* interrupted_pc(void* context) {
+    ucontext_t* uc = (ucontext_t*)context;
+#if defined(__x86_64__)
+    return (void*)uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+    return (void*)uc->uc_mcontext.pc;
+#else
+    return NULL;
+#endif
+}
+
+void sampling_profiler::on_signal(int sig, siginfo_t* info, void* context) {
+    int saved = errno;
+    http_profiler.record(context);
+    errno = saved;
+}
+
+// 信号处理函数里执行：只用原子操作和backtrace（第一次调用已经在run里做过，不会再加载libgcc、分配内存）
+void sampling_profiler::record(void* context) {
+    m_inside.fetch_add(1, std::memory_order_acquire);
+    int slot = profile_slot;
+    if(m_active.load(std::memory_order_acquire) && slot >= 0) {
+        thread_buf& b = m_bufs[slot];
+        int n = b.count.load(std::memory_order_relaxed);
+        if(n < THREAD_SAMPLES) {
+            sample& s = b.samples[n];
+            s.stage = profile_current_stage;
+            s.depth = backtrace(s.pc, MAX_DEPTH);
+            // 前面几帧是信号处理函数自己和内核放的信号返回跳板，从被打断的指令开始保留
+            void* pc = interrupted_pc(context);
+            int skip = 0;
+            while(pc && skip < s.depth && s.pc[skip] != pc) {
+                skip++;
+            }
+            if(pc && skip == s.depth) {
+                s.pc[0] = pc;
+                s.depth = 1;
+            }else if(skip > 0) {
+                memmove(s.pc, s.pc + skip, (s.depth - skip) * sizeof(void*));
+                s.depth -= skip;
+            }
+            b.count.store(n + 1, std::memory_order_release);
+        }else {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    m_inside.fetch_sub(1, std::memory_order_release);
+}
+
+int sampling_profiler::run(int seconds, int hz, std::string& out, size_t* samples, size_t* dropped) {
+    bool expected = false;
+    if(!m_running.compare_exchange_strong(expected, true)) {
+        return PROFILE_BUSY;
+    }
+    if(!m_bufs) {
+        // 几十兆的虚拟内存，只有真正写过样本的页才占物理内存
+        void* p = mmap(NULL, sizeof(thread_buf) * MAX_THREADS, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(p == MAP_FAILED) {
+            m_running.store(false);
+            return PROFILE_FAILED;
+        }
+        m_bufs = (thread_buf*)p;
+        void* warm[4];
+        backtrace(warm, 4);
+
+        // SA_RESTART：被打断的socket读写、accept自动重来。处理函数装上之后一直保留，关掉之后迟到的信号也无害
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_signal;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, NULL);
+    }
+    m_dropped.store(0);
+
+    m_lock.lock();
+    for(int i = 0; i < MAX_THREADS; i++) {
+        m_bufs[i].count.store(0, std::memory_order_relaxed);
+    }
+    m_active.store(true, std::memory_order_release);
+    m_interval = 1000000000L / hz;
+    int armed = 0;
+    for(int i = 0; i < MAX_THREADS; i++) {
+        if(m_slots[i].used && arm(m_slots[i])) {
+            armed++;
+        }
+    }
+    if(armed == 0) {
+        m_interval = 0;
+        m_active.store(false, std::memory_order_release);
+        m_lock.unlock();
+        m_running.store(false);
+        return PROFILE_FAILED;
+    }
+    m_lock.unlock();
+
+    struct timespec left = { seconds, 0 };
+    while(nanosleep(&left, &left) != 0 && errno == EINTR) {
+    }
+
+    m_lock.lock();
+    for(int i = 0; i < MAX_THREADS; i++) {
+        disarm(m_slots[i]);
+    }
+    m_interval = 0;
+    m_active.store(false, std::memory_order_release);
+    m_lock.unlock();
+    // 已经进了处理函数的线程写完这个样本
+    while(m_inside.load(std::memory_order_acquire) != 0) {
+        sched_yield();
+    }
+
+    fold(out, samples);
+    *dropped = m_dropped.load();
+    m_running.store(false);
+    return PROFILE_OK;
+}
+
+
+// 把地址换成函数名。可执行文件里的函数大多不在动态符号表里（没有-rdynamic），dladdr查不到，
+// 直接读/proc/self/exe的.symtab；共享库里的用dladdr
+class symbolizer {
+public:
+    symbolizer() : m_base(0) {
+        dl_iterate_phdr(find_base, &m_base);
+        load("/proc/self/exe");
+    }
+
+    std::string name(void* pc) {
+        uintptr_t addr = (uintptr_t)pc;
+        std::unordered_map<uintptr_t, std::string>::iterator it = m_cache.find(addr);
+        if(it != m_cache.end()) {
+            return it->second;
+        }
+        std::string result;
+        uintptr_t rel = addr - m_base;
+        std::vector<symbol>::iterator s = std::upper_bound(m_symbols.begin(), m_symbols.end(), rel,
+                [](uintptr_t a, const symbol& sym) { return a < sym.addr; });
+        if(s != m_symbols.begin() && rel < (s - 1)->addr + (s - 1)->size) {
+            result = demangle((s - 1)->name.c_str());
+        }else {
+            Dl_info info;
+            memset(&info, 0, sizeof(info));
+            if(dladdr(pc, &info) && info.dli_sname) {
+                result = demangle(info.dli_sname);
+            }else if(info.dli_fname && info.dli_fname[0]) {
+                const char* base = strrchr(info.dli_fname, '/');
+                char buf[64];
+                snprintf(buf, sizeof(buf), "+0x%lx", (unsigned long)(addr - (uintptr_t)info.dli_fbase));
+                result = std::string("[") + (base ? base + 1 : info.dli_fname) + buf + "]";
+            }else {
+                char buf[32];
+                snprintf(buf, sizeof(buf), "[0x%lx]", (unsigned long)addr);
+                result = buf;
+            }
+        }
+        m_cache[addr] = result;
+        return result;
+    }
+
+private:
+    struct symbol {
+        uintptr_t addr;
+        uintptr_t size;
+        std::string name;
+        bool operator<(const symbol& o) const { return addr < o.addr; }
+    };
+
+    // 第一个对象就是可执行文件，dlpi_addr是它的加载偏移（不是PIE时为0）
+    static int find_base(struct dl_phdr_info* info, size_t size, void* data) {
+        *(uintptr_t*)data = info->dlpi_addr;
+        return 1;
+    }
+
+    void load(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            return;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr)) {
+            close(fd);
+            return;
+        }
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED) {
+            return;
+        }
+        const char* base = (const char*)map;
+        const Elf64_Ehdr* eh = (const Elf64_Ehdr*)base;
+        if(memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0 && eh->e_ident[EI_CLASS] == ELFCLASS64 &&
+           eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) <= (uint64_t)st.st_size) {
+            const Elf64_Shdr* sh = (const Elf64_Shdr*)(base + eh->e_shoff);
+            for(int i = 0; i < eh->e_shnum; i++) {
+                if(sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum) {
+                    continue;
+                }
+                const Elf64_Sym* syms = (const Elf64_Sym*)(base + sh[i].sh_offset);
+                const char* strs = base + sh[sh[i].sh_link].sh_offset;
+                size_t n = sh[i].sh_size / sizeof(Elf64_Sym);
+                for(size_t j = 0; j < n; j++) {
+                    if(ELF64_ST_TYPE(syms[j].st_info) == STT_FUNC && syms[j].st_value && syms[j].st_size) {
+                        symbol s = { (uintptr_t)syms[j].st_value, (uintptr_t)syms[j].st_size, strs + syms[j].st_name };
+                        m_symbols.push_back(s);
+                    }
+                }
+            }
+        }
+        munmap(map, st.st_size);
+        std::sort(m_symbols.begin(), m_symbols.end());
+    }
+
+    // 还原C++的名字，去掉参数表；分号是folded格式的分隔符，换掉
+    static std::string demangle(const char* mangled) {
+        int status = 0;
+        char* d = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+        std::string s = (status == 0 && d) ? d : mangled;
+        free(d);
+        int depth = 0;
+        for(size_t i = 0; i < s.size(); i++) {
+            if(s[i] == '<') {
+                depth++;
+            }else if(s[i] == '>') {
+                depth--;
+            }else if(s[i] == '(' && depth == 0 && i > 0 && !(i >= 8 && s.compare(i - 8, 8, "operator") == 0)) {
+                s.resize(i);
+                break;
+            }
+        }
+        std::replace(s.begin(), s.end(), ';', ':');
+        return s;
+    }
+
+private:
+    uintptr_t m_base;
+    std::vector<symbol> m_symbols;
+    std::unordered_map<uintptr_t, std::string> m_cache;
+};
+
+void sampling_profiler::fold(std::string& out, size_t* samples) {
+    symbolizer sym;
+    std::map<std::string, size_t> stacks;
+    size_t total = 0;
+    for(int t = 0; t < MAX_THREADS; t++) {
+        int n = m_bufs[t].count.load(std::memory_order_acquire);
+        for(int i = 0; i < n; i++) {
+            const sample& s = m_bufs[t].samples[i];
+            // 被打断的那一帧是精确的地址，更外层的是返回地址，减一落在call指令里
+            std::string line = stage_names[s.stage >= 0 && s.stage < STAGE_COUNT ? s.stage : STAGE_OTHER];
+            for(int d = s.depth - 1; d >= 0; d--) {
+                line += ';';
+                line += sym.name(d == 0 ? s.pc[d] : (char*)s.pc[d] - 1);
+            }
+            stacks[line]++;
+            total++;
+        }
+    }
+    for(std::map<std::string, size_t>::iterator it = stacks.begin(); it != stacks.end(); ++it) {
+        char count[32];
+        snprintf(count, sizeof(count), " %zu\n", it->second);
+        out += it->first;
+        out += count;
+    }
+    *samples = total;
+}
+
+
+// 查询串里name=整数的值，没有返回def
+static int query_int(std::string_view query, const char* name, int def) {
+    size_t len = strlen(name);
+    while(!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view kv = query.substr(0, amp);
+        if(kv.size() > len && kv.compare(0, len, name) == 0 && kv[len] == '=') {
+            return atoi(std::string(kv.substr(len + 1)).c_str());
+        }
+        if(amp == std::string_view::npos) {
+            break;
+        }
+        query.remove_prefix(amp + 1);
+    }
+    return def;
+}
+
+void profile_handler(const request_view& req, response_builder& resp, void* arg) {
+    bool local = req.cred ? (req.cred->uid == 0 || req.cred->uid == geteuid())
+                          : (ntohl(req.peer->sin_addr.s_addr) >> 24) == 127;
+    if(!local) {
+        static const char forbidden[] = "profiling is only available to local clients\n";
+        resp.status(403, "Forbidden");
+        resp.header("Content-Type", "text/plain");
+        resp.header("Cache-Control", "no-store");
+        resp.body(forbidden, sizeof(forbidden) - 1);
+        return;
+    }
+    int seconds = query_int(req.query, "seconds", 5);
+    int hz = query_int(req.query, "hz", 99);
+    if(seconds <= 0 || seconds > sampling_profiler::MAX_SECONDS || hz <= 0 || hz > sampling_profiler::MAX_HZ) {
+        static const char bad[] = "seconds must be 1-60, hz 1-1000\n";
+        resp.status(400, "Bad Request");
+        resp.header("Content-Type", "text/plain");
+        resp.header("Cache-Control", "no-store");
+        resp.body(bad, sizeof(bad) - 1);
+        return;
+    }
+
+    std::string out;
+    size_t samples = 0, dropped = 0;
+    int ret = http_profiler.run(seconds, hz, out, &samples, &dropped);
+    if(ret == PROFILE_BUSY) {
+        static const char busy[] = "another profile is in progress\n";
+        resp.status(503, "Service Unavailable");
+        resp.header("Content-Type", "text/plain");
+        resp.header("Cache-Control", "no-store");
+        resp.body(busy, sizeof(busy) - 1);
+        return;
+    }
+    if(ret == PROFILE_FAILED) {
+        static const char failed[] = "could not start the sampling timers\n";
+        resp.status(500, "Internal Server Error");
+        resp.header("Content-Type", "text/plain");
+        resp.header("Cache-Control", "no-store");
+        resp.body(failed, sizeof(failed) - 1);
+        return;
+    }
+    char value[32];
+    resp.header("Content-Type", "text/plain");
+    resp.header("Cache-Control", "no-store");
+    snprintf(value, sizeof(value), "%zu", samples);
+    resp.header("X-Profile-Samples", value);
+    snprintf(value, sizeof(value), "%zu", dropped);
+    resp.header("X-Profile-Dropped", value);
+    char* body = (char*)malloc(out.size() + 1);
+    if(!body) {
+        return;
+    }
+    memcpy(body, out.data(), out.size());
+    resp.body_owned(body, out.size());
+}
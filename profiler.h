@@ -0,0 +1,108 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<atomic>
+#include<time.h>
+#include<signal.h>
+#include<sys/types.h>
+#include<pthread.h>
+#include"locker.h"
+
+
+// 进程内的采样剖析器，线上机器变慢又不方便挂perf的时候用
+// 通过管理接口按需打开，采样几秒后关掉：给每个登记过的线程建一个按它自己的CPU时间走的定时器，
+// 到点时SIGPROF直接送给这个线程，处理函数在线程自己的缓冲区里记下调用栈和它当前所处的请求阶段，不加锁、不分配内存。
+// 结束后把地址换成函数名，按“阶段;最外层函数;...;最里层函数 次数”的folded格式输出，可以直接交给flamegraph.pl。
+// 不在采样的时候没有定时器也没有信号，只剩各个阶段入口处的一次线程局部变量写入。
+
+
+// 请求处理的阶段，作为火焰图最外层的一帧
+enum PROFILE_STAGE { STAGE_OTHER = 0, STAGE_READ, STAGE_PARSE, STAGE_REQUEST, STAGE_WRITE, STAGE_COUNT };
+
+// 当前线程所处的阶段，信号处理函数在同一个线程上读它
+inline thread_local volatile int profile_current_stage = STAGE_OTHER;
+
+// 进入一个阶段，离开作用域时恢复；嵌套时（解析请求里调用do_request）记最里面的
+class profile_stage {
+public:
+    explicit profile_stage(int stage) : m_saved(profile_current_stage) { profile_current_stage = stage; }
+    ~profile_stage() { profile_current_stage = m_saved; }
+
+private:
+    int m_saved;
+};
+
+
+// 一次采样的结果
+enum PROFILE_RESULT { PROFILE_OK = 0, PROFILE_BUSY, PROFILE_FAILED };
+
+class sampling_profiler {
+public:
+    static const int MAX_SECONDS = 60;      // 一次最多采样的秒数
+    static const int MAX_HZ = 1000;         // 每秒CPU时间最多的采样次数
+    static const int MAX_DEPTH = 48;        // 调用栈最多记录的层数
+    static const int MAX_THREADS = 256;     // 最多登记的线程数，更多的线程不采样
+    static const int THREAD_SAMPLES = 4096; // 每个线程每次采样最多记录的样本数
+
+    sampling_profiler();
+
+    // 线程开始、退出时调用（主循环的线程和线程池的工作线程），只有登记过的线程会被采样
+    void attach_thread();
+    void detach_thread();
+
+    // 采样seconds秒，阻塞调用它的线程，folded格式的结果写到out；已经有一次采样在进行时返回PROFILE_BUSY，
+    // 分配缓冲区失败、一个线程的定时器都没建起来时返回PROFILE_FAILED
+    int run(int seconds, int hz, std::string& out, size_t* samples, size_t* dropped);
+
+private:
+    struct sample {
+        int stage;
+        int depth;
+        void* pc[MAX_DEPTH];
+    };
+
+    struct thread_buf {
+        std::atomic<int> count;     // 已经写完的样本数，只有所属线程写
+        sample samples[THREAD_SAMPLES];
+    };
+
+    // 登记的线程，下标同时是它的样本缓冲区
+    struct thread_slot {
+        bool used;
+        pid_t tid;
+        pthread_t thread;
+        bool armed;                 // 定时器已经创建
+        timer_t timer;
+    };
+
+    static void on_signal(int sig, siginfo_t* info, void* context);
+    void record(void* context);
+    bool arm(thread_slot& t);
+    void disarm(thread_slot& t);
+    void fold(std::string& out, size_t* samples);
+
+private:
+    locker m_lock;                      // 保护m_slots和m_interval
+    thread_slot m_slots[MAX_THREADS];
+    long m_interval;                    // 采样间隔（纳秒），0表示没有在采样
+    thread_buf* m_bufs;                 // MAX_THREADS个线程的缓冲区，第一次采样时分配，之后一直保留
+    std::atomic<bool> m_running;        // 有一次采样在进行（或者正在整理结果）
+    std::atomic<bool> m_active;         // 信号处理函数要记录样本
+    std::atomic<int> m_inside;          // 正在执行信号处理函数的线程数，关掉之后要等它变成0再读缓冲区
+    std::atomic<size_t> m_dropped;      // 缓冲区满了丢掉的样本
+};
+
+extern sampling_profiler http_profiler;
+
+struct request_view;
+class response_builder;
+
+// 管理接口：GET /debug/profile?seconds=N&hz=M，返回folded格式的调用栈。只接受本机的请求
+// （回环地址，或者Unix域socket上和服务器同一个用户、root的进程）
+void profile_handler(const request_view& req, response_builder& resp, void* arg);
+
+
+#endif
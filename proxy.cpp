@@ -0,0 +1,265 @@
+#include"proxy.h"
+#include"router.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<string>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<poll.h>
+#include<time.h>
+#include<netdb.h>
+#include<sys/un.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+
+
+int64_t proxy_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+bool proxy_wait(int fd, short events, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = events;
+    pfd.revents = 0;
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while(ret < 0 && errno == EINTR);
+    return ret > 0 && !(pfd.revents & POLLNVAL);
+}
+
+// 每个线程固定使用的连接池分片
+static int pool_shard_index() {
+    static std::atomic<unsigned> next(0);
+    static thread_local int index = -1;
+    if(index < 0) {
+        index = next.fetch_add(1) % UPSTREAM_POOL_SHARDS;
+    }
+    return index;
+}
+
+
+upstream::upstream() : m_active(0), m_addr_len(0), m_unix(false), m_fails(0), m_down_until(0) {
+    memset(&m_addr, 0, sizeof(m_addr));
+}
+
+bool upstream::parse(const char* addr) {
+    if(strncmp(addr, "unix:", 5) == 0) {
+        sockaddr_un* un = (sockaddr_un*)&m_addr;
+        const char* path = addr + 5;
+        if(strlen(path) >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        m_addr_len = sizeof(sockaddr_un);
+        m_unix = true;
+        return true;
+    }
+
+    const char* colon = strrchr(addr, ':');
+    if(!colon) {
+        return false;
+    }
+    std::string host(addr, colon - addr);
+    addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host.c_str(), colon + 1, &hints, &res) != 0 || !res) {
+        return false;
+    }
+    memcpy(&m_addr, res->ai_addr, res->ai_addrlen);
+    m_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+int upstream::connect_fd() {
+    int fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    if(!m_unix) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if(connect(fd, (sockaddr*)&m_addr, m_addr_len) < 0) {
+        if(errno != EINPROGRESS && errno != EAGAIN) {
+            close(fd);
+            return -1;
+        }
+        // 非阻塞connect，等到可写后检查结果
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(!proxy_wait(fd, POLLOUT, UPSTREAM_CONNECT_TIMEOUT_MS) ||
+           getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+bool upstream::healthy(int64_t now_ms) const {
+    return m_down_until.load(std::memory_order_relaxed) <= now_ms;
+}
+
+void upstream::mark_ok() {
+    if(m_fails.load(std::memory_order_relaxed) != 0) {
+        m_fails.store(0, std::memory_order_relaxed);
+    }
+}
+
+void upstream::mark_failed(int64_t now_ms) {
+    if(m_fails.fetch_add(1, std::memory_order_relaxed) + 1 >= UPSTREAM_MAX_FAILS) {
+        // 连续失败太多次，一段时间内不再选它；到时间后放一个请求过去试探
+        m_down_until.store(now_ms + UPSTREAM_FAIL_TIMEOUT_MS, std::memory_order_relaxed);
+        m_fails.store(UPSTREAM_MAX_FAILS - 1, std::memory_order_relaxed);
+        printf("upstream marked down for %d ms\n", UPSTREAM_FAIL_TIMEOUT_MS);
+    }
+}
+
+
+bool upstream_group::parse(const char* spec) {
+    std::string s(spec);
+    size_t start = 0;
+    while(start <= s.size()) {
+        size_t end = s.find(',', start);
+        if(end == std::string::npos) {
+            end = s.size();
+        }
+        if(end > start) {
+            upstream* up = new upstream;
+            if(!up->parse(s.substr(start, end - start).c_str())) {
+                delete up;
+                return false;
+            }
+            m_upstreams.push_back(up);
+        }
+        start = end + 1;
+    }
+    return !m_upstreams.empty();
+}
+
+// 最少连接数：在健康的上游里选正在使用的连接最少的；从轮询位置开始扫描，
+// 连接数相同的上游轮流被选中。全都不健康时仍然选一个，让请求有机会试探恢复
+upstream* upstream_group::pick(int64_t now_ms) {
+    int n = m_upstreams.size();
+    unsigned start = m_rr.fetch_add(1, std::memory_order_relaxed);
+    upstream* best = NULL;
+    upstream* fallback = NULL;
+    for(int i = 0; i < n; i++) {
+        upstream* up = m_upstreams[(start + i) % n];
+        if(!fallback) {
+            fallback = up;
+        }
+        if(!up->healthy(now_ms)) {
+            continue;
+        }
+        if(!best || up->m_active.load(std::memory_order_relaxed) < best->m_active.load(std::memory_order_relaxed)) {
+            best = up;
+        }
+    }
+    return best ? best : fallback;
+}
+
+bool upstream_group::acquire(upstream_conn& conn) {
+    int64_t now = proxy_now_ms();
+    int shard = pool_shard_index();
+    // 每个上游最多试一次
+    for(size_t attempt = 0; attempt < m_upstreams.size(); attempt++) {
+        upstream* up = pick(now);
+        upstream::pool_shard& ps = up->m_shards[shard];
+
+        // 先从本线程的分片里找还活着的空闲连接
+        int fd = -1;
+        ps.lock.lock();
+        while(!ps.idle.empty()) {
+            upstream::idle_conn ic = ps.idle.back();
+            ps.idle.pop_back();
+            char c;
+            if(now - ic.since_ms < UPSTREAM_IDLE_TIMEOUT_MS &&
+               recv(ic.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+                // 没有数据也没有关闭，可以复用
+                fd = ic.fd;
+                break;
+            }
+            close(ic.fd);
+        }
+        ps.lock.unlock();
+
+        conn.reused = fd != -1;
+        if(fd == -1) {
+            fd = up->connect_fd();
+        }
+        if(fd == -1) {
+            up->mark_failed(now);
+            continue;
+        }
+        up->mark_ok();
+        up->m_active.fetch_add(1, std::memory_order_relaxed);
+        conn.fd    = fd;
+        conn.up    = up;
+        conn.shard = shard;
+        return true;
+    }
+    return false;
+}
+
+bool upstream_group::reconnect(upstream_conn& conn) {
+    close(conn.fd);
+    conn.fd     = conn.up->connect_fd();
+    conn.reused = false;
+    if(conn.fd == -1) {
+        conn.up->mark_failed(proxy_now_ms());
+        conn.up->m_active.fetch_sub(1, std::memory_order_relaxed);
+        conn.up = NULL;
+        return false;
+    }
+    return true;
+}
+
+void upstream_group::release(upstream_conn& conn, bool keepalive) {
+    if(!conn.up) {
+        return;
+    }
+    conn.up->m_active.fetch_sub(1, std::memory_order_relaxed);
+    if(keepalive) {
+        upstream::pool_shard& ps = conn.up->m_shards[conn.shard];
+        ps.lock.lock();
+        if((int)ps.idle.size() < UPSTREAM_POOL_MAX_IDLE) {
+            upstream::idle_conn ic;
+            ic.fd       = conn.fd;
+            ic.since_ms = proxy_now_ms();
+            ps.idle.push_back(ic);
+            conn.fd = -1;
+        }
+        ps.lock.unlock();
+    }
+    if(conn.fd != -1) {
+        close(conn.fd);
+    }
+    conn.fd = -1;
+    conn.up = NULL;
+}
+
+
+bool proxy_add_route(const char* arg) {
+    const char* eq = strchr(arg, '=');
+    if(!eq || eq == arg || arg[0] != '/') {
+        return false;
+    }
+    upstream_group* group = new upstream_group;
+    if(!group->parse(eq + 1)) {
+        delete group;
+        return false;
+    }
+    std::string path(arg, eq - arg);
+    return http_router.add_proxy(path.c_str(), group);
+}
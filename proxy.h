@@ -0,0 +1,104 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include<stdint.h>
+#include<sys/socket.h>
+#include<atomic>
+#include<vector>
+#include"locker.h"
+
+
+// 反向代理的上游管理：上游地址、健康状态、负载均衡和保持连接的连接池
+// 一个代理路由对应一个upstream_group，里面可以有多个上游（TCP或者Unix域socket）
+
+
+// 连接池按线程分片：每个工作线程固定用一个分片，只有它自己和归还连接的主线程会碰这个分片的锁
+static const int UPSTREAM_POOL_SHARDS = 16;
+static const int UPSTREAM_POOL_MAX_IDLE = 32;       // 每个分片最多保留的空闲连接
+static const int UPSTREAM_IDLE_TIMEOUT_MS = 30000;  // 空闲连接超过这个时间就不再复用
+static const int UPSTREAM_MAX_FAILS = 3;            // 连续失败多少次认为上游不可用
+static const int UPSTREAM_FAIL_TIMEOUT_MS = 5000;   // 不可用的上游多久之后再试
+static const int UPSTREAM_CONNECT_TIMEOUT_MS = 3000;// 连接上游的超时
+static const int UPSTREAM_IO_TIMEOUT_MS = 30000;    // 等待上游读写的超时
+
+
+class upstream {
+public:
+    upstream();
+
+    bool parse(const char* addr);       // host:port 或者 unix:/path
+
+    int connect_fd();                   // 新建一条到上游的非阻塞连接，失败返回-1
+    bool healthy(int64_t now_ms) const;
+    void mark_ok();
+    void mark_failed(int64_t now_ms);
+
+    std::atomic<int> m_active;          // 正在使用的连接数，最少连接数均衡用
+
+private:
+    struct idle_conn {
+        int fd;
+        int64_t since_ms;               // 放回连接池的时间
+    };
+    struct pool_shard {
+        locker lock;
+        std::vector<idle_conn> idle;
+        char pad[64];                   // 避免相邻分片落在同一缓存行
+    };
+
+    friend class upstream_group;
+
+    sockaddr_storage m_addr;
+    socklen_t m_addr_len;
+    bool m_unix;
+    std::atomic<int> m_fails;           // 连续失败次数
+    std::atomic<int64_t> m_down_until;  // 在此时间之前不选它
+    pool_shard m_shards[UPSTREAM_POOL_SHARDS];
+};
+
+
+// 从连接池取出或者新建的一条上游连接
+struct upstream_conn {
+    int fd;
+    upstream* up;
+    int shard;                          // 归还到哪个分片
+    bool reused;                        // 是否是从连接池里复用的
+};
+
+
+class upstream_group {
+public:
+    upstream_group() : m_rr(0) {}
+
+    // spec形如 127.0.0.1:8080,unix:/run/app.sock
+    bool parse(const char* spec);
+
+    // 按健康状态和最少连接数选一个上游，取一条连接；全部失败返回false
+    bool acquire(upstream_conn& conn);
+
+    // 用完归还，keepalive为false时直接关闭
+    void release(upstream_conn& conn, bool keepalive);
+
+    // 复用的连接发送失败时调用：关掉它，重新建一条新连接
+    bool reconnect(upstream_conn& conn);
+
+private:
+    upstream* pick(int64_t now_ms);
+
+private:
+    std::vector<upstream*> m_upstreams;
+    std::atomic<unsigned> m_rr;         // 连接数相同的上游之间轮询
+};
+
+
+// 解析 -p 参数：/prefix=addr[,addr...]，注册代理路由
+bool proxy_add_route(const char* arg);
+
+// 当前毫秒时间
+int64_t proxy_now_ms();
+
+// 在超时时间内等待fd可读或可写，超时或出错返回false
+bool proxy_wait(int fd, short events, int timeout_ms);
+
+
+#endif
@@ -0,0 +1,169 @@
+#include"rate_limit.h"
+#include<stdio.h>
+#include<string.h>
+#include<time.h>
+#include<sys/mman.h>
+#include<arpa/inet.h>
+
+rate_limiter http_limiter;
+
+
+static char limit_response[256];
+static size_t limit_response_len = 0;
+
+
+rate_limiter::rate_limiter() : m_slots(0), m_map_len(0), m_shard_mask(0), m_shard_shift(0), m_rate(0), m_burst(0) {
+}
+
+rate_limiter::~rate_limiter() {
+    if(m_slots) {
+        munmap(m_slots, m_map_len);
+    }
+}
+
+bool rate_limiter::init(uint32_t rate, uint32_t burst, size_t slots) {
+    if(rate == 0) {
+        return true;
+    }
+    if(burst == 0) {
+        burst = rate;
+    }
+    if(burst > 200000 || rate > 200000) {
+        return false;       // 令牌数按千分之一存在32位里，网段的桶还要再乘PREFIX_FACTOR
+    }
+    // 每个分片的桶数取2的幂，至少能放下一次探测
+    size_t per_shard = PROBES;
+    while(per_shard * SHARDS < slots) {
+        per_shard <<= 1;
+    }
+    m_shard_mask  = per_shard - 1;
+    m_shard_shift = __builtin_ctzl(per_shard);
+    m_map_len     = per_shard * SHARDS * sizeof(slot);
+    // 匿名映射的页是全零的，正好是空表；只有真正写到的页才分配物理内存
+    // 共享映射：多进程模式下fork出来的工作进程共用同一张表，限流的额度按整台机器算
+    void* addr = mmap(0, m_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(addr == MAP_FAILED) {
+        return false;
+    }
+    m_slots = (slot*)addr;
+    m_rate  = rate;
+    m_burst = burst;
+
+    const char* body = "Too many requests, please slow down.\n";
+    limit_response_len = snprintf(limit_response, sizeof(limit_response),
+                                  "HTTP/1.1 429 Too Many Requests\r\nContent-Length: %d\r\nContent-Type:text/html\r\n"
+                                  "Retry-After: 1\r\nConnection: close\r\n\r\n%s", (int)strlen(body), body);
+    return true;
+}
+
+const char* rate_limiter::response() {
+    return limit_response;
+}
+
+size_t rate_limiter::response_len() {
+    return limit_response_len;
+}
+
+// 粗粒度的单调时钟就够用了，比CLOCK_MONOTONIC便宜；32位毫秒大约49天回绕一次，只用来算差值
+uint32_t rate_limiter::now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000);
+}
+
+// 找到键对应的桶，没有就占一个空位；探测范围内都满了就换掉最久没用的那个
+rate_limiter::slot* rate_limiter::find(uint64_t key, uint32_t now) {
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+    size_t base = (size_t)(h >> 58) << m_shard_shift;  // 高6位选分片
+    size_t start = h & m_shard_mask;
+
+    slot* victim = NULL;
+    uint64_t victim_key = 0;
+    uint32_t victim_age = 0;
+    for(int i = 0; i < PROBES; i++) {
+        slot* s = &m_slots[base + ((start + i) & m_shard_mask)];
+        uint64_t k = s->key.load(std::memory_order_acquire);
+        if(k == key) {
+            return s;
+        }
+        if(k == 0) {
+            // 状态为0表示桶是满的，所以占位只要一次CAS；没抢到就看看是不是别的线程放了同一个键
+            if(s->key.compare_exchange_strong(k, key, std::memory_order_acq_rel) || k == key) {
+                return s;
+            }
+            continue;
+        }
+        uint32_t age = now - (uint32_t)(s->state.load(std::memory_order_relaxed) >> 32);
+        if(!victim || age > victim_age) {
+            victim     = s;
+            victim_key = k;
+            victim_age = age;
+        }
+    }
+    if(victim && victim->key.compare_exchange_strong(victim_key, key, std::memory_order_acq_rel)) {
+        victim->state.store(0, std::memory_order_relaxed);
+        if(victim_age < IDLE_MS) {
+            static std::atomic<int> warned(0);
+            if(warned.fetch_add(1, std::memory_order_relaxed) == 0) {
+                printf("rate limiter table is full, evicting active clients\n");
+            }
+        }
+        return victim;
+    }
+    return NULL;
+}
+
+// 惰性补充：令牌数 = 上次剩下的 + 经过的毫秒数 * 每秒的令牌数（千分之一个为单位正好是每毫秒补rate个）
+bool rate_limiter::take(uint64_t key, uint32_t now, uint32_t rate, uint32_t burst, bool consume) {
+    slot* s = find(key, now);
+    if(!s) {
+        return true;    // 表争用得厉害，宁可放行
+    }
+    uint64_t cap = (uint64_t)burst * 1000;
+    uint64_t old = s->state.load(std::memory_order_relaxed);
+    while(true) {
+        uint64_t tokens;
+        if(old == 0) {
+            tokens = cap;
+        }else {
+            // 别的线程可能用稍晚一点的时间写过，差值为负时当作没有经过时间
+            int32_t elapsed = (int32_t)(now - (uint32_t)(old >> 32));
+            if(elapsed < 0) {
+                elapsed = 0;
+            }
+            tokens = (uint32_t)old + (uint64_t)elapsed * rate;
+            if(tokens > cap) {
+                tokens = cap;
+            }
+        }
+        if(tokens < 1000) {
+            return false;   // 被拒绝时不写，不让同一个客户端的请求在核之间来回抢缓存行
+        }
+        if(!consume) {
+            return true;
+        }
+        uint64_t next = ((uint64_t)now << 32) | (tokens - 1000);
+        if(s->state.compare_exchange_weak(old, next ? next : 1, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+bool rate_limiter::allow(const sockaddr_in& addr) {
+    uint32_t ip = ntohl(addr.sin_addr.s_addr);
+    uint32_t now = now_ms();
+    // 先看单个IP的桶是不是空了，空了直接拒绝，不扣网段的令牌：一个滥用的地址不能把同网段邻居的额度耗光。
+    // 然后扣网段的再扣单个IP的；网段被限流时单个IP的令牌不动
+    uint64_t ip_key = (32ULL << 32) | ip;
+    return take(ip_key, now, m_rate, m_burst, false) &&
+           take((24ULL << 32) | (ip & 0xffffff00), now, m_rate * PREFIX_FACTOR, m_burst * PREFIX_FACTOR, true) &&
+           take(ip_key, now, m_rate, m_burst, true);
+}
+
+bool rate_limiter::limited(const sockaddr_in& addr) {
+    uint32_t ip = ntohl(addr.sin_addr.s_addr);
+    uint32_t now = now_ms();
+    return !take((32ULL << 32) | ip, now, m_rate, m_burst, false) ||
+           !take((24ULL << 32) | (ip & 0xffffff00), now, m_rate * PREFIX_FACTOR, m_burst * PREFIX_FACTOR, false);
+}
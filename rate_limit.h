@@ -0,0 +1,63 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<atomic>
+#include<netinet/in.h>
+
+
+// 按客户端限流：每个IP一个令牌桶，每个/24网段再一个令牌桶，两个都有令牌才放行
+// 桶存放在按哈希分片的开放寻址表里，键和状态都是64位原子变量：
+//   查找只做原子读，不加锁；扣令牌是一次CAS；令牌在扣的时候按经过的时间惰性补充，
+//   没有定时器。表满时把探测范围内最久没用的桶换掉，闲置够久的桶早就补满了，换掉也不影响限流结果。
+// 主线程在accept和每个请求开始时查表，被限流的客户端直接回预先生成好的429，不进线程池。
+
+
+class rate_limiter {
+public:
+    static const int SHARDS = 64;
+    static const int PROBES = 8;                    // 线性探测的最大长度，16字节一个桶，正好两条缓存行
+    static const int PREFIX_FACTOR = 16;            // /24网段的速率和突发量是单个IP的多少倍
+    static const uint32_t IDLE_MS = 60000;          // 闲置超过这个时间的桶可以被换掉
+
+    rate_limiter();
+    ~rate_limiter();
+
+    // rate：每秒补充的令牌数，burst：桶的容量；slots：表的总容量（桶的个数）。rate为0表示不限流
+    bool init(uint32_t rate, uint32_t burst, size_t slots);
+    bool enabled() const { return m_rate > 0; }
+
+    // 每个请求调用一次：两个桶都有令牌就各扣一个，返回true
+    bool allow(const sockaddr_in& addr);
+
+    // accept时调用：只看桶是不是已经空了，不扣令牌
+    bool limited(const sockaddr_in& addr);
+
+    // 预先生成好的429响应，发完就关闭连接
+    static const char* response();
+    static size_t response_len();
+
+private:
+    struct slot {
+        std::atomic<uint64_t> key;                  // 0表示空；高32位是前缀长度，低32位是地址
+        std::atomic<uint64_t> state;                // 高32位是上次更新的时间（毫秒），低32位是令牌数（千分之一个）
+    };
+
+    slot* find(uint64_t key, uint32_t now);
+    bool take(uint64_t key, uint32_t now, uint32_t rate, uint32_t burst, bool consume);
+    static uint32_t now_ms();
+
+private:
+    slot* m_slots;                  // 所有分片连续存放，匿名映射，用到的页才占内存
+    size_t m_map_len;
+    size_t m_shard_mask;            // 每个分片的桶数减1
+    int m_shard_shift;              // 分片内下标的位数
+    uint32_t m_rate;                // 单个IP每秒补充的令牌数
+    uint32_t m_burst;               // 单个IP的桶容量
+};
+
+extern rate_limiter http_limiter;
+
+
+#endif
@@ -0,0 +1,674 @@
+// 回放服务器 -C 抓下来的请求
+// 按抓包里的时间（或者按倍速）建立同样多的连接，每块数据按服务器当初一次recv读到的分块发出去：
+// 同一块里的几个请求照样流水线发出去，从请求开头开始的一块要等前面的请求都有了响应再发（保持连接的客户端就是这样一问一答的）。
+// 按原来的时间关闭连接，空闲的保持连接也占着。最后报告每个请求从发完到收完响应的延迟分布。
+// 只回放HTTP/1.1的明文连接：抓包里换成了HTTP/2、WebSocket、流式请求体，或者抓包时丢过记录的连接整个跳过。
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<time.h>
+#include<getopt.h>
+#include<arpa/inet.h>
+#include<netinet/tcp.h>
+#include<sys/epoll.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/resource.h>
+#include<sys/timerfd.h>
+#include<string>
+#include<vector>
+#include<queue>
+#include<map>
+#include<unordered_map>
+#include<algorithm>
+#include"../capture.h"
+#include"../chunked.h"
+
+// 抓包里的一块数据
+struct chunk {
+    uint64_t at;                // 原始时间（微秒，按墙上时间对齐了几个文件）
+    size_t begin;               // 在这个连接的字节流里的起点
+    size_t end;
+    size_t wait;                // 发之前要先收到这么多个响应
+};
+
+// 字节流里的一个完整请求
+struct request {
+    size_t end;                 // 请求在字节流里结束的位置
+    bool head;                  // HEAD的响应没有响应体
+    uint64_t sent;              // 最后一个字节发出去的时间，0表示还没发完
+};
+
+enum CONN_STATE { CONN_PENDING = 0, CONN_CONNECTING, CONN_OPEN, CONN_DONE };
+
+enum RESP_STATE { RESP_HEAD = 0, RESP_LENGTH, RESP_CHUNKED, RESP_EOF };
+
+struct conn {
+    uint64_t open_at;
+    uint64_t close_at;          // 抓包里没有关闭的记录时是0
+    bool closed;                // 抓包里已经关了，之后同一编号的记录不算它的
+    bool skip;
+    std::string stream;         // 客户端发来的全部字节
+    std::vector<chunk> chunks;
+    std::vector<request> requests;
+
+    // 回放时的状态
+    int state;
+    int fd;
+    bool writable;
+    size_t next_chunk;
+    size_t sent;                // 字节流里已经发出去的字节数
+    size_t next_sent;           // 下一个还没发完的请求
+    size_t answered;            // 已经收完响应的请求数
+    uint64_t progress;          // 最近一次发完请求或者收到响应数据的时间，等响应超时用
+    bool peer_closing;          // 响应带了Connection: close，等服务器先关，TIME_WAIT留在服务器那边，和原来一样
+
+    int resp_state;
+    std::string resp_head;
+    int status;
+    int64_t resp_left;
+    chunked_decoder resp_chunk;
+};
+
+static std::vector<conn> conns;
+static double speed = 1.0;                      // -s 倍速
+static uint64_t timeout_us = 10 * 1000000ULL;   // -t 等一个响应最多这么久
+static uint64_t first_at = 0;                   // 抓包里最早的记录
+static uint64_t last_at = 0;                    // 最晚的记录
+static uint64_t replay_start = 0;
+static int epollfd = -1;
+static int timerfd = -1;                        // 下一个要做的事的时间，epoll_wait的毫秒精度不够
+static size_t live = 0;                         // 还没结束的连接
+
+static struct sockaddr_storage target;
+static socklen_t target_len = 0;
+static bool target_unix = false;
+
+// 统计
+static std::vector<uint32_t> latencies;
+static std::map<int, uint64_t> statuses;
+static uint64_t failed = 0;
+static uint64_t timed_out = 0;
+static uint64_t connect_failed = 0;
+static uint64_t deferred = 0;           // 文件描述符用完了，推迟建立连接的次数
+
+typedef std::pair<uint64_t, size_t> wakeup;
+static std::priority_queue<wakeup, std::vector<wakeup>, std::greater<wakeup> > timers;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 抓包里的时间换成回放时的时间
+static uint64_t due(uint64_t at) {
+    return replay_start + (uint64_t)((at - first_at) / speed);
+}
+
+static bool parse_target(const char* arg) {
+    memset(&target, 0, sizeof(target));
+    if(strncmp(arg, "unix:", 5) == 0) {
+        struct sockaddr_un* un = (struct sockaddr_un*)&target;
+        const char* path = arg + 5;
+        if(strlen(path) == 0 || strlen(path) >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        if(path[0] == '@') {
+            un->sun_path[0] = '\0';     // 抽象命名空间
+        }
+        target_len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + (path[0] == '@' ? 0 : 1);
+        target_unix = true;
+        return true;
+    }
+    const char* colon = strrchr(arg, ':');
+    if(!colon) {
+        return false;
+    }
+    std::string host(arg, colon - arg);
+    struct sockaddr_in* in = (struct sockaddr_in*)&target;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(atoi(colon + 1));
+    if(inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1 || in->sin_port == 0) {
+        return false;
+    }
+    target_len = sizeof(*in);
+    return true;
+}
+
+// 按Content-Length、chunked把字节流切成一个个请求，最后不完整的请求照样发出去但是不算
+static void split_requests(conn& c) {
+    const std::string& s = c.stream;
+    size_t pos = 0;
+    while(pos < s.size()) {
+        size_t head_end = s.find("\r\n\r\n", pos);
+        if(head_end == std::string::npos) {
+            return;
+        }
+        head_end += 4;
+        request r;
+        r.head = s.compare(pos, 5, "HEAD ") == 0;
+        r.sent = 0;
+        int64_t length = 0;
+        bool chunked = false;
+        for(size_t line = s.find("\r\n", pos) + 2; line < head_end - 2; line = s.find("\r\n", line) + 2) {
+            const char* p = s.data() + line;
+            if(strncasecmp(p, "Content-Length:", 15) == 0) {
+                length = atoll(p + 15);
+            }else if(strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+                size_t eol = s.find("\r\n", line);
+                chunked = s.substr(line, eol - line).find("chunked") != std::string::npos;
+            }
+        }
+        pos = head_end;
+        if(chunked) {
+            chunked_decoder d;
+            while(pos < s.size() && !d.done() && !d.bad()) {
+                if(d.state() == chunked_decoder::DATA) {
+                    int64_t n = std::min<int64_t>(d.data_left(), s.size() - pos);
+                    d.consume_data(n);
+                    pos += n;
+                }else {
+                    pos += d.feed(s.data() + pos, s.size() - pos);
+                }
+            }
+            if(!d.done()) {
+                return;
+            }
+        }else {
+            if(length < 0 || pos + length > s.size()) {
+                return;
+            }
+            pos += length;
+        }
+        r.end = pos;
+        c.requests.push_back(r);
+    }
+}
+
+// 从请求开头开始的一块：前面的请求都要先有响应
+static void plan_chunks(conn& c) {
+    size_t k = 0;
+    for(size_t i = 0; i < c.chunks.size(); i++) {
+        chunk& ch = c.chunks[i];
+        while(k < c.requests.size() && c.requests[k].end <= ch.begin) {
+            k++;
+        }
+        bool boundary = ch.begin == 0 || (k > 0 && c.requests[k - 1].end == ch.begin);
+        ch.wait = boundary ? k : 0;
+    }
+}
+
+static bool load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if(!f) {
+        printf("打不开抓包文件：%s（%s）\n", path, strerror(errno));
+        return false;
+    }
+    capture_file_head head;
+    if(fread(&head, sizeof(head), 1, f) != 1 || memcmp(head.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        printf("不是抓包文件：%s\n", path);
+        fclose(f);
+        return false;
+    }
+    std::unordered_map<uint32_t, size_t> ids;   // 连接编号只在一个文件里唯一
+    capture_record r;
+    std::string data;
+    while(fread(&r, sizeof(r), 1, f) == 1) {
+        data.resize(r.len());
+        if(r.len() > 0 && fread(&data[0], r.len(), 1, f) != 1) {
+            break;      // 进程退出时最后一条没写完
+        }
+        uint64_t at = head.start_us + r.usec;
+        last_at = std::max(last_at, at);
+        if(r.type() == CAP_LOST) {
+            // 丢了记录：这时还开着的连接都不完整
+            for(std::unordered_map<uint32_t, size_t>::iterator it = ids.begin(); it != ids.end(); ++it) {
+                if(!conns[it->second].closed) {
+                    conns[it->second].skip = true;
+                }
+            }
+            continue;
+        }
+        if(r.type() == CAP_OPEN) {
+            conn c = conn();
+            c.open_at = at;
+            c.fd = -1;
+            ids[r.conn] = conns.size();
+            conns.push_back(c);
+            continue;
+        }
+        std::unordered_map<uint32_t, size_t>::iterator it = ids.find(r.conn);
+        if(it == ids.end() || conns[it->second].closed) {
+            continue;
+        }
+        conn& c = conns[it->second];
+        if(r.type() == CAP_DATA) {
+            chunk ch;
+            ch.at = at;
+            ch.begin = c.stream.size();
+            c.stream += data;
+            ch.end = c.stream.size();
+            ch.wait = 0;
+            c.chunks.push_back(ch);
+        }else if(r.type() == CAP_CLOSE) {
+            c.close_at = at;
+            c.closed = true;
+        }else if(r.type() == CAP_GAP) {
+            c.skip = true;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void schedule(size_t i, uint64_t at) {
+    timers.push(wakeup(at, i));
+}
+
+// 还没收到响应的请求都算失败
+static void finish(conn& c, bool timeout) {
+    uint64_t lost = c.requests.size() - c.answered;
+    if(timeout) {
+        timed_out += lost;
+    }else {
+        failed += lost;
+    }
+    if(c.fd >= 0) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, NULL);
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.state = CONN_DONE;
+    live--;
+}
+
+static void open_conn(size_t i) {
+    conn& c = conns[i];
+    c.fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c.fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+        // 同时开着的连接太多：等别的连接关了再试，这个连接的时间往后推
+        deferred++;
+        schedule(i, now_us() + 1000);
+        return;
+    }
+    if(c.fd < 0) {
+        connect_failed++;
+        finish(c, false);
+        return;
+    }
+    if(!target_unix) {
+        int on = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if(connect(c.fd, (struct sockaddr*)&target, target_len) < 0 && errno != EINPROGRESS) {
+        connect_failed++;
+        finish(c, false);
+        return;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = i;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    c.state = CONN_CONNECTING;
+    c.progress = now_us();
+}
+
+// 一个响应收完了
+static void answered(conn& c, uint64_t now) {
+    request& r = c.requests[c.answered];
+    statuses[c.status]++;
+    if(r.sent) {
+        latencies.push_back((uint32_t)std::min<uint64_t>(now - r.sent, UINT32_MAX));
+    }
+    c.answered++;
+    c.resp_state = RESP_HEAD;
+    c.resp_head.clear();
+}
+
+// 解析响应，返回false表示连接不能再用了（101或者格式不对）
+static bool feed_response(conn& c, const char* p, size_t n, uint64_t now) {
+    while(n > 0) {
+        if(c.answered >= c.requests.size()) {
+            return false;       // 没有对应的请求
+        }
+        if(c.resp_state == RESP_HEAD) {
+            size_t old = c.resp_head.size();
+            c.resp_head.append(p, n);
+            size_t end = c.resp_head.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+            if(end == std::string::npos) {
+                return c.resp_head.size() < 65536;
+            }
+            end += 4;
+            size_t used = end - old;
+            p += used;
+            n -= used;
+            const char* h = c.resp_head.c_str();
+            if(strncmp(h, "HTTP/1.", 7) != 0) {
+                return false;
+            }
+            c.status = atoi(h + 9);
+            if(c.status == 101) {
+                answered(c, now);
+                return false;
+            }
+            if(c.status >= 100 && c.status < 200) {
+                c.resp_head.clear();    // 100 Continue之类，后面还有真正的响应
+                continue;
+            }
+            c.resp_state = RESP_EOF;
+            c.resp_left = 0;
+            const char* line = strstr(h, "\r\n");
+            while(line && line[2] != '\r') {
+                line += 2;
+                if(strncasecmp(line, "Content-Length:", 15) == 0) {
+                    c.resp_state = RESP_LENGTH;
+                    c.resp_left = atoll(line + 15);
+                }else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+                    c.resp_state = RESP_CHUNKED;
+                    c.resp_chunk.reset();
+                }else if(strncasecmp(line, "Connection:", 11) == 0 && strncasecmp(line + 11 + strspn(line + 11, " "), "close", 5) == 0) {
+                    c.peer_closing = true;
+                }
+                line = strstr(line, "\r\n");
+            }
+            if(c.requests[c.answered].head || c.status == 204 || c.status == 304 ||
+               (c.resp_state == RESP_LENGTH && c.resp_left == 0)) {
+                answered(c, now);
+            }
+            continue;
+        }
+        if(c.resp_state == RESP_LENGTH) {
+            size_t k = std::min<int64_t>(c.resp_left, n);
+            c.resp_left -= k;
+            p += k;
+            n -= k;
+            if(c.resp_left == 0) {
+                answered(c, now);
+            }
+        }else if(c.resp_state == RESP_CHUNKED) {
+            if(c.resp_chunk.state() == chunked_decoder::DATA) {
+                size_t k = std::min<int64_t>(c.resp_chunk.data_left(), n);
+                c.resp_chunk.consume_data(k);
+                p += k;
+                n -= k;
+            }else {
+                int k = c.resp_chunk.feed(p, n > 65536 ? 65536 : (int)n);
+                p += k;
+                n -= k;
+            }
+            if(c.resp_chunk.bad()) {
+                return false;
+            }
+            if(c.resp_chunk.done()) {
+                answered(c, now);
+            }
+        }else {
+            n = 0;      // 读到关闭为止
+        }
+    }
+    return true;
+}
+
+// 连接上该做的事：到时间了就连上、发下一块，都发完、响应都收到、到了原来关闭的时间就关掉
+static void step(size_t i) {
+    conn& c = conns[i];
+    uint64_t now = now_us();
+    if(c.state == CONN_DONE || c.state == CONN_CONNECTING) {
+        return;
+    }
+    if(c.state == CONN_PENDING) {
+        if(now < due(c.open_at)) {
+            schedule(i, due(c.open_at));
+            return;
+        }
+        open_conn(i);
+        return;
+    }
+    while(c.next_chunk < c.chunks.size() && c.writable) {
+        chunk& ch = c.chunks[c.next_chunk];
+        if(c.sent == ch.begin) {
+            if(now < due(ch.at)) {
+                schedule(i, due(ch.at));
+                break;
+            }
+            if(c.answered < ch.wait) {
+                break;      // 收到响应时再来
+            }
+        }
+        // 发送之前取时间：回环上服务器可能在send返回之前就已经回了响应
+        now = now_us();
+        ssize_t n = send(c.fd, c.stream.data() + c.sent, ch.end - c.sent, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                c.writable = false;
+                break;
+            }
+            finish(c, false);
+            return;
+        }
+        c.sent += n;
+        while(c.next_sent < c.requests.size() && c.requests[c.next_sent].end <= c.sent) {
+            c.requests[c.next_sent++].sent = now;
+            c.progress = now;
+        }
+        if(c.sent == ch.end) {
+            c.next_chunk++;
+        }
+    }
+    if(c.answered < c.requests.size() || c.peer_closing) {
+        // 等响应，或者等服务器关连接
+        if((c.answered < c.next_sent || c.peer_closing) && now - c.progress >= timeout_us) {
+            finish(c, true);
+            return;
+        }
+        schedule(i, std::max(now, c.progress) + timeout_us);
+        return;
+    }
+    if(c.next_chunk == c.chunks.size()) {
+        if(c.close_at && now < due(c.close_at)) {
+            schedule(i, due(c.close_at));
+            return;
+        }
+        finish(c, false);
+    }
+}
+
+static void on_event(size_t i, uint32_t events) {
+    conn& c = conns[i];
+    if(c.state == CONN_DONE) {
+        return;
+    }
+    if(c.state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0) {
+            connect_failed++;
+            finish(c, false);
+            return;
+        }
+        if(!(events & EPOLLOUT)) {
+            return;
+        }
+        c.state = CONN_OPEN;
+    }
+    if(events & EPOLLOUT) {
+        c.writable = true;
+    }
+    if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        char buf[65536];
+        while(true) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            uint64_t now = now_us();
+            if(n > 0) {
+                c.progress = now;
+                if(!feed_response(c, buf, n, now)) {
+                    finish(c, false);
+                    return;
+                }
+                continue;
+            }
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            // 服务器关了连接：读到关闭为止的响应这时才算收完
+            if(c.resp_state == RESP_EOF && c.answered < c.requests.size()) {
+                answered(c, now);
+            }
+            finish(c, false);
+            return;
+        }
+    }
+    step(i);
+}
+
+static int percentile(double p) {
+    if(latencies.empty()) {
+        return 0;
+    }
+    size_t k = (size_t)(p * (latencies.size() - 1) + 0.5);
+    return latencies[k];
+}
+
+static void usage(const char* prog) {
+    printf("按照如下格式运行：%s [-s 倍速] [-t 超时秒数] host:port|unix:/path 抓包文件...\n"
+           "  -s 倍速   默认1，按原来的时间回放；2是两倍的速度，连接的建立、每块数据的发送和关闭都提前\n"
+           "  -t 秒数   等一个响应最多多久，默认10\n"
+           "  多进程模式下每个工作进程一个抓包文件，一起给出时按抓包时的时间对齐\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "s:t:h")) != -1) {
+        switch(opt) {
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 't':
+                timeout_us = (uint64_t)(atof(optarg) * 1000000);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(argc - optind < 2 || speed <= 0 || timeout_us == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(!parse_target(argv[optind])) {
+        printf("目标地址有误：%s\n", argv[optind]);
+        return 1;
+    }
+    for(int k = optind + 1; k < argc; k++) {
+        if(!load(argv[k])) {
+            return 1;
+        }
+    }
+
+    size_t skipped = 0, total_requests = 0;
+    first_at = UINT64_MAX;
+    for(size_t i = 0; i < conns.size(); i++) {
+        conn& c = conns[i];
+        if(c.skip) {
+            skipped++;
+            c.state = CONN_DONE;
+            continue;
+        }
+        split_requests(c);
+        plan_chunks(c);
+        total_requests += c.requests.size();
+        first_at = std::min(first_at, c.open_at);
+    }
+    if(first_at == UINT64_MAX) {
+        printf("抓包里没有可以回放的连接\n");
+        return 1;
+    }
+
+    // 连接多的时候文件描述符不够用
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_event tev;
+    tev.events = EPOLLIN;
+    tev.data.u64 = UINT64_MAX;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &tev);
+    replay_start = now_us();
+    for(size_t i = 0; i < conns.size(); i++) {
+        if(conns[i].state != CONN_DONE) {
+            schedule(i, due(conns[i].open_at));
+            live++;
+        }
+    }
+    printf("回放 %zu 个连接、%zu 个请求（跳过 %zu 个连接），原始时长 %.1fs，倍速 %g\n",
+           live, total_requests, skipped, (last_at - first_at) / 1e6, speed);
+
+    epoll_event events[1024];
+    uint64_t armed = 0;
+    while(true) {
+        uint64_t now = now_us();
+        while(!timers.empty() && timers.top().first <= now) {
+            size_t i = timers.top().second;
+            timers.pop();
+            step(i);
+        }
+        if(live == 0) {
+            break;
+        }
+        if(!timers.empty() && timers.top().first != armed) {
+            armed = timers.top().first;
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = armed / 1000000;
+            its.it_value.tv_nsec = armed % 1000000 * 1000;
+            timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+        }
+        int n = epoll_wait(epollfd, events, 1024, 1000);
+        for(int k = 0; k < n; k++) {
+            if(events[k].data.u64 == UINT64_MAX) {
+                uint64_t expired;
+                ssize_t r = read(timerfd, &expired, sizeof(expired));
+                (void)r;
+                armed = 0;
+                continue;
+            }
+            on_event(events[k].data.u64, events[k].events);
+        }
+    }
+    double elapsed = (now_us() - replay_start) / 1e6;
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t done = 0;
+    for(std::map<int, uint64_t>::iterator it = statuses.begin(); it != statuses.end(); ++it) {
+        done += it->second;
+    }
+    printf("用时 %.1fs，完成 %llu 个请求（每秒 %.0f 个），失败 %llu 个，超时 %llu 个，连接失败 %llu 个\n", elapsed,
+           (unsigned long long)done, elapsed > 0 ? done / elapsed : 0.0, (unsigned long long)failed,
+           (unsigned long long)timed_out, (unsigned long long)connect_failed);
+    if(deferred > 0) {
+        printf("文件描述符不够用，推迟建立连接 %llu 次\n", (unsigned long long)deferred);
+    }
+    printf("状态码：");
+    for(std::map<int, uint64_t>::iterator it = statuses.begin(); it != statuses.end(); ++it) {
+        printf(" %d×%llu", it->first, (unsigned long long)it->second);
+    }
+    printf("\n");
+    if(!latencies.empty()) {
+        printf("延迟（微秒）：最小 %u  p50 %d  p90 %d  p99 %d  p99.9 %d  最大 %u\n", latencies.front(), percentile(0.5),
+               percentile(0.9), percentile(0.99), percentile(0.999), latencies.back());
+    }
+    return failed || timed_out || connect_failed ? 2 : 0;
+}
@@ -0,0 +1,322 @@
+#include"response_cache.h"
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<time.h>
+#include<functional>
+
+response_cache http_cache;
+
+
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+response_cache::response_cache() : m_budget(0), m_shard_budget(0) {
+    for(int i = 0; i < SHARDS; i++) {
+        m_shards[i].probation       = NULL;
+        m_shards[i].protected_head  = NULL;
+        m_shards[i].probation_bytes = 0;
+        m_shards[i].protected_bytes = 0;
+    }
+}
+
+void response_cache::init(size_t budget_bytes) {
+    m_budget       = budget_bytes;
+    m_shard_budget = budget_bytes / SHARDS;
+}
+
+response_cache::shard& response_cache::shard_of(const std::string& base) {
+    return m_shards[std::hash<std::string>()(base) % SHARDS];
+}
+
+// Vary里的每个请求头的值都拼进键里
+std::string response_cache::full_key(const std::string& base, const std::string& vary, header_getter get, void* ctx) {
+    std::string key = base;
+    size_t start = 0;
+    while(start < vary.size()) {
+        size_t end = vary.find(',', start);
+        if(end == std::string::npos) {
+            end = vary.size();
+        }
+        std::string name = vary.substr(start, end - start);
+        const char* value = get ? get(ctx, name.c_str()) : NULL;
+        key.append(1, '\n').append(name).append(1, '=').append(value ? value : "");
+        start = end + 1;
+    }
+    return key;
+}
+
+void response_cache::unlink(shard& s, cache_entry* e) {
+    cache_entry*& head = e->in_protected ? s.protected_head : s.probation;
+    (e->in_protected ? s.protected_bytes : s.probation_bytes) -= e->size();
+    if(e->next == e) {
+        head = NULL;
+    }else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if(head == e) {
+            head = e->next;
+        }
+    }
+    e->prev = e->next = NULL;
+}
+
+// 链表是环形的，表头是最近使用的，head->prev就是最久没用的
+void response_cache::push_front(shard& s, cache_entry* e, bool to_protected) {
+    e->in_protected = to_protected;
+    cache_entry*& head = to_protected ? s.protected_head : s.probation;
+    (to_protected ? s.protected_bytes : s.probation_bytes) += e->size();
+    if(!head) {
+        e->prev = e->next = e;
+    }else {
+        e->next = head;
+        e->prev = head->prev;
+        head->prev->next = e;
+        head->prev = e;
+    }
+    head = e;
+}
+
+void response_cache::remove(shard& s, cache_entry* e) {
+    std::unordered_map<std::string, cache_entry*>::iterator it = s.entries.find(e->key);
+    if(it != s.entries.end() && it->second == e) {
+        s.entries.erase(it);
+    }
+    if(e->next) {
+        unlink(s, e);
+    }
+    release(e);
+}
+
+// 超出预算时先淘汰试用段最久没用的，试用段空了再淘汰保护段
+void response_cache::evict(shard& s) {
+    while(s.probation_bytes + s.protected_bytes > m_shard_budget) {
+        cache_entry* victim = s.probation ? s.probation->prev : (s.protected_head ? s.protected_head->prev : NULL);
+        if(!victim) {
+            break;
+        }
+        remove(s, victim);
+    }
+}
+
+cache_entry* response_cache::lookup(std::string_view method, std::string_view host, std::string_view url,
+                                    header_getter get, void* ctx, cache_entry** fill) {
+    if(fill) {
+        *fill = NULL;
+    }
+    if(!enabled()) {
+        return NULL;
+    }
+    std::string base;
+    base.reserve(method.size() + host.size() + url.size() + 2);
+    base.append(method).append(1, ' ').append(host).append(1, ' ').append(url);
+    shard& s = shard_of(base);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)WAIT_MS * 1000000;
+    deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    s.lock.lock();
+    while(true) {
+        std::unordered_map<std::string, std::string>::iterator vit = s.vary.find(base);
+        std::string key = vit == s.vary.end() ? base : full_key(base, vit->second, get, ctx);
+        std::unordered_map<std::string, cache_entry*>::iterator it = s.entries.find(key);
+        int64_t now = now_ms();
+        if(it != s.entries.end()) {
+            cache_entry* e = it->second;
+            if(e->pending) {
+                // 别的请求正在生成同一个响应，等它填好；等的人够多了、或者等超时了就自己去生成，但不再填充
+                if(e->waiters >= MAX_WAITERS) {
+                    s.lock.unlock();
+                    return NULL;
+                }
+                e->waiters++;
+                e->refs.fetch_add(1, std::memory_order_relaxed);     // 等的时候条目可能被换掉，计数要减在原来的条目上
+                bool woken = s.changed.timewait(s.lock.get(), deadline);
+                e->waiters--;
+                release(e);
+                if(!woken) {
+                    s.lock.unlock();
+                    return NULL;
+                }
+                continue;
+            }
+            if(now < e->expires_ms) {
+                if(e->pass) {
+                    s.lock.unlock();
+                    return NULL;
+                }
+                // 命中：提升到保护段表头，保护段超过八成预算时把最久没用的降回试用段
+                unlink(s, e);
+                push_front(s, e, true);
+                while(s.protected_bytes > m_shard_budget / 5 * 4 && s.protected_head->prev != e) {
+                    cache_entry* old = s.protected_head->prev;
+                    unlink(s, old);
+                    push_front(s, old, false);
+                }
+                e->refs.fetch_add(1, std::memory_order_relaxed);
+                s.lock.unlock();
+                return e;
+            }
+            remove(s, e);       // 过期了
+        }
+        if(fill) {
+            // 放一个占位条目，后来的同键请求会等它；缓存和填充者各持有一个引用
+            cache_entry* p = new cache_entry;
+            p->key          = key;
+            p->base         = base;
+            p->data         = NULL;
+            p->head_len     = 0;
+            p->body_len     = 0;
+            p->created_ms   = now;
+            p->expires_ms   = now;
+            p->refs.store(2, std::memory_order_relaxed);
+            p->pending      = true;
+            p->hot_key      = 0;
+            p->waiters      = 0;
+            p->pass         = false;
+            p->in_protected = false;
+            p->prev = p->next = NULL;
+            s.entries[key] = p;
+            *fill = p;
+        }
+        s.lock.unlock();
+        return NULL;
+    }
+}
+
+cache_entry* response_cache::complete(cache_entry* fill, const char* head, size_t head_len,
+                                      const char* body, size_t body_len, int max_age, const char* vary,
+                                      header_getter get, void* ctx, uint64_t hot_key) {
+    if(!fill) {
+        return NULL;
+    }
+    if(max_age <= 0 || head_len + body_len > max_object() || (vary && strchr(vary, '*'))) {
+        abandon(fill, true);
+        return NULL;
+    }
+
+    // Vary的名字统一成小写、逗号分隔、没有空格
+    std::string names;
+    for(const char* p = vary; p && *p; p++) {
+        if(*p == ' ' || *p == '\t') {
+            continue;
+        }
+        names.append(1, *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p);
+    }
+
+    cache_entry* e = new cache_entry;
+    e->base         = fill->base;
+    e->data         = (char*)malloc(head_len + body_len);
+    memcpy(e->data, head, head_len);
+    memcpy(e->data + head_len, body, body_len);
+    e->head_len     = head_len;
+    e->body_len     = body_len;
+    e->created_ms   = now_ms();
+    e->expires_ms   = e->created_ms + max_age * 1000LL;
+    e->refs.store(2, std::memory_order_relaxed);    // 缓存一个，调用者一个
+    e->pending      = false;
+    e->hot_key      = hot_key;
+    e->waiters      = 0;
+    e->pass         = false;
+    e->in_protected = false;
+    e->prev = e->next = NULL;
+    e->key          = names.empty() ? e->base : full_key(e->base, names, get, ctx);
+
+    shard& s = shard_of(e->base);
+    s.lock.lock();
+    std::unordered_map<std::string, cache_entry*>::iterator it = s.entries.find(fill->key);
+    if(it != s.entries.end() && it->second == fill) {
+        s.entries.erase(it);
+        release(fill);      // 缓存持有的引用
+    }
+    release(fill);          // 填充者持有的引用
+    if(names.empty()) {
+        s.vary.erase(e->base);
+    }else {
+        s.vary[e->base] = names;
+    }
+    it = s.entries.find(e->key);
+    if(it != s.entries.end()) {
+        remove(s, it->second);
+    }
+    s.entries[e->key] = e;
+    push_front(s, e, false);
+    evict(s);
+    s.changed.broadcast();
+    s.lock.unlock();
+    return e;
+}
+
+void response_cache::invalidate(cache_entry* e) {
+    shard& s = shard_of(e->base);
+    s.lock.lock();
+    std::unordered_map<std::string, cache_entry*>::iterator it = s.entries.find(e->key);
+    if(it != s.entries.end() && it->second == e) {
+        remove(s, e);
+    }
+    s.lock.unlock();
+}
+
+void response_cache::abandon(cache_entry* fill, bool pass) {
+    if(!fill) {
+        return;
+    }
+    shard& s = shard_of(fill->base);
+    s.lock.lock();
+    std::unordered_map<std::string, cache_entry*>::iterator it = s.entries.find(fill->key);
+    if(it != s.entries.end() && it->second == fill) {
+        if(pass) {
+            // 留下一个短时间有效的标记，放在试用段里，和普通条目一样会被淘汰
+            fill->pending    = false;
+            fill->pass       = true;
+            fill->expires_ms = now_ms() + PASS_MS;
+            push_front(s, fill, false);
+            evict(s);
+        }else {
+            s.entries.erase(it);
+            release(fill);
+        }
+    }
+    release(fill);          // 填充者持有的引用
+    s.changed.broadcast();
+    s.lock.unlock();
+}
+
+void response_cache::release(cache_entry* e) {
+    if(e && e->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        free(e->data);
+        delete e;
+    }
+}
+
+int response_cache::max_age(const char* cc) {
+    if(!cc) {
+        return -1;
+    }
+    int age = -1;
+    int shared_age = -1;
+    const char* p = cc;
+    while(*p) {
+        p += strspn(p, " \t,");
+        size_t n = strcspn(p, ",");
+        if(strncasecmp(p, "no-store", 8) == 0 || strncasecmp(p, "no-cache", 8) == 0 ||
+           strncasecmp(p, "private", 7) == 0) {
+            return -1;
+        }
+        if(strncasecmp(p, "s-maxage=", 9) == 0) {
+            shared_age = atoi(p + 9);
+        }else if(strncasecmp(p, "max-age=", 8) == 0) {
+            age = atoi(p + 8);
+        }
+        p += n;
+    }
+    // 共享缓存优先用s-maxage
+    return shared_age >= 0 ? shared_age : age;
+}
@@ -0,0 +1,113 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<atomic>
+#include<string>
+#include<string_view>
+#include<unordered_map>
+#include"locker.h"
+
+
+// 进程内的HTTP响应缓存
+// 键是 方法 + Host + URL，响应带Vary时再加上对应请求头的值。
+// 按键的哈希分成多个分片，每个分片一把锁，工作线程之间很少争用；
+// 每个分片有自己的字节预算，用分段LRU淘汰：新条目先进试用段，再次命中才进保护段。
+// 同一个键同时有多个请求未命中时，只有第一个去生成响应，其余的等它填好；等的是工作线程，
+// 所以最多MAX_WAITERS个请求等、每个最多等WAIT_MS，再多的和等超时的自己去生成。
+// 条目里存的是序列化好的响应头（不含Connection）和响应体，命中时直接作为iovec发送。
+
+
+struct cache_entry {
+    std::string key;                // 完整的键（含Vary的值）
+    std::string base;               // 不含Vary的键
+    char* data;                     // 响应头 + 响应体，连续存放
+    size_t head_len;                // 响应头长度，不含Connection和空行
+    size_t body_len;                // 响应体长度
+    int64_t created_ms;             // 生成时间，用来算Age
+    int64_t expires_ms;             // 过期时间
+    std::atomic<int> refs;          // 引用计数，缓存本身持有一个，每个正在发送它的连接各持有一个
+    bool pending;                   // 占位条目，正在由某个请求生成
+    uint64_t hot_key;               // 填充者给的访问计数的键（能在NUMA节点上复制的静态文件），0表示没有
+    int waiters;                    // 占位条目上正在等它填好的请求数
+    bool pass;                      // 不可缓存的标记，在过期前的请求直接去生成，不再等待
+    bool in_protected;              // 是否在保护段
+    cache_entry* prev;              // LRU链表
+    cache_entry* next;
+
+    const char* head() const { return data; }
+    const char* body() const { return data + head_len; }
+    size_t size() const { return key.size() + head_len + body_len + sizeof(cache_entry); }
+};
+
+
+class response_cache {
+public:
+    static const int SHARDS = 16;
+    static const int WAIT_MS = 200;             // 等待别的请求填充的最长时间
+    static const int MAX_WAITERS = 2;           // 一个占位条目上最多这么多请求等，其余的直接去生成
+    static const int PASS_MS = 1000;            // 不可缓存的响应在这段时间内不再合并等待
+
+    // 查找时用来读取请求头的值，Vary要用
+    typedef const char* (*header_getter)(void* ctx, const char* name);
+
+    response_cache();
+
+    void init(size_t budget_bytes);             // 设置总的字节预算，0表示关闭
+    bool enabled() const { return m_budget > 0; }
+    size_t max_object() const { return m_budget / SHARDS / 4; }     // 单个条目的上限
+
+    // 查找。命中返回条目（已经加了引用，用完调用release）；
+    // 未命中返回NULL，如果fill不为NULL，调用者负责生成响应后调用complete或者abandon
+    cache_entry* lookup(std::string_view method, std::string_view host, std::string_view url,
+                        header_getter get, void* ctx, cache_entry** fill);
+
+    // 生成好了可缓存的响应：head不含Connection头和最后的空行，vary为响应的Vary头（可以为NULL）
+    // 返回新条目（已经为调用者加了引用），放不进缓存时返回NULL
+    cache_entry* complete(cache_entry* fill, const char* head, size_t head_len,
+                          const char* body, size_t body_len, int max_age, const char* vary,
+                          header_getter get, void* ctx, uint64_t hot_key = 0);
+
+    // 把还在表里的这个条目提前去掉，之后同一个键的请求重新生成；正在发送它的连接不受影响
+    void invalidate(cache_entry* e);
+
+    // 响应不可缓存，pass为true时短时间内同一个键的请求直接去生成，不再等待
+    void abandon(cache_entry* fill, bool pass);
+
+    static void release(cache_entry* e);
+
+    // 解析Cache-Control，返回可以缓存的秒数，不可缓存返回-1
+    static int max_age(const char* cache_control);
+
+private:
+    struct shard {
+        locker lock;
+        cond changed;                           // 占位条目填好或者放弃时广播
+        std::unordered_map<std::string, cache_entry*> entries;
+        std::unordered_map<std::string, std::string> vary;     // 基础键 -> Vary里的请求头名字
+        cache_entry* probation;                 // 试用段，表头是最近使用的
+        cache_entry* protected_head;            // 保护段
+        size_t probation_bytes;
+        size_t protected_bytes;
+        char pad[64];
+    };
+
+    shard& shard_of(const std::string& base);
+    static std::string full_key(const std::string& base, const std::string& vary, header_getter get, void* ctx);
+
+    void unlink(shard& s, cache_entry* e);
+    void push_front(shard& s, cache_entry* e, bool to_protected);
+    void remove(shard& s, cache_entry* e);      // 从分片里去掉并释放缓存持有的引用
+    void evict(shard& s);
+
+private:
+    size_t m_budget;                            // 总字节预算
+    size_t m_shard_budget;                      // 每个分片的预算
+    shard m_shards[SHARDS];
+};
+
+extern response_cache http_cache;
+
+
+#endif
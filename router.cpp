@@ -0,0 +1,230 @@
+#include"router.h"
+#include<stdio.h>
+#include<stdarg.h>
+#include<stdlib.h>
+#include<string.h>
+
+router http_router;
+
+
+response_builder::response_builder(char* buf, int size) :
+        m_buf(buf), m_size(size), m_len(0), m_failed(false), m_has_status(false),
+        m_has_type(false), m_code(200), m_set_cookie(false), m_body(0), m_body_len(0), m_body_owned(false) {
+}
+
+bool response_builder::append(const char* format, ...) {
+    if(m_failed) {
+        return false;
+    }
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(m_buf + m_len, m_size - 1 - m_len, format, arg_list);
+    va_end(arg_list);
+    if(len < 0 || len >= m_size - 1 - m_len) {
+        m_failed = true;
+        return false;
+    }
+    m_len += len;
+    return true;
+}
+
+bool response_builder::status(int code, const char* title) {
+    if(m_has_status) {
+        return false;
+    }
+    m_has_status = true;
+    m_code = code;
+    return append("HTTP/1.1 %d %s\r\n", code, title);
+}
+
+bool response_builder::header(const char* name, const char* value) {
+    if(!m_has_status) {
+        status(200, "OK");
+    }
+    if(strcasecmp(name, "Content-Type") == 0) {
+        m_has_type = true;
+    }else if(strcasecmp(name, "Cache-Control") == 0) {
+        m_cache_control = value;
+    }else if(strcasecmp(name, "Vary") == 0) {
+        m_vary = value;
+    }else if(strcasecmp(name, "Set-Cookie") == 0) {
+        m_set_cookie = true;
+    }
+    return append("%s: %s\r\n", name, value);
+}
+
+void response_builder::body(const char* data, size_t len) {
+    if(m_body_owned) {
+        free((void*)m_body);
+    }
+    m_body       = data;
+    m_body_len   = len;
+    m_body_owned = false;
+}
+
+void response_builder::body_owned(char* data, size_t len) {
+    body(data, len);
+    m_body_owned = true;
+}
+
+bool response_builder::redirect(int code, const char* location) {
+    return status(code, code == 301 ? "Moved Permanently" : "Found") && header("Location", location);
+}
+
+
+router::router() {
+    new_node(0, 0);
+}
+
+int32_t router::new_node(uint32_t off, uint32_t len) {
+    node n;
+    n.label_off    = off;
+    n.label_len    = len;
+    n.first_child  = -1;
+    n.next_sibling = -1;
+    n.exact        = -1;
+    n.prefix       = -1;
+    n.first        = len ? m_labels[off] : '\0';
+    m_nodes.push_back(n);
+    return (int32_t)m_nodes.size() - 1;
+}
+
+bool router::add(const char* path, MATCH type, route_handler handler, void* arg) {
+    if(!handler) {
+        return false;
+    }
+    route r;
+    r.type     = type;
+    r.handler  = handler;
+    r.arg      = arg;
+    r.upstream = NULL;
+    return insert(path, type, r);
+}
+
+bool router::add_proxy(const char* path, upstream_group* group) {
+    if(!group) {
+        return false;
+    }
+    route r;
+    r.type     = PREFIX;
+    r.handler  = NULL;
+    r.arg      = NULL;
+    r.upstream = group;
+    return insert(path, PREFIX, r);
+}
+
+bool router::insert(const char* path, MATCH type, const route& r) {
+    if(!path || path[0] != '/') {
+        return false;
+    }
+    size_t len = strlen(path);
+    size_t i = 0;
+    int32_t cur = 0;
+    while(i < len) {
+        // 找第一个字符相同的子节点
+        int32_t prev = -1;
+        int32_t child = m_nodes[cur].first_child;
+        while(child != -1 && m_nodes[child].first != path[i]) {
+            prev  = child;
+            child = m_nodes[child].next_sibling;
+        }
+        if(child == -1) {
+            // 没有可以共用的边，剩下的路径整个作为新边
+            uint32_t off = m_labels.size();
+            m_labels.append(path + i, len - i);
+            int32_t n = new_node(off, len - i);
+            m_nodes[n].next_sibling  = m_nodes[cur].first_child;
+            m_nodes[cur].first_child = n;
+            cur = n;
+            break;
+        }
+
+        // 求公共前缀
+        const node& c = m_nodes[child];
+        uint32_t common = 0;
+        while(common < c.label_len && i + common < len && m_labels[c.label_off + common] == path[i + common]) {
+            common++;
+        }
+        if(common == c.label_len) {
+            cur = child;
+            i += common;
+            continue;
+        }
+
+        // 只匹配了边的一部分，把这条边在common处拆成两段
+        int32_t mid = new_node(m_nodes[child].label_off, common);
+        m_nodes[mid].next_sibling   = m_nodes[child].next_sibling;
+        m_nodes[mid].first_child    = child;
+        m_nodes[child].next_sibling = -1;
+        m_nodes[child].label_off   += common;
+        m_nodes[child].label_len   -= common;
+        m_nodes[child].first        = m_labels[m_nodes[child].label_off];
+        if(prev == -1) {
+            m_nodes[cur].first_child = mid;
+        }else {
+            m_nodes[prev].next_sibling = mid;
+        }
+        cur = mid;
+        i += common;
+    }
+
+    int32_t& slot = type == EXACT ? m_nodes[cur].exact : m_nodes[cur].prefix;
+    if(slot != -1) {
+        return false;   // 重复注册
+    }
+    m_routes.push_back(r);
+    slot = (int32_t)m_routes.size() - 1;
+    return true;
+}
+
+const router::route* router::match(const char* path, size_t len, size_t* prefix_len) const {
+    int32_t best = m_nodes[0].prefix;
+    size_t best_len = 0;
+    size_t i = 0;
+    int32_t cur = 0;
+    while(i < len) {
+        int32_t child = m_nodes[cur].first_child;
+        while(child != -1 && m_nodes[child].first != path[i]) {
+            child = m_nodes[child].next_sibling;
+        }
+        if(child == -1) {
+            break;
+        }
+        const node& c = m_nodes[child];
+        if(c.label_len > len - i || memcmp(m_labels.data() + c.label_off, path + i, c.label_len) != 0) {
+            break;
+        }
+        i += c.label_len;
+        cur = child;
+        // 走过的每个带前缀路由的节点都是候选，越往下越长；前缀要在路径段的边界上结束，/api不匹配/apix
+        if(c.prefix != -1 && (i == len || path[i] == '/' || path[i - 1] == '/')) {
+            best     = c.prefix;
+            best_len = i;
+        }
+    }
+    if(i == len && m_nodes[cur].exact != -1) {
+        if(prefix_len) {
+            *prefix_len = len;
+        }
+        return &m_routes[m_nodes[cur].exact];
+    }
+    if(best == -1) {
+        return NULL;
+    }
+    if(prefix_len) {
+        *prefix_len = best_len;
+    }
+    return &m_routes[best];
+}
+
+
+void health_handler(const request_view& req, response_builder& resp, void* arg) {
+    static const char ok[] = "ok\n";
+    resp.header("Content-Type", "text/plain");
+    resp.header("Cache-Control", "no-store");
+    resp.body(ok, sizeof(ok) - 1);
+}
+
+void redirect_handler(const request_view& req, response_builder& resp, void* arg) {
+    resp.redirect(302, (const char*)arg);
+}
@@ -0,0 +1,135 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<string_view>
+#include<vector>
+#include<netinet/in.h>
+#include"header_map.h"
+
+
+// 进程内的请求处理函数注册表
+// 启动时在main里注册好路由，之后只读，工作线程并发查找不需要加锁。
+// 路由存放在一棵压缩的基数树里，查找只沿着路径走一遍，不分配内存。
+
+
+// 交给处理函数的请求视图，全部指向连接的读缓冲区，不做拷贝
+struct request_view {
+    int method;                 // http_conn::METHOD
+    std::string_view path;      // 请求路径，不含?后面的查询串
+    std::string_view query;     // 查询串，不含?
+    std::string_view rest;      // 前缀匹配时路径去掉路由前缀后剩下的部分
+    std::string_view host;      // Host 头，可能为空
+    const sockaddr_in* peer;    // 客户端地址，Unix域socket连进来的是127.0.0.1
+    const struct ucred* cred;   // Unix域socket连接对端进程的pid/uid/gid，TCP连接为NULL
+    const header_map* headers;  // 全部请求头，按编号或者名字取，值同样指向读缓冲区
+};
+
+
+// 处理函数用来生成响应：状态行和响应头直接写进连接的写缓冲区，
+// 响应体只记录指针，发送时和响应头一起writev出去
+class response_builder {
+public:
+    response_builder(char* buf, int size);
+
+    bool status(int code, const char* title);               // 设置状态行，必须在header之前调用，不调用默认200
+    bool header(const char* name, const char* value);       // 追加一个响应头
+    void body(const char* data, size_t len);                // 响应体，不拷贝，调用者保证发送完之前有效（比如静态字符串）
+    void body_owned(char* data, size_t len);                // 用malloc分配的响应体，发送完由连接free
+    bool redirect(int code, const char* location);          // 便捷函数：重定向
+
+    // 下面是给http_conn用的
+    int length() const { return m_len; }
+    bool failed() const { return m_failed; }
+    bool has_status() const { return m_has_status; }
+    bool has_content_type() const { return m_has_type; }
+    int code() const { return m_code; }
+    const char* cache_control() const { return m_cache_control.empty() ? NULL : m_cache_control.c_str(); }
+    const char* vary() const { return m_vary.empty() ? NULL : m_vary.c_str(); }
+    bool set_cookie() const { return m_set_cookie; }
+    const char* body_data() const { return m_body; }
+    size_t body_len() const { return m_body_len; }
+    bool body_is_owned() const { return m_body_owned; }
+
+private:
+    bool append(const char* format, ...);
+
+private:
+    char* m_buf;            // 连接的写缓冲区
+    int m_size;             // 写缓冲区大小
+    int m_len;              // 已经写入的长度
+    bool m_failed;          // 写缓冲区放不下
+    bool m_has_status;      // 状态行是否已经写入
+    bool m_has_type;        // 处理函数是否自己设置了Content-Type
+    int m_code;             // 状态码
+    std::string m_cache_control;    // 响应缓存用：Cache-Control 和 Vary 的值，是否设置了Cookie
+    std::string m_vary;
+    bool m_set_cookie;
+    const char* m_body;     // 响应体
+    size_t m_body_len;      // 响应体长度
+    bool m_body_owned;      // 响应体是否需要free
+};
+
+
+typedef void (*route_handler)(const request_view& req, response_builder& resp, void* arg);
+
+class upstream_group;
+
+
+class router {
+public:
+    // EXACT：路径完全相同才匹配；PREFIX：路径以它开头、并且在/处结束（或者它本身以/结尾）才匹配，多个前缀都匹配时取最长的
+    enum MATCH { EXACT = 0, PREFIX };
+
+    struct route {
+        MATCH type;
+        route_handler handler;
+        void* arg;
+        upstream_group* upstream;   // 不为空表示这是反向代理路由，请求整个转发给上游
+    };
+
+    router();
+
+    // 注册路由，只能在启动阶段、工作线程开始处理请求之前调用
+    bool add(const char* path, MATCH type, route_handler handler, void* arg = 0);
+
+    // 注册反向代理路由，前缀匹配
+    bool add_proxy(const char* path, upstream_group* group);
+
+    // 查找路由，prefix_len返回匹配上的前缀长度；没有匹配返回NULL
+    const route* match(const char* path, size_t len, size_t* prefix_len) const;
+
+    bool empty() const { return m_routes.empty(); }
+
+private:
+    // 树节点，边上的字符串存在m_labels里，子节点用first_child/next_sibling串起来
+    struct node {
+        uint32_t label_off;     // 边标签在m_labels中的偏移
+        uint32_t label_len;     // 边标签长度
+        int32_t first_child;    // 第一个子节点，-1表示没有
+        int32_t next_sibling;   // 下一个兄弟节点，-1表示没有
+        int32_t exact;          // 精确匹配的路由下标，-1表示没有
+        int32_t prefix;         // 前缀匹配的路由下标，-1表示没有
+        char first;             // 边标签的第一个字符，查找子节点时先比较它
+    };
+
+    int32_t new_node(uint32_t off, uint32_t len);
+    bool insert(const char* path, MATCH type, const route& r);
+
+private:
+    std::vector<node> m_nodes;      // m_nodes[0]是根节点，空标签
+    std::string m_labels;           // 所有边标签拼接在一起
+    std::vector<route> m_routes;
+};
+
+// 全局路由表
+extern router http_router;
+
+// 常用的处理函数
+void health_handler(const request_view& req, response_builder& resp, void* arg);      // 健康检查，返回200 ok
+void redirect_handler(const request_view& req, response_builder& resp, void* arg);    // 302重定向到arg指向的地址
+
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SHARDED_COUNTER_H
+#define SHARDED_COUNTER_H
+
+#include<stdint.h>
+#include<atomic>
+
+
+// 按线程分片的计数器：每个线程只改自己那一片，各占一条缓存行，互不干扰；读的时候把所有分片加起来
+// 同一个连接可能在主线程里加一、在工作线程里减一，所以单个分片可以是负数，只有总和有意义。
+// 读是各分片的快照之和，不是一个瞬间的精确值，只拿来做上限判断和统计足够了。
+
+
+class sharded_counter {
+public:
+    static const int SHARDS = 64;       // 线程比分片多时后来的线程共用分片，fetch_add保证仍然正确
+
+    sharded_counter() {
+        for(int i = 0; i < SHARDS; i++) {
+            m_shards[i].value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(int64_t delta) {
+        m_shards[shard()].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    int64_t load() const {
+        int64_t sum = 0;
+        for(int i = 0; i < SHARDS; i++) {
+            sum += m_shards[i].value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+private:
+    // 线程第一次用时领一个编号，之后一直用这一片
+    static int shard() {
+        static std::atomic<int> next(0);
+        static thread_local int index = next.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return index;
+    }
+
+    struct alignas(64) slot {
+        std::atomic<int64_t> value;
+    };
+
+    slot m_shards[SHARDS];
+};
+
+
+#endif
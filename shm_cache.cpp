@@ -0,0 +1,238 @@
+#include"shm_cache.h"
+#include<stdio.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+#include<sys/mman.h>
+
+shm_file_cache http_files;
+
+
+shm_file_cache::shm_file_cache() : m_base(0), m_map_len(0), m_header(0), m_entries(0), m_pins(0),
+                                   m_data(0), m_data_size(0), m_worker(0) {
+}
+
+bool shm_file_cache::init(size_t bytes) {
+    if(bytes == 0) {
+        return true;
+    }
+    size_t head_len    = align8(sizeof(header));
+    size_t entries_off = (head_len + 63) & ~(size_t)63;
+    size_t pins_off    = entries_off + sizeof(entry) * ENTRIES;
+    size_t data_off    = pins_off + sizeof(std::atomic<uint32_t>) * ENTRIES * MAX_WORKERS;
+    m_map_len = data_off + bytes;
+    // 共享的匿名映射，fork出来的进程看到的是同一份；页是全零的，正好是空表
+    void* addr = mmap(0, m_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(addr == MAP_FAILED) {
+        return false;
+    }
+    m_base      = (char*)addr;
+    m_header    = (header*)m_base;
+    m_entries   = (entry*)(m_base + entries_off);
+    m_pins      = (std::atomic<uint32_t>*)(m_base + pins_off);
+    m_data      = m_base + data_off;
+    m_data_size = bytes;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int ret = pthread_mutex_init(&m_header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if(ret != 0) {
+        munmap(m_base, m_map_len);
+        m_base = 0;
+        return false;
+    }
+    m_header->cursor = 0;
+    return true;
+}
+
+// 上一个持锁的进程死在写条目的中途：把序号是奇数的条目清空，锁标记为一致后照常使用
+void shm_file_cache::lock() {
+    if(pthread_mutex_lock(&m_header->lock) == EOWNERDEAD) {
+        for(int i = 0; i < ENTRIES; i++) {
+            entry& e = m_entries[i];
+            if(e.seq.load(std::memory_order_relaxed) & 1) {
+                e.hash.store(0, std::memory_order_relaxed);
+                e.seq.fetch_add(1, std::memory_order_release);
+            }
+        }
+        pthread_mutex_consistent(&m_header->lock);
+    }
+}
+
+void shm_file_cache::reap(int worker) {
+    if(!enabled() || worker < 0 || worker >= MAX_WORKERS) {
+        return;
+    }
+    for(int i = 0; i < ENTRIES; i++) {
+        pins(worker, i).store(0, std::memory_order_release);
+    }
+}
+
+// FNV-1a，0留给空条目
+uint64_t shm_file_cache::hash(const char* path, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+bool shm_file_cache::same_file(const entry& e, const struct stat& st) {
+    return e.ino.load(std::memory_order_relaxed) == (uint64_t)st.st_ino &&
+           e.size.load(std::memory_order_relaxed) == (uint64_t)st.st_size &&
+           e.mtime_ns.load(std::memory_order_relaxed) == st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// 先加引用再确认序号：和reclaim里先改序号再数引用配对，两边都用顺序一致的原子操作，
+// 要么读者看到序号变了自己退出，要么回收的一方看到引用不为0放弃回收
+bool shm_file_cache::pin(int i, uint32_t seq) {
+    pins(m_worker, i).fetch_add(1, std::memory_order_seq_cst);
+    if(m_entries[i].seq.load(std::memory_order_seq_cst) != seq) {
+        pins(m_worker, i).fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+void shm_file_cache::release(int handle) {
+    pins(m_worker, handle).fetch_sub(1, std::memory_order_release);
+}
+
+bool shm_file_cache::reclaim(int i) {
+    entry& e = m_entries[i];
+    if(e.hash.load(std::memory_order_relaxed) == 0) {
+        return true;
+    }
+    e.seq.fetch_add(1, std::memory_order_seq_cst);
+    for(int w = 0; w < MAX_WORKERS; w++) {
+        if(pins(w, i).load(std::memory_order_seq_cst) != 0) {
+            // 还有人在发送，内容没动过，把序号改回去，之前读到旧序号的读者照样有效
+            e.seq.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+    }
+    e.hash.store(0, std::memory_order_relaxed);
+    e.seq.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+const char* shm_file_cache::acquire(const char* path, const struct stat& st, int* handle) {
+    size_t len = strlen(path);
+    uint64_t h = hash(path, len);
+    for(int p = 0; p < PROBES; p++) {
+        int i = (h + p) & (ENTRIES - 1);
+        entry& e = m_entries[i];
+        uint32_t seq = e.seq.load(std::memory_order_acquire);
+        if((seq & 1) || e.hash.load(std::memory_order_relaxed) != h ||
+           e.path_len.load(std::memory_order_relaxed) != len || !same_file(e, st)) {
+            continue;
+        }
+        if(!pin(i, seq)) {
+            return NULL;
+        }
+        // 加上引用之后内容不会再变，可以放心比较路径
+        const char* data = m_data + e.off.load(std::memory_order_relaxed);
+        if(memcmp(data, path, len) != 0) {
+            release(i);
+            continue;
+        }
+        *handle = i;
+        return data + align8(len);
+    }
+    return NULL;
+}
+
+const char* shm_file_cache::insert(const char* path, const struct stat& st, int fd, int* handle) {
+    size_t len = strlen(path);
+    uint64_t size = st.st_size;
+    uint64_t need = align8(len) + size;
+    if(need > max_object()) {
+        return NULL;
+    }
+    uint64_t h = hash(path, len);
+
+    lock();
+    // 选条目：同一个文件已经有了就用它（可能是别的进程刚填好的，也可能是旧版本），否则找空的，
+    // 都不行就回收探测范围内的第一个
+    int slot = -1;
+    for(int p = 0; p < PROBES; p++) {
+        int i = (h + p) & (ENTRIES - 1);
+        entry& e = m_entries[i];
+        if(e.hash.load(std::memory_order_relaxed) == h && e.path_len.load(std::memory_order_relaxed) == len &&
+           memcmp(m_data + e.off.load(std::memory_order_relaxed), path, len) == 0) {
+            if(same_file(e, st) && pin(i, e.seq.load(std::memory_order_relaxed))) {
+                unlock();
+                *handle = i;
+                return m_data + e.off.load(std::memory_order_relaxed) + align8(len);
+            }
+            slot = reclaim(i) ? i : -2;
+            break;
+        }
+        if(slot == -1 && e.hash.load(std::memory_order_relaxed) == 0) {
+            slot = i;
+        }
+    }
+    if(slot == -1) {
+        slot = reclaim(h & (ENTRIES - 1)) ? (int)(h & (ENTRIES - 1)) : -2;
+    }
+    if(slot < 0) {
+        unlock();
+        return NULL;
+    }
+
+    // 数据区环形分配，覆盖掉和新位置重叠的旧条目；有还在用的就放弃这次缓存
+    uint64_t off = m_header->cursor;
+    if(off + need > m_data_size) {
+        off = 0;
+    }
+    for(int i = 0; i < ENTRIES; i++) {
+        entry& e = m_entries[i];
+        if(e.hash.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        uint64_t o = e.off.load(std::memory_order_relaxed);
+        uint64_t l = align8(e.path_len.load(std::memory_order_relaxed)) + e.size.load(std::memory_order_relaxed);
+        if(o < off + need && off < o + l && !reclaim(i)) {
+            unlock();
+            return NULL;
+        }
+    }
+
+    entry& e = m_entries[slot];
+    e.seq.fetch_add(1, std::memory_order_relaxed);      // 变成奇数，读者跳过
+    std::atomic_thread_fence(std::memory_order_release);
+    char* data = m_data + off;
+    memcpy(data, path, len);
+    uint64_t got = 0;
+    while(got < size) {
+        ssize_t n = pread(fd, data + align8(len) + got, size - got, got);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    if(got < size) {
+        e.seq.fetch_add(1, std::memory_order_release);  // hash还是0，仍然是空条目
+        unlock();
+        return NULL;
+    }
+    e.path_len.store(len, std::memory_order_relaxed);
+    e.ino.store(st.st_ino, std::memory_order_relaxed);
+    e.size.store(size, std::memory_order_relaxed);
+    e.mtime_ns.store(st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, std::memory_order_relaxed);
+    e.off.store(off, std::memory_order_relaxed);
+    e.hash.store(h, std::memory_order_relaxed);
+    uint32_t seq = e.seq.fetch_add(1, std::memory_order_release) + 1;
+    m_header->cursor = off + need;
+    pin(slot, seq);     // 持着锁，不会有人回收它
+    unlock();
+    *handle = slot;
+    return data + align8(len);
+}
@@ -0,0 +1,92 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<atomic>
+#include<pthread.h>
+#include<sys/stat.h>
+
+
+// 多个工作进程共用的静态文件缓存，放在fork之前创建的共享匿名映射里
+// 热文件的内容和元数据（inode、大小、修改时间）在所有进程里只有一份，工作进程命中时直接从这里writev，
+// 不用open、mmap、munmap，也就没有munmap引起的跨核TLB刷新，新起的进程不用自己再预热一遍。
+//
+// 读是无锁的：每个条目有一个序号，奇数表示正在改。读者先看序号、比对元数据，然后在自己进程的那一行里
+// 给条目的引用计数加一，再确认序号没变，之后条目的内容就不会被回收，直到release。
+// 写（未命中时填充、回收旧条目）由一把进程间共享的健壮锁串行化；持锁的进程崩溃时，下一个拿锁的人把
+// 写了一半的条目清掉。引用计数按进程分行存放，工作进程崩溃后主进程把它那一行清零，它手上的条目就能回收了。
+// 文件内容按写入顺序在数据区里环形分配，绕回来时覆盖最早的条目，还在发送中的条目不覆盖，这次就不缓存。
+// 新鲜度和原来一样靠每个请求的stat：inode、大小、修改时间有一个对不上就当作未命中，重新填充。
+
+
+class shm_file_cache {
+public:
+    static const int ENTRIES = 4096;            // 条目数，2的幂
+    static const int PROBES = 8;                // 线性探测的最大长度
+    static const int MAX_WORKERS = 64;          // 最多的工作进程数
+
+    shm_file_cache();
+
+    // 在fork之前调用，bytes是文件内容区的大小，0表示关闭
+    bool init(size_t bytes);
+    bool enabled() const { return m_base != 0; }
+
+    // fork出来的工作进程调用，worker是它的编号，引用计数记在对应的行里
+    void attach(int worker) { m_worker = worker; }
+
+    // 主进程在工作进程退出后调用，清掉它持有的引用
+    void reap(int worker);
+
+    // 查找path，元数据要和st一致。命中返回文件内容，handle用来release
+    const char* acquire(const char* path, const struct stat& st, int* handle);
+
+    // 未命中时从fd读入文件内容并返回（已经加了引用）；文件太大、空间都被占着时返回NULL
+    const char* insert(const char* path, const struct stat& st, int fd, int* handle);
+
+    void release(int handle);
+
+    size_t max_object() const { return m_data_size / 4; }
+
+private:
+    // 一个条目一条缓存行；字段都是原子变量，读者在序号的保护下读
+    struct alignas(64) entry {
+        std::atomic<uint32_t> seq;              // 奇数表示正在修改
+        std::atomic<uint32_t> path_len;
+        std::atomic<uint64_t> hash;             // 0表示空
+        std::atomic<uint64_t> ino;
+        std::atomic<uint64_t> size;
+        std::atomic<int64_t> mtime_ns;
+        std::atomic<uint64_t> off;              // 在数据区里的偏移，先是路径，按8字节对齐后是文件内容
+    };
+
+    struct header {
+        pthread_mutex_t lock;                   // 写者之间的锁，进程间共享、健壮
+        uint64_t cursor;                        // 数据区里下一次分配的位置
+    };
+
+    static uint64_t hash(const char* path, size_t len);
+    static uint64_t align8(uint64_t n) { return (n + 7) & ~7ULL; }
+    static bool same_file(const entry& e, const struct stat& st);
+
+    std::atomic<uint32_t>& pins(int worker, int i) { return m_pins[(size_t)worker * ENTRIES + i]; }
+    void lock();
+    void unlock() { pthread_mutex_unlock(&m_header->lock); }
+    bool reclaim(int i);                        // 持锁调用：没有进程在用就清空条目
+    bool pin(int i, uint32_t seq);              // 给条目加引用，序号变了返回false
+
+private:
+    char* m_base;                               // 整个共享映射
+    size_t m_map_len;
+    header* m_header;
+    entry* m_entries;
+    std::atomic<uint32_t>* m_pins;              // MAX_WORKERS行，每行ENTRIES个计数
+    char* m_data;
+    size_t m_data_size;
+    int m_worker;                               // 本进程的编号
+};
+
+extern shm_file_cache http_files;
+
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include<cstddef>
+#include<new>
+#include<utility>
+#include<type_traits>
+
+
+// 类型擦除的任务：任意可调用对象，只能移动不能拷贝
+// 捕获的数据不超过INLINE_SIZE字节（并且移动不抛异常）时直接放在对象里，创建、入队、执行都不分配内存；
+// 更大的才在堆上分配。整个对象正好一条缓存行。
+// 线程池用它跑请求以外的后台工作（缓存预热、压缩、刷日志），和请求共用同一组线程。
+class task {
+public:
+    static const size_t INLINE_SIZE = 48;
+
+    task() : m_ops(0) {}
+
+    template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, task>::value>::type>
+    task(F&& f) : m_ops(0) {
+        typedef typename std::decay<F>::type fn;
+        if(sizeof(fn) <= INLINE_SIZE && alignof(fn) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<fn>::value) {
+            new (m_buf) fn(std::forward<F>(f));
+            m_ops = &inline_ops<fn>::table;
+        }else {
+            *(fn**)m_buf = new fn(std::forward<F>(f));
+            m_ops = &heap_ops<fn>::table;
+        }
+    }
+
+    task(task&& o) : m_ops(o.m_ops) {
+        if(m_ops) {
+            m_ops->move(m_buf, o.m_buf);
+            o.m_ops = 0;
+        }
+    }
+
+    task& operator=(task&& o) {
+        if(this != &o) {
+            reset();
+            m_ops = o.m_ops;
+            if(m_ops) {
+                m_ops->move(m_buf, o.m_buf);
+                o.m_ops = 0;
+            }
+        }
+        return *this;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task() { reset(); }
+
+    explicit operator bool() const { return m_ops != 0; }
+
+    void operator()() { m_ops->invoke(m_buf); }
+
+    void reset() {
+        if(m_ops) {
+            m_ops->destroy(m_buf);
+            m_ops = 0;
+        }
+    }
+
+private:
+    // 每种可调用对象一张静态的函数表
+    struct ops {
+        void (*invoke)(void* buf);
+        void (*move)(void* dst, void* src);     // 移动到dst，并销毁src
+        void (*destroy)(void* buf);
+    };
+
+    template<typename F>
+    struct inline_ops {
+        static void invoke(void* buf) { (*(F*)buf)(); }
+        static void move(void* dst, void* src) {
+            new (dst) F(std::move(*(F*)src));
+            ((F*)src)->~F();
+        }
+        static void destroy(void* buf) { ((F*)buf)->~F(); }
+        static const ops table;
+    };
+
+    template<typename F>
+    struct heap_ops {
+        static void invoke(void* buf) { (**(F**)buf)(); }
+        static void move(void* dst, void* src) { *(F**)dst = *(F**)src; }
+        static void destroy(void* buf) { delete *(F**)buf; }
+        static const ops table;
+    };
+
+private:
+    alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+    const ops* m_ops;
+};
+
+template<typename F>
+const task::ops task::inline_ops<F>::table = { &task::inline_ops<F>::invoke, &task::inline_ops<F>::move, &task::inline_ops<F>::destroy };
+
+template<typename F>
+const task::ops task::heap_ops<F>::table = { &task::heap_ops<F>::invoke, &task::heap_ops<F>::move, &task::heap_ops<F>::destroy };
+
+
+#endif
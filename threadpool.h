@@ -2,152 +2,492 @@
 #define THREADPOOL_H
 
 #include<pthread.h>
-#include<list>
+#include<time.h>
+#include<stdint.h>
+#include<unistd.h>
+#include<errno.h>
+#include<atomic>
+#include<vector>
+#include<utility>
 #include"locker.h"
+#include"task.h"
+#include"profiler.h"
 #include<cstdio>
 
 
 // 线程池类，定义成模板类是为了代码的复用，模板参数T是任务类
+// 除了T*（调用process()，原来的快速路径），还可以提交类型擦除的task做后台工作，两种任务共用队列和线程。
+// 优先级模式下请求按估计的处理代价分成几类，每类一个FIFO队列，工作线程先取代价小的类：
+// 一批大文件请求排在前面时，小页面和健康检查不用跟在后面等。
+// 为了不让大请求饿死，每个请求每等待AGING_MS毫秒就往上提一类，取任务时比较各个队头提升之后的类别，
+// 相同时取原本类别高的，所以一个请求最多多等 类别差 * AGING_MS 毫秒。
+//
+// 线程数在[最少, 最多]之间伸缩，每CONTROL_MS毫秒按这段时间的统计调整一次（入队和取任务时顺便检查，不另开线程）：
+// 请求在队列里等的时间超过TARGET_DELAY_US，并且线程数还不到CPU数、或者工作线程的时间大半花在阻塞上
+// （处理请求的墙上时间减去线程CPU时间，比如冷的磁盘读），就加线程，一次最多加一半；
+// 线程都在算、CPU已经占满时再加线程只会增加争用，不加。
+// 队列几乎不等、线程忙的时间合计不到一半的线程数时，每次让一个线程退出；
+// 另外空闲等了IDLE_MS还没有任务的线程也会退出，线程数不会低于最少的数量。
+//
+// 最先创建的“最少数量”个线程是固定线程，不会退出，每个有自己的队列：指定了affinity的后台任务总在
+// 同一个固定线程上按提交顺序执行，比如刷日志不用再加锁。
+// 队列是环形缓冲区，满了才翻倍扩容，稳定之后入队出队都不分配内存；每个线程有自己的信号量，
+// 空闲的线程排在一个栈里，入队时叫醒最近睡下的那个，指定了线程的任务只叫醒那个线程。
+
+
+// 任务的优先级，数字越小越先处理
+enum TASK_PRIORITY { PRIO_HIGH = 0, PRIO_NORMAL, PRIO_BULK, PRIO_CLASSES };
+
+
+// 可扩容的环形队列，容量是2的幂
+template<typename E>
+class task_ring {
+public:
+    task_ring() : m_buf(NULL), m_cap(0), m_head(0), m_size(0) {}
+    ~task_ring() { delete[] m_buf; }
+
+    bool empty() const { return m_size == 0; }
+    size_t size() const { return m_size; }
+    E& front() { return m_buf[m_head]; }
+
+    void push_back(E&& e) {
+        if(m_size == m_cap) {
+            grow();
+        }
+        m_buf[(m_head + m_size) & (m_cap - 1)] = std::move(e);
+        m_size++;
+    }
+
+    void pop_front() {
+        m_head = (m_head + 1) & (m_cap - 1);
+        m_size--;
+    }
+
+private:
+    void grow() {
+        size_t cap = m_cap ? m_cap * 2 : 64;
+        E* buf = new E[cap];
+        for(size_t i = 0; i < m_size; i++) {
+            buf[i] = std::move(m_buf[(m_head + i) & (m_cap - 1)]);
+        }
+        delete[] m_buf;
+        m_buf = buf;
+        m_cap = cap;
+        m_head = 0;
+    }
+
+    task_ring(const task_ring&) = delete;
+    task_ring& operator=(const task_ring&) = delete;
+
+private:
+    E* m_buf;
+    size_t m_cap;
+    size_t m_head;
+    size_t m_size;
+};
 
 
 template<typename T>
 class threadpool {
 
 public:
-    // 构造
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    static const int AGING_MS = 20;             // 每等待这么久提升一类
+    static const int CONTROL_MS = 50;           // 两次调整线程数的最小间隔
+    static const int TARGET_DELAY_US = 2000;    // 队列等待时间的目标
+    static const int IDLE_MS = 5000;            // 空闲这么久的线程退出
+
+    // 构造，thread_number是最少的线程数，max_threads是最多的线程数，不大于thread_number时线程数固定
+    // prioritized为false时所有请求都进同一个队列，和原来一样严格按先后顺序处理
+    threadpool(int thread_number = 8, int max_requests = 10000, bool prioritized = false, int max_threads = 0);
     // 析构
     ~threadpool();
 
-    // 添加请求到请求队列
-    bool append(T* request);
+    // 添加请求到请求队列，priority是TASK_PRIORITY
+    bool append(T* request, int priority = PRIO_NORMAL);
+
+    // 提交后台任务；affinity不小于0时交给第 affinity % 最少线程数 个固定线程执行，同一个affinity的任务不会并发
+    bool submit(task&& work, int priority = PRIO_BULK, int affinity = -1);
 
 private:
+    struct entry {
+        T* request;             // 不为NULL时调用request->process()
+        task work;              // 否则执行它
+        int priority;
+        int64_t enqueue_us;     // 入队的时间
+    };
+
+    struct worker_slot {
+        sem wake;               // 空闲时在上面等
+        bool used;              // 有线程占着这个槽
+        bool idle;              // 在m_idle里
+        task_ring<entry> local; // 指定给这个线程的任务，只有固定线程有
+    };
 
     static void* worker(void* arg);
     void run();
+    static int64_t now_us();
+    static int64_t thread_cpu_us();
+    bool push(entry&& e, int affinity);     // 持锁调用：入队并叫醒一个线程
+    bool pick(int slot, entry* e, int64_t now);     // 持锁调用：按提升后的类别选一个任务
+    int adjust(int64_t now);                // 持锁调用：按统计调整线程数，返回要新建的线程数
+    void spawn(int n, bool verbose = false);    // 不持锁调用；verbose只在构造时打开，动态扩容在请求路径上不打印
+    void unidle(int slot);                  // 持锁调用：把线程从空闲栈里拿出来
 private:
-    // 线程的数量
+    // 当前线程的数量，以及伸缩的上下限
     int m_thread_number;
-
-    // 线程数组 大小为m_thread_number
-    pthread_t* m_threads;
+    int m_min_threads;
+    int m_max_threads;
+    int m_cpus;
 
     // 请求队列中，最多允许等待处理的请求的数量
     int m_max_requests;
 
-    // 请求队列
-    std::list<T*> m_workqueue;
+    // 请求队列，每个优先级一个
+    task_ring<entry> m_workqueue[PRIO_CLASSES];
 
-    // 互斥锁
-    locker m_queue_mutex;
+    // 所有队列（包括固定线程自己的队列）里的任务总数
+    int m_queued;
 
-    // 信号量来判断是否有任务需要处理
-    sem m_queue_sem;
+    // 是否按优先级调度
+    bool m_prioritized;
+
+    // 每个线程一个槽，前m_min_threads个给固定线程；空闲线程的槽号，后进先出
+    worker_slot* m_slots;
+    std::vector<int> m_idle;
+
+    // 上次调整以来的统计：取出的任务数、它们在队列里等待的总时间；工作线程处理请求的墙上时间和其中阻塞的时间
+    int64_t m_last_adjust_us;
+    int64_t m_picked;
+    int64_t m_wait_us;
+    std::atomic<int64_t> m_busy_us;
+    std::atomic<int64_t> m_blocked_us;
+
+    // 等着退出的线程数，缩容时加一，下一个处理完任务的非固定线程看到后退出；空闲超时退出的线程也减一
+    std::atomic<int> m_retiring;
+
+    // 互斥锁，保护队列、线程槽和统计
+    locker m_queue_mutex;
 
     // 是否结束线程
     bool m_stop;
 };
 // 初始化列表方式初始化参数： threadpool(int XXX, int XXX) : m_thread_number(thread_number) ........ {}
 template<typename T>
-threadpool< T >::threadpool(int thread_number, int max_requests): 
-        m_thread_number(thread_number), m_max_requests(max_requests), 
-        m_stop(false), m_threads(NULL) {
-    if((thread_number == 0) || (max_requests <= 0)) {
+threadpool< T >::threadpool(int thread_number, int max_requests, bool prioritized, int max_threads):
+        m_thread_number(0), m_min_threads(thread_number), m_max_threads(max_threads), m_max_requests(max_requests),
+        m_queued(0), m_prioritized(prioritized), m_slots(NULL), m_last_adjust_us(0), m_picked(0),
+        m_wait_us(0), m_busy_us(0), m_blocked_us(0), m_retiring(0), m_stop(false) {
+    if((thread_number <= 0) || (max_requests <= 0)) {
         throw std:: exception();
     }
+    if(m_max_threads < m_min_threads) {
+        m_max_threads = m_min_threads;
+    }
+    m_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(m_cpus <= 0) {
+        m_cpus = 1;
+    }
+    m_slots = new worker_slot[m_max_threads];
+    for(int i = 0; i < m_max_threads; i++) {
+        m_slots[i].used = false;
+        m_slots[i].idle = false;
+    }
+    m_idle.reserve(m_max_threads);
 
-    m_threads = new pthread_t[m_thread_number];
-    if(!m_threads) {
+    // 创建最少数量的线程，并将他们设置成线程脱离
+    m_queue_mutex.lock();
+    m_thread_number = m_min_threads;
+    m_last_adjust_us = now_us();
+    m_queue_mutex.unlock();
+    spawn(m_min_threads, true);
+    if(m_thread_number < m_min_threads) {
         throw std::exception();
     }
+}
+
+
+template<typename T>
+threadpool<T>::~threadpool() {
+    m_stop = true;
+
+}
 
-    // 创建thread_number个线程， 并将他们设置成线程脱离
-    for(int i = 0; i < m_thread_number; i++) {
-        printf("creating %dth thread\n", i);
-        // 创建线程， 线程号为m_threads + i, 线程执行函数worker，传参this指针
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-            delete [] m_threads;
-            throw std:: exception();
+// 创建n个线程；失败的从线程数里减掉
+template<typename T>
+void threadpool<T>::spawn(int n, bool verbose) {
+    for(int i = 0; i < n; i++) {
+        if(verbose) {
+            printf("creating %dth thread\n", i);
         }
-        // 设置线程分离
-        if(pthread_detach(m_threads[i]) != 0) {
-            delete[] m_threads;
-            throw std::exception();
+        // 创建线程，线程执行函数worker，传参this指针，然后设置线程分离
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, worker, this) != 0) {
+            m_queue_mutex.lock();
+            m_thread_number -= n - i;
+            m_queue_mutex.unlock();
+            return;
         }
+        pthread_detach(tid);
     }
 }
 
-
 template<typename T>
-threadpool<T>::~threadpool() {
-    delete[] m_threads;
-    m_stop = true;
+void threadpool<T>::unidle(int slot) {
+    for(size_t i = 0; i < m_idle.size(); i++) {
+        if(m_idle[i] == slot) {
+            m_idle.erase(m_idle.begin() + i);
+            break;
+        }
+    }
+    m_slots[slot].idle = false;
+}
 
+template<typename T>
+bool threadpool<T>::push(entry&& e, int affinity) {
+    // 工作队列已经放满了最大任务量，返回添加失败
+    if(m_queued >= m_max_requests) {
+        return false;
+    }
+    m_queued++;
+    if(affinity >= 0) {
+        int slot = affinity % m_min_threads;
+        m_slots[slot].local.push_back(std::move(e));
+        if(m_slots[slot].idle) {
+            unidle(slot);
+            m_slots[slot].wake.post();
+        }
+        return true;
+    }
+    int priority = e.priority;
+    m_workqueue[priority].push_back(std::move(e));
+    // 没有空闲的线程就不用叫：忙着的线程睡下之前都会再看一遍队列
+    if(!m_idle.empty()) {
+        int slot = m_idle.back();
+        m_idle.pop_back();
+        m_slots[slot].idle = false;
+        m_slots[slot].wake.post();
+    }
+    return true;
 }
 
-// 向工作队列中添加任务，主体流程：上锁、添加、解锁、信号量加一
+// 向工作队列中添加任务，主体流程：上锁、添加、叫醒一个空闲线程、解锁
 template<typename T>
-bool threadpool<T>::append(T* request) {
+bool threadpool<T>::append(T* request, int priority) {
+    if(!m_prioritized || priority < 0 || priority >= PRIO_CLASSES) {
+        priority = m_prioritized ? PRIO_NORMAL : PRIO_HIGH;
+    }
+    entry e;
+    e.request = request;
+    e.priority = priority;
+    e.enqueue_us = now_us();
 
     //  线程同步上互斥锁
     m_queue_mutex.lock();
-    // 如果当前工作队列超过最大任务量，解锁返回添加失败
-    if(m_workqueue.size() > m_max_requests) {
+    if(!push(std::move(e), -1)) {
         m_queue_mutex.unlock();
         return false;
     }
-    // 正常的话， 工作队列添加请求
-    m_workqueue.push_back(request);
+    // 工作线程都堵住的时候没有人取任务，入队时也要检查一下要不要加线程
+    int grow = adjust(now_us());
     // 线程同步， 解互斥锁
     m_queue_mutex.unlock();
-    // 任务列表信号量+1
-    m_queue_sem.post();
+    spawn(grow);
     return true;
 }
 
+template<typename T>
+bool threadpool<T>::submit(task&& work, int priority, int affinity) {
+    if(!m_prioritized || priority < 0 || priority >= PRIO_CLASSES) {
+        priority = m_prioritized ? PRIO_NORMAL : PRIO_HIGH;
+    }
+    entry e;
+    e.request = NULL;
+    e.work = std::move(work);
+    e.priority = priority;
+    e.enqueue_us = now_us();
+
+    m_queue_mutex.lock();
+    bool ok = push(std::move(e), affinity);
+    int grow = ok && affinity < 0 ? adjust(now_us()) : 0;
+    m_queue_mutex.unlock();
+    spawn(grow);
+    return ok;
+}
+
 // 子线程里的工作：运行run函数的工作
 template<typename T>
 void* threadpool<T>::worker(void* arg) {
 
     threadpool* pool = (threadpool*) arg;
+    http_profiler.attach_thread();
     pool->run();
+    http_profiler.detach_thread();
     return pool;
 }
 
+template<typename T>
+int64_t threadpool<T>::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+template<typename T>
+int64_t threadpool<T>::thread_cpu_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-// run函数是要进行的处理：通过信号量判断是否有工作需要处理，如有，进行如下操作：
-// 上锁、拿到请求、解锁（需要线程同步)、处理
+// 每个队列里越靠前的等得越久，所以只要比较各个队头；固定线程自己的队列按任务的优先级一起比较
+template<typename T>
+bool threadpool<T>::pick(int slot, entry* e, int64_t now) {
+    task_ring<entry>* best = NULL;
+    int64_t best_class = 0;
+    for(int c = 0; c <= PRIO_CLASSES; c++) {
+        task_ring<entry>* q = c < PRIO_CLASSES ? &m_workqueue[c] : &m_slots[slot].local;
+        if(q->empty()) {
+            continue;
+        }
+        int64_t effective = q->front().priority - (now - q->front().enqueue_us) / (AGING_MS * 1000);
+        if(!best || effective < best_class) {
+            best = q;
+            best_class = effective;
+        }
+    }
+    if(!best) {
+        return false;
+    }
+    *e = std::move(best->front());
+    best->pop_front();
+    m_wait_us += now - e->enqueue_us;
+    m_picked++;
+    m_queued--;
+    return true;
+}
+
+// 等待时间取这段时间里取出的任务的平均值和现在队头已经等了的时间中大的那个：
+// 所有线程都堵住时没有任务被取出，只有队头的等待时间在涨
+template<typename T>
+int threadpool<T>::adjust(int64_t now) {
+    int64_t elapsed = now - m_last_adjust_us;
+    if(m_min_threads == m_max_threads || elapsed < CONTROL_MS * 1000) {
+        return 0;
+    }
+    int64_t delay = m_picked ? m_wait_us / m_picked : 0;
+    for(int c = 0; c < PRIO_CLASSES; c++) {
+        if(!m_workqueue[c].empty() && now - m_workqueue[c].front().enqueue_us > delay) {
+            delay = now - m_workqueue[c].front().enqueue_us;
+        }
+    }
+    int64_t busy = m_busy_us.exchange(0, std::memory_order_relaxed);
+    int64_t blocked = m_blocked_us.exchange(0, std::memory_order_relaxed);
+    m_last_adjust_us = now;
+    m_picked = 0;
+    m_wait_us = 0;
+
+    // 空闲超时退出的线程也顶掉了名额，名额不能比最少线程数之外的线程还多，否则之后新建的线程处理完一个任务就退出
+    int surplus = m_thread_number - m_min_threads;
+    int r = m_retiring.load(std::memory_order_relaxed);
+    while(r > surplus && !m_retiring.compare_exchange_weak(r, surplus, std::memory_order_relaxed)) {
+    }
+
+    int grow = 0;
+    if(delay > TARGET_DELAY_US) {
+        // 这段时间一个请求都没处理完，说明线程全堵住了，当作全是阻塞
+        bool blocking = busy == 0 || blocked * 2 > busy;
+        if(m_thread_number < m_max_threads && (m_thread_number < m_cpus || blocking)) {
+            grow = m_thread_number / 2 + 1;
+            if(grow > m_max_threads - m_thread_number) {
+                grow = m_max_threads - m_thread_number;
+            }
+            m_thread_number += grow;
+            m_retiring.store(0, std::memory_order_relaxed);     // 要扩容了，之前的缩容名额作废
+        }
+    }else if(delay < TARGET_DELAY_US / 2 && busy * 2 < (int64_t)m_thread_number * elapsed &&
+             m_thread_number - m_retiring.load(std::memory_order_relaxed) > m_min_threads) {
+        m_retiring.fetch_add(1, std::memory_order_relaxed);
+    }
+    return grow;
+}
+
+
+// run函数是要进行的处理：上锁、拿到任务、解锁（需要线程同步)、处理；没有任务时在自己的信号量上等
 template<typename T>
 void threadpool<T>::run() {
+    m_queue_mutex.lock();
+    // 占一个槽：构造时先创建的线程拿到前面的槽，成为固定线程
+    int slot = 0;
+    while(m_slots[slot].used) {
+        slot++;
+    }
+    m_slots[slot].used = true;
+    bool pinned = slot < m_min_threads;
+    worker_slot& self = m_slots[slot];
+
     while(!m_stop) {
-        // 判断有无任务需要完成，没有的话会阻塞， 有的话信号量减一
-        m_queue_sem.wait();
-        // 往下运行即为有任务
-        // 互斥锁上锁
-        m_queue_mutex.lock();
-        // 如果工作列表为空，解锁继续循环
-        if(m_workqueue.empty()) {
+        // 得到任务并从工作列表中删除
+        int64_t start = now_us();
+        entry e;
+        if(pick(slot, &e, start)) {
+            int grow = adjust(start);
             m_queue_mutex.unlock();
+            spawn(grow);
+
+            // 执行任务，记下墙上时间和其中没有在用CPU的时间
+            int64_t cpu = thread_cpu_us();
+            if(e.request) {
+                e.request->process();
+            }else {
+                e.work();
+                e.work.reset();
+            }
+            int64_t wall = now_us() - start;
+            int64_t blocked = wall - (thread_cpu_us() - cpu);
+            m_busy_us.fetch_add(wall, std::memory_order_relaxed);
+            m_blocked_us.fetch_add(blocked > 0 ? blocked : 0, std::memory_order_relaxed);
+
+            // 缩容：非固定线程领一个退出的名额
+            int r = pinned ? 0 : m_retiring.load(std::memory_order_relaxed);
+            while(r > 0 && !m_retiring.compare_exchange_weak(r, r - 1, std::memory_order_relaxed)) {
+            }
+            m_queue_mutex.lock();
+            if(r > 0 && m_thread_number > m_min_threads) {
+                break;
+            }
             continue;
         }
 
-        // 得到请求
-        T* request = m_workqueue.front();
-        // 从工作列表中删除该请求，并解锁
-        m_workqueue.pop_front();
+        // 没有任务，进空闲栈睡下；空闲太久的非固定线程退出
+        self.idle = true;
+        m_idle.push_back(slot);
         m_queue_mutex.unlock();
-
-        // 如果没拿到请求， 继续循环
-        if(!request) {
-            continue;
+        bool woken = self.wake.timewait(IDLE_MS);
+        int err = errno;
+        m_queue_mutex.lock();
+        if(!woken) {
+            if(!self.idle) {
+                // 超时的同时被叫醒了，把那次post消耗掉
+                m_queue_mutex.unlock();
+                self.wake.wait();
+                m_queue_mutex.lock();
+            }else {
+                unidle(slot);
+                if(err == ETIMEDOUT && !pinned && m_thread_number > m_min_threads) {
+                    // 自己退出了，顶掉一个缩容名额
+                    int r = m_retiring.load(std::memory_order_relaxed);
+                    while(r > 0 && !m_retiring.compare_exchange_weak(r, r - 1, std::memory_order_relaxed)) {
+                    }
+                    break;
+                }
+            }
         }
-
-        // 执行请求的处理程序
-        request->process();
     }
-} 
+    m_thread_number--;
+    self.used = false;
+    m_queue_mutex.unlock();
+}
 
 
 
-#endif
\ No newline at end of file
+#endif
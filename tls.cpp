@@ -0,0 +1,394 @@
+#include"tls.h"
+#include<stdio.h>
+
+tls_context http_tls;
+
+
+#ifdef USE_OPENSSL
+
+#include<stdint.h>
+#include<string.h>
+#include<errno.h>
+#include<atomic>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<sys/socket.h>
+#include<linux/tls.h>
+#include<openssl/ssl.h>
+#include<openssl/err.h>
+#include<openssl/evp.h>
+#include<openssl/kdf.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+
+static const long SESSION_CACHE_SIZE = 20000;   // 服务端会话缓存的条目数
+static const long SESSION_TIMEOUT = 3600;       // 会话和票据的有效期（秒）
+static const unsigned char SESSION_ID_CONTEXT[] = "webserver";
+
+// 握手状态，握手完成后连同SSL对象一起释放
+struct tls_conn {
+    SSL* ssl;
+    int sockfd;
+    bool done;                  // 握手完成，内核已经接手
+    // 交给内核时要带上当前的记录序号：从对应方向换成最终密钥之后开始数记录
+    bool tx_counting;
+    bool rx_counting;
+    uint64_t tx_seq;
+    uint64_t rx_seq;
+    // TLS 1.3 的应用流量密钥，从keylog回调里拿到
+    unsigned char client_secret[EVP_MAX_MD_SIZE];
+    unsigned char server_secret[EVP_MAX_MD_SIZE];
+    size_t client_secret_len;
+    size_t server_secret_len;
+};
+
+// 一个方向的密钥材料
+struct tls_keys {
+    unsigned char key[32];
+    unsigned char iv[12];           // TLS 1.3：完整的12字节nonce基值；TLS 1.2：前4字节是隐式的salt
+    size_t key_len;
+};
+
+
+// 统计记录：每写/读一条记录OpenSSL都会报一次记录头；
+// TLS 1.2 在ChangeCipherSpec之后、TLS 1.3 在Finished之后开始用最终的密钥，之后的记录都要计入序号
+static void msg_callback(int write_p, int version, int content_type, const void* buf, size_t len, SSL* ssl, void* arg) {
+    tls_conn* c = (tls_conn*)SSL_get_app_data(ssl);
+    if(!c) {
+        return;
+    }
+    bool& counting = write_p ? c->tx_counting : c->rx_counting;
+    uint64_t& seq = write_p ? c->tx_seq : c->rx_seq;
+    bool tls13 = SSL_version(ssl) == TLS1_3_VERSION;
+    const unsigned char* p = (const unsigned char*)buf;
+    if(content_type != SSL3_RT_HEADER) {
+        if(tls13 && content_type == SSL3_RT_HANDSHAKE && len > 0 && p[0] == SSL3_MT_FINISHED) {
+            counting = true;
+            seq = 0;
+        }
+        return;
+    }
+    if(counting) {
+        seq++;
+    }else if(!tls13 && len > 0 && p[0] == SSL3_RT_CHANGE_CIPHER_SPEC) {
+        // 读方向不会单独报ChangeCipherSpec消息，只能看记录头；TLS 1.3 里兼容用的ChangeCipherSpec不算
+        counting = true;
+        seq = 0;
+    }
+}
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// TLS 1.3 的流量密钥只能从keylog回调里拿到，格式是 "标签 client_random 密钥"，都是十六进制
+static void keylog_callback(const SSL* ssl, const char* line) {
+    tls_conn* c = (tls_conn*)SSL_get_app_data(ssl);
+    if(!c) {
+        return;
+    }
+    unsigned char* out;
+    size_t* out_len;
+    if(strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0) {
+        out = c->client_secret;
+        out_len = &c->client_secret_len;
+    }else if(strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0) {
+        out = c->server_secret;
+        out_len = &c->server_secret_len;
+    }else {
+        return;
+    }
+    const char* hex = strchr(line + 24, ' ');
+    if(!hex) {
+        return;
+    }
+    hex++;
+    size_t n = 0;
+    while(n < EVP_MAX_MD_SIZE && hex[2 * n] && hex[2 * n + 1]) {
+        int hi = hex_value(hex[2 * n]);
+        int lo = hex_value(hex[2 * n + 1]);
+        if(hi < 0 || lo < 0) {
+            return;
+        }
+        out[n++] = (unsigned char)(hi << 4 | lo);
+    }
+    *out_len = n;
+}
+
+// ALPN：客户端支持h2就用h2，否则http/1.1
+static int alpn_callback(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                         const unsigned char* in, unsigned int inlen, void* arg) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    unsigned char* selected;
+    if(SSL_select_next_proto(&selected, outlen, protos, sizeof(protos) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// HKDF-Expand-Label(secret, label, "", len)，RFC 8446 7.1
+static bool expand_label(const EVP_MD* md, const unsigned char* secret, size_t secret_len,
+                         const char* label, unsigned char* out, size_t len) {
+    unsigned char info[64];
+    size_t label_len = strlen(label);
+    size_t n = 0;
+    info[n++] = (unsigned char)(len >> 8);
+    info[n++] = (unsigned char)len;
+    info[n++] = (unsigned char)(6 + label_len);
+    memcpy(info + n, "tls13 ", 6);
+    n += 6;
+    memcpy(info + n, label, label_len);
+    n += label_len;
+    info[n++] = 0;
+
+    EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    bool ok = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+              EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+              EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+              EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_len) > 0 &&
+              EVP_PKEY_CTX_add1_hkdf_info(pctx, info, n) > 0 &&
+              EVP_PKEY_derive(pctx, out, &len) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ok;
+}
+
+// TLS 1.2 的密钥块：PRF(master_secret, "key expansion", server_random + client_random)
+// AEAD套件没有MAC密钥，依次是 客户端密钥、服务端密钥、客户端IV、服务端IV
+static bool tls12_keys(SSL* ssl, const EVP_MD* md, size_t key_len, tls_keys* client, tls_keys* server) {
+    unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+    unsigned char client_random[SSL3_RANDOM_SIZE];
+    unsigned char server_random[SSL3_RANDOM_SIZE];
+    size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+    SSL_get_client_random(ssl, client_random, sizeof(client_random));
+    SSL_get_server_random(ssl, server_random, sizeof(server_random));
+
+    unsigned char block[2 * 32 + 2 * 4];
+    size_t block_len = 2 * key_len + 2 * 4;
+    EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, NULL);
+    bool ok = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+              EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+              EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, master_len) > 0 &&
+              EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, (const unsigned char*)"key expansion", 13) > 0 &&
+              EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random, sizeof(server_random)) > 0 &&
+              EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random, sizeof(client_random)) > 0 &&
+              EVP_PKEY_derive(pctx, block, &block_len) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    OPENSSL_cleanse(master, sizeof(master));
+    if(ok) {
+        memcpy(client->key, block, key_len);
+        memcpy(server->key, block + key_len, key_len);
+        memcpy(client->iv, block + 2 * key_len, 4);
+        memcpy(server->iv, block + 2 * key_len + 4, 4);
+        client->key_len = server->key_len = key_len;
+    }
+    OPENSSL_cleanse(block, sizeof(block));
+    return ok;
+}
+
+// 按内核的格式填一个方向的参数，AES-GCM-128和256的结构体只有密钥长度不同
+static bool install_keys(int sockfd, int direction, bool tls13, const tls_keys& k, uint64_t seq) {
+    unsigned char rec_seq[8];
+    for(int i = 0; i < 8; i++) {
+        rec_seq[i] = (unsigned char)(seq >> (56 - 8 * i));
+    }
+    union {
+        tls12_crypto_info_aes_gcm_128 gcm128;
+        tls12_crypto_info_aes_gcm_256 gcm256;
+    } info;
+    memset(&info, 0, sizeof(info));
+    socklen_t len;
+    unsigned char *iv, *key, *salt, *seq_out;
+    if(k.key_len == 16) {
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        iv = info.gcm128.iv; key = info.gcm128.key; salt = info.gcm128.salt; seq_out = info.gcm128.rec_seq;
+        len = sizeof(info.gcm128);
+    }else {
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        iv = info.gcm256.iv; key = info.gcm256.key; salt = info.gcm256.salt; seq_out = info.gcm256.rec_seq;
+        len = sizeof(info.gcm256);
+    }
+    info.gcm128.info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+    memcpy(key, k.key, k.key_len);
+    memcpy(salt, k.iv, 4);
+    if(tls13) {
+        memcpy(iv, k.iv + 4, 8);
+    }else {
+        memcpy(iv, rec_seq, 8);     // OpenSSL的TLS 1.2显式nonce就是记录序号，内核接着往下用
+    }
+    memcpy(seq_out, rec_seq, 8);
+    bool ok = setsockopt(sockfd, SOL_TLS, direction, &info, len) == 0;
+    OPENSSL_cleanse(&info, sizeof(info));
+    return ok;
+}
+
+// 握手完成：算出两个方向的密钥，交给内核
+static bool enable_ktls(tls_conn* c) {
+    SSL* ssl = c->ssl;
+    // 内核只能从记录边界接手，OpenSSL手里不能有已经读进来还没交出去的数据
+    if(SSL_has_pending(ssl)) {
+        return false;
+    }
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+    int nid = SSL_CIPHER_get_cipher_nid(cipher);
+    size_t key_len = nid == NID_aes_128_gcm ? 16 : nid == NID_aes_256_gcm ? 32 : 0;
+    const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+    if(!key_len || !md) {
+        return false;
+    }
+    bool tls13 = SSL_version(ssl) == TLS1_3_VERSION;
+    tls_keys client, server;
+    if(tls13) {
+        client.key_len = server.key_len = key_len;
+        if(!c->client_secret_len || !c->server_secret_len ||
+           !expand_label(md, c->client_secret, c->client_secret_len, "key", client.key, key_len) ||
+           !expand_label(md, c->client_secret, c->client_secret_len, "iv", client.iv, 12) ||
+           !expand_label(md, c->server_secret, c->server_secret_len, "key", server.key, key_len) ||
+           !expand_label(md, c->server_secret, c->server_secret_len, "iv", server.iv, 12)) {
+            return false;
+        }
+    }else if(!tls12_keys(ssl, md, key_len, &client, &server)) {
+        return false;
+    }
+
+    bool ok = false;
+    if(setsockopt(c->sockfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+        ok = install_keys(c->sockfd, TLS_TX, tls13, server, c->tx_seq) &&
+             install_keys(c->sockfd, TLS_RX, tls13, client, c->rx_seq);
+    }
+    if(!ok) {
+        static std::atomic<int> warned(0);
+        if(warned.fetch_add(1, std::memory_order_relaxed) == 0) {
+            printf("kernel TLS is not available (%s), closing TLS connections\n", strerror(errno));
+        }
+    }
+    OPENSSL_cleanse(&client, sizeof(client));
+    OPENSSL_cleanse(&server, sizeof(server));
+    OPENSSL_cleanse(c->client_secret, sizeof(c->client_secret));
+    OPENSSL_cleanse(c->server_secret, sizeof(c->server_secret));
+    return ok;
+}
+
+
+tls_context::tls_context() : m_ctx(0) {
+}
+
+tls_context::~tls_context() {
+    SSL_CTX_free((SSL_CTX*)m_ctx);
+}
+
+bool tls_context::init(const char* cert_file, const char* key_file) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx) {
+        return false;
+    }
+    // 只用内核能接手的套件
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384");
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM");
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    // 不预读：握手读到客户端的Finished为止，后面的记录留在socket里给内核
+    SSL_CTX_set_read_ahead(ctx, 0);
+
+    // 会话复用：TLS 1.2 用会话ID查服务端缓存，两个版本都发会话票据（票据密钥由OpenSSL生成并定期轮换）
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    SSL_CTX_set_msg_callback(ctx, msg_callback);
+    SSL_CTX_set_keylog_callback(ctx, keylog_callback);
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_callback, NULL);
+
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+       SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    m_ctx = ctx;
+    return true;
+}
+
+tls_conn* tls_context::create(int sockfd) {
+    SSL* ssl = SSL_new((SSL_CTX*)m_ctx);
+    if(!ssl) {
+        return NULL;
+    }
+    tls_conn* c = new tls_conn;
+    memset(c, 0, sizeof(*c));
+    c->ssl    = ssl;
+    c->sockfd = sockfd;
+    SSL_set_fd(ssl, sockfd);
+    SSL_set_app_data(ssl, c);
+    SSL_set_accept_state(ssl);
+    return c;
+}
+
+tls_context::RESULT tls_context::handshake(tls_conn* c) {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(c->ssl);
+    if(ret == 1) {
+        c->done = enable_ktls(c);
+        return c->done ? TLS_DONE : TLS_FAILED;
+    }
+    switch(SSL_get_error(c->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            return TLS_FAILED;
+    }
+}
+
+void tls_context::destroy(tls_conn* c) {
+    if(c) {
+        if(c->done) {
+            // 连接交给了内核，不会再有close_notify；不标记成已经关闭的话OpenSSL会把会话当作坏的从缓存里删掉
+            SSL_set_shutdown(c->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
+        SSL_free(c->ssl);
+        delete c;
+    }
+}
+
+
+#else   // USE_OPENSSL
+
+
+tls_context::tls_context() : m_ctx(0) {
+}
+
+tls_context::~tls_context() {
+}
+
+bool tls_context::init(const char* cert_file, const char* key_file) {
+    printf("编译时没有定义USE_OPENSSL，不支持TLS\n");
+    return false;
+}
+
+tls_conn* tls_context::create(int sockfd) {
+    return NULL;
+}
+
+tls_context::RESULT tls_context::handshake(tls_conn* c) {
+    return TLS_FAILED;
+}
+
+void tls_context::destroy(tls_conn* c) {
+}
+
+
+#endif  // USE_OPENSSL
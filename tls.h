@@ -0,0 +1,48 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include<stddef.h>
+
+
+// 监听端口上的TLS终结
+// 握手由OpenSSL在工作线程里做，完成后把这条连接的对称密钥和记录序号交给内核（kTLS，TCP_ULP "tls"）：
+// 之后socket上的recv/sendmsg/splice看到的都是明文，内核负责加解密，文件的零拷贝发送路径、
+// HTTP/2、代理转发都不用区分连接是不是加密的，SSL对象在握手完成后就释放。
+// 只协商内核支持的AES-GCM套件（TLS 1.2 和 1.3）；内核不支持kTLS时握手完的连接直接关闭。
+// 会话复用：服务端会话缓存加上会话票据。ALPN优先选h2，选中后客户端直接发HTTP/2的连接前言。
+// 需要用 -DUSE_OPENSSL 编译并链接 -lssl -lcrypto，否则 -s 选项不可用。
+
+
+struct tls_conn;
+
+
+class tls_context {
+public:
+    // 握手推进的结果
+    enum RESULT { TLS_DONE = 0, TLS_WANT_READ, TLS_WANT_WRITE, TLS_FAILED };
+
+    tls_context();
+    ~tls_context();
+
+    // 加载证书链和私钥，失败返回false
+    bool init(const char* cert_file, const char* key_file);
+    bool enabled() const { return m_ctx != 0; }
+
+    // accept之后调用，为连接创建握手状态
+    tls_conn* create(int sockfd);
+
+    // 推进握手，非阻塞socket上返回TLS_WANT_READ/TLS_WANT_WRITE表示要等事件；
+    // TLS_DONE表示握手完成并且内核已经接管了加解密
+    RESULT handshake(tls_conn* c);
+
+    // 释放握手状态，握手完成或者连接关闭时调用
+    void destroy(tls_conn* c);
+
+private:
+    void* m_ctx;            // SSL_CTX，头文件里不引入OpenSSL
+};
+
+extern tls_context http_tls;
+
+
+#endif
@@ -0,0 +1,204 @@
+#include"vhost.h"
+#include"response_cache.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<ctype.h>
+#include<sys/stat.h>
+#include<algorithm>
+
+vhost_table http_vhosts;
+
+// 网站的根目录，没有配置文件时唯一的站点用它
+extern const char* doc_root;
+
+
+vhost_table::vhost_table() : m_seed(0), m_mask(0), m_fallback(&m_default) {
+    m_default.root  = doc_root;
+    m_default.cache = &http_cache;
+    m_default.missing = NULL;
+}
+
+std::vector<vhost*> vhost_table::all() {
+    return m_sites.empty() ? std::vector<vhost*>(1, &m_default) : m_sites;
+}
+
+// FNV-1a，最后再混合一遍，让低位也足够随机，槽下标只取低位
+uint64_t vhost_table::hash(uint64_t seed, const char* name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+    for(size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// 站点只有几十个，槽数取主机名个数两倍以上的2的幂，换种子直到所有名字落在不同的槽里；
+// 试了足够多的种子还有冲突就把表扩大一倍再试
+bool vhost_table::build(const std::vector<std::string>& names, const std::vector<int>& sites) {
+    static const int SEED_TRIES = 1000;
+    size_t n = names.size();
+    size_t size = 8;
+    while(size < n * 2) {
+        size <<= 1;
+    }
+    std::vector<char> used;
+    for(; size <= n * 64 + 8; size <<= 1) {
+        for(uint64_t seed = 1; seed <= SEED_TRIES; seed++) {
+            used.assign(size, 0);
+            bool ok = true;
+            for(size_t i = 0; i < n && ok; i++) {
+                size_t idx = hash(seed, names[i].data(), names[i].size()) & (size - 1);
+                ok = !used[idx];
+                used[idx] = 1;
+            }
+            if(!ok) {
+                continue;
+            }
+            m_seed = seed;
+            m_mask = size - 1;
+            m_slots.assign(size, slot());
+            m_names.assign(size, std::string());
+            for(size_t i = 0; i < size; i++) {
+                m_slots[i].site = -1;
+            }
+            for(size_t i = 0; i < n; i++) {
+                uint64_t h = hash(seed, names[i].data(), names[i].size());
+                slot& s = m_slots[h & m_mask];
+                s.hash = h;
+                s.site = sites[i];
+                s.len  = names[i].size();
+                memcpy(s.name, names[i].data(), std::min(names[i].size(), sizeof(s.name)));
+                m_names[h & m_mask] = names[i];
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool vhost_table::load(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if(!fp) {
+        printf("打开虚拟主机配置失败：%s\n", path);
+        return false;
+    }
+    std::vector<std::string> names;
+    std::vector<int> sites;
+    int default_site = -1;
+    bool has_cache = false;     // 当前站点有没有写cache
+    char line[2048];
+    int lineno = 0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), fp)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char* p = line + strspn(line, " \t");
+        if(*p == '\0' || *p == '#') {
+            continue;
+        }
+        char* arg = p + strcspn(p, " \t");
+        if(*arg) {
+            *arg++ = '\0';
+            arg += strspn(arg, " \t");
+        }
+        vhost* site = m_sites.empty() ? NULL : m_sites.back();
+        if(strcmp(p, "site") == 0) {
+            if(site && site->root.empty()) {
+                ok = false;
+                break;
+            }
+            site = new vhost;
+            site->cache = &http_cache;
+            site->missing = NULL;
+            m_sites.push_back(site);
+            has_cache = false;
+            char* save = NULL;
+            int count = 0;
+            for(char* name = strtok_r(arg, " \t", &save); name; name = strtok_r(NULL, " \t", &save)) {
+                size_t len = strlen(name);
+                for(size_t i = 0; i < len; i++) {
+                    name[i] = tolower((unsigned char)name[i]);
+                }
+                if(len > (size_t)MAX_HOST_LEN || std::find(names.begin(), names.end(), name) != names.end()) {
+                    ok = false;
+                    break;
+                }
+                names.push_back(name);
+                sites.push_back(m_sites.size() - 1);
+                count++;
+            }
+            ok = ok && count > 0;
+        }else if(!site) {
+            ok = false;
+        }else if(strcmp(p, "root") == 0 && *arg) {
+            struct stat st;
+            size_t len = strcspn(arg, " \t");
+            while(len > 1 && arg[len - 1] == '/') {
+                len--;      // url以/开头，根目录末尾的/去掉
+            }
+            site->root.assign(arg, len);
+            ok = stat(site->root.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }else if(strcmp(p, "cache") == 0 && *arg && !has_cache) {
+            int mb = atoi(arg);
+            site->cache = new response_cache;
+            site->cache->init(mb > 0 ? (size_t)mb * 1024 * 1024 : 0);
+            has_cache = true;
+        }else if(strcmp(p, "header") == 0 && strchr(arg, ':')) {
+            site->headers.append(arg).append("\r\n");
+            ok = site->headers.size() <= vhost::MAX_HEADER_BYTES;
+        }else if(strcmp(p, "default") == 0) {
+            default_site = m_sites.size() - 1;
+        }else {
+            ok = false;
+        }
+    }
+    fclose(fp);
+    if(ok && (m_sites.empty() || m_sites.back()->root.empty())) {
+        ok = false;
+    }
+    if(!ok) {
+        printf("虚拟主机配置有误：%s 第%d行\n", path, lineno);
+        return false;
+    }
+    if(!build(names, sites)) {
+        printf("虚拟主机建表失败\n");
+        return false;
+    }
+    m_fallback = m_sites[default_site >= 0 ? default_site : 0];
+    printf("虚拟主机：%d个站点，%d个主机名，%d个槽\n", (int)m_sites.size(), (int)names.size(), (int)(m_mask + 1));
+    return true;
+}
+
+// Host可能带端口，IPv6的地址带方括号；主机名不区分大小写，末尾的点去掉
+const vhost* vhost_table::find(const char* host) const {
+    if(!host || m_slots.empty()) {
+        return m_fallback;
+    }
+    char name[MAX_HOST_LEN + 1];
+    size_t len = 0;
+    bool bracket = *host == '[';
+    for(const char* p = host; *p && *p != ' ' && *p != '\t'; p++) {
+        if(len == (size_t)MAX_HOST_LEN || (*p == ':' && !bracket)) {
+            break;
+        }
+        name[len++] = tolower((unsigned char)*p);
+        if(*p == ']') {
+            break;
+        }
+    }
+    while(len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+    uint64_t h = hash(m_seed, name, len);
+    const slot& s = m_slots[h & m_mask];
+    if(s.site < 0 || s.hash != h || s.len != len) {
+        return m_fallback;
+    }
+    bool same = len <= sizeof(s.name) ? memcmp(s.name, name, len) == 0
+                                      : m_names[h & m_mask].compare(0, len, name, len) == 0;
+    return same ? m_sites[s.site] : m_fallback;
+}
@@ -0,0 +1,79 @@
+#ifndef VHOST_H
+#define VHOST_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<vector>
+
+
+// 虚拟主机：按请求的Host选站点，每个站点有自己的根目录、响应缓存和附加的响应头
+// 配置文件在启动时读一次，所有主机名建成一张完美哈希表，之后只读，工作线程并发查找不需要加锁。
+// 表的每个槽正好一条缓存行，主机名不太长时就存在槽里：一次查找是算一遍哈希、读一条缓存行、比较一次。
+// 建表只是换种子直到没有冲突，槽数随主机名个数平方增长：几十个名字几百个槽，几百个名字要几万个槽（几MB），
+// 但不管多大每次查找都只碰一条缓存行。
+// 不带Host或者Host没有配置的请求交给默认站点；没有配置文件时只有一个站点，就是原来的doc_root。
+//
+// 配置文件的格式，一个站点从site开始，到下一个site为止，#开头的是注释：
+//   site example.com www.example.com       主机名，可以有多个，不区分大小写，不带端口
+//   root /srv/example                      根目录
+//   cache 16                               单独的响应缓存（MB），0表示这个站点不缓存，不写就和别的站点共用全局缓存
+//   header X-Frame-Options: DENY           附加在这个站点的响应上，可以有多行
+//   default                                Host没有匹配上时用这个站点，不写就用第一个站点
+
+
+class response_cache;
+class negative_cache;
+
+struct vhost {
+    static const size_t MAX_HEADER_BYTES = 1024;    // 附加响应头的总长度上限
+
+    std::string root;               // 根目录
+    std::string headers;            // 附加的响应头，已经拼成 "名字: 值\r\n" 的格式
+    response_cache* cache;          // 这个站点用的响应缓存，共用时指向全局的http_cache
+    negative_cache* missing;        // 根目录下确定不存在的路径，每个进程在reactor里建，没建时为NULL
+};
+
+
+class vhost_table {
+public:
+    static const int MAX_HOST_LEN = 255;
+
+    vhost_table();
+
+    // 读配置文件并建表，出错时打印出错的行并返回false；只能在启动阶段调用
+    bool load(const char* path);
+
+    // host是请求里的Host头（可以带端口），为NULL或者没有匹配时返回默认站点
+    const vhost* find(const char* host) const;
+    const vhost* fallback() const { return m_fallback; }
+
+    // 所有站点，没有配置文件时只有默认站点；启动之后给站点挂上每个进程自己的数据时用
+    std::vector<vhost*> all();
+
+private:
+    // 一个槽一条缓存行：哈希值、站点下标、主机名（放得下的话）
+    struct alignas(64) slot {
+        uint64_t hash;
+        int32_t site;               // -1表示空槽
+        uint16_t len;
+        char name[50];
+    };
+
+    bool build(const std::vector<std::string>& names, const std::vector<int>& sites);
+    static uint64_t hash(uint64_t seed, const char* name, size_t len);
+
+private:
+    std::vector<vhost*> m_sites;
+    std::vector<slot> m_slots;
+    std::vector<std::string> m_names;   // 每个槽完整的主机名，槽里放不下的长名字要用它比较
+    uint64_t m_seed;                    // 建表时找到的没有冲突的种子
+    uint64_t m_mask;                    // 槽数减1
+    vhost m_default;                    // 没有配置文件时的唯一站点
+    const vhost* m_fallback;            // 默认站点
+};
+
+extern vhost_table http_vhosts;
+
+
+#endif
@@ -43,6 +43,7 @@ int force=0;
 int force_reload=0;
 int proxyport=80;
 char *proxyhost=NULL;
+char *unixpath=NULL;
 int benchtime=30;
 /* internal */
 int mypipe[2];
@@ -66,6 +67,7 @@ static const struct option long_options[]=
  {"version",no_argument,NULL,'V'},
  {"proxy",required_argument,NULL,'p'},
  {"clients",required_argument,NULL,'c'},
+ {"unix",required_argument,NULL,'U'},
  {NULL,0,NULL,0}
 };
 
@@ -88,6 +90,7 @@ static void usage(void)
 	"  -t|--time <sec>          Run benchmark for <sec> seconds. Default 30.\n"
 	"  -p|--proxy <server:port> Use proxy server for request.\n"
 	"  -c|--clients <n>         Run <n> HTTP clients at once. Default one.\n"
+	"  -U|--unix <path|@name>   Connect through a unix domain socket.\n"
 	"  -9|--http09              Use HTTP/0.9 style requests.\n"
 	"  -1|--http10              Use HTTP/1.0 protocol.\n"
 	"  -2|--http11              Use HTTP/1.1 protocol.\n"
@@ -111,7 +114,7 @@ int main(int argc, char *argv[])
           return 2;
  } 
 
- while((opt=getopt_long(argc,argv,"912Vfrt:p:c:?h",long_options,&options_index))!=EOF )
+ while((opt=getopt_long(argc,argv,"912Vfrt:p:c:U:?h",long_options,&options_index))!=EOF )
  {
   switch(opt)
   {
@@ -147,6 +150,7 @@ int main(int argc, char *argv[])
    case 'h':
    case '?': usage();return 2;break;
    case 'c': clients=atoi(optarg);break;
+   case 'U': unixpath=optarg;break;
   }
  }
  
@@ -191,6 +195,7 @@ int main(int argc, char *argv[])
  printf(", running %d sec", benchtime);
  if(force) printf(", early socket close");
  if(proxyhost!=NULL) printf(", via proxy server %s:%d",proxyhost,proxyport);
+ if(unixpath!=NULL) printf(", via unix socket %s",unixpath);
  if(force_reload) printf(", forcing reload");
  printf(".\n");
  return bench();
@@ -298,7 +303,7 @@ static int bench(void)
   FILE *f;
 
   /* check avaibility of target server */
-  i=Socket(proxyhost==NULL?host:proxyhost,proxyport);
+  i=unixpath!=NULL?UnixSocket(unixpath):Socket(proxyhost==NULL?host:proxyhost,proxyport);
   if(i<0) { 
 	   fprintf(stderr,"\nConnect to server failed. Aborting benchmark.\n");
            return 1;
@@ -421,7 +426,7 @@ void benchcore(const char *host,const int port,const char *req)
        }
        return;
     }
-    s=Socket(host,port);                          
+    s=unixpath!=NULL?UnixSocket(unixpath):Socket(host,port);                          
     if(s<0) { failed++;continue;} 
     if(rlen!=write(s,req,rlen)) {failed++;close(s);continue;}
     if(http10==0) 
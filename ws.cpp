@@ -0,0 +1,600 @@
+#include"ws.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<new>
+#include<unistd.h>
+#include<sys/uio.h>
+#include<sys/epoll.h>
+#include<sys/socket.h>
+#include<sys/eventfd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include<immintrin.h>
+#elif defined(__ARM_NEON)
+#include<arm_neon.h>
+#endif
+
+ws_hub http_ws;
+
+extern void addfd(int epollfd, int fd, bool edge);
+
+static const char* WS_PREFIX = "/ws/";
+static const char* WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+
+// 文本消息和关闭原因必须是合法的UTF-8（RFC 3629）：不能有过长编码、代理对、超过U+10FFFF的码点
+static bool valid_utf8(const char* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    size_t i = 0;
+    while(i < len) {
+        unsigned char c = p[i];
+        if(c < 0x80) {
+            i++;
+            continue;
+        }
+        int n;
+        unsigned char lo = 0x80, hi = 0xBF;     // 第二个字节的范围，排除过长编码和代理对
+        if(c >= 0xC2 && c <= 0xDF) {
+            n = 1;
+        }else if(c >= 0xE0 && c <= 0xEF) {
+            n = 2;
+            if(c == 0xE0) {
+                lo = 0xA0;
+            }else if(c == 0xED) {
+                hi = 0x9F;
+            }
+        }else if(c >= 0xF0 && c <= 0xF4) {
+            n = 3;
+            if(c == 0xF0) {
+                lo = 0x90;
+            }else if(c == 0xF4) {
+                hi = 0x8F;
+            }
+        }else {
+            return false;
+        }
+        if(len - i <= (size_t)n || p[i + 1] < lo || p[i + 1] > hi) {
+            return false;
+        }
+        for(int k = 2; k <= n; k++) {
+            if((p[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+// 对方关闭帧里的状态码能不能出现在线路上（RFC 6455 7.4）：1005、1006、1015只在本地用，1004保留
+static bool valid_close_code(uint16_t code) {
+    if(code >= 3000 && code <= 4999) {
+        return true;
+    }
+    return code >= 1000 && code <= 1014 && code != 1004 && code != 1005 && code != 1006;
+}
+
+// 握手只需要SHA-1和base64，不为这个引入OpenSSL
+static uint32_t rol(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1(const unsigned char* msg, size_t len, unsigned char out[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    size_t total = ((len + 8) / 64 + 1) * 64;
+    unsigned char* buf = (unsigned char*)calloc(total, 1);
+    memcpy(buf, msg, len);
+    buf[len] = 0x80;
+    uint64_t bits = (uint64_t)len * 8;
+    for(int i = 0; i < 8; i++) {
+        buf[total - 1 - i] = (unsigned char)(bits >> (i * 8));
+    }
+    for(size_t off = 0; off < total; off += 64) {
+        uint32_t w[80];
+        for(int i = 0; i < 16; i++) {
+            const unsigned char* p = buf + off + i * 4;
+            w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+        for(int i = 16; i < 80; i++) {
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if(i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }else if(i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }else if(i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    free(buf);
+    for(int i = 0; i < 5; i++) {
+        out[i * 4]     = (unsigned char)(h[i] >> 24);
+        out[i * 4 + 1] = (unsigned char)(h[i] >> 16);
+        out[i * 4 + 2] = (unsigned char)(h[i] >> 8);
+        out[i * 4 + 3] = (unsigned char)h[i];
+    }
+}
+
+static void base64_encode(const unsigned char* in, size_t len, char* out) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for(size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if(i + 1 < len) {
+            v |= (uint32_t)in[i + 1] << 8;
+        }
+        if(i + 2 < len) {
+            v |= in[i + 2];
+        }
+        out[o++] = table[(v >> 18) & 63];
+        out[o++] = table[(v >> 12) & 63];
+        out[o++] = i + 1 < len ? table[(v >> 6) & 63] : '=';
+        out[o++] = i + 2 < len ? table[v & 63] : '=';
+    }
+    out[o] = '\0';
+}
+
+void ws_accept_key(const char* key, char* out) {
+    char buf[128];
+    int n = snprintf(buf, sizeof(buf), "%s%s", key, WS_GUID);
+    unsigned char digest[20];
+    sha1((const unsigned char*)buf, n < (int)sizeof(buf) ? n : sizeof(buf) - 1, digest);
+    base64_encode(digest, sizeof(digest), out);
+}
+
+// 掩码从负载的第一个字节开始按4字节循环，每次处理的长度都是4的倍数，所以整块异或时相位不变
+void ws_unmask(char* data, size_t len, const unsigned char mask[4]) {
+    uint32_t m;
+    memcpy(&m, mask, 4);
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i m256 = _mm256_set1_epi32((int)m);
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(v, m256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i m128 = _mm_set1_epi32((int)m);
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, m128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t m128 = vreinterpretq_u8_u32(vdupq_n_u32(m));
+    for(; i + 16 <= len; i += 16) {
+        uint8_t* p = (uint8_t*)data + i;
+        vst1q_u8(p, veorq_u8(vld1q_u8(p), m128));
+    }
+#endif
+    uint64_t m64 = ((uint64_t)m << 32) | m;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= m64;
+        memcpy(data + i, &v, 8);
+    }
+    for(; i < len; i++) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+
+// 服务端的帧不加掩码：2字节头，负载长了再加2或8字节的长度
+ws_frame* ws_frame::create(int opcode, const char* payload, size_t len) {
+    size_t head = len < 126 ? 2 : (len < 65536 ? 4 : 10);
+    ws_frame* f = (ws_frame*)malloc(sizeof(ws_frame) + head + len);
+    if(!f) {
+        return NULL;
+    }
+    new (&f->refs) std::atomic<int>(1);
+    f->len = head + len;
+    unsigned char* p = (unsigned char*)f->data();
+    p[0] = 0x80 | opcode;
+    if(head == 2) {
+        p[1] = len;
+    }else if(head == 4) {
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
+    }else {
+        p[1] = 127;
+        for(int i = 0; i < 8; i++) {
+            p[2 + i] = (unsigned char)((uint64_t)len >> (56 - i * 8));
+        }
+    }
+    memcpy(p + head, payload, len);
+    return f;
+}
+
+void ws_frame::release(ws_frame* f) {
+    if(f && f->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        free(f);
+    }
+}
+
+
+ws_session::ws_session(int sockfd, const char* channel, size_t channel_len) : m_fd(sockfd), m_channel(channel, channel_len),
+        m_started(false), m_closing(false), m_dead(false), m_want_out(false), m_in(0), m_in_len(0), m_msg_opcode(0),
+        m_out_off(0), m_out_bytes(0), m_index(0) {
+}
+
+ws_session::~ws_session() {
+    if(m_started && !m_dead) {
+        http_ws.leave(this);
+    }
+    for(size_t i = 0; i < m_out.size(); i++) {
+        ws_frame::release(m_out[i]);
+    }
+    free(m_in);
+}
+
+bool ws_session::start() {
+    m_in = (char*)malloc(MAX_MESSAGE + 14);
+    if(!m_in) {
+        return false;
+    }
+    m_started = true;
+    http_ws.join(this);
+    arm();
+    return true;
+}
+
+// 还有没发完的输出时在等EPOLLOUT：连接是边沿触发同时关注读写的，写到EAGAIN之后socket一有空间就会报告
+void ws_session::arm() {
+    m_want_out = !m_out.empty();
+}
+
+bool ws_session::on_event(uint32_t events) {
+    if((events & EPOLLIN) && !read_frames()) {
+        return false;
+    }
+    if(!flush() || m_dead) {
+        return false;
+    }
+    if(m_closing && m_out.empty()) {
+        return false;       // 关闭帧已经发出去了
+    }
+    arm();
+    return true;
+}
+
+// 边沿触发，一直读到EAGAIN；每读一次就把完整的帧都处理掉，缓冲区总是放得下一个最大的帧
+bool ws_session::read_frames() {
+    while(true) {
+        ssize_t n = recv(m_fd, m_in + m_in_len, MAX_MESSAGE + 14 - m_in_len, 0);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if(n == 0) {
+            return false;
+        }
+        if(m_closing) {
+            m_in_len = 0;   // 已经在关闭了，后面的数据都不要
+            continue;
+        }
+        m_in_len += n;
+
+        size_t pos = 0;
+        while(!m_closing && m_in_len - pos >= 2) {
+            unsigned char* p = (unsigned char*)m_in + pos;
+            size_t avail = m_in_len - pos;
+            bool fin = p[0] & 0x80;
+            int opcode = p[0] & 0x0f;
+            uint64_t len = p[1] & 0x7f;
+            size_t head = 2;
+            if(len == 126) {
+                if(avail < 4) {
+                    break;
+                }
+                len = ((uint64_t)p[2] << 8) | p[3];
+                head = 4;
+            }else if(len == 127) {
+                if(avail < 10) {
+                    break;
+                }
+                len = 0;
+                for(int i = 0; i < 8; i++) {
+                    len = (len << 8) | p[2 + i];
+                }
+                head = 10;
+            }
+            if((p[0] & 0x70) || !(p[1] & 0x80)) {
+                close_with(1002);   // 没有协商扩展，RSV必须为0；客户端的帧必须带掩码
+                break;
+            }
+            if(len > (uint64_t)MAX_MESSAGE) {
+                close_with(1009);
+                break;
+            }
+            if(avail < head + 4 + len) {
+                break;
+            }
+            char* payload = (char*)p + head + 4;
+            ws_unmask(payload, len, p + head);
+            if(!handle_frame(opcode, fin, payload, len)) {
+                return false;
+            }
+            pos += head + 4 + len;
+        }
+        if(m_closing) {
+            m_in_len = 0;
+        }else if(pos > 0) {
+            memmove(m_in, m_in + pos, m_in_len - pos);
+            m_in_len -= pos;
+        }
+    }
+}
+
+bool ws_session::handle_frame(int opcode, bool fin, char* payload, size_t len) {
+    if(opcode >= OP_CLOSE) {
+        // 控制帧不能分片，负载不超过125字节
+        if(!fin || len > 125) {
+            close_with(1002);
+            return true;
+        }
+        if(opcode == OP_CLOSE) {
+            // 把对方合法的状态码原样发回去，然后等输出发完关闭；没有状态码时回1000
+            // 只有1个字节、状态码不能用在线路上的回1002，关闭原因不是UTF-8的回1007
+            uint16_t code = len >= 2 ? (((unsigned char)payload[0] << 8) | (unsigned char)payload[1]) : 1000;
+            if(len == 1 || !valid_close_code(code)) {
+                code = 1002;
+            }else if(len > 2 && !valid_utf8(payload + 2, len - 2)) {
+                code = 1007;
+            }
+            close_with(code);
+        }else if(opcode == OP_PING) {
+            ws_frame* pong = ws_frame::create(OP_PONG, payload, len);
+            bool ok = pong && send(pong);
+            ws_frame::release(pong);
+            return ok;
+        }else if(opcode != OP_PONG) {
+            close_with(1002);
+        }
+        return true;
+    }
+    if(opcode == OP_TEXT || opcode == OP_BINARY) {
+        if(m_msg_opcode != 0) {
+            close_with(1002);       // 上一条分片消息还没结束
+        }else if(fin) {
+            if(opcode == OP_TEXT && !valid_utf8(payload, len)) {
+                close_with(1007);
+                return true;
+            }
+            deliver(opcode, payload, len);  // 不分片的消息不用先拼到m_message里
+        }else {
+            m_msg_opcode = opcode;
+            m_message.assign(payload, len);
+        }
+        return true;
+    }
+    if(opcode == OP_CONTINUATION && m_msg_opcode != 0) {
+        if(m_message.size() + len > (size_t)MAX_MESSAGE) {
+            close_with(1009);
+            return true;
+        }
+        m_message.append(payload, len);
+        if(fin) {
+            // 分片的文本消息拼完整了再检查，一个字符可以跨在两个分片之间
+            if(m_msg_opcode == OP_TEXT && !valid_utf8(m_message.data(), m_message.size())) {
+                close_with(1007);
+                return true;
+            }
+            deliver(m_msg_opcode, m_message.data(), m_message.size());
+            m_msg_opcode = 0;
+            m_message.clear();
+        }
+        return true;
+    }
+    close_with(1002);
+    return true;
+}
+
+void ws_session::deliver(int opcode, const char* data, size_t len) {
+    ws_frame* f = ws_frame::create(opcode, data, len);
+    if(f) {
+        http_ws.broadcast(m_channel, f);
+        ws_frame::release(f);
+    }
+}
+
+void ws_session::close_with(uint16_t code) {
+    if(m_closing) {
+        return;
+    }
+    m_closing = true;
+    char payload[2] = {(char)(code >> 8), (char)code};
+    ws_frame* f = ws_frame::create(OP_CLOSE, payload, sizeof(payload));
+    if(f) {
+        send(f);
+        ws_frame::release(f);
+    }
+}
+
+bool ws_session::send(ws_frame* f) {
+    if(m_dead) {
+        return true;
+    }
+    if(m_out_bytes + f->len > MAX_QUEUED_BYTES) {
+        return false;
+    }
+    f->acquire();
+    m_out.push_back(f);
+    m_out_bytes += f->len;
+    if(m_want_out) {
+        return true;        // 已经在等EPOLLOUT了，到时候一起发
+    }
+    // 队列原来是空的，先直接写；写不完才去注册EPOLLOUT
+    if(!flush()) {
+        return false;
+    }
+    if(!m_out.empty()) {
+        m_want_out = true;
+    }
+    return true;
+}
+
+bool ws_session::flush() {
+    while(!m_out.empty()) {
+        struct iovec iov[MAX_IOV];
+        int n = 0;
+        for(size_t i = 0; i < m_out.size() && n < MAX_IOV; i++, n++) {
+            size_t off = i == 0 ? m_out_off : 0;
+            iov[n].iov_base = m_out[i]->data() + off;
+            iov[n].iov_len  = m_out[i]->len - off;
+        }
+        ssize_t w = writev(m_fd, iov, n);
+        if(w < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        m_out_bytes -= w;
+        while(w > 0) {
+            ws_frame* f = m_out.front();
+            size_t left = f->len - m_out_off;
+            if((size_t)w < left) {
+                m_out_off += w;
+                break;
+            }
+            w -= left;
+            m_out_off = 0;
+            m_out.pop_front();
+            ws_frame::release(f);
+        }
+    }
+    return true;
+}
+
+void ws_session::kill() {
+    if(m_dead) {
+        return;
+    }
+    m_dead = true;
+    http_ws.leave(this);
+    shutdown(m_fd, SHUT_RDWR);
+}
+
+
+ws_hub::ws_hub() : m_efd(-1), m_epollfd(-1) {
+}
+
+bool ws_hub::init(int epollfd) {
+    m_epollfd = epollfd;
+    m_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_efd < 0) {
+        return false;
+    }
+    addfd(epollfd, m_efd, false);
+    return true;
+}
+
+bool ws_hub::accepts(const char* url, const char** channel, size_t* len) {
+    size_t prefix = strlen(WS_PREFIX);
+    if(strncmp(url, WS_PREFIX, prefix) != 0) {
+        return false;
+    }
+    *channel = url + prefix;
+    *len = strcspn(*channel, "?");
+    return true;
+}
+
+void ws_hub::join(ws_session* s) {
+    std::vector<ws_session*>& members = m_channels[s->m_channel];
+    s->m_index = members.size();
+    members.push_back(s);
+}
+
+// 和最后一个成员交换位置再删掉，不用挪动整个数组
+void ws_hub::leave(ws_session* s) {
+    std::unordered_map<std::string, std::vector<ws_session*> >::iterator it = m_channels.find(s->m_channel);
+    if(it == m_channels.end()) {
+        return;
+    }
+    std::vector<ws_session*>& members = it->second;
+    ws_session* last = members.back();
+    members[s->m_index] = last;
+    last->m_index = s->m_index;
+    members.pop_back();
+    if(members.empty()) {
+        m_channels.erase(it);
+    }
+}
+
+// 同一个帧的指针放进每个成员的队列；积压超限的成员记下来，遍历完再断开，免得遍历时改动成员数组
+void ws_hub::broadcast(const std::string& channel, ws_frame* f) {
+    std::unordered_map<std::string, std::vector<ws_session*> >::iterator it = m_channels.find(channel);
+    if(it == m_channels.end()) {
+        return;
+    }
+    std::vector<ws_session*>& members = it->second;
+    for(size_t i = 0; i < members.size(); i++) {
+        if(!members[i]->send(f)) {
+            m_slow.push_back(members[i]);
+        }
+    }
+    for(size_t i = 0; i < m_slow.size(); i++) {
+        m_slow[i]->kill();
+    }
+    m_slow.clear();
+}
+
+void ws_hub::publish(const char* channel, int opcode, const char* data, size_t len) {
+    if(m_efd < 0) {
+        return;
+    }
+    ws_frame* f = ws_frame::create(opcode, data, len);
+    if(!f) {
+        return;
+    }
+    m_lock.lock();
+    m_pending.push_back(std::make_pair(std::string(channel), f));
+    m_lock.unlock();
+    uint64_t one = 1;
+    ::write(m_efd, &one, sizeof(one));
+}
+
+void ws_hub::drain() {
+    uint64_t count;
+    ::read(m_efd, &count, sizeof(count));
+    std::vector<std::pair<std::string, ws_frame*> > pending;
+    m_lock.lock();
+    pending.swap(m_pending);
+    m_lock.unlock();
+    for(size_t i = 0; i < pending.size(); i++) {
+        broadcast(pending[i].first, pending[i].second);
+        ws_frame::release(pending[i].second);
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef WS_H
+#define WS_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<atomic>
+#include<deque>
+#include<string>
+#include<vector>
+#include<unordered_map>
+#include"locker.h"
+
+
+// WebSocket（RFC 6455）
+// GET /ws/<频道> 带 Upgrade: websocket 的请求在工作线程里回101，101发完之后连接交给ws_session，
+// 之后这条连接的收发都在主线程里做，不进线程池：一个频道的广播要碰很多连接，放在一个线程里就不用给每个连接加锁。
+// 客户端发来的文本/二进制消息广播给同一个频道的所有连接（包括它自己）。
+// 广播时帧只编码一次，放在带引用计数的缓冲区里，每个接收者的输出队列只放一个指针，发送时直接writev，没有逐个拷贝。
+// 输出队列积压超过MAX_QUEUED_BYTES的慢消费者直接断开，不让一个读得慢的客户端拖住内存。
+// 别的线程（比如路由处理函数）用http_ws.publish推送消息，经eventfd交给主线程去广播。
+// 多进程模式下每个工作进程有自己的频道表，广播只到本进程的连接。
+
+
+// 服务端发出的一帧，头部和负载连续存放；引用计数归零时释放
+struct ws_frame {
+    std::atomic<int> refs;
+    uint32_t len;                   // 头部 + 负载
+
+    char* data() { return (char*)(this + 1); }
+
+    static ws_frame* create(int opcode, const char* payload, size_t len);
+    void acquire() { refs.fetch_add(1, std::memory_order_relaxed); }
+    static void release(ws_frame* f);
+};
+
+
+// 对负载做掩码异或，SSE2/AVX2/NEON 一次处理16/32字节，剩下的按8字节和单字节处理
+void ws_unmask(char* data, size_t len, const unsigned char mask[4]);
+
+// Sec-WebSocket-Accept：base64(SHA-1(key + GUID))，out至少29字节
+void ws_accept_key(const char* key, char* out);
+
+
+class ws_session {
+public:
+    static const int MAX_MESSAGE = 64 * 1024;               // 单条消息（分片拼起来之后）的上限
+    static const size_t MAX_QUEUED_BYTES = 1024 * 1024;     // 输出队列积压的上限
+    static const int MAX_IOV = 64;                          // 一次writev最多的帧数
+
+    enum OPCODE { OP_CONTINUATION = 0x0, OP_TEXT = 0x1, OP_BINARY = 0x2, OP_CLOSE = 0x8, OP_PING = 0x9, OP_PONG = 0xA };
+
+    ws_session(int sockfd, const char* channel, size_t channel_len);
+    ~ws_session();
+
+    // 101发完之后在主线程里调用：加入频道，开始收帧
+    bool start();
+    bool started() const { return m_started; }
+
+    // 主线程里处理socket上的事件，返回false表示要关闭连接
+    bool on_event(uint32_t events);
+
+    // 把一帧放进输出队列并尽量立即发出去；积压超限或者写出错返回false
+    bool send(ws_frame* f);
+
+    // 慢消费者：退出频道，关掉socket两个方向，epoll随后报EPOLLHUP，由主循环关闭连接
+    void kill();
+
+    const std::string& channel() const { return m_channel; }
+
+private:
+    bool read_frames();
+    bool handle_frame(int opcode, bool fin, char* payload, size_t len);
+    void deliver(int opcode, const char* data, size_t len);
+    void close_with(uint16_t code);
+    bool flush();
+    void arm();
+
+private:
+    friend class ws_hub;
+
+    int m_fd;
+    std::string m_channel;
+    bool m_started;
+    bool m_closing;                 // 已经发出关闭帧，发完输出队列就关闭
+    bool m_dead;                    // 被当作慢消费者断开了
+    bool m_want_out;                // 是否在等EPOLLOUT
+    char* m_in;                     // 输入缓冲区，放得下一个最大的帧
+    size_t m_in_len;
+    std::string m_message;          // 分片消息拼到一半
+    int m_msg_opcode;               // 分片消息的类型，0表示没有分片消息
+    std::deque<ws_frame*> m_out;    // 输出队列
+    size_t m_out_off;               // 队头的帧已经发出去的字节数
+    size_t m_out_bytes;             // 队列里还没发出去的总字节数
+    size_t m_index;                 // 在频道成员数组里的下标
+};
+
+
+class ws_hub {
+public:
+    ws_hub();
+
+    // 主线程创建epoll之后调用，创建用来接收跨线程推送的eventfd
+    bool init(int epollfd);
+    int notify_fd() const { return m_efd; }
+    int epollfd() const { return m_epollfd; }
+
+    // url是不是WebSocket的端点（/ws/前缀），channel返回频道名
+    static bool accepts(const char* url, const char** channel, size_t* len);
+
+    // 下面几个只能在主线程里调用
+    void join(ws_session* s);
+    void leave(ws_session* s);
+    void broadcast(const std::string& channel, ws_frame* f);
+    void drain();                   // eventfd可读时调用，广播别的线程推送过来的消息
+
+    // 任意线程调用：编码一次，交给主线程广播
+    void publish(const char* channel, int opcode, const char* data, size_t len);
+
+private:
+    std::unordered_map<std::string, std::vector<ws_session*> > m_channels;
+    std::vector<ws_session*> m_slow;        // 一次广播里发现的慢消费者，广播完再断开
+    locker m_lock;                          // 保护m_pending
+    std::vector<std::pair<std::string, ws_frame*> > m_pending;
+    int m_efd;
+    int m_epollfd;
+};
+
+extern ws_hub http_ws;
+
+
+#endif
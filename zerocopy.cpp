@@ -0,0 +1,160 @@
+#include"zerocopy.h"
+#include"response_cache.h"
+#include"locker.h"
+#include<string.h>
+#include<errno.h>
+#include<time.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<linux/errqueue.h>
+#include<deque>
+#include<utility>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+
+// 连接关闭时还没完成的条目：释放时间、条目
+static locker orphan_lock;
+static std::deque<std::pair<int64_t, cache_entry*> > orphans;
+
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void zerocopy_collect() {
+    int64_t now = now_ms();
+    orphan_lock.lock();
+    while(!orphans.empty() && orphans.front().first <= now) {
+        response_cache::release(orphans.front().second);
+        orphans.pop_front();
+    }
+    orphan_lock.unlock();
+}
+
+
+zerocopy_tracker::zerocopy_tracker() : m_count(0), m_current(-1), m_next_seq(0), m_enabled(false), m_useless(false) {
+}
+
+// socket已经关了，收不到通知了，但是已经进了发送队列的数据可能还在发送或者重传
+zerocopy_tracker::~zerocopy_tracker() {
+    if(m_count == 0) {
+        return;
+    }
+    int64_t when = now_ms() + LINGER_MS;
+    orphan_lock.lock();
+    for(int i = 0; i < m_count; i++) {
+        orphans.push_back(std::make_pair(when, m_slots[i].entry));
+    }
+    orphan_lock.unlock();
+    zerocopy_collect();
+}
+
+bool zerocopy_tracker::begin(int fd, cache_entry* e, size_t len) {
+    m_current = -1;
+    if(m_useless || len < MIN_BYTES || m_count == MAX_PENDING) {
+        return false;
+    }
+    if(!m_enabled) {
+        int on = 1;
+        if(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+            m_useless = true;       // 内核不支持
+            return false;
+        }
+        m_enabled = true;
+    }
+    e->refs.fetch_add(1, std::memory_order_relaxed);
+    slot& s = m_slots[m_count];
+    s.entry = e;
+    s.first = m_next_seq;
+    s.next  = m_next_seq;
+    s.done  = 0;
+    s.open  = true;
+    m_current = m_count++;
+    return true;
+}
+
+void zerocopy_tracker::end() {
+    if(m_current < 0) {
+        return;
+    }
+    slot& s = m_slots[m_current];
+    s.next = m_next_seq;
+    s.open = false;
+    if(s.done == s.next - s.first) {
+        remove(m_current);
+    }
+    m_current = -1;
+}
+
+// 释放第i个槽，用最后一个槽补上；当前响应的槽不会在这里被移走
+void zerocopy_tracker::remove(int i) {
+    response_cache::release(m_slots[i].entry);
+    m_count--;
+    if(i != m_count) {
+        m_slots[i] = m_slots[m_count];
+        if(m_current == m_count) {
+            m_current = i;
+        }
+    }
+}
+
+// 通知里的序号范围[lo, hi]可能合并了好几次发送，一般按顺序来，但不保证；按区间重叠计数
+void zerocopy_tracker::complete(uint32_t lo, uint32_t hi) {
+    for(int i = 0; i < m_count; ) {
+        slot& s = m_slots[i];
+        uint32_t end = s.open ? m_next_seq : s.next;
+        uint32_t a = lo > s.first ? lo : s.first;
+        uint32_t b = hi + 1 < end ? hi + 1 : end;
+        if(a < b) {
+            s.done += b - a;
+        }
+        if(!s.open && s.done == s.next - s.first) {
+            remove(i);
+            continue;
+        }
+        i++;
+    }
+}
+
+bool zerocopy_tracker::reap(int fd) {
+    char control[128];
+    while(true) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0) {
+                return false;
+            }
+            if(ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                m_useless = true;
+            }
+            complete(ee->ee_info, ee->ee_data);
+        }
+    }
+    zerocopy_collect();
+    // 错误队列收空了，EPOLLERR也可能是socket本身出了错
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    return err == 0;
+}
@@ -0,0 +1,70 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include<stdint.h>
+#include<stddef.h>
+
+
+// MSG_ZEROCOPY发送缓存里的大响应体
+// 命中响应缓存时响应体本来就在内存里，sendmsg还要把它整个拷进socket缓冲区。
+// 不小于MIN_BYTES的响应体改用MSG_ZEROCOPY发送，内核直接引用这些页，省掉拷贝；
+// 代价是页要等内核用完才能动：完成通知放在socket的错误队列里，以EPOLLERR报告给主循环，由主循环调用reap收取，
+// 在那之前连接一直持有缓存条目的一个引用，条目被淘汰、过期也不会被释放。
+// 小于MIN_BYTES的时候锁页、收通知的开销比拷贝还大，照常拷贝。
+// 每个连接最多同时等MAX_PENDING个缓存条目，满了之后的响应照常拷贝；内核报告它还是做了拷贝
+// （回环接口、网卡不支持分散聚集的时候），说明这条连接零拷贝没有好处，之后不再用。
+// 连接关闭时还没等到通知的条目交给一个全局的列表，LINGER_MS之后再释放。
+
+
+struct cache_entry;
+
+class zerocopy_tracker {
+public:
+    static const size_t MIN_BYTES = 32 * 1024;      // 零拷贝发送的最小响应体
+    static const int MAX_PENDING = 8;               // 每个连接最多同时等待完成通知的缓存条目数
+    static const int LINGER_MS = 10000;             // 连接关闭后，没等到通知的条目过这么久释放
+
+    zerocopy_tracker();
+    ~zerocopy_tracker();
+
+    // 准备发送缓存条目e的响应体：要用零拷贝时加一个引用并返回true。第一次用时给socket打开SO_ZEROCOPY
+    bool begin(int fd, cache_entry* e, size_t len);
+
+    // 一次带MSG_ZEROCOPY的发送成功了，它的完成通知记在当前条目上
+    void sent() { m_next_seq++; }
+
+    // 当前响应发完或者放弃了：发出去的都已经完成就释放引用，否则等reap
+    void end();
+
+    // 有没有在等的完成通知
+    bool pending() const { return m_count > 0; }
+
+    // 收取错误队列里的通知，释放内核已经用完的条目；socket本身出错返回false
+    bool reap(int fd);
+
+private:
+    struct slot {
+        cache_entry* entry;
+        uint32_t first;         // 这个条目第一次零拷贝发送的序号
+        uint32_t next;          // 发完时下一个序号，[first, next)都是它的
+        uint32_t done;          // 已经收到完成通知的发送次数
+        bool open;              // 还在发送中
+    };
+
+    void complete(uint32_t lo, uint32_t hi);
+    void remove(int i);
+
+private:
+    slot m_slots[MAX_PENDING];
+    int m_count;                // 在用的槽数
+    int m_current;              // 当前响应用的槽，-1表示当前响应没有用零拷贝
+    uint32_t m_next_seq;        // 内核给下一次零拷贝发送的序号，从0开始，每次成功的发送加一
+    bool m_enabled;             // 已经设置了SO_ZEROCOPY
+    bool m_useless;             // 内核报告做了拷贝，这条连接不再用零拷贝
+};
+
+// 释放连接关闭时留下的、已经过了LINGER_MS的条目
+void zerocopy_collect();
+
+
+#endif